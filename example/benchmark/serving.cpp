@@ -0,0 +1,367 @@
+//
+// 服务压测: 按到达过程(泊松 / 突发 / 回放trace)调用LaunchResponseTokens, 统计TTFT, TPOT, 端到端延迟和goodput
+//
+
+#include "model.h"
+#include "utils.h"
+#include "fstream"
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <sstream>
+#include <thread>
+
+struct ServingConfig {
+    std::string path = "chatglm-6b-int4.bin"; // 模型文件路径
+    int threads = 4; // 使用的线程数
+    std::string arrival = "poisson"; // 到达过程: poisson, bursty, trace
+    std::vector <float> rates = {1.0f}; // 每档负载的请求速率(请求 / s), trace模式下为时间轴的加速倍数, <= 0代表所有请求同时到达
+    float burstiness = 0.25f; // bursty模式下到达间隔服从形状参数为burstiness的gamma分布, 越小越突发, 1.0等价于泊松
+    int num = 32; // 每档负载的请求数 (trace模式下为trace中的请求数)
+    int inputLen = 128; // 输入token数
+    int outputLen = 128; // 输出token数
+    float lenJitter = 0.0f; // 输入输出长度在 [len * (1 - jitter), len * (1 + jitter)] 中均匀随机
+    std::string file; // prompt文件, 每行一个prompt, 编码后拼接成token池
+    std::string trace; // trace文件, 每行 "到达时间(s) 输入token数 输出token数"
+    float ttftSlo = 1000.0f; // TTFT的SLO (ms)
+    float tpotSlo = 100.0f; // TPOT的SLO (ms)
+    int seed = 0; // 随机种子
+    std::string output; // 结果输出文件(json, 每档负载一行)
+};
+
+struct ServingRequest {
+    double arrival = 0; // 到达时间, 相对于这档负载开始的秒数
+    int inputLen = 0, outputLen = 0;
+
+    double ttft = 0, tpot = 0, e2e = 0; // s
+    int outputTokens = 0;
+};
+
+void Usage() {
+    std::cout << "Usage:" << std::endl;
+    std::cout << "[-h|--help]:                  显示帮助" << std::endl;
+    std::cout << "<-p|--path> <args>:           模型文件的路径" << std::endl;
+    std::cout << "<-t|--threads> <args>:        使用的线程数量" << std::endl;
+    std::cout << "<-a|--arrival> <args>:        到达过程, poisson, bursty或trace, 默认poisson" << std::endl;
+    std::cout << "<-r|--rates> <args>:          逗号分隔的各档请求速率(请求 / s), 0代表同时到达; trace模式下为时间轴加速倍数" << std::endl;
+    std::cout << "<--burstiness> <args>:        bursty模式下gamma分布的形状参数, 越小越突发, 默认0.25" << std::endl;
+    std::cout << "<-n|--num> <args>:            每档负载的请求数" << std::endl;
+    std::cout << "<-i|--input_len> <args>:      输入token数" << std::endl;
+    std::cout << "<-l|--output_len> <args>:     输出token数" << std::endl;
+    std::cout << "<--len_jitter> <args>:        输入输出长度的随机浮动比例, 0 ~ 1" << std::endl;
+    std::cout << "<-f|--file> <args>:           prompt文件, 每行一个prompt, 用来生成输入token" << std::endl;
+    std::cout << "<--trace> <args>:             trace文件, 每行 \"到达时间(s) 输入token数 输出token数\"" << std::endl;
+    std::cout << "<--ttft_slo> <args>:          TTFT的SLO (ms), 默认1000" << std::endl;
+    std::cout << "<--tpot_slo> <args>:          TPOT的SLO (ms), 默认100" << std::endl;
+    std::cout << "<-s|--seed> <args>:           随机种子" << std::endl;
+    std::cout << "<-o|--output> <args>:         结果输出文件(json)" << std::endl;
+}
+
+std::vector <float> ParseRates(const std::string &s) {
+    std::vector <float> rates;
+    std::stringstream ss(s);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (item == "inf") {
+            rates.push_back(0.0f);
+        } else if (item != "") {
+            rates.push_back(atof(item.c_str()));
+        }
+    }
+    return rates;
+}
+
+void ParseArgs(int argc, char **argv, ServingConfig &config) {
+    std::vector <std::string> sargv;
+    for (int i = 0; i < argc; i++) {
+        sargv.push_back(std::string(argv[i]));
+    }
+    for (int i = 1; i < argc; i++) {
+        if (sargv[i] == "-h" || sargv[i] == "--help") {
+            Usage();
+            exit(0);
+        } else if (i + 1 >= argc) {
+            Usage();
+            exit(-1);
+        } else if (sargv[i] == "-p" || sargv[i] == "--path") {
+            config.path = sargv[++i];
+        } else if (sargv[i] == "-t" || sargv[i] == "--threads") {
+            config.threads = atoi(sargv[++i].c_str());
+        } else if (sargv[i] == "-a" || sargv[i] == "--arrival") {
+            config.arrival = sargv[++i];
+        } else if (sargv[i] == "-r" || sargv[i] == "--rates") {
+            config.rates = ParseRates(sargv[++i]);
+        } else if (sargv[i] == "--burstiness") {
+            config.burstiness = atof(sargv[++i].c_str());
+        } else if (sargv[i] == "-n" || sargv[i] == "--num") {
+            config.num = atoi(sargv[++i].c_str());
+        } else if (sargv[i] == "-i" || sargv[i] == "--input_len") {
+            config.inputLen = atoi(sargv[++i].c_str());
+        } else if (sargv[i] == "-l" || sargv[i] == "--output_len") {
+            config.outputLen = atoi(sargv[++i].c_str());
+        } else if (sargv[i] == "--len_jitter") {
+            config.lenJitter = atof(sargv[++i].c_str());
+        } else if (sargv[i] == "-f" || sargv[i] == "--file") {
+            config.file = sargv[++i];
+        } else if (sargv[i] == "--trace") {
+            config.trace = sargv[++i];
+        } else if (sargv[i] == "--ttft_slo") {
+            config.ttftSlo = atof(sargv[++i].c_str());
+        } else if (sargv[i] == "--tpot_slo") {
+            config.tpotSlo = atof(sargv[++i].c_str());
+        } else if (sargv[i] == "-s" || sargv[i] == "--seed") {
+            config.seed = atoi(sargv[++i].c_str());
+        } else if (sargv[i] == "-o" || sargv[i] == "--output") {
+            config.output = sargv[++i];
+        } else {
+            Usage();
+            exit(-1);
+        }
+    }
+    if (config.arrival != "poisson" && config.arrival != "bursty" && config.arrival != "trace") {
+        Usage();
+        exit(-1);
+    }
+    if (config.arrival == "trace" && config.trace == "") {
+        printf("trace模式需要指定--trace文件\n");
+        exit(-1);
+    }
+    if (config.rates.empty()) {
+        config.rates.push_back(0.0f);
+    }
+}
+
+std::vector <ServingRequest> ReadTrace(const std::string &fileName) {
+    std::vector <ServingRequest> requests;
+    std::ifstream fin(fileName, std::ios::in);
+    if (!fin.good()) {
+        printf("trace文件 %s 不存在！\n", fileName.c_str());
+        exit(-1);
+    }
+    std::string line;
+    while (std::getline(fin, line)) {
+        if (line == "" || line[0] == '#') {
+            continue;
+        }
+        ServingRequest request;
+        std::stringstream ss(line);
+        if (ss >> request.arrival >> request.inputLen >> request.outputLen) {
+            requests.push_back(request);
+        }
+    }
+    std::sort(requests.begin(), requests.end(), [](const ServingRequest &a, const ServingRequest &b) {
+        return a.arrival < b.arrival;
+    });
+    for (int i = requests.size() - 1; i >= 0; i--) {
+        requests[i].arrival -= requests[0].arrival;
+    }
+    return requests;
+}
+
+// 生成一档负载的请求: 到达间隔服从gamma(shape, 1 / (rate * shape)), 均值为1 / rate, shape = 1时即泊松过程
+std::vector <ServingRequest> MakeRequests(const ServingConfig &config, const std::vector <ServingRequest> &traceRequests,
+                                          float rate, std::mt19937 &rng) {
+    std::vector <ServingRequest> requests;
+    if (config.arrival == "trace") {
+        requests = traceRequests;
+        for (auto &request : requests) {
+            request.arrival = rate > 0 ? request.arrival / rate : 0.0;
+        }
+        return requests;
+    }
+
+    float shape = config.arrival == "poisson" ? 1.0f : std::max(1e-3f, config.burstiness);
+    std::gamma_distribution <double> interval(shape, rate > 0 ? 1.0 / (rate * shape) : 1.0);
+    std::uniform_real_distribution <float> jitter(1.0f - config.lenJitter, 1.0f + config.lenJitter);
+    double now = 0;
+    for (int i = 0; i < config.num; i++) {
+        ServingRequest request;
+        if (rate > 0 && i > 0) {
+            now += interval(rng);
+        }
+        request.arrival = now;
+        request.inputLen = std::max(1, (int)std::round(config.inputLen * jitter(rng)));
+        request.outputLen = std::max(1, (int)std::round(config.outputLen * jitter(rng)));
+        requests.push_back(request);
+    }
+    return requests;
+}
+
+// 从token池中循环取出len个token作为输入
+std::vector <int> MakePrompt(const std::vector <int> &pool, int len, int offset) {
+    std::vector <int> tokens(len);
+    for (int i = 0; i < len; i++) {
+        tokens[i] = pool[(offset + i) % pool.size()];
+    }
+    return tokens;
+}
+
+double Percentile(std::vector <double> v, double p) {
+    if (v.empty()) {
+        return 0.0;
+    }
+    std::sort(v.begin(), v.end());
+    double pos = p / 100.0 * (v.size() - 1);
+    int l = (int)pos, r = std::min(l + 1, (int)v.size() - 1);
+    return v[l] + (v[r] - v[l]) * (pos - l);
+}
+
+double Mean(const std::vector <double> &v) {
+    double sum = 0;
+    for (double x : v) {
+        sum += x;
+    }
+    return v.empty() ? 0.0 : sum / v.size();
+}
+
+// 按到达时间依次启动请求, 每个请求用一个线程读取输出并记录每个token的时间
+double RunLevel(fastllm::basellm *model, std::vector <ServingRequest> &requests, const std::vector <int> &pool) {
+    std::vector <std::thread> fetchers;
+    auto st = std::chrono::system_clock::now();
+    std::vector <double> finishes(requests.size(), 0.0);
+    for (int i = 0; i < requests.size(); i++) {
+        auto &request = requests[i];
+        auto arrival = st + std::chrono::microseconds((long long)(request.arrival * 1e6));
+        std::this_thread::sleep_until(arrival);
+
+        fastllm::GenerationConfig generationConfig;
+        generationConfig.output_token_limit = request.outputLen;
+        int handle = model->LaunchResponseTokens(MakePrompt(pool, request.inputLen, i * 131), generationConfig);
+        fetchers.push_back(std::thread([model, handle, arrival, st, &request, &finishes, i]() {
+            auto first = arrival, last = arrival;
+            while (model->FetchResponseTokens(handle) != -1) {
+                last = std::chrono::system_clock::now();
+                if (request.outputTokens++ == 0) {
+                    first = last;
+                }
+            }
+            request.ttft = fastllm::GetSpan(arrival, first);
+            request.e2e = fastllm::GetSpan(arrival, last);
+            request.tpot = request.outputTokens > 1 ? fastllm::GetSpan(first, last) / (request.outputTokens - 1) : 0.0;
+            finishes[i] = fastllm::GetSpan(st, last);
+        }));
+    }
+    for (auto &fetcher : fetchers) {
+        fetcher.join();
+    }
+    return *std::max_element(finishes.begin(), finishes.end());
+}
+
+int main(int argc, char **argv) {
+    ServingConfig config;
+    ParseArgs(argc, argv, config);
+    fastllm::SetThreads(config.threads);
+    std::ifstream model_file(config.path, std::ios::in);
+    if (!model_file.good()) {
+        printf("模型文件 %s 不存在！\n", config.path.c_str());
+        exit(0);
+    }
+    model_file.close();
+    auto model = fastllm::CreateLLMModelFromFile(config.path);
+    fastllm::PrintInstructionInfo();
+
+    // 输入token: prompt编码后拼成token池, 按需要的长度循环截取
+    std::vector <std::string> prompts;
+    if (config.file != "") {
+        std::ifstream finputs(config.file, std::ios::in);
+        std::string input;
+        while (std::getline(finputs, input)) {
+            if (input != "") {
+                prompts.push_back(input);
+            }
+        }
+    }
+    if (prompts.empty()) {
+        prompts.push_back("Hello！");
+    }
+    std::vector <int> pool;
+    for (auto &prompt : prompts) {
+        fastllm::Data ids = model->weight.tokenizer.Encode(model->MakeInput("", 0, prompt));
+        for (int i = 0; i < ids.Count(0); i++) {
+            pool.push_back((int)((float*)ids.cpuData)[i]);
+        }
+    }
+    if (pool.empty()) {
+        // 分词器没有编码出token时直接使用词表中的token
+        for (auto &it : model->weight.tokenizer.tokenToStringDict) {
+            pool.push_back(it.first);
+        }
+        std::sort(pool.begin(), pool.end());
+        if (pool.empty()) {
+            pool.push_back(0);
+        }
+    }
+
+    std::vector <ServingRequest> traceRequests;
+    if (config.arrival == "trace") {
+        traceRequests = ReadTrace(config.trace);
+        if (traceRequests.empty()) {
+            printf("trace文件 %s 中没有请求！\n", config.trace.c_str());
+            exit(-1);
+        }
+    }
+
+    // 预热, 同时启动模型的主循环
+    std::vector <ServingRequest> warmup(1);
+    warmup[0].inputLen = std::min(config.inputLen, 16);
+    warmup[0].outputLen = 2;
+    RunLevel(model.get(), warmup, pool);
+
+    FILE *fo = config.output != "" ? fopen(config.output.c_str(), "w") : nullptr;
+    std::mt19937 rng(config.seed);
+    printf("%-8s %6s %8s %10s %10s | %9s %9s %9s | %9s %9s %9s | %9s %9s | %9s %9s\n",
+           "rate", "reqs", "time(s)", "req/s", "tok/s", "ttft p50", "ttft p90", "ttft p99",
+           "tpot p50", "tpot p90", "tpot p99", "e2e p50", "e2e p99", "goodput", "slo%");
+    for (float rate : config.rates) {
+        std::vector <ServingRequest> requests = MakeRequests(config, traceRequests, rate, rng);
+        double duration = RunLevel(model.get(), requests, pool);
+
+        std::vector <double> ttfts, tpots, e2es;
+        int outputTokens = 0, good = 0;
+        for (auto &request : requests) {
+            ttfts.push_back(request.ttft * 1000);
+            e2es.push_back(request.e2e * 1000);
+            if (request.outputTokens > 1) {
+                tpots.push_back(request.tpot * 1000);
+            }
+            outputTokens += request.outputTokens;
+            good += (request.outputTokens > 0 && request.ttft * 1000 <= config.ttftSlo && request.tpot * 1000 <= config.tpotSlo);
+        }
+        duration = std::max(duration, 1e-9);
+        double goodput = good / duration, sloRatio = 100.0 * good / requests.size();
+        char rateName[32];
+        if (rate <= 0) {
+            snprintf(rateName, sizeof(rateName), "inf");
+        } else {
+            snprintf(rateName, sizeof(rateName), config.arrival == "trace" ? "x%g" : "%g", rate);
+        }
+        printf("%-8s %6d %8.2f %10.3f %10.2f | %9.1f %9.1f %9.1f | %9.2f %9.2f %9.2f | %9.1f %9.1f | %9.3f %8.1f%%\n",
+               rateName, (int)requests.size(), duration, requests.size() / duration, outputTokens / duration,
+               Percentile(ttfts, 50), Percentile(ttfts, 90), Percentile(ttfts, 99),
+               Percentile(tpots, 50), Percentile(tpots, 90), Percentile(tpots, 99),
+               Percentile(e2es, 50), Percentile(e2es, 99), goodput, sloRatio);
+        if (fo != nullptr) {
+            fprintf(fo, "{\"arrival\": \"%s\", \"rate\": %f, \"requests\": %d, \"duration\": %f, "
+                        "\"request_throughput\": %f, \"output_throughput\": %f, \"output_tokens\": %d, "
+                        "\"ttft_ms\": {\"mean\": %f, \"p50\": %f, \"p90\": %f, \"p99\": %f}, "
+                        "\"tpot_ms\": {\"mean\": %f, \"p50\": %f, \"p90\": %f, \"p99\": %f}, "
+                        "\"e2e_ms\": {\"mean\": %f, \"p50\": %f, \"p90\": %f, \"p99\": %f}, "
+                        "\"ttft_slo_ms\": %f, \"tpot_slo_ms\": %f, \"goodput\": %f, \"slo_attainment\": %f}\n",
+                    config.arrival.c_str(), rate, (int)requests.size(), duration,
+                    requests.size() / duration, outputTokens / duration, outputTokens,
+                    Mean(ttfts), Percentile(ttfts, 50), Percentile(ttfts, 90), Percentile(ttfts, 99),
+                    Mean(tpots), Percentile(tpots, 50), Percentile(tpots, 90), Percentile(tpots, 99),
+                    Mean(e2es), Percentile(e2es, 50), Percentile(e2es, 90), Percentile(e2es, 99),
+                    config.ttftSlo, config.tpotSlo, goodput, sloRatio / 100.0);
+            fflush(fo);
+        }
+    }
+    if (fo != nullptr) {
+        fclose(fo);
+    }
+    printf("goodput: 每秒完成的满足SLO(TTFT <= %.0f ms, TPOT <= %.0f ms)的请求数\n", config.ttftSlo, config.tpotSlo);
+    // 模型的主循环线程不会退出, 不能在它还在运行时析构模型
+    model.release();
+    return 0;
+}
@@ -31,6 +31,10 @@ namespace fastllm {
         void Run(const std::string &opType, const DataDict &datas, const FloatDict &floatParams, const IntDict &intParams);
     };
 
+    class CpuToBFloat16 : BaseOperator {
+        void Run(const std::string &opType, const DataDict &datas, const FloatDict &floatParams, const IntDict &intParams);
+    };
+
     class CpuAttention : BaseOperator {
         void Reshape(const std::string &opType, const DataDict &datas, const FloatDict &floatParams, const IntDict &intParams);
     protected:
@@ -50,10 +54,36 @@ namespace fastllm {
         void Run(const std::string &opType, const DataDict &datas, const FloatDict &floatParams, const IntDict &intParams);
     };
 
-    class CpuLinearOp : BaseOperator {
+    // input += residual, output = RMSNorm(input), 可选再输出按行量化好的quantizedOutput给INT8 / INT4的Linear使用
+    class CpuAddRMSNormOp : BaseOperator {
         void Reshape(const std::string &opType, const DataDict &datas, const FloatDict &floatParams, const IntDict &intParams);
+    protected:
+        void Run(const std::string &opType, const DataDict &datas, const FloatDict &floatParams, const IntDict &intParams);
+    };
+
+    // input += residual, output = LayerNorm(input) (最后一维), 其余同AddRMSNorm
+    class CpuAddLayerNormOp : CpuAddRMSNormOp {
+    };
+
+    class CpuLinearOp : BaseOperator {
         bool CanRun(const std::string &opType, const DataDict &datas, const FloatDict &floatParams, const IntDict &intParams);
     protected:
+        void Reshape(const std::string &opType, const DataDict &datas, const FloatDict &floatParams, const IntDict &intParams);
+        void Run(const std::string &opType, const DataDict &datas, const FloatDict &floatParams, const IntDict &intParams);
+    };
+
+    // silu(input * gateWeight^T) * (input * upWeight^T), 对应LLaMA类模型MLP的gate_proj和up_proj
+    class CpuLinearSwigluOp : CpuLinearOp {
+        void Reshape(const std::string &opType, const DataDict &datas, const FloatDict &floatParams, const IntDict &intParams);
+        bool CanRun(const std::string &opType, const DataDict &datas, const FloatDict &floatParams, const IntDict &intParams);
+        void Run(const std::string &opType, const DataDict &datas, const FloatDict &floatParams, const IntDict &intParams);
+    };
+
+    // q, k, v = input * weight^T + bias, 再对q, k做LlamaRotatePosition2D, q按Attention需要的格式输出, k, v直接追加到KV cache
+    // 按head分块计算Linear, 每个head算完马上做旋转并写到最终位置
+    class CpuLlamaQKVRotateAppendOp : BaseOperator {
+        void Reshape(const std::string &opType, const DataDict &datas, const FloatDict &floatParams, const IntDict &intParams);
+        bool CanRun(const std::string &opType, const DataDict &datas, const FloatDict &floatParams, const IntDict &intParams);
         void Run(const std::string &opType, const DataDict &datas, const FloatDict &floatParams, const IntDict &intParams);
     };
 
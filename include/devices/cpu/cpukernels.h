@@ -0,0 +1,81 @@
+// CPU上Linear及激活函数, Norm等使用的计算kernel, 可以按不同指令集编译多份, 运行时选择
+
+#ifndef FASTLLM_CPUKERNELS_H
+#define FASTLLM_CPUKERNELS_H
+
+#include "fastllm.h"
+
+namespace fastllm {
+    struct FP16ToFP32Manager {
+        float dict[65536];
+
+        FP16ToFP32Manager();
+    };
+
+    extern FP16ToFP32Manager fp16tofp32;
+
+    // 一组按某个指令集编译的Linear kernel
+    struct CpuLinearKernels {
+        CpuInstructionLevel level; // 编译这组kernel时的指令集
+        bool int8SignedInput; // int8矩阵乘的input需要预先转成 (x ^ 128) 的int8格式 (DotU8U8的符号技巧)
+        bool int4ReorderInput; // int4矩阵乘的input需要每32个一组重排 (奇数位在前16个, 偶数位在后16个)
+
+        // float的input, float / float16的weight, 计算output的[st, end)列
+        void (*floatLinearPart)(float *inputData, float *weightData, float *biasData, float *outputData,
+                                int n, int m, int k, int st, int end);
+        void (*float16LinearPart)(float *inputData, uint16_t *weightData, float *biasData, float *outputData,
+                                  int n, int m, int k, int st, int end);
+        // float的input, L2(码本)权重, weight为uint8 / uint16的码本下标, 计算output的[st, end)列
+        void (*codebookLinearPartU8)(float *inputData, uint8_t *indexData, float *codebook, int codebookSize,
+                                     float *biasData, float *outputData, int n, int m, int k, int st, int end);
+        void (*codebookLinearPartU16)(float *inputData, uint16_t *indexData, float *codebook, int codebookSize,
+                                      float *biasData, float *outputData, int n, int m, int k, int st, int end);
+        // float的input, bfloat16的weight, 计算output的[st, end)列
+        void (*bfloat16LinearPart)(float *inputData, uint16_t *weightData, float *biasData, float *outputData,
+                                   int n, int m, int k, int st, int end);
+        // bfloat16的input和weight(AVX512_BF16), 计算output的[st, end)列; nullptr代表不支持
+        void (*bfloat16InputLinearPart)(uint16_t *inputData, uint16_t *weightData, float *biasData, float *outputData,
+                                        int n, int m, int k, int st, int end);
+
+        //a = [n, m], b = [k, m], c = aT(b') = [n, k]
+        void (*multiply)(uint8_t *a, uint8_t *b, int32_t *c, int n, int m, int k, int kstride);
+        void (*multiplyInt4)(uint8_t *a, uint8_t *b, int32_t *c, int n, int m, int k, int kstride,
+                             int *weightSums, int *weightZeros, float *scales, float *bias, LowBitConfig *config,
+                             int *inputSums);
+        void (*multiplyInt4NoZero)(uint8_t *a, uint8_t *b, int32_t *c, int n, int m, int k, int kstride,
+                                   int *weightSums, float *weightMins, float *scales, float *bias, LowBitConfig *config,
+                                   int *inputSums);
+        void (*multiplyInt4Group)(uint8_t *a, uint8_t *b, int32_t *c, int n, int m, int k, int kstride,
+                                  int *weightSums, float *weightMins, float *scales, float *bias,
+                                  float *iscales, float *izeros, float *inputSums, int group, int groupCnt);
+
+        // AMX int8矩阵乘, a为补齐到[16, 64]整数倍的int8 input, b为Data::CalcAMXWeight重排好的权重,
+        // 计算[kst, kend)列写入c(c指向第kst列, 行间距为kstride); nullptr代表不支持
+        void (*multiplyAMX)(int8_t *a, int8_t *b, int32_t *c, int n, int mPad, int kst, int kend, int kstride);
+
+        // 逐元素的激活函数, 处理连续的len个float; silu的up不为nullptr时 output = silu(input) * up
+        void (*silu)(float *input, float *up, float *output, int len);
+        void (*gelu)(float *input, float *output, int len); // erf版本
+        void (*geluNew)(float *input, float *output, int len); // tanh近似版本
+        void (*tanh)(float *input, float *output, int len);
+        void (*addTo)(float *input, float *residual, int len); // input += residual
+
+        // 连续len个float的点积 (Attention的q·k, MatMulTransB的一行)
+        float (*dotRow)(float *a, float *b, int len);
+        // 权重求和(Data::CalcWeightSum): len个uint8之和 / bytes个字节中全部2 * bytes个int4之和
+        int (*sumU8Row)(uint8_t *data, int len);
+        int (*sumU4Row)(uint8_t *data, int bytes);
+
+        // 按行计算的softmax / RMSNorm / LayerNorm, 一行为channels个连续的float
+        void (*softmaxRow)(float *input, float *output, int channels);
+        void (*rmsNormRow)(float *input, float *weight, float *output, int channels, float eps);
+        void (*layerNormRow)(float *input, float *gamma, float *beta, float *output, int channels, float eps);
+
+        // 峰值算力测试: 用这个指令集最宽的向量做iterations轮互不依赖的float乘加, 结果写入sink, 返回浮点运算次数
+        uint64_t (*fmaProbe)(int iterations, float *sink);
+    };
+
+    const CpuLinearKernels *GetCpuLinearKernels(); // 按GetCpuInstructionLevel()选择当前使用的kernel
+}
+
+#endif //FASTLLM_CPUKERNELS_H
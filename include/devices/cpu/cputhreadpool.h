@@ -7,12 +7,26 @@
 
 #include <mutex>
 #include <queue>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
 #include <functional>
 #include <future>
 #include <thread>
 #include <utility>
 #include <vector>
 
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#include <immintrin.h>
+#endif
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
 namespace fastllm {
     template <typename T>
     class TaskQueue {
@@ -50,8 +64,51 @@ namespace fastllm {
         }
     };
 
+    enum ParallelSchedule {
+        ParallelScheduleStatic = 0, // 按线程数均分成连续的几段, 每个线程一段
+        ParallelScheduleDynamic = 1 // 切成大小为grain的块, 各线程用原子计数领取
+    };
+
+    inline void CpuRelax() {
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+        _mm_pause();
+#elif defined(__aarch64__)
+        __asm__ __volatile__("yield");
+#endif
+    }
+
+    // 当前线程是否是线程池的工作线程 (工作线程中再调用ParallelFor时直接串行执行, 避免死锁)
+    inline bool &InThreadPoolWorker() {
+        static thread_local bool inWorker = false;
+        return inWorker;
+    }
+
+    // 记录ParallelFor中每个参与者耗时的回调, worker是工作线程编号(调用线程为-1); 为空时不读时钟
+    typedef void (*ThreadPoolTraceHook)(int worker, std::chrono::steady_clock::time_point st,
+                                        std::chrono::steady_clock::time_point end);
+
+    inline std::atomic <ThreadPoolTraceHook> &GetThreadPoolTraceHook() {
+        static std::atomic <ThreadPoolTraceHook> hook(nullptr);
+        return hook;
+    }
+
     class ThreadPool {
     private:
+        static const int maxSpinCount = 1 << 14;
+        int spinCount; // 没有任务时先空转这么多次再睡眠; 线程数超过cpu核数时空转只会抢占其他线程, 直接睡眠
+
+        // 一次ParallelFor: 调用线程发布后工作线程直接读取, 不经过任务队列
+        struct ParallelJob {
+            void (*run)(const void *fn, int st, int end) = nullptr;
+            const void *fn = nullptr;
+            int begin = 0, end = 0, grain = 1, parts = 1;
+            bool dynamic = false;
+            std::atomic <int> next; // 动态划分时下一个未领取的块的起点
+            std::atomic <int> unfinished; // 还没有完成的工作线程数
+            std::exception_ptr exception;
+            std::mutex exceptionLocker;
+        };
+
         class ThreadWorker
         {
         private:
@@ -61,39 +118,134 @@ namespace fastllm {
             ThreadWorker(ThreadPool *pool, const int id) : pool(pool), id(id) {}
 
             void operator()() {
+                InThreadPoolWorker() = true;
                 std::function<void()> func;
-                bool dequeued;
-
+                uint64_t seen = 0; // 线程启动前jobTicket为0, 不能在这里读取, 否则可能错过刚发布的任务
+                int spin = 0;
                 while (!pool->shutdown) {
-                    {
-                        std::unique_lock<std::mutex> lock(pool->locker);
-                        if (pool->queue.Empty()) {
-                            pool->cv.wait(lock);
+                    uint64_t ticket = pool->jobTicket.load();
+                    if (ticket != seen) {
+                        seen = ticket;
+                        spin = 0;
+                        // ticket的低16位是参与这次ParallelFor的工作线程数, 第id个工作线程负责第id部分
+                        if (id < (int)(ticket & 0xFFFF)) {
+                            pool->RunJobPart(id);
+                            pool->job.unfinished.fetch_sub(1);
                         }
-
-                        dequeued = pool->queue.Pop(func);
+                        continue;
                     }
-                    if (dequeued) {
+                    if (pool->pendingTasks.load() > 0 && pool->queue.Pop(func)) {
+                        pool->pendingTasks.fetch_sub(1);
                         func();
+                        spin = 0;
+                        continue;
+                    }
+                    if (++spin < pool->spinCount) {
+                        CpuRelax();
+                        continue;
                     }
+                    std::unique_lock<std::mutex> lock(pool->locker);
+                    pool->sleepers.fetch_add(1);
+                    pool->cv.wait(lock, [&]() {
+                        return pool->shutdown || pool->jobTicket.load() != seen || pool->pendingTasks.load() > 0;
+                    });
+                    pool->sleepers.fetch_sub(1);
+                    spin = 0;
                 }
             }
         };
 
-        bool shutdown = false;
+        std::atomic <bool> shutdown;
         TaskQueue<std::function<void()>> queue;
+        std::atomic <int> pendingTasks; // 队列中的任务数, 工作线程空转时不用加锁检查队列
         std::vector<std::thread> threads;
+        bool callerJoins = true; // 调用ParallelFor的线程是否参与计算 (绑核时不参与, 保证第i部分总在第i个工作线程上计算)
         std::mutex locker;
         std::condition_variable cv;
+        std::atomic <int> sleepers; // 正在睡眠的工作线程数
+
+        ParallelJob job;
+        std::atomic <uint64_t> jobTicket; // (序号 << 16) | 参与的工作线程数, 每发布一次ParallelFor变化一次
+        std::mutex jobLocker; // 同一时间只有一个ParallelFor在执行, 其余调用者串行执行
+
+        void WakeUp() {
+            if (sleepers.load() > 0) {
+                std::unique_lock<std::mutex> lock(locker);
+                cv.notify_all();
+            }
+        }
+
+        // 执行第part个参与者(工作线程的id, 调用线程是最后一个)负责的部分
+        void RunJobPart(int part) {
+            ThreadPoolTraceHook hook = GetThreadPoolTraceHook().load(std::memory_order_relaxed);
+            std::chrono::steady_clock::time_point st;
+            if (hook != nullptr) {
+                st = std::chrono::steady_clock::now();
+            }
+            try {
+                if (job.dynamic) {
+                    while (true) {
+                        int st = job.next.fetch_add(job.grain);
+                        if (st >= job.end) {
+                            break;
+                        }
+                        job.run(job.fn, st, std::min(job.end, st + job.grain));
+                    }
+                } else {
+                    int len = job.end - job.begin, per = len / job.parts, remain = len % job.parts;
+                    int st = job.begin + part * per + std::min(part, remain);
+                    int end = st + per + (part < remain);
+                    if (st < end) {
+                        job.run(job.fn, st, end);
+                    }
+                }
+            } catch (...) {
+                std::unique_lock<std::mutex> lock(job.exceptionLocker);
+                if (!job.exception) {
+                    job.exception = std::current_exception();
+                }
+            }
+            if (hook != nullptr) {
+                // 工作线程只执行和自己编号相同的部分, 调用线程执行最后一部分
+                hook(InThreadPoolWorker() ? part : -1, st, std::chrono::steady_clock::now());
+            }
+        }
+
+        template <typename F>
+        static void RunFunc(const void *fn, int st, int end) {
+            (*(const F*)fn)(st, end);
+        }
     public:
-        ThreadPool(const int t = 4) : threads(std::vector<std::thread>(t)) {
+        // cpus非空时第i个工作线程绑定到cpus[i]上
+        ThreadPool(const int t = 4, const std::vector <int> &cpus = std::vector <int> ()) : threads(std::vector<std::thread>(t)) {
+            spinCount = (t < (int)std::thread::hardware_concurrency() ? maxSpinCount : 0);
+            shutdown = false;
+            pendingTasks = 0;
+            sleepers = 0;
+            jobTicket = 0;
+            job.next = 0;
+            job.unfinished = 0;
             for (int i = 0; i < threads.size(); ++i) {
                 threads[i] = std::thread(ThreadWorker(this, i));
             }
+#ifdef __linux__
+            if (cpus.size() == threads.size()) {
+                callerJoins = false;
+                for (int i = 0; i < threads.size(); ++i) {
+                    cpu_set_t cpuSet;
+                    CPU_ZERO(&cpuSet);
+                    CPU_SET(cpus[i], &cpuSet);
+                    pthread_setaffinity_np(threads[i].native_handle(), sizeof(cpu_set_t), &cpuSet);
+                }
+            }
+#endif
         }
         void Shutdown() {
-            shutdown = true;
-            cv.notify_all();
+            {
+                std::unique_lock<std::mutex> lock(locker);
+                shutdown = true;
+                cv.notify_all();
+            }
             for (int i = 0; i < threads.size(); ++i) {
                 if (threads[i].joinable()) {
                     threads[i].join();
@@ -101,6 +253,65 @@ namespace fastllm {
             }
         }
 
+        int ThreadCount() const {
+            return threads.size();
+        }
+
+        // 等待正在执行的ParallelFor结束; 返回后, 之前发布的任务里读到的trace回调都已经调用完
+        void WaitParallelFor() {
+            std::lock_guard<std::mutex> guard(jobLocker);
+        }
+
+        // 把[begin, end)切块后在常驻线程上并行执行fn(st, end), 返回时所有块都已完成
+        // 未绑核时调用线程也参与计算(负责最后一部分), 绑核时静态划分的第i部分由第i个工作线程计算
+        // ParallelScheduleStatic: 均分成min(线程数, (end - begin) / grain)段连续的区间
+        // ParallelScheduleDynamic: 切成大小为grain的块, 各线程动态领取, 适合每块耗时不均匀的情况
+        template <typename F>
+        void ParallelFor(int begin, int end, int grain, const F &fn,
+                         ParallelSchedule schedule = ParallelScheduleStatic) {
+            if (end <= begin) {
+                return;
+            }
+            grain = std::max(1, grain);
+            int len = end - begin;
+            int maxParts = schedule == ParallelScheduleStatic ? len / grain : (len + grain - 1) / grain;
+            int parts = std::max(1, std::min(std::min((int)threads.size(), 0xFFFF), maxParts));
+            std::unique_lock<std::mutex> jobLock(jobLocker, std::defer_lock);
+            if (parts == 1 || InThreadPoolWorker() || !jobLock.try_lock()) {
+                fn(begin, end);
+                return;
+            }
+
+            job.run = RunFunc<F>;
+            job.fn = &fn;
+            job.begin = begin;
+            job.end = end;
+            job.grain = grain;
+            job.parts = parts;
+            job.dynamic = (schedule == ParallelScheduleDynamic);
+            job.next = begin;
+            job.exception = nullptr;
+            int workers = callerJoins ? parts - 1 : parts;
+            job.unfinished = workers;
+            jobTicket.store((((jobTicket.load() >> 16) + 1) << 16) | (uint64_t)workers);
+            WakeUp();
+
+            if (callerJoins) {
+                RunJobPart(parts - 1);
+            }
+            // 等待其余线程完成 (barrier)
+            for (int spin = 0; job.unfinished.load() > 0; spin++) {
+                if (spin < spinCount) {
+                    CpuRelax();
+                } else {
+                    std::this_thread::yield();
+                }
+            }
+            if (job.exception) {
+                std::rethrow_exception(job.exception);
+            }
+        }
+
         template<typename F, typename... Args>
         auto Submit(F &&f, Args &&...args) -> std::future<decltype(f(args...))> {
             std::function<decltype(f(args...))()> func = std::bind(std::forward<F>(f), std::forward<Args>(args)...);
@@ -109,7 +320,8 @@ namespace fastllm {
                 (*task_ptr)();
             };
             queue.Push(warpper_func);
-            cv.notify_one();
+            pendingTasks.fetch_add(1);
+            WakeUp();
             return task_ptr->get_future();
         }
     };
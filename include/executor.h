@@ -7,11 +7,86 @@
 
 #include "device.h"
 
+#include <chrono>
+#include <mutex>
+
 namespace fastllm {
+    // 预先解析的op: 构造时按名字注册得到一个稠密的编号, Executor按编号缓存分派结果, 调用时不再做字符串查找
+    // 一般定义成静态变量, 每个调用点只构造一次
+    struct OpHandle {
+        int id;
+        const std::string *name;
+
+        explicit OpHandle(const std::string &opType);
+
+        const std::string &Name() const {
+            return *name;
+        }
+    };
+
+    // trace中的一条记录, 时间是相对StartTrace的纳秒数
+    struct TraceEvent {
+        enum Type {
+            OP = 0, SCOPE = 1, POOL = 2 // 一次op, 模型标记的一段, 线程池中一个线程执行的一部分
+        };
+        Type type;
+        std::string name;
+        int tid; // 0: 调用线程, i + 1: 线程池的第i个工作线程
+        uint64_t begin, end;
+        int layer = -1;
+        std::string scope; // 所在的scope, 例如"layer 12 / attention"
+        std::string shapes, dataType, device;
+        uint64_t bytes = 0, flops = 0; // 读写的数据量和估算的浮点运算量
+        double rooflineSpend = 0.0; // 见OpProfile
+    };
+
+    // 一组op调用的累计统计
+    struct OpProfile {
+        double spend = 0.0; // 耗时(秒)
+        int calls = 0;
+        uint64_t bytes = 0, flops = 0; // 读写的数据量, 估算的浮点运算量
+        double rooflineSpend = 0.0; // 按机器峰值估算的最短耗时 max(bytes / 带宽, flops / 算力), 只统计CPU上的op
+
+        void Add(double spend, uint64_t bytes, uint64_t flops, double rooflineSpend);
+
+        std::string ToString(const MachinePeak &peak) const; // 耗时, 次数, GB/s, GFLOPS和达到roofline的比例
+    };
+
     class Executor {
     private:
         std::vector <BaseDevice*> devices;
-        std::map <std::string, float> profiler;
+        std::vector <OpProfile> profiler; // 按op编号累计的统计
+        bool profiling = true; // 是否统计各op的耗时; 默认统计(只读时钟), 环境变量FASTLLM_PROFILE=0时关闭, ClearProfiler会重新打开并开始统计数据量和浮点运算量
+        MachinePeak peak; // ClearProfiler或StartTrace时测出的机器峰值
+
+        bool tracing = false; // StartTrace之后逐个记录op, scope和线程池任务的起止时间
+        std::chrono::steady_clock::time_point traceStart;
+        std::vector <TraceEvent> traceEvents;
+        std::vector <TraceEvent> traceScopes; // 还没结束的scope
+        std::mutex traceLocker; // 线程池任务在工作线程中写入traceEvents
+
+        static void TracePoolTask(int worker, std::chrono::steady_clock::time_point st,
+                                  std::chrono::steady_clock::time_point end);
+
+        void TraceOp(const OpHandle &op, BaseDevice *device, const fastllm::DataDict &datas,
+                     const fastllm::IntDict &intParams, bool hasBatch, std::chrono::steady_clock::time_point st);
+
+        // 分派缓存: 下标为op编号 * 2 + lockInCPU, 内容是按优先级排列的注册了这个op的设备
+        // 命中时只需要依次调用这些算子的CanRun, 和逐个设备查找的结果相同
+        struct DispatchEntry {
+            bool ready = false;
+            std::vector <std::pair <BaseDevice*, BaseOperator*> > candidates;
+        };
+        std::vector <DispatchEntry> dispatchCache;
+
+        const DispatchEntry &GetDispatch(int opId, bool lockInCPU);
+
+        GraphPlan *graph = nullptr; // 正在记录或重放的静态图
+        int graphOpId = 0; // 下一个op在图中的序号
+        bool graphMatched = true; // 这一步到目前为止的op序列和记录一致
+        std::map <uint64_t, std::pair <uint64_t, int> > graphLiveRanges; // 记录时: 中间结果的起始地址 -> (结束地址, 编号)
+
+        void GraphMarkUse(Data *data); // 记录时: data的内存属于某个中间结果时, 更新它的最后使用时间
 
     public:
         Executor (); // 创建默认的Executor
@@ -30,12 +105,32 @@ namespace fastllm {
                        const fastllm::IntDict &intParams);
                        
         // 运行一个op
+        void Run(const OpHandle &op, const fastllm::DataDict &datas, const fastllm::FloatDict &floatParams,
+                 const fastllm::IntDict &intParams);
+
+        // 按名字运行一个op (每次调用都要解析名字, 频繁调用的地方用OpHandle)
         void Run(const std::string &opType, const fastllm::DataDict &datas, const fastllm::FloatDict &floatParams,
                  const fastllm::IntDict &intParams);
 
-        void ClearProfiler();
+        bool BeginGraph(GraphPlan *plan); // 开始记录或重放plan, 已经在另一个图中时返回false
+
+        void EndGraph(); // 结束这一步, 需要时完成规划或重新规划
+
+        void ClearProfiler(); // 清空统计(确保开始统计)各op的耗时, 数据量和浮点运算量, 并测出机器峰值
+
+        void PrintProfiler(); // 输出各op的耗时和roofline效率, 记录过trace时还输出按层和按形状的统计
+
+        void StartTrace(); // 开始记录trace
+
+        void StopTrace(const std::string &fileName); // 结束记录, fileName非空时写成chrome trace格式的json
+
+        bool IsTracing() const {
+            return tracing;
+        }
+
+        void PushTraceScope(const std::string &name, int layer); // 进入模型中的一段, 之后的op都属于它
 
-        void PrintProfiler();
+        void PopTraceScope();
     };
 }
 
@@ -9,6 +9,7 @@
 #include <cstdint>
 #include <string>
 #include <map>
+#include <list>
 #include <set>
 #include <queue>
 #include <unordered_map>
@@ -19,6 +20,8 @@
 #include <memory>
 #include <locale>
 #include <codecvt>
+#include <mutex>
+#include <atomic>
 #include "devices/cpu/cputhreadpool.h"
 
 #ifdef USE_SENTENCEPIECE
@@ -26,16 +29,31 @@
 #endif
 
 namespace fastllm {
+    enum CpuInstructionLevel { // CPU量化计算可选用的指令集, 由低到高
+        ISA_BASE = 0,
+        ISA_AVX2 = 1,
+        ISA_AVX512 = 2,
+        ISA_AVX512_VNNI = 3,
+        ISA_AMX = 4
+    };
+
     void SetDeviceMap(const std::map <std::string, int> &deviceMap);
     std::map <std::string, int> GetDeviceMap();
     void PrintInstructionInfo();
+    void SetCpuInstructionLevel(int level); // 限制CPU计算使用的最高指令集, -1代表不限制(也可用环境变量FASTLLM_CPU_ISA设置)
+    CpuInstructionLevel GetCpuInstructionLevel(); // 当前CPU计算实际使用的指令集 (min(硬件支持, 编译支持, 限制))
     void SetThreads(int t);
-    void SetLowMemMode(bool m);
+    void SetLowMemMode(bool m); // 低内存模式: embedding留在文件中, 也不生成AMX格式的INT8权重副本; 需要在加载模型前设置
     void SetKVCacheInCPU(bool kvCacheInCPU);
     bool GetLowMemMode();
     int GetThreads();
     bool GetKVCacheInCPU();
     ThreadPool *GetPool();
+    void SetNumaMode(bool numa); // NUMA模式: 工作线程按node绑核, Linear的权重按计算它的线程放到对应node的内存上 (也可用环境变量FASTLLM_NUMA=1开启)
+    bool GetNumaMode();
+    uint8_t *FastllmCpuMalloc(uint64_t size); // 从cpu内存池中分配内存(不清零), 用于中间结果
+    void FastllmCpuFree(uint8_t *data); // 归还给内存池; 不是内存池分配的内存直接delete[]
+    void ClearCpuMemoryPool(); // 释放内存池中所有空闲的内存
 
     struct GenerationConfig {
         int output_token_limit = -1; // 最多输出多少, <= 0代表无限制
@@ -188,7 +206,8 @@ namespace fastllm {
 
     struct FileMmap {
     public:
-        FileMmap(const std::string &path);
+        // copyOnWrite: 私有映射, 写入时复制, 不会改动文件; prefetch: 提示内核顺序预读整个文件
+        FileMmap(const std::string &path, bool copyOnWrite = false, bool prefetch = false);
         ~FileMmap();
 
         char *data;
@@ -237,6 +256,8 @@ namespace fastllm {
         uint64_t expansionBytes = 0; // 扩容后的字节数
         std::vector <int> expansionDims; // 预扩容的形状
         uint8_t *cpuData = nullptr; // 数据指针
+        mutable std::shared_ptr <uint8_t> cpuDataHolder; // 非空时cpuData所在的内存被原Data和它的视图共享(引用计数), 由最后一个持有者释放
+        bool isView = false; // 视图: 数据指针指向其他Data的内存(可以带偏移), 不负责释放; CUDA上的视图不持有引用, 原Data需要比视图活得久
 
 	    void *cudaData = nullptr;
         std::vector <void*> extraCudaData;
@@ -260,6 +281,8 @@ namespace fastllm {
         std::vector <float> scales, mins;
         std::vector <int> zeros;
         std::vector <int> weightSum; // 作为权重时，有时候需要存一些和加速计算
+        std::vector <int8_t> amxWeight; // 作为INT8权重时, 按AMX格式重排好的权重(每16行一组), CPU支持AMX时加载权重时生成; 和cpuData各占一份内存(INT8权重的内存翻倍), 低内存模式下不生成也不使用
+        int linearInputLayout = 0; // 作为Linear的quantizedInput时的排布, 0为按行量化的uint8, 其余由CPU的Linear kernel决定(见cpudevice.cpp)
 
         // 以下参数用于L2
         int l2_num = -1;
@@ -274,6 +297,8 @@ namespace fastllm {
         std::shared_ptr<FileMmap> mapFile;
 
         bool directMemory = false; // 直接分配/释放Memory，不经过缓存
+        int numaPlacedThreads = 0; // NUMA模式下按多少个线程的划分放置过各行的内存, 0代表还没有放置
+        int numaPlacedSegments = 1; // NUMA模式下放置时把各行分成了几段(合并的gate和up为2段)
 
         Data () {};
 
@@ -289,8 +314,26 @@ namespace fastllm {
 
         Data (const Data &ori); // 深拷贝
 
+        Data (Data &&ori) noexcept; // 移动构造, 接管ori的内存, ori变为空
+
+        Data &operator = (const Data &ori); // 深拷贝
+
+        Data &operator = (Data &&ori) noexcept; // 移动赋值
+
         void CopyFrom(const Data &ori); // 复制
 
+        // 视图: 和ori共享内存, 不复制数据, 视图上的原地修改对ori可见
+        // 视图之后如果需要更大的空间(Allocate / ToDataType等), 会重新分配自己的内存, 不再和ori共享
+        static Data View(const Data &ori);
+
+        void ViewFrom(const Data &ori); // 变为整个ori的视图
+
+        void ViewFrom(const Data &ori, int axis, int start, int end); // 变为ori在axis维上[start, end)部分的视图, 要求这部分数据是连续的
+
+        void FreeCpuData(); // 释放cpuData, 共享的内存只减少引用计数
+
+        void PlaceOnNumaNodes(int segments = 1); // NUMA模式下把各行(输出通道)的内存和amxWeight迁移到计算这些行的工作线程所在的node, 各行先平均分成segments段再各自划分
+
         uint64_t GetBytes() const; // 获取总字节数
 
         void Allocate(); // 分配内存
@@ -319,6 +362,10 @@ namespace fastllm {
 
         void CalcWeightSum(); // 计算WeightSum
 
+        void CalcAMXWeight(); // 计算amxWeight
+
+        void CalcAMXWeight(int st, int end); // 计算amxWeight的[st, end)行, amxWeight需要已经分配好
+
         void ToDevice(DataDevice device); // 移动到指定device
 
         void ToDevice(DataDevice device, const std::vector <int> &deviceIds); // 移动到指定device
@@ -341,20 +388,29 @@ namespace fastllm {
             BERT = 4
         };
 
-        struct TrieNode {
-            int tokenId;
-            float score;
-            std::map <int, TrieNode*> next;
-            TrieNode();
+        // 双数组trie: 节点t的子节点c位于base[t] + c, 当check[base[t] + c] == t时存在
+        // 数组末尾留出256个空位, 查找时不需要判断越界
+        struct DoubleArrayTrie {
+            std::vector <int> base, check;
+            std::vector <int> tokenIds; // 节点对应的token, 不是token的节点为-999999
+            std::vector <float> scores;
+
+            // entries需按字符串(无符号字节序)排序且不重复
+            void Build(const std::vector <std::pair <std::string, std::pair <int, float> > > &entries);
+
+            int Next(int node, uint8_t c) const {
+                int t = base[node] + c;
+                return check[t] == node ? t : -1;
+            }
         };
         struct Symbol {
-            TrieNode *node;
+            int node; // 在trie中的节点, -1代表没有
             char *s;
             int pos, len;
             int prev, next;
             int fixId;
 
-            Symbol (Tokenizer::TrieNode *node,
+            Symbol (int node,
                     char *s, int pos, int len,
                     int prev, int next, int fixId) {
                 this->node = node;
@@ -382,9 +438,17 @@ namespace fastllm {
             return a.score < b.score || (a.score == b.score && a.l > b.l);
         }
 
-        TrieNode *root;
+        std::vector <std::pair <std::string, std::pair <int, float> > > trieEntries; // Insert的token, 编译trie时使用
+        std::vector <std::pair <std::string, std::pair <int, float> > > specialEntries; // 特殊token
+        DoubleArrayTrie trie, specialTrie;
+        std::atomic <bool> trieDirty {true}; // Insert之后需要重新编译trie
+        std::mutex compileLocker;
+        bool splitAtBlank = false, splitAtByteBlank = false; // 没有token跨过词首(▁, byteAsChar时为Ġ)时, BPE可以按词切分后分别合并
 
-        TrieNode *specialRoot = nullptr;
+        int wordCacheCapacity = 32768; // 按词缓存BPE合并结果(LRU)的容量, 0代表不缓存
+        std::list <std::pair <std::string, std::vector <int> > > wordCacheList;
+        std::unordered_map <std::string, std::list <std::pair <std::string, std::vector <int> > >::iterator> wordCache;
+        std::mutex wordCacheLocker;
 
         TokenizerType type = TokenizerType::BPE;
 
@@ -410,6 +474,12 @@ namespace fastllm {
 
         void Clear(); // 清空分词器
 
+        void Compile(bool buildTrie = true); // 把Insert的token编译成双数组trie, Encode时会自动调用; buildTrie为false时使用已加载的trie
+
+        bool LookupWordCache(const std::string &word, std::vector <int> &ids);
+
+        void UpdateWordCache(const std::string &word, const std::vector <int> &ids);
+
         void TryMergePairs(std::vector<Symbol> &symbols, int l, int r, std::priority_queue <SymbolPairs> &q); // 插入备选symbol
 
         int GetRank(std::vector<Symbol> &symbols,  std::vector<std::pair<int, int>> &partitions, int idx, int skip);
@@ -422,6 +492,8 @@ namespace fastllm {
 
         Data Encode(const std::string &s); // 编码
 
+        std::vector <Data> EncodeBatch(const std::vector <std::string> &inputs); // 在线程池上并行编码多个输入
+
         std::string Decode(const Data &data); // 解码
 
         std::string DecodeTokens(const std::vector <int> &tokens); // 解码
@@ -442,9 +514,14 @@ namespace fastllm {
 
         std::set <std::string> embeddingNames;
 
+        // 权重表每次加载, 增加或替换权重时更新为一个全局唯一的值, 缓存了权重指针的模型据此判断是否需要重新解析
+        uint64_t revision = 0;
+
         void LoadFromFile(const std::string &fileName); // 从文件读取
 
-        void SaveLowBitModel(const std::string &fileName, int bit); // 存储成量化模型, bit = 0代表直接存
+        void LoadFromFileV3(const std::string &fileName); // 读取v3格式的文件, 权重直接映射文件中对齐好的数据, 不拷贝
+
+        void SaveLowBitModel(const std::string &fileName, int bit); // 存储成量化模型(v3格式), bit = 0代表直接存
 
         void AddTokenizerWord(const std::string &key, int value, float score); // 增加一个词
 
@@ -468,6 +545,84 @@ namespace fastllm {
 
     void PrintProfiler();
 
+    // 机器的峰值, 用来判断op受带宽还是算力限制; 第一次调用(或线程数改变后)用一个小的STREAM / FMA测试测出
+    struct MachinePeak {
+        float bandwidth = 0.0f; // 内存带宽(GB/s), STREAM triad
+        float gflops = 0.0f; // float32乘加的峰值(GFLOPS), 当前线程数下
+    };
+
+    MachinePeak GetMachinePeak();
+
+    void StartTrace(); // 开始记录每个op的起止时间, 层号, 形状, 数据类型和设备
+
+    void StopTrace(const std::string &fileName); // 结束记录并写出chrome trace (chrome://tracing 或 Perfetto 可以打开)
+
+    // 在trace中标记模型的一段, 例如TraceScope("attention", 12)记为"layer 12 / attention"; 没有在记录时什么都不做
+    class TraceScope {
+    public:
+        TraceScope(const char *name, int layer = -1);
+
+        TraceScope(const TraceScope &) = delete;
+
+        TraceScope &operator = (const TraceScope &) = delete;
+
+        ~TraceScope();
+
+        void End(); // 提前结束这一段
+
+    private:
+        bool active = false;
+    };
+
+    class BaseDevice;
+    class BaseOperator;
+
+    // 静态图: 一个形状桶内第一次运行时记录op序列, 选中的设备和各中间结果的生存期, 并把中间结果按生存期规划到一块slab中;
+    // 之后每一步按记录重放, 跳过设备的选择, 输出直接放到规划好的位置上, 只有随长度变化的大小会在超出时重新规划
+    struct GraphPlan {
+        struct Op {
+            int opId; // OpHandle的编号
+            BaseDevice *device; // 记录时选中的设备
+            BaseOperator *op; // 和这个设备上对应的算子
+            int value; // output对应的中间结果编号, -1代表不放进slab
+        };
+
+        struct Value {
+            int def, lastUse; // 定义它的op和最后一次使用它的op的序号
+            uint64_t bytes; // 见过的最大字节数
+            uint64_t capacity = 0, offset = 0; // 在slab中的位置
+        };
+
+        std::vector <Op> ops;
+        std::vector <Value> values;
+        uint8_t *slab = nullptr;
+        uint64_t slabBytes = 0;
+        bool ready = false; // 已经记录完成, 可以重放
+        bool grown = false; // 重放时有中间结果超出了规划的大小, 这一步结束后重新规划
+
+        GraphPlan() {}
+        GraphPlan(const GraphPlan &) = delete;
+        GraphPlan &operator = (const GraphPlan &) = delete;
+        ~GraphPlan();
+
+        void Plan(); // 按生存期为中间结果分配slab中的位置, 生存期不重叠的中间结果共用空间
+        void Reset(); // 丢弃记录, 下一次重新记录
+    };
+
+    void SetGraphMode(bool graph); // 开启后模型的Forward按形状桶记录和重放静态图 (也可用环境变量FASTLLM_GRAPH=1开启)
+    bool GetGraphMode();
+
+    // 作用域内的op按plan记录或重放, plan为空时不做任何事
+    // 要定义在Forward的所有中间Data之前: 析构时这些Data都已经释放, 才能安全地调整slab
+    struct GraphScope {
+        bool active;
+
+        GraphScope(GraphPlan *plan);
+        GraphScope(const GraphScope &) = delete;
+        GraphScope &operator = (const GraphScope &) = delete;
+        ~GraphScope();
+    };
+
     void ApplyDeviceMap(const std::map <std::string, int> &deviceMap, int current, int total); // 执行到了current, 一共total，使用deviceMap切换设备
 
     int LLMSampling(Data &logits, int outerOffset,
@@ -477,8 +632,17 @@ namespace fastllm {
 
     void CopyKVCache(Data &oldCache, Data &newCache, int oldBsStart, int newBsStart, int bs, int offset);
 
+    // Attention / MatMul / MatMulTransB中q(input0)和output的排布
+    enum AttentionLayout {
+        LayoutHeadMajor = 0, // [heads, seq, dim]
+        LayoutSeqMajor = 1 // [seq, heads, dim], 即[bsz = 1, seq, hidden]直接Reshape得到的排布, 不需要PermuteSelf
+    };
+
+    bool CanRunAttentionLayout(); // 第一个设备上的Attention / MatMul / MatMulTransB是否支持LayoutSeqMajor
+
     void Attention(const Data &q, const Data &k, const Data &v, const Data &mask, Data &output,
-                   int group, float scale, int attentionType);
+                   int group, float scale, int attentionType, AttentionLayout qLayout = LayoutHeadMajor,
+                   AttentionLayout kvLayout = LayoutHeadMajor, AttentionLayout outputLayout = LayoutHeadMajor);
 
     void AttentionBatch(std::vector <Data*> &q, std::vector <Data*> &k, std::vector <Data*> &v,
                         std::vector <Data*> &mask, std::vector <Data*> &output,
@@ -490,8 +654,21 @@ namespace fastllm {
 
     void LayerNorm(Data &input, Data &gamma, Data &beta, int axis, Data &output);
 
+    // input += residual (residual为空时跳过), output = RMSNorm(input)
+    // quantizedOutput不为nullptr时同时输出按行量化的uint8 input, 可直接传给Linear的quantizedInput
+    // quantizedFor为之后使用quantizedOutput的Linear的weight类型, 用于直接输出对应kernel需要的排布; 这种类型的Linear不读取量化的input时(浮点, INT4_GROUP等)quantizedOutput为空
+    void AddRMSNorm(Data &input, const Data &residual, const Data &weight, float eps, Data &output,
+                    Data *quantizedOutput = nullptr, DataType quantizedFor = DataType::INT8);
+
+    // input += residual (residual为空时跳过), output = LayerNorm(input) (最后一维), quantizedOutput同AddRMSNorm
+    void AddLayerNorm(Data &input, const Data &residual, Data &gamma, Data &beta, Data &output,
+                      Data *quantizedOutput = nullptr, DataType quantizedFor = DataType::INT8);
+
     void Linear(Data &input, Data &weight, const Data &bias, Data &output);
 
+    // quantizedInput为AddRMSNorm / AddLayerNorm输出的量化input, weight为INT8 / INT4 / INT4_NOZERO时跳过input的量化
+    void Linear(Data &input, Data &weight, const Data &bias, Data &output, const Data &quantizedInput);
+
     enum LinearExType {
         ExTypeNone = 0,
         ExSwiglu = 1,
@@ -499,19 +676,25 @@ namespace fastllm {
         ExSilu = 3
     };
     
-    bool CanRunLinearEx(LinearExType exType);
+    bool CanRunLinearEx(LinearExType exType, const Data &input, const Data &weight); // 当前设备能否对这样的input, weight运行LinearEx
     void LinearEx(Data &input, Data &weight, const Data &bias, Data &output,
                     LinearExType exType); // 扩展Linear，可以接后续操作
 
+    bool CanRunLinearSwiglu(const Data &input, const Data &gateWeight, const Data &upWeight);
+    void LinearSwiglu(Data &input, Data &gateWeight, Data &upWeight, Data &output,
+                      const Data *quantizedInput = nullptr); // output = silu(input * gateWeight^T) * (input * upWeight^T)
+
     void Split(const Data &input, int axis, int start, int end, Data &output);
 
     void Cat(const Data &input0, const Data &input1, int axis, Data &output);
 
 	void CatDirect(Data &input0, const Data &input1, int axis); // 直接把input1的数据拷贝到input0后面（需要input0提前扩容了足够的空间）
 
-    void MatMul(const Data &input0, const Data &input1, Data &output, float alpha = 1.0, int group = 1);
+    void MatMul(const Data &input0, const Data &input1, Data &output, float alpha = 1.0, int group = 1,
+                AttentionLayout input0Layout = LayoutHeadMajor, AttentionLayout outputLayout = LayoutHeadMajor);
 
-    void MatMulTransB(const Data &input0, const Data &input1, Data &output, float alpha = 1.0, int group = 1);
+    void MatMulTransB(const Data &input0, const Data &input1, Data &output, float alpha = 1.0, int group = 1,
+                      AttentionLayout input0Layout = LayoutHeadMajor, AttentionLayout outputLayout = LayoutHeadMajor);
 
     void Softmax(const Data &input, Data &output, int axis);
 
@@ -549,6 +732,18 @@ namespace fastllm {
 
     void LlamaRotatePosition2D(Data &input, const Data &positionIds, Data &sinData, Data &cosData, int rotaryDim); // 2D position for llama
 
+    // 当前设备能否用融合算子完成LlamaQKVRotateAppend(参数的类型, 形状等都支持), 不能时应使用不融合的Linear + LlamaRotatePosition2D
+    bool CanRunLlamaQKVRotateAppend(Data &input, const std::vector <Data*> &weights, const std::vector <Data*> &biases,
+                                    const Data &positionIds, Data &sinData, Data &cosData, int rotaryDim,
+                                    int numHeads, int numKVHeads, int headDim, Data &pastKey, Data &pastValue);
+    // 融合的attention前处理: q, k, v = input * weight^T + bias, weights为{qkvWeight} (每行按[q, k, v]拼接) 或{qWeight, kWeight, vWeight},
+    // biases和weights一一对应 (可以为nullptr); q, k做LlamaRotatePosition2D后, q输出为[numHeads, bsz * seqlen, headDim],
+    // k, v直接追加到pastKey / pastValue ([numKVHeads, len, headDim]) 的末尾, 容量不足时自动扩容
+    void LlamaQKVRotateAppend(Data &input, const std::vector <Data*> &weights, const std::vector <Data*> &biases,
+                              const Data &positionIds, Data &sinData, Data &cosData, int rotaryDim,
+                              int numHeads, int numKVHeads, int headDim, Data &pastKey, Data &pastValue, Data &q,
+                              const Data *quantizedInput = nullptr);
+
     void RepeatPenalty(Data &input, const Data &penalty); // 惩罚，input[i] = input[i] < 0 ? input[i] * penalty[i] : input[i] / penalty[i];
 
     void ApplyLognAttn(Data &input, const Data &lognAttn, const Data &positionIds);
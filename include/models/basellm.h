@@ -128,6 +128,8 @@ namespace fastllm {
 
         virtual void DisableAdapter();
 
+        GraphPlan *GetGraphPlan(const std::string &bucket); // 形状桶bucket对应的静态图, 没有开启静态图时返回nullptr
+
         std::string model_type;
 
         std::string pre_prompt; // 最初对话的提示语
@@ -159,6 +161,8 @@ namespace fastllm {
         std::string adapterName;
 
         int tokensLimit = -1;
+
+        std::map <std::string, GraphPlan> graphPlans; // 各形状桶记录的静态图
     };
 }
 
@@ -48,6 +48,9 @@ namespace fastllm {
                 const std::vector <GenerationConfig> &generationConfigs,
                 const LastTokensManager &lastTokens = LastTokensManager(),
                 std::vector <std::vector <float>*> *logits = nullptr);
+
+    protected:
+        virtual void ResolveLayerWeights(); // InternLM2的权重名
     };
 }
 
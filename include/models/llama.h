@@ -19,6 +19,16 @@ namespace fastllm {
         DYMAMIC_NTK = 3
     };
 
+    // 一层用到的权重, 按名字解析一次后Forward直接使用指针; 可选的权重不存在时为nullptr
+    struct LlamaLayerWeights {
+        Data *inputNorm = nullptr, *postNorm = nullptr;
+        Data *qkv = nullptr; // W_pack, 存在时不使用q, k, v
+        Data *q = nullptr, *k = nullptr, *v = nullptr;
+        Data *qBias = nullptr, *kBias = nullptr, *vBias = nullptr;
+        Data *o = nullptr, *oBias = nullptr;
+        Data *gate = nullptr, *up = nullptr, *down = nullptr;
+    };
+
     class LlamaModel: public basellm {
     public:
         LlamaModel (); // 构造函数
@@ -88,6 +98,14 @@ namespace fastllm {
         int num_key_value_heads = num_attention_heads;
 
         float rms_norm_eps = 1e-6;
+
+        std::vector <LlamaLayerWeights> layerWeights;
+        Data *embedWeight = nullptr, *normWeight = nullptr, *lmHeadWeight = nullptr;
+        uint64_t resolvedWeightRevision = 0; // 解析时权重表的revision, 权重表变化(或换了一个权重表)后重新解析
+
+        void ResolveWeights(); // 权重表变化时调用ResolveLayerWeights重新解析
+
+        virtual void ResolveLayerWeights(); // 把每层的权重名解析成指针, 权重名不同的子类重载
     };
 }
 
@@ -0,0 +1,179 @@
+// AVX2 / AVX-512 的exp, tanh, erf, 对应armMath.h中NEON的exp_ps
+// exp使用cephes的多项式 (和armMath.h相同), erf为分段多项式逼近 (误差约1ulp)
+
+#ifndef FASTLLM_AVXMATH_H
+#define FASTLLM_AVXMATH_H
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+#define c_avx_exp_hi 88.3762626647949f
+#define c_avx_exp_lo -88.3762626647949f
+#define c_avx_cephes_LOG2EF 1.44269504088896341f
+#define c_avx_cephes_exp_C1 0.693359375f
+#define c_avx_cephes_exp_C2 -2.12194440e-4f
+#define c_avx_cephes_exp_p0 1.9875691500E-4f
+#define c_avx_cephes_exp_p1 1.3981999507E-3f
+#define c_avx_cephes_exp_p2 8.3334519073E-3f
+#define c_avx_cephes_exp_p3 4.1665795894E-2f
+#define c_avx_cephes_exp_p4 1.6666665459E-1f
+#define c_avx_cephes_exp_p5 5.0000001201E-1f
+
+// |x| < 0.625时tanh(x) = x + x^3 * P(x^2) (cephes tanhf)
+#define c_avx_tanh_p0 -5.70498872745E-3f
+#define c_avx_tanh_p1 2.06390887954E-2f
+#define c_avx_tanh_p2 -5.37397155531E-2f
+#define c_avx_tanh_p3 1.33314422036E-1f
+#define c_avx_tanh_p4 -3.33332819422E-1f
+
+#ifdef __AVX2__
+static inline __m256 exp256_ps(__m256 x) {
+    x = _mm256_min_ps(x, _mm256_set1_ps(c_avx_exp_hi));
+    x = _mm256_max_ps(x, _mm256_set1_ps(c_avx_exp_lo));
+
+    // exp(x) = 2^n * exp(r), n = round(x / ln2)
+    __m256 fx = _mm256_fmadd_ps(x, _mm256_set1_ps(c_avx_cephes_LOG2EF), _mm256_set1_ps(0.5f));
+    fx = _mm256_floor_ps(fx);
+    x = _mm256_fnmadd_ps(fx, _mm256_set1_ps(c_avx_cephes_exp_C1), x);
+    x = _mm256_fnmadd_ps(fx, _mm256_set1_ps(c_avx_cephes_exp_C2), x);
+
+    __m256 z = _mm256_mul_ps(x, x);
+    __m256 y = _mm256_set1_ps(c_avx_cephes_exp_p0);
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(c_avx_cephes_exp_p1));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(c_avx_cephes_exp_p2));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(c_avx_cephes_exp_p3));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(c_avx_cephes_exp_p4));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(c_avx_cephes_exp_p5));
+    y = _mm256_fmadd_ps(y, z, x);
+    y = _mm256_add_ps(y, _mm256_set1_ps(1.0f));
+
+    __m256i n = _mm256_add_epi32(_mm256_cvttps_epi32(fx), _mm256_set1_epi32(0x7f));
+    return _mm256_mul_ps(y, _mm256_castsi256_ps(_mm256_slli_epi32(n, 23)));
+}
+
+static inline __m256 tanh256_ps(__m256 x) {
+    const __m256 signMask = _mm256_set1_ps(-0.0f);
+    __m256 sign = _mm256_and_ps(x, signMask);
+    __m256 t = _mm256_andnot_ps(signMask, x);
+
+    // 小的|x|用多项式, 否则tanh(|x|) = (1 - exp(-2|x|)) / (1 + exp(-2|x|))
+    __m256 z = _mm256_mul_ps(x, x);
+    __m256 small = _mm256_set1_ps(c_avx_tanh_p0);
+    small = _mm256_fmadd_ps(small, z, _mm256_set1_ps(c_avx_tanh_p1));
+    small = _mm256_fmadd_ps(small, z, _mm256_set1_ps(c_avx_tanh_p2));
+    small = _mm256_fmadd_ps(small, z, _mm256_set1_ps(c_avx_tanh_p3));
+    small = _mm256_fmadd_ps(small, z, _mm256_set1_ps(c_avx_tanh_p4));
+    small = _mm256_fmadd_ps(_mm256_mul_ps(small, z), x, x);
+
+    __m256 one = _mm256_set1_ps(1.0f);
+    __m256 e = exp256_ps(_mm256_mul_ps(t, _mm256_set1_ps(-2.0f)));
+    __m256 big = _mm256_div_ps(_mm256_sub_ps(one, e), _mm256_add_ps(one, e));
+    big = _mm256_or_ps(big, sign);
+
+    return _mm256_blendv_ps(small, big, _mm256_cmp_ps(t, _mm256_set1_ps(0.625f), _CMP_GE_OQ));
+}
+
+static inline __m256 erf256_ps(__m256 a) {
+    const __m256 signMask = _mm256_set1_ps(-0.0f);
+    __m256 t = _mm256_andnot_ps(signMask, a);
+    __m256 s = _mm256_mul_ps(a, a);
+
+    // |a| > 0.927734375
+    __m256 r = _mm256_fmadd_ps(_mm256_set1_ps(-1.72853470e-5f), t, _mm256_set1_ps(3.83197126e-4f));
+    __m256 u = _mm256_fmadd_ps(_mm256_set1_ps(-3.88396438e-3f), t, _mm256_set1_ps(2.42546219e-2f));
+    r = _mm256_fmadd_ps(r, s, u);
+    r = _mm256_fmadd_ps(r, t, _mm256_set1_ps(-1.06777877e-1f));
+    r = _mm256_fmadd_ps(r, t, _mm256_set1_ps(-6.34846687e-1f));
+    r = _mm256_fmadd_ps(r, t, _mm256_set1_ps(-1.28717512e-1f));
+    r = _mm256_fmadd_ps(r, t, _mm256_sub_ps(_mm256_setzero_ps(), t));
+    __m256 big = _mm256_sub_ps(_mm256_set1_ps(1.0f), exp256_ps(r));
+    big = _mm256_or_ps(big, _mm256_and_ps(a, signMask));
+
+    // |a| <= 0.927734375
+    __m256 small = _mm256_set1_ps(-5.96761703e-4f);
+    small = _mm256_fmadd_ps(small, s, _mm256_set1_ps(4.99119423e-3f));
+    small = _mm256_fmadd_ps(small, s, _mm256_set1_ps(-2.67681349e-2f));
+    small = _mm256_fmadd_ps(small, s, _mm256_set1_ps(1.12819925e-1f));
+    small = _mm256_fmadd_ps(small, s, _mm256_set1_ps(-3.76125336e-1f));
+    small = _mm256_fmadd_ps(small, s, _mm256_set1_ps(1.28379166e-1f));
+    small = _mm256_fmadd_ps(small, a, a);
+
+    return _mm256_blendv_ps(small, big, _mm256_cmp_ps(t, _mm256_set1_ps(0.927734375f), _CMP_GT_OQ));
+}
+#endif
+
+#ifdef __AVX512F__
+static inline __m512 exp512_ps(__m512 x) {
+    x = _mm512_min_ps(x, _mm512_set1_ps(c_avx_exp_hi));
+    x = _mm512_max_ps(x, _mm512_set1_ps(c_avx_exp_lo));
+
+    __m512 fx = _mm512_fmadd_ps(x, _mm512_set1_ps(c_avx_cephes_LOG2EF), _mm512_set1_ps(0.5f));
+    fx = _mm512_roundscale_ps(fx, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+    x = _mm512_fnmadd_ps(fx, _mm512_set1_ps(c_avx_cephes_exp_C1), x);
+    x = _mm512_fnmadd_ps(fx, _mm512_set1_ps(c_avx_cephes_exp_C2), x);
+
+    __m512 z = _mm512_mul_ps(x, x);
+    __m512 y = _mm512_set1_ps(c_avx_cephes_exp_p0);
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(c_avx_cephes_exp_p1));
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(c_avx_cephes_exp_p2));
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(c_avx_cephes_exp_p3));
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(c_avx_cephes_exp_p4));
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(c_avx_cephes_exp_p5));
+    y = _mm512_fmadd_ps(y, z, x);
+    y = _mm512_add_ps(y, _mm512_set1_ps(1.0f));
+
+    __m512i n = _mm512_add_epi32(_mm512_cvttps_epi32(fx), _mm512_set1_epi32(0x7f));
+    return _mm512_mul_ps(y, _mm512_castsi512_ps(_mm512_slli_epi32(n, 23)));
+}
+
+static inline __m512 tanh512_ps(__m512 x) {
+    const __m512i signMask = _mm512_set1_epi32(0x80000000);
+    __m512i sign = _mm512_and_si512(_mm512_castps_si512(x), signMask);
+    __m512 t = _mm512_castsi512_ps(_mm512_andnot_si512(signMask, _mm512_castps_si512(x)));
+
+    __m512 z = _mm512_mul_ps(x, x);
+    __m512 small = _mm512_set1_ps(c_avx_tanh_p0);
+    small = _mm512_fmadd_ps(small, z, _mm512_set1_ps(c_avx_tanh_p1));
+    small = _mm512_fmadd_ps(small, z, _mm512_set1_ps(c_avx_tanh_p2));
+    small = _mm512_fmadd_ps(small, z, _mm512_set1_ps(c_avx_tanh_p3));
+    small = _mm512_fmadd_ps(small, z, _mm512_set1_ps(c_avx_tanh_p4));
+    small = _mm512_fmadd_ps(_mm512_mul_ps(small, z), x, x);
+
+    __m512 one = _mm512_set1_ps(1.0f);
+    __m512 e = exp512_ps(_mm512_mul_ps(t, _mm512_set1_ps(-2.0f)));
+    __m512 big = _mm512_div_ps(_mm512_sub_ps(one, e), _mm512_add_ps(one, e));
+    big = _mm512_castsi512_ps(_mm512_or_si512(_mm512_castps_si512(big), sign));
+
+    return _mm512_mask_blend_ps(_mm512_cmp_ps_mask(t, _mm512_set1_ps(0.625f), _CMP_GE_OQ), small, big);
+}
+
+static inline __m512 erf512_ps(__m512 a) {
+    const __m512i signMask = _mm512_set1_epi32(0x80000000);
+    __m512 t = _mm512_castsi512_ps(_mm512_andnot_si512(signMask, _mm512_castps_si512(a)));
+    __m512 s = _mm512_mul_ps(a, a);
+
+    __m512 r = _mm512_fmadd_ps(_mm512_set1_ps(-1.72853470e-5f), t, _mm512_set1_ps(3.83197126e-4f));
+    __m512 u = _mm512_fmadd_ps(_mm512_set1_ps(-3.88396438e-3f), t, _mm512_set1_ps(2.42546219e-2f));
+    r = _mm512_fmadd_ps(r, s, u);
+    r = _mm512_fmadd_ps(r, t, _mm512_set1_ps(-1.06777877e-1f));
+    r = _mm512_fmadd_ps(r, t, _mm512_set1_ps(-6.34846687e-1f));
+    r = _mm512_fmadd_ps(r, t, _mm512_set1_ps(-1.28717512e-1f));
+    r = _mm512_fmadd_ps(r, t, _mm512_sub_ps(_mm512_setzero_ps(), t));
+    __m512 big = _mm512_sub_ps(_mm512_set1_ps(1.0f), exp512_ps(r));
+    big = _mm512_castsi512_ps(_mm512_or_si512(_mm512_castps_si512(big),
+                                              _mm512_and_si512(_mm512_castps_si512(a), signMask)));
+
+    __m512 small = _mm512_set1_ps(-5.96761703e-4f);
+    small = _mm512_fmadd_ps(small, s, _mm512_set1_ps(4.99119423e-3f));
+    small = _mm512_fmadd_ps(small, s, _mm512_set1_ps(-2.67681349e-2f));
+    small = _mm512_fmadd_ps(small, s, _mm512_set1_ps(1.12819925e-1f));
+    small = _mm512_fmadd_ps(small, s, _mm512_set1_ps(-3.76125336e-1f));
+    small = _mm512_fmadd_ps(small, s, _mm512_set1_ps(1.28379166e-1f));
+    small = _mm512_fmadd_ps(small, a, a);
+
+    return _mm512_mask_blend_ps(_mm512_cmp_ps_mask(t, _mm512_set1_ps(0.927734375f), _CMP_GT_OQ), small, big);
+}
+#endif
+
+#endif //FASTLLM_AVXMATH_H
@@ -74,6 +74,17 @@ namespace fastllm {
                (e > 143) * 0x7FFF; // sign : normalized : denormalized : saturate
     }
 
+    static float bfloat16_to_float(const uint16_t x) { // bfloat16: float32的高16位
+        return as_float((uint32_t) x << 16);
+    }
+    static uint16_t float_to_bfloat16(const float x) { // round-to-nearest-even, NaN保持为NaN
+        const uint32_t b = as_uint(x);
+        if ((b & 0x7FFFFFFF) > 0x7F800000) {
+            return (b >> 16) | 0x0040;
+        }
+        return (b + 0x7FFF + ((b >> 16) & 1)) >> 16;
+    }
+
     static double GetSpan(std::chrono::system_clock::time_point time1, std::chrono::system_clock::time_point time2) {
         auto duration = std::chrono::duration_cast<std::chrono::microseconds> (time2 - time1);
         return double(duration.count()) * std::chrono::microseconds::period::num / std::chrono::microseconds::period::den;
@@ -3,6 +3,7 @@
 //
 
 #include "devices/cpu/cpudevice.h"
+#include "devices/cpu/cpukernels.h"
 
 #include <cstring>
 #include <thread>
@@ -22,12 +23,17 @@ namespace fastllm {
         this->deviceType = "cpu";
         this->ops["ToFloat16"] = (BaseOperator*)(new CpuToFloat16());
         this->ops["ToFloat32"] = (BaseOperator*)(new CpuToFloat32());
+        this->ops["ToBFloat16"] = (BaseOperator*)(new CpuToBFloat16());
         this->ops["Attention"] = (BaseOperator*)(new CpuAttention());
         this->ops["CopyKVCache"] = (BaseOperator*)(new CpuCopyKVCacheOp());
         this->ops["Embedding"] = (BaseOperator*)(new CpuEmbedding());
         this->ops["LayerNorm"] = (BaseOperator*)(new CpuLayerNormOp());
         this->ops["RMSNorm"] = (BaseOperator*)(new CpuRMSNormOp());
+        this->ops["AddRMSNorm"] = (BaseOperator*)(new CpuAddRMSNormOp());
+        this->ops["AddLayerNorm"] = (BaseOperator*)(new CpuAddLayerNormOp());
         this->ops["Linear"] = (BaseOperator*)(new CpuLinearOp());
+        this->ops["LinearSwiglu"] = (BaseOperator*)(new CpuLinearSwigluOp());
+        this->ops["LlamaQKVRotateAppend"] = (BaseOperator*)(new CpuLlamaQKVRotateAppendOp());
         this->ops["Split"] = (BaseOperator*)(new CpuSplitOp());
         this->ops["Cat"] = (BaseOperator*)(new CpuCatOp());
         this->ops["CatDirect"] = (BaseOperator*)(new CpuCatDirectOp());
@@ -83,89 +89,159 @@ namespace fastllm {
     }
 
 
-#ifdef __AVX2__
-    int DotU8U8(uint8_t *a, uint8_t *b, int n) {
-        __m256i acc = _mm256_setzero_si256();
-        int i = 0;
-        int ans = 0;
-        const __m256i lowMask = _mm256_set1_epi8(0xf);
-        const __m256i ones = _mm256_set1_epi16(1);
-        const __m256i ones8 = _mm256_set1_epi8(1);
-        const __m256i xors = _mm256_set1_epi8(-128);
-        for (; i + 31 < n; i += 32) {
-            __m256i bx = _mm256_loadu_si256((const __m256i *) (a + i));
-            __m256i by = _mm256_loadu_si256((const __m256i *) (b + i));
+    FP16ToFP32Manager::FP16ToFP32Manager() {
+        for (uint16_t i = 0; i < 65535; i++) {
+            dict[i] = half_to_float(i);
+        }
+    }
 
-            by = _mm256_xor_si256(by, xors);
-            by = _mm256_add_epi8(by, _mm256_and_si256(_mm256_cmpeq_epi8(by, xors), ones8));
+    FP16ToFP32Manager fp16tofp32;
 
-            by = _mm256_sign_epi8(by, bx);
-            bx = _mm256_sign_epi8(bx, bx);
+#ifdef USE_FAT_BINARY
+    const CpuLinearKernels *GetCpuLinearKernels_base();
+    const CpuLinearKernels *GetCpuLinearKernels_avx2();
+    const CpuLinearKernels *GetCpuLinearKernels_avx512();
+    const CpuLinearKernels *GetCpuLinearKernels_avx512vnni();
+#ifdef USE_FAT_BINARY_AMX
+    const CpuLinearKernels *GetCpuLinearKernels_amx();
+#endif
 
-            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_maddubs_epi16(bx, by), ones));
-        }
-        for (; i < n; i++) {
-            ans += ((int8_t*)a)[i] * ((int)b[i] - 128);
+    const CpuLinearKernels *GetCpuLinearKernels() {
+        switch (GetCpuInstructionLevel()) {
+#ifdef USE_FAT_BINARY_AMX
+            case ISA_AMX: return GetCpuLinearKernels_amx();
+#else
+            case ISA_AMX:
+#endif
+            case ISA_AVX512_VNNI: return GetCpuLinearKernels_avx512vnni();
+            case ISA_AVX512: return GetCpuLinearKernels_avx512();
+            case ISA_AVX2: return GetCpuLinearKernels_avx2();
+            default: return GetCpuLinearKernels_base();
         }
+    }
+#else
+    const CpuLinearKernels *GetCpuLinearKernels_native();
 
-        return ans + I32sum(acc);
-    };
-//#else
-//    int DotU8U8(uint8_t *a, uint8_t *b, int n) {
-//        __m256i acc = _mm256_setzero_si256();
-
-//        int i = 0;
-//        int ans = 0;
-//        for (; i + 31 < n; i += 32) {
-//            __m256i bx = _mm256_loadu_si256((const __m256i *) (a + i));
-//            __m256i by = _mm256_loadu_si256((const __m256i *) (b + i));
-
-//            __m256i mx0 = _mm256_cvtepu8_epi16(_mm256_extractf128_si256(bx, 0));
-//            __m256i mx1 = _mm256_cvtepu8_epi16(_mm256_extractf128_si256(bx, 1));
-
-//            __m256i my0 = _mm256_cvtepu8_epi16(_mm256_extractf128_si256(by, 0));
-//            __m256i my1 = _mm256_cvtepu8_epi16(_mm256_extractf128_si256(by, 1));
-
-//            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(mx0, my0));
-//            //acc = _mm256_add_epi32(acc, _mm256_madd_epi16(mx1, my1));
-//        }
-//        for (; i < n; i++) {
-//            ans += a[i] * b[i];
-//        }
-
-//        return ans + I32sum(acc);
-//    };
-    int DotU4U8(uint8_t *a, uint8_t *b, int n) {
-        __m256i acc = _mm256_setzero_si256();
-
-        int i = 0;
-        int ans = 0;
-        const __m256i lowMask = _mm256_set1_epi8(0xf);
-        const __m256i ones = _mm256_set1_epi16(1);
-        for (; i + 31 < n; i += 32) {
-            __m128i orix = _mm_loadu_si128((const __m128i *) (a + i / 2));
-            __m256i bytex = _mm256_set_m128i(_mm_srli_epi16(orix, 4), orix);
-            __m256i bx = _mm256_and_si256(lowMask, bytex);
-            __m256i by = _mm256_loadu_si256((const __m256i *) (b + i));
-            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_maddubs_epi16(by, bx), ones));
-        }
-        for (; i < n; i++) {
-            ans += a[i] * b[i];
-        }
-
-        return ans + I32sum(acc);
-    };
+    const CpuLinearKernels *GetCpuLinearKernels() {
+        return GetCpuLinearKernels_native();
+    }
 #endif
 
-    struct FP16ToFP32Manager {
-        float dict[65536];
-
-        FP16ToFP32Manager() {
-            for (uint16_t i = 0; i < 65535; i++) {
-                dict[i] = half_to_float(i);
+    // 把[0, len)均分成threadNum段连续的区间, 在线程池的常驻线程上并行执行func(args..., st, end)
+    template <typename F, typename... Args>
+    void RunPartsMultiThread(int len, int threadNum, F func, Args... args) {
+        threadNum = std::max(1, std::min(threadNum, len));
+        GetPool()->ParallelFor(0, threadNum, 1, [&](int partSt, int partEnd) {
+            for (int i = partSt; i < partEnd; i++) {
+                func(args..., (int)((int64_t)len * i / threadNum), (int)((int64_t)len * (i + 1) / threadNum));
             }
+        });
+    }
+
+    // 把[0, len)切成连续的若干段(每段至少minLen个)交给线程池, 每段调用func(args..., st, end)
+    template <typename F, typename... Args>
+    void RunRangeMultiThread(int len, int minLen, F func, Args... args) {
+        RunPartsMultiThread(len, std::min(GetThreads(), len / std::max(1, minLen)), func, args...);
+    }
+
+    const int elementwiseMinLen = 4096; // 逐元素 / 按行的算子每个线程至少处理这么多个float
+
+    MachinePeak GetMachinePeak() {
+        // 线程数变化时会重新测量并改写peak, 所以在持有锁时复制一份返回
+        static std::mutex locker;
+        static MachinePeak peak;
+        static int peakThreads = -1;
+        std::lock_guard <std::mutex> guard(locker);
+        if (peakThreads == GetThreads()) {
+            return peak;
+        }
+        peakThreads = GetThreads();
+        auto pool = GetPool();
+
+        // 带宽: STREAM triad a = b + s * c, 每个数组32MB (超过一般的末级缓存), 取最快的一次; 由各线程自己初始化(first touch)
+        const int len = 8 << 20, grain = 1 << 16;
+        float *a = new float[len], *b = new float[len], *c = new float[len];
+        pool->ParallelFor(0, len, grain, [&](int st, int end) {
+            for (int i = st; i < end; i++) {
+                a[i] = 0.0f;
+                b[i] = 1.0f;
+                c[i] = 2.0f;
+            }
+        });
+        double best = 1e100;
+        for (int it = 0; it < 5; it++) {
+            auto st = std::chrono::system_clock::now();
+            pool->ParallelFor(0, len, grain, [&](int st, int end) {
+                for (int i = st; i < end; i++) {
+                    a[i] = b[i] + 3.0f * c[i];
+                }
+            });
+            best = std::min(best, GetSpan(st, std::chrono::system_clock::now()));
+        }
+        peak.bandwidth = 3.0 * len * sizeof(float) / best / 1e9;
+        delete[] a;
+        delete[] b;
+        delete[] c;
+
+        // 算力: 每个线程各执行一份乘加测试, 取最快的一次
+        const CpuLinearKernels *kernels = GetCpuLinearKernels();
+        int parts = std::max(1, pool->ThreadCount());
+        std::vector <uint64_t> flops(parts, 0);
+        std::vector <float> sinks(parts, 0.0f);
+        best = 1e100;
+        for (int it = 0; it < 3; it++) {
+            auto st = std::chrono::system_clock::now();
+            pool->ParallelFor(0, parts, 1, [&](int st, int end) {
+                for (int i = st; i < end; i++) {
+                    flops[i] = kernels->fmaProbe(1 << 20, &sinks[i]);
+                }
+            });
+            best = std::min(best, GetSpan(st, std::chrono::system_clock::now()));
+        }
+        uint64_t totalFlops = 0;
+        for (int i = 0; i < parts; i++) {
+            totalFlops += flops[i];
+        }
+        peak.gflops = totalFlops / best / 1e9;
+        return peak;
+    }
+
+    void ActivationPart(void (*func)(float *, float *, int), float *input, float *output, int st, int end) {
+        func(input + st, output + st, end - st);
+    }
+
+    // output的第i个元素 = silu(input[row, col]) * (up == nullptr ? 1 : input[row, mid + col]), 处理output的[st, end)
+    void SiluPart(void (*silu)(float *, float *, float *, int), float *input, float *output,
+                  int mid, int spatial, bool swiglu, int st, int end) {
+        while (st < end) {
+            int row = st / mid, col = st % mid;
+            int len = std::min(end - st, mid - col);
+            float *x = input + (size_t) row * spatial + col;
+            silu(x, swiglu ? x + mid : nullptr, output + st, len);
+            st += len;
+        }
+    }
+
+    void SoftmaxRowsPart(void (*softmaxRow)(float *, float *, int), float *input, float *output,
+                         int channels, int st, int end) {
+        for (int i = st; i < end; i++) {
+            softmaxRow(input + (size_t) i * channels, output + (size_t) i * channels, channels);
+        }
+    }
+
+    void RMSNormRowsPart(void (*rmsNormRow)(float *, float *, float *, int, float), float *input, float *weight,
+                         float *output, int channels, float eps, int st, int end) {
+        for (int i = st; i < end; i++) {
+            rmsNormRow(input + (size_t) i * channels, weight, output + (size_t) i * channels, channels, eps);
+        }
+    }
+
+    void LayerNormRowsPart(void (*layerNormRow)(float *, float *, float *, float *, int, float), float *input,
+                           float *gamma, float *beta, float *output, int channels, float eps, int st, int end) {
+        for (int i = st; i < end; i++) {
+            layerNormRow(input + (size_t) i * channels, gamma, beta, output + (size_t) i * channels, channels, eps);
         }
-    } fp16tofp32;
+    }
 
     void Float16ToFloat32(uint16_t *float16, float *float32, int len) {
         for (int i = 0; i < len; i++) {
@@ -179,6 +255,27 @@ namespace fastllm {
         }
     }
 
+    void BFloat16ToFloat32(uint16_t *bfloat16, float *float32, int len) {
+        for (int i = 0; i < len; i++) {
+            float32[i] = bfloat16_to_float(bfloat16[i]);
+        }
+    }
+
+    void Float32ToBFloat16(float *float32, uint16_t *bfloat16, int len) {
+        for (int i = 0; i < len; i++) {
+            bfloat16[i] = float_to_bfloat16(float32[i]);
+        }
+    }
+
+    // 类型转换后换成新的cpu内存, 原来的内存释放(如果是共享的则只解除引用)
+    static void ReplaceCpuData(Data &data, uint8_t *cur) {
+        data.FreeCpuData();
+        data.cpuData = cur;
+        data.isView = false;
+        data.expansionSize = data.Count(0);
+        data.expansionBytes = data.GetBytes();
+    }
+
     void CpuToFloat16::Run(const std::string &opType, const fastllm::DataDict &datas,
                            const fastllm::FloatDict &floatParams, const fastllm::IntDict &intParams) {
         Data &data = *(datas.find("input")->second);
@@ -194,13 +291,12 @@ namespace fastllm {
             float *old = (float*)data.cpuData;
             data.dataType = DataType::FLOAT16;
             data.UpdateUnitSize();
-            data.cpuData = new uint8_t[data.GetBytes()];
-            uint16_t *cur = (uint16_t*)data.cpuData;
+            uint16_t *cur = (uint16_t*)new uint8_t[data.GetBytes()];
             int len = data.Count(0);
             for (int i = 0; i < len; i++) {
                 cur[i] = float_to_half(old[i]);
             }
-            delete[] old;
+            ReplaceCpuData(data, (uint8_t*)cur);
         } else {
             ErrorInFastLLM("ToFloat16: unsupport dataType.\n");
         }
@@ -221,18 +317,58 @@ namespace fastllm {
             uint16_t *old = (uint16_t*)data.cpuData;
             data.dataType = DataType::FLOAT32;
             data.UpdateUnitSize();
-            data.cpuData = new uint8_t[data.GetBytes()];
-            float *cur = (float*)data.cpuData;
+            float *cur = (float*)new uint8_t[data.GetBytes()];
             int len = data.Count(0);
             for (int i = 0; i < len; i++) {
                 cur[i] = fp16tofp32.dict[old[i]];
             }
-            delete[] old;
+            ReplaceCpuData(data, (uint8_t*)cur);
+        } else if (data.dataType == DataType::BFLOAT16) {
+            uint16_t *old = (uint16_t*)data.cpuData;
+            data.dataType = DataType::FLOAT32;
+            data.UpdateUnitSize();
+            uint8_t *cur = new uint8_t[data.GetBytes()];
+            BFloat16ToFloat32(old, (float*)cur, data.Count(0));
+            ReplaceCpuData(data, cur);
         } else {
             ErrorInFastLLM("ToFloat32: unsupport dataType.\n");
         }
     }
 
+    void CpuToBFloat16::Run(const std::string &opType, const fastllm::DataDict &datas,
+                            const fastllm::FloatDict &floatParams, const fastllm::IntDict &intParams) {
+        Data &data = *(datas.find("input")->second);
+        if (data.dataType == DataType::BFLOAT16) {
+            return;
+        }
+        if (data.dims.size() == 0) {
+            data.dataType = DataType::BFLOAT16;
+            data.UpdateUnitSize();
+            return;
+        }
+        if (data.dataType == DataType::FLOAT32) {
+            float *old = (float*)data.cpuData;
+            data.dataType = DataType::BFLOAT16;
+            data.UpdateUnitSize();
+            uint8_t *cur = new uint8_t[data.GetBytes()];
+            Float32ToBFloat16(old, (uint16_t*)cur, data.Count(0));
+            ReplaceCpuData(data, cur);
+        } else {
+            ErrorInFastLLM("ToBFloat16: unsupport dataType.\n");
+        }
+    }
+
+    // 按layout取出Attention的q / k / v / output中heads和seq两维的大小与stride
+    // LayoutHeadMajor: [heads, seq, dim], LayoutSeqMajor: [seq, heads, dim]
+    static void GetAttentionStrides(const Data &data, int layout, int &heads, int &seqLen,
+                                    uint64_t &headStride, uint64_t &seqStride) {
+        int headAxis = (layout == LayoutSeqMajor ? 1 : 0), seqAxis = 1 - headAxis;
+        heads = data.dims[headAxis];
+        seqLen = data.dims[seqAxis];
+        headStride = data.strides[headAxis];
+        seqStride = data.strides[seqAxis];
+    }
+
     void CpuAttention::Reshape(const std::string &opType, const fastllm::DataDict &datas,
                                const fastllm::FloatDict &floatParams, const fastllm::IntDict &intParams) {
         Data &q = *(datas.find("q")->second);
@@ -240,26 +376,41 @@ namespace fastllm {
         Data &v = *(datas.find("v")->second);
         Data &output = *(datas.find("output")->second);
         int group = intParams.find("group") != intParams.end() ? intParams.find("group")->second : 1;
+        int qLayout = intParams.find("qLayout") != intParams.end() ? intParams.find("qLayout")->second : LayoutHeadMajor;
+        int kvLayout = intParams.find("kvLayout") != intParams.end() ? intParams.find("kvLayout")->second : LayoutHeadMajor;
+        int outputLayout = intParams.find("outputLayout") != intParams.end() ? intParams.find("outputLayout")->second : LayoutHeadMajor;
 
         AssertInFastLLM(q.dims.size() == 3 && k.dims.size() == 3 && v.dims.size() == 3, "Attention: dims of q, k, v should be 3.\n");
+        int qHeads, qLen, kHeads, kLen, vHeads, vLen;
+        uint64_t headStride, seqStride;
+        GetAttentionStrides(q, qLayout, qHeads, qLen, headStride, seqStride);
+        GetAttentionStrides(k, kvLayout, kHeads, kLen, headStride, seqStride);
+        GetAttentionStrides(v, kvLayout, vHeads, vLen, headStride, seqStride);
         AssertInFastLLM(q.dims[2] == k.dims[2], "Attention: q.dims[2] should be equal to k.dims[2].\n");
-        AssertInFastLLM(k.dims[1] == v.dims[1], "Attention: k.dims[1] should be equal to v.dims[1].\n");
-        AssertInFastLLM(k.dims[0] == v.dims[0], "Attention: k.dims[0] should be equal to v.dims[0].\n");
-        AssertInFastLLM(q.dims[0] == k.dims[0] * group, "Attention: q.dims[0] should be equal to k.dims[0] * group.\n");
+        AssertInFastLLM(kLen == vLen, "Attention: k's length should be equal to v's length.\n");
+        AssertInFastLLM(kHeads == vHeads, "Attention: k's heads should be equal to v's heads.\n");
+        AssertInFastLLM(qHeads == kHeads * group, "Attention: q's heads should be equal to k's heads * group.\n");
 
         AssertInFastLLM(q.dataType == k.dataType && q.dataType == v.dataType,
                         "Attention: q, k, v's datatype should be same.\n");
         AssertInFastLLM(q.dataType == DataType::FLOAT32 ||
-                        q.dataType == DataType::FLOAT16, 
-                        "Attention's input's type should be float32.\n");
+                        q.dataType == DataType::FLOAT16 ||
+                        q.dataType == DataType::BFLOAT16,
+                        "Attention's input's type should be float32, float16 or bfloat16.\n");
 
-        std::vector <int> dims = {q.dims[0], q.dims[1], v.dims[2]};
+        std::vector <int> dims = {qHeads, qLen, v.dims[2]};
+        if (outputLayout == LayoutSeqMajor) {
+            dims = {qLen, qHeads, v.dims[2]};
+        }
         output.dataType = q.dataType;
         output.Resize(dims);
     }
 
+    // q, k, v的行之间分别间隔qStride, kStride, vStride个元素, output的行之间间隔oStride个元素
     void SingleAttention(float *qd, float *kd, float *vd, float *maskd, float *od,
-                         float scale, int q1, int q2, int k1, int v2) {
+                         float scale, int q1, int q2, int k1, int v2,
+                         int qStride, int kStride, int vStride, int oStride) {
+        auto dotRow = GetCpuLinearKernels()->dotRow;
         float *qk = new float[k1];
         float *temp = new float[k1];
         for (int i = 0; i < q1; i++) {
@@ -269,27 +420,7 @@ namespace fastllm {
                     qk[j] = -10000;
                     continue;
                 }
-                float now = 0.0f;
-                int l = 0;
-#ifdef __aarch64__
-                float32x4_t sum = {0, 0, 0, 0};
-                for (; l + 3 < q2; l += 4) {
-                    sum = vaddq_f32(sum, vmulq_f32(vld1q_f32(qd + i * q2 + l),
-                                                   vld1q_f32(kd + j * q2 + l)));
-                }
-                now += sum[0] + sum[1] + sum[2] + sum[3];
-#elif defined(__AVX__)
-                __m256 vsum = _mm256_set1_ps(0.0f);
-                for (; l + 7 < q2; l += 8) {
-                    __m256 vx = _mm256_loadu_ps((const float *) (qd + i * q2 + l));
-                    __m256 vy = _mm256_loadu_ps((const float *) (kd + j * q2 + l));
-                    vsum = _mm256_add_ps(vsum, _mm256_mul_ps(vx, vy));
-                }
-                now += Floatsum(vsum);
-#endif
-                for (; l < q2; l++) {
-                    now += qd[i * q2 + l] * kd[j * q2 + l];
-                }
+                float now = dotRow(qd + i * qStride, kd + j * kStride, q2);
                 qk[j] = now * scale;
                 maxValue = std::max(maxValue, now * scale);
             }
@@ -315,7 +446,7 @@ namespace fastllm {
             }
             for (int j = 0; j < k1; j++) {
                 for (int l = 0; l < v2; l++) {
-                    od[i * v2 + l] += qk[j] * vd[j * v2 + l];
+                    od[i * oStride + l] += qk[j] * vd[j * vStride + l];
                 }
             }
         }
@@ -324,7 +455,8 @@ namespace fastllm {
     }
 
     void SingleAttentionFloat16(uint16_t *qd, uint16_t *kd, uint16_t *vd, uint16_t *maskd, uint16_t *od,
-                                float scale, int q1, int q2, int k1, int v2) {
+                                float scale, int q1, int q2, int k1, int v2,
+                                int qStride, int kStride, int vStride, int oStride) {
         std::vector <float> fqd, fkd, fvd, fmaskd, fod;
         
         fqd.resize(q1 * q2);
@@ -333,23 +465,52 @@ namespace fastllm {
         fmaskd.resize(maskd ? q1 * k1 : 0);
         fod.resize(q1 * v2);
 
-        Float16ToFloat32(qd, fqd.data(), (int)fqd.size());
-        Float16ToFloat32(kd, fkd.data(), (int)fkd.size());
-        Float16ToFloat32(vd, fvd.data(), (int)fvd.size());
+        for (int i = 0; i < q1; i++) {
+            Float16ToFloat32(qd + i * qStride, fqd.data() + i * q2, q2);
+        }
+        for (int j = 0; j < k1; j++) {
+            Float16ToFloat32(kd + j * kStride, fkd.data() + j * q2, q2);
+            Float16ToFloat32(vd + j * vStride, fvd.data() + j * v2, v2);
+        }
         if (maskd) {
             Float16ToFloat32(maskd, fmaskd.data(), (int)fmaskd.size());
         }
 
         SingleAttention(fqd.data(), fkd.data(), fvd.data(), maskd ? fmaskd.data() : nullptr, fod.data(), 
-                        scale, q1, q2, k1, v2);
+                        scale, q1, q2, k1, v2, q2, q2, v2, v2);
 
-        Float32ToFloat16(fod.data(), od, (int)fod.size());
+        for (int i = 0; i < q1; i++) {
+            Float32ToFloat16(fod.data() + i * v2, od + i * oStride, v2);
+        }
     }
 
-    template<typename T>
-    void findWeight(float *data, T *index, std::vector<float> &index2data, int st, int end) {
-        for (int i = st; i < end; i++) {
-            data[i] = index2data[index[i]];
+    void SingleAttentionBFloat16(uint16_t *qd, uint16_t *kd, uint16_t *vd, uint16_t *maskd, uint16_t *od,
+                                 float scale, int q1, int q2, int k1, int v2,
+                                 int qStride, int kStride, int vStride, int oStride) {
+        std::vector <float> fqd, fkd, fvd, fmaskd, fod;
+
+        fqd.resize(q1 * q2);
+        fkd.resize(k1 * q2);
+        fvd.resize(k1 * v2);
+        fmaskd.resize(maskd ? q1 * k1 : 0);
+        fod.resize(q1 * v2);
+
+        for (int i = 0; i < q1; i++) {
+            BFloat16ToFloat32(qd + i * qStride, fqd.data() + i * q2, q2);
+        }
+        for (int j = 0; j < k1; j++) {
+            BFloat16ToFloat32(kd + j * kStride, fkd.data() + j * q2, q2);
+            BFloat16ToFloat32(vd + j * vStride, fvd.data() + j * v2, v2);
+        }
+        if (maskd) {
+            BFloat16ToFloat32(maskd, fmaskd.data(), (int)fmaskd.size());
+        }
+
+        SingleAttention(fqd.data(), fkd.data(), fvd.data(), maskd ? fmaskd.data() : nullptr, fod.data(),
+                        scale, q1, q2, k1, v2, q2, q2, v2, v2);
+
+        for (int i = 0; i < q1; i++) {
+            Float32ToBFloat16(fod.data() + i * v2, od + i * oStride, v2);
         }
     }
 
@@ -362,51 +523,53 @@ namespace fastllm {
         Data &output = *(datas.find("output")->second);
         int group = intParams.find("group") != intParams.end() ? intParams.find("group")->second : 1;
         float scale = floatParams.find("scale") != floatParams.end() ? floatParams.find("scale")->second : 1.0;
+        int qLayout = intParams.find("qLayout") != intParams.end() ? intParams.find("qLayout")->second : LayoutHeadMajor;
+        int kvLayout = intParams.find("kvLayout") != intParams.end() ? intParams.find("kvLayout")->second : LayoutHeadMajor;
+        int outputLayout = intParams.find("outputLayout") != intParams.end() ? intParams.find("outputLayout")->second : LayoutHeadMajor;
         output.Allocate();
-        int q0 = q.dims[0], q1 = q.dims[1], q2 = q.dims[2], k0 = k.dims[0], k1 = k.dims[1], v2 = v.dims[2];
 
+        int q0, q1, k0, k1, v0, v1, o0, o1;
+        uint64_t qHeadStride, qStride, kHeadStride, kStride, vHeadStride, vStride, oHeadStride, oStride;
+        GetAttentionStrides(q, qLayout, q0, q1, qHeadStride, qStride);
+        GetAttentionStrides(k, kvLayout, k0, k1, kHeadStride, kStride);
+        GetAttentionStrides(v, kvLayout, v0, v1, vHeadStride, vStride);
+        GetAttentionStrides(output, outputLayout, o0, o1, oHeadStride, oStride);
+        int q2 = q.dims[2], v2 = v.dims[2];
+
+        bool hasMask = (datas.find("mask")->second && mask.dims.size() > 0);
+        int batch = (hasMask && mask.dims.size() == 3) ? mask.dims[0] : 1;
+        batch = intParams.find("mask___batch") != intParams.end() ? intParams.find("mask___batch")->second : batch;
+        int maskStride = hasMask ? (mask.dims.size() == 3 ? mask.strides[0] : mask.Count(0)) : 0;
+        auto pool = GetPool();
+        // 每个head一个任务, 动态领取
         if (q.dataType == DataType::FLOAT32) {
             float *qd = (float*)q.cpuData;
             float *kd = (float*)k.cpuData;
             float *vd = (float*)v.cpuData;
-            float *maskd = (datas.find("mask")->second && mask.dims.size() > 0) ? (float*)mask.cpuData : nullptr;
+            float *maskd = hasMask ? (float*)mask.cpuData : nullptr;
             float *od = (float*)output.cpuData;
-            int batch = (maskd != nullptr && mask.dims.size() == 3) ? mask.dims[0] : 1; 
-            batch = intParams.find("mask___batch") != intParams.end() ? intParams.find("mask___batch")->second : batch;
-            int maskStride = (maskd != nullptr) ? (mask.dims.size() == 3 ? mask.strides[0] : mask.Count(0)) : 0;
             std::fill(od, od + output.Count(0), 0.0f);
-            auto pool = GetPool();
-            std::vector<std::future<void> > futures;
-            for (int o = 0; o < q0; o++) {
-                futures.push_back(pool->Submit(SingleAttention,
-                                qd + o * q.strides[0], kd + (o / group) * k.strides[0], vd + (o / group) * v.strides[0],
-                                maskd + (o / (q0 / batch)) * maskStride, od + o * output.strides[0], scale,
-                                q1, q2, k1, v2));
-            }
-            for (int o = 0; o < futures.size(); o++) {
-                futures[o].get();
-            }
-        } else if (q.dataType == DataType::FLOAT16) {
+            pool->ParallelFor(0, q0, 1, [&](int st, int end) {
+                for (int o = st; o < end; o++) {
+                    SingleAttention(qd + o * qHeadStride, kd + (o / group) * kHeadStride, vd + (o / group) * vHeadStride,
+                                    maskd + (o / (q0 / batch)) * maskStride, od + o * oHeadStride, scale,
+                                    q1, q2, k1, v2, (int)qStride, (int)kStride, (int)vStride, (int)oStride);
+                }
+            }, ParallelScheduleDynamic);
+        } else if (q.dataType == DataType::FLOAT16 || q.dataType == DataType::BFLOAT16) {
             uint16_t *qd = (uint16_t*)q.cpuData;
             uint16_t *kd = (uint16_t*)k.cpuData;
             uint16_t *vd = (uint16_t*)v.cpuData;
-            uint16_t *maskd = (datas.find("mask")->second && mask.dims.size() > 0) ? (uint16_t*)mask.cpuData : nullptr;
+            uint16_t *maskd = hasMask ? (uint16_t*)mask.cpuData : nullptr;
             uint16_t *od = (uint16_t*)output.cpuData;
-            int batch = (maskd != nullptr && mask.dims.size() == 3) ? mask.dims[0] : 1; 
-            batch = intParams.find("mask___batch") != intParams.end() ? intParams.find("mask___batch")->second : batch;
-            int maskStride = (maskd != nullptr) ? (mask.dims.size() == 3 ? mask.strides[0] : mask.Count(0)) : 0;
-            std::fill(od, od + output.Count(0), float_to_half(0.0f));
-            auto pool = GetPool();
-            std::vector<std::future<void> > futures;
-            for (int o = 0; o < q0; o++) {
-                futures.push_back(pool->Submit(SingleAttentionFloat16,
-                                qd + o * q.strides[0], kd + (o / group) * k.strides[0], vd + (o / group) * v.strides[0],
-                                maskd + (o / (q0 / batch)) * maskStride, od + o * output.strides[0], scale,
-                                q1, q2, k1, v2));
-            }
-            for (int o = 0; o < futures.size(); o++) {
-                futures[o].get();
-            }
+            auto func = (q.dataType == DataType::FLOAT16 ? SingleAttentionFloat16 : SingleAttentionBFloat16);
+            pool->ParallelFor(0, q0, 1, [&](int st, int end) {
+                for (int o = st; o < end; o++) {
+                    func(qd + o * qHeadStride, kd + (o / group) * kHeadStride, vd + (o / group) * vHeadStride,
+                         maskd + (o / (q0 / batch)) * maskStride, od + o * oHeadStride, scale,
+                         q1, q2, k1, v2, (int)qStride, (int)kStride, (int)vStride, (int)oStride);
+                }
+            }, ParallelScheduleDynamic);
         } else {
             ErrorInFastLLM("Attention error: unsupport dataType.\n");
         }
@@ -576,69 +739,11 @@ namespace fastllm {
         float *betaData = (float *) beta.cpuData;
 
         if (inner == 1) {
-            for (int i = 0; i < outer; i++) {
-                float mean = 0.f, s2 = 0.f, var = 0.f;
-                int j = 0;
-#ifdef __aarch64__
-                float32x4_t sums = vdupq_n_f32(0.0);
-                    float32x4_t sums2 = vdupq_n_f32(0.0);
-                    for (; j + 3 < channels; j += 4) {
-                        float32x4_t vi = vld1q_f32(inputData + j);
-                        sums = vaddq_f32(sums, vi);
-                        sums2 = vaddq_f32(sums2, vmulq_f32(vi, vi));
-                    }
-                    mean = sums[0] + sums[1] + sums[2] + sums[3];
-                    s2 = sums2[0] + sums2[1] + sums2[2] + sums2[3];
-#endif
-#ifdef __AVX2__
-                __m256 sum_vec = _mm256_setzero_ps();
-                __m256 squared_sum_vec = _mm256_setzero_ps();
-
-                for (; j < channels - 7; j += 8) {
-                    __m256 data_vec = _mm256_loadu_ps(inputData + j);
-                    sum_vec = _mm256_add_ps(sum_vec, data_vec);
-
-                    __m256 squared_data_vec = _mm256_mul_ps(data_vec, data_vec);
-                    squared_sum_vec = _mm256_add_ps(squared_sum_vec, squared_data_vec);
-                }
-
-                float sum_array[8];
-                _mm256_storeu_ps(sum_array, sum_vec);
-                mean = sum_array[0] + sum_array[1] + sum_array[2] + sum_array[3] +
-                            sum_array[4] + sum_array[5] + sum_array[6] + sum_array[7];
-
-                float squared_sum_array[8];
-                _mm256_storeu_ps(squared_sum_array, squared_sum_vec);
-                s2 = squared_sum_array[0] + squared_sum_array[1] +
-                                    squared_sum_array[2] + squared_sum_array[3] +
-                                    squared_sum_array[4] + squared_sum_array[5] +
-                                    squared_sum_array[6] + squared_sum_array[7];
-#endif
-                for (; j < channels; j++) {
-                    mean += inputData[j];
-                    s2 += inputData[j] * inputData[j];
-                }
-                mean /= channels;
-                var = sqrt(s2 / channels - mean*mean + 1e-10);
-                j = 0;
-#ifdef __aarch64__
-                float32x4_t means = vdupq_n_f32(mean);
-                    float32x4_t vars = vdupq_n_f32(1.0 / var);
-                    for (; j + 3 < channels; j += 4) {
-                        float32x4_t va = vld1q_f32(gammaData + j), vb = vld1q_f32(betaData + j);
-                        float32x4_t vi = vld1q_f32(inputData + j);
-                        float32x4_t vo = vaddq_f32(vmulq_f32(vmulq_f32(vsubq_f32(vi, means), vars), va), vb);
-                        vst1q_f32(outputData + j, vo);
-                    }
-#endif
-                for (; j < channels; j++) {
-                    float a = gammaData[j], b = betaData[j];
-                    outputData[j] = (inputData[j] - mean) / var * a + b;
-                }
-
-                inputData += channels;
-                outputData += channels;
-            }
+            RunRangeMultiThread(outer, std::max(1, elementwiseMinLen / channels), LayerNormRowsPart,
+                                GetCpuLinearKernels()->layerNormRow, inputData, gammaData, betaData, outputData,
+                                channels, 1e-10f);
+            delete[] mean;
+            delete[] var;
             return;
         } else {
             for (int i = 0; i < outer; i++) {
@@ -698,38 +803,8 @@ namespace fastllm {
             float *inputData = (float *) input.cpuData;
             float *outputData = (float *) output.cpuData;
             float *weightData = (float *) weight.cpuData;
-
-            for (int i = 0; i < outer; i++) {
-                float mean = 0.f;
-                int j = 0;
-#ifdef __aarch64__
-                float32x4_t sums = vdupq_n_f32(0.0);
-                for (; j + 3 < channels; j += 4) {
-                    float32x4_t vi = vld1q_f32(inputData + j);
-                    sums = vaddq_f32(sums, vmulq_f32(vi, vi));
-                }
-                mean = sums[0] + sums[1] + sums[2] + sums[3];
-#endif
-                for (; j < channels; j++) {
-                    mean += inputData[j] * inputData[j];
-                }
-                float scale = 1.0 / sqrt(mean / channels + eps);
-                j = 0;
-#ifdef __aarch64__
-                float32x4_t vscale = vdupq_n_f32(scale);
-                for (; j + 3 < channels; j += 4) {
-                    float32x4_t vi = vld1q_f32(inputData + j);
-                    float32x4_t vw = vld1q_f32(weightData + j);
-                    vst1q_f32(outputData + j, vmulq_f32(vmulq_f32(vi, vscale), vw));
-                }
-#endif
-                for (; j < channels; j++) {
-                    outputData[j] = inputData[j] * scale * weightData[j];
-                }
-
-                inputData += channels;
-                outputData += channels;
-            }
+            RunRangeMultiThread(outer, std::max(1, elementwiseMinLen / channels), RMSNormRowsPart,
+                                GetCpuLinearKernels()->rmsNormRow, inputData, weightData, outputData, channels, eps);
         } else if (input.dataType == DataType::FLOAT16) {
             uint16_t *inputData = (uint16_t *) input.cpuData;
             uint16_t *outputData = (uint16_t *) output.cpuData;
@@ -756,6 +831,139 @@ namespace fastllm {
         }
     }
 
+    void QuantizeRowUInt8(float *input, uint8_t *output, int m, LowBitConfig &config);
+
+    // 按行量化的Linear input(Data::linearInputLayout)的排布
+    enum LinearInputLayout {
+        LinearInputRaw = 0, // QuantizeRowUInt8的输出
+        LinearInputInt8Signed = 1, // (x ^ 128)的int8, 见CpuLinearKernels::int8SignedInput
+        LinearInputInt4Reordered = 2 // 每32个一组重排, 见CpuLinearKernels::int4ReorderInput
+    };
+
+    // 当前kernel计算weightType的Linear时需要的input排布; INT4_GROUP等按组量化input的类型不使用按行量化的input
+    static int GetLinearInputLayout(const CpuLinearKernels *kernels, DataType weightType) {
+        if (weightType == DataType::INT8 && kernels->int8SignedInput) {
+            return LinearInputInt8Signed;
+        }
+        if ((weightType == DataType::INT4 || weightType == DataType::INT4_NOZERO) && kernels->int4ReorderInput) {
+            return LinearInputInt4Reordered;
+        }
+        return LinearInputRaw;
+    }
+
+    // weightType的Linear是否读取按行量化的input(quantizedInput); 浮点和INT4_GROUP等类型不读取
+    static bool UseRowQuantizedInput(DataType weightType) {
+        return weightType == DataType::INT8 || weightType == DataType::INT4 || weightType == DataType::INT4_NOZERO;
+    }
+
+    // 把一行LinearInputRaw排布的量化input原地转换成layout排布
+    static void ConvertLinearInputRow(uint8_t *row, int m, int layout) {
+        if (layout == LinearInputInt8Signed) {
+            for (int j = 0; j < m; j++) {
+                row[j] = (row[j] + !row[j]) ^ 128;
+            }
+        } else if (layout == LinearInputInt4Reordered) {
+            uint8_t temp[32];
+            for (int j = 0; j + 31 < m; j += 32) {
+                uint8_t *now = row + j;
+                memcpy(temp, now, 32);
+                for (int l = 0; l < 16; l++) {
+                    now[l] = temp[l * 2 + 1];
+                    now[l + 16] = temp[l * 2];
+                }
+            }
+        }
+    }
+
+    // 融合的 residual-add + RMSNorm / LayerNorm + Linear的input量化, 处理[st, end)行
+    // residualData不为nullptr时先做 input += residual; betaData为nullptr时为RMSNorm, 否则为LayerNorm
+    // uinput不为nullptr时再把output按行量化成uint8(排布为layout), 量化参数写入configs
+    void AddNormPart(float *inputData, float *residualData, float *weightData, float *betaData, float eps,
+                     float *outputData, uint8_t *uinput, LowBitConfig *configs, int layout, int channels,
+                     int st, int end) {
+        const CpuLinearKernels *kernels = GetCpuLinearKernels();
+        for (int i = st; i < end; i++) {
+            float *x = inputData + (size_t) i * channels;
+            float *y = outputData + (size_t) i * channels;
+            if (residualData != nullptr) {
+                kernels->addTo(x, residualData + (size_t) i * channels, channels);
+            }
+            if (betaData == nullptr) {
+                kernels->rmsNormRow(x, weightData, y, channels, eps);
+            } else {
+                kernels->layerNormRow(x, weightData, betaData, y, channels, eps);
+            }
+            if (uinput != nullptr) {
+                uint8_t *row = uinput + (size_t) i * channels;
+                QuantizeRowUInt8(y, row, channels, configs[i]);
+                ConvertLinearInputRow(row, channels, layout);
+            }
+        }
+    }
+
+    void CpuAddRMSNormOp::Reshape(const std::string &opType, const fastllm::DataDict &datas,
+                                  const fastllm::FloatDict &floatParams, const fastllm::IntDict &intParams) {
+        Data &input = *(datas.find("input")->second);
+        Data &output = *(datas.find("output")->second);
+        Data *residual = datas.find("residual")->second;
+        Data *quantizedOutput = datas.find("quantizedOutput")->second;
+        AssertInFastLLM(input.dataType == DataType::FLOAT32, opType + " error: input's type should be float32.\n");
+        AssertInFastLLM(residual == nullptr || residual->dims.size() == 0 || residual->dims == input.dims,
+                        opType + " error: residual's shape should be the same as input's.\n");
+
+        output.dataType = input.dataType;
+        output.Resize(input.dims);
+        if (quantizedOutput != nullptr) {
+            auto it = intParams.find("quantizedFor");
+            if (it != intParams.end() && UseRowQuantizedInput((DataType) it->second)) {
+                quantizedOutput->dataType = DataType::INT8;
+                quantizedOutput->Resize(input.dims); // 每行的量化参数放在perChannelsConfigs[i]中
+            } else {
+                // 之后的Linear不读取量化的input, 不输出
+                quantizedOutput->Resize({});
+                quantizedOutput->perChannelsConfigs.clear();
+                quantizedOutput->linearInputLayout = LinearInputRaw;
+            }
+        }
+    }
+
+    void CpuAddRMSNormOp::Run(const std::string &opType, const fastllm::DataDict &datas,
+                              const fastllm::FloatDict &floatParams, const fastllm::IntDict &intParams) {
+        Data &input = *(datas.find("input")->second);
+        Data &output = *(datas.find("output")->second);
+        Data *residual = datas.find("residual")->second;
+        Data *quantizedOutput = datas.find("quantizedOutput")->second;
+        Data &weight = *(datas.find(opType == "AddRMSNorm" ? "weight" : "gamma")->second);
+        Data *beta = (opType == "AddRMSNorm" ? nullptr : datas.find("beta")->second);
+        // AddLayerNorm和LayerNorm保持一致, 方差上只加一个很小的数
+        float eps = floatParams.find("eps") != floatParams.end() ? floatParams.find("eps")->second :
+                    (beta == nullptr ? 1e-5 : 1e-10);
+        output.Allocate();
+
+        int channels = input.dims.back();
+        int outer = input.Count(0) / channels;
+        float *residualData = (residual != nullptr && residual->dims.size() > 0) ? (float *) residual->cpuData : nullptr;
+        float *betaData = (beta != nullptr ? (float *) beta->cpuData : nullptr);
+        uint8_t *uinput = nullptr;
+        LowBitConfig *configs = nullptr;
+        int layout = LinearInputRaw;
+        if (quantizedOutput != nullptr && quantizedOutput->dims.size() > 0) {
+            // 按之后使用它的Linear的weight类型直接输出kernel需要的排布
+            layout = GetLinearInputLayout(GetCpuLinearKernels(), (DataType) intParams.find("quantizedFor")->second);
+            quantizedOutput->Allocate();
+            quantizedOutput->perChannelsConfigs.resize(outer);
+            quantizedOutput->linearInputLayout = layout;
+            uinput = quantizedOutput->cpuData;
+            configs = quantizedOutput->perChannelsConfigs.data();
+        }
+
+        float *inputData = (float *) input.cpuData;
+        float *outputData = (float *) output.cpuData;
+        float *weightData = (float *) weight.cpuData;
+        RunPartsMultiThread(outer, GetThreads(), AddNormPart, inputData, residualData, weightData, betaData, eps,
+                            outputData, uinput, configs, layout, channels);
+    }
+
     void CpuLinearOp::Reshape(const std::string &opType, const fastllm::DataDict &datas,
                               const fastllm::FloatDict &floatParams, const fastllm::IntDict &intParams) {
         Data &input = *(datas.find("input")->second);
@@ -768,85 +976,15 @@ namespace fastllm {
         weight.weightType = WeightType::LINEAR;
         std::vector <int> dims = input.dims;
         dims.back() = weight.dims[0];
+        if (intParams.find("exType") != intParams.end() &&
+            intParams.find("exType")->second == LinearExType::ExSwiglu) {
+            dims.back() /= 2;
+        }
 
         output.dataType = input.dataType;
         output.Resize(dims);
     }
 
-    void FloatLinearPart(float *inputData, float *weightData, float *biasData, float *outputData,
-                         int n, int m, int k, int st, int end) {
-        for (int i = 0; i < n; i++) {
-            for (int j = st; j < end; j++) {
-                float now = biasData ? biasData[j] : 0.0f;
-                int l = 0;
-#ifdef __aarch64__
-                float32x4_t sum = {0, 0, 0, 0};
-                for (; l + 3 < m; l += 4) {
-                    sum = vaddq_f32(sum, vmulq_f32(vld1q_f32(inputData + i * m + l), vld1q_f32(weightData + j * m + l)));
-                }
-                now += sum[0] + sum[1] + sum[2] + sum[3];
-#else
-#ifdef __AVX2__
-                __m256 vsum = _mm256_setzero_ps();
-                for (; l + 7 < m; l += 8) {
-                    __m256 vi = _mm256_loadu_ps(inputData + i * m + l);
-                    __m256 vw = _mm256_loadu_ps(weightData + j * m + l);
-                    vsum = _mm256_fmadd_ps(vi, vw, vsum);
-                }
-                now += Floatsum(vsum);
-#endif
-#endif
-                for (; l < m; l++) {
-                    now += inputData[i * m + l] * weightData[j * m + l];
-                }
-                outputData[i * k + j] = now;
-            }
-        }
-    }
-
-    // float的input, float16的weight, 直接计算得到float的output
-    void Float16LinearPart(float *inputData, uint16_t *weightData, float *biasData, float *outputData,
-                           int n, int m, int k, int st, int end) {
-        for (int i = 0; i < n; i++) {
-            for (int j = st; j < end; j++) {
-                float now = biasData ? biasData[j] : 0.0f;
-                int l = 0;
-#ifdef __ARM_FEATURE_FP16_VECTOR_ARITHMETIC
-                float16x8_t sum = {0, 0, 0, 0, 0, 0, 0, 0};
-                for (; l + 7 < m; l += 8) {
-                    sum = vfmaq_f16(sum, vld1q_f16((float16_t*)inputData + i * m + l),
-                                        vld1q_f16((float16_t*)weightData + j * m + l));
-                }
-                now += sum[0] + sum[1] + sum[2] + sum[3] + sum[4] + sum[5] + sum[6] + sum[7];
-#else
-#ifdef __aarch64__
-                float32x4_t sum = {0, 0, 0, 0};
-                for (; l + 3 < m; l += 4) {
-                    float32x4_t vcur = {fp16tofp32.dict[weightData[j * m + l]], fp16tofp32.dict[weightData[j * m + l + 1]],
-                                        fp16tofp32.dict[weightData[j * m + l + 2]], fp16tofp32.dict[weightData[j * m + l + 3]]};
-                    sum = vaddq_f32(sum, vmulq_f32(vld1q_f32(inputData + i * m + l), vcur));
-                }
-                now += sum[0] + sum[1] + sum[2] + sum[3];
-#else
-#ifdef __AVX2__
-                __m256 vsum = _mm256_setzero_ps();
-                for (; l + 7 < m; l += 8) {
-                    __m256 vi = _mm256_loadu_ps(inputData + i * m + l);
-                    __m256 vw = _mm256_cvtph_ps(_mm_loadu_si128((__m128i *) (weightData + j * m + l)));
-                    vsum = _mm256_fmadd_ps(vi, vw, vsum);
-                }
-                now += Floatsum(vsum);
-#endif
-#endif
-#endif
-                for (; l < m; l++) {
-                    now += inputData[i * m + l] * fp16tofp32.dict[weightData[j * m + l]];
-                }
-                outputData[i * k + j] = now;
-            }
-        }
-    }
-
     // float16的input, float16的weight, 直接计算得到float16的output
     void Float16xFloat16LinearPart(uint16_t *inputData, uint16_t *weightData, float *biasData, uint16_t *outputData,
                            int n, int m, int k, int st, int end) {
@@ -1041,894 +1179,772 @@ namespace fastllm {
         }
     }
 
-    //a = [n, m], b = [k, m], c = aT(b') = [n, k]
-    void Multiply(uint8_t *a, uint8_t *b, int32_t *c, int n, int m, int k, int kstride) {
-#ifdef __ARM_FEATURE_DOTPROD
-        int block = 0;
-        for (; block < n; block++) {
-            uint8_t *weightWalk = b;
-            uint8_t *inputStart = a + block * m;
+    // 行数较多(prefill)时用AMX计算int8矩阵乘
+    const int amxMinRows = 16;
 
-            for (int i = 0; i < k; i++) {
-                int value = 0;
-                uint8_t *inputWalk = inputStart;
-                int j = 0;
-                uint32x4_t sum0 = {0, 0, 0, 0};
-                for (; j + 31 < m; j += 32) {
-                    uint8x16_t vi = vld1q_u8(inputWalk);
-                    uint8x16_t vi0 = vld1q_u8(inputWalk + 16);
-                    uint8x16_t vw = vld1q_u8(weightWalk);
-                    uint8x16_t vw0 = vld1q_u8(weightWalk + 16);
-                    sum0 = vdotq_u32(sum0, vi, vw);
-                    sum0 = vdotq_u32(sum0, vi0, vw0);
-                    inputWalk += 32;
-                    weightWalk += 32;
-                }
-
-                value += sum0[0] + sum0[1] + sum0[2] + sum0[3];
-                for (; j < m; j++) {
-				    value += (int)(*(weightWalk++)) * (*(inputWalk++));
-			    }
-                c[block * kstride + i] = value;
-            }
-        }
-#elif defined(__aarch64__)
-        int block = 0;
-        for (; block < n; block++) {
-            uint8_t *weightWalk = b;
-            uint8_t *inputStart = a + block * m;
-
-            for (int i = 0; i < k; i++) {
-                int value = 0;
-                uint8_t *inputWalk = inputStart;
-
-                int per = 64;
-                int cnt = m / per;
-                int sur = m % per;
-
-                uint32x4_t sum = {0};
-                uint16x8_t temp = {0};
-                uint16x8_t temp1 = {0};
-                uint16x8_t temp2 = {0};
-                uint16x8_t temp3 = {0};
-                uint16x8_t temp4 = {0};
-                uint16x8_t temp5 = {0};
-                uint16x8_t temp6 = {0};
-                uint16x8_t temp7 = {0};
-
-                while (cnt--) {
-                    temp = vmull_u8(vld1_u8(inputWalk), vld1_u8(weightWalk));
-                    temp1 = vmull_u8(vld1_u8(inputWalk + 8), vld1_u8(weightWalk + 8));
-                    temp2 = vmull_u8(vld1_u8(inputWalk + 16), vld1_u8(weightWalk + 16));
-                    temp3 = vmull_u8(vld1_u8(inputWalk + 24), vld1_u8(weightWalk + 24));
-                    temp4 = vmull_u8(vld1_u8(inputWalk + 32), vld1_u8(weightWalk + 32));
-                    temp5 = vmull_u8(vld1_u8(inputWalk + 40), vld1_u8(weightWalk + 40));
-                    temp6 = vmull_u8(vld1_u8(inputWalk + 48), vld1_u8(weightWalk + 48));
-                    temp7 = vmull_u8(vld1_u8(inputWalk + 56), vld1_u8(weightWalk + 56));
-
-                    sum = vpadalq_u16(sum, temp);
-                    sum = vpadalq_u16(sum, temp1);
-                    sum = vpadalq_u16(sum, temp2);
-                    sum = vpadalq_u16(sum, temp3);
-                    sum = vpadalq_u16(sum, temp4);
-                    sum = vpadalq_u16(sum, temp5);
-                    sum = vpadalq_u16(sum, temp6);
-                    sum = vpadalq_u16(sum, temp7);
-
-                    inputWalk += per;
-                    weightWalk += per;
-                }
+    // 行数较多时把input转成bfloat16, 用AVX512_BF16计算
+    const int bf16InputMinRows = 4;
 
-                value += (sum[0] + sum[1] + sum[2] + sum[3]);
-                while (sur--) {
-                    value += (int)(*(weightWalk++)) * (*(inputWalk++));
-                }
-
-                c[block * kstride + i] = value;
-            }
-        }
-#elif defined(__AVX2__)
-        int block = 0;
-        for (; block < n; block++) {
-            uint8_t *weightWalk = b;
-            uint8_t *inputStart = a + block * m;
+    // Linear后面接激活函数等时, 每个线程每次计算这么多列, 算完马上在cache中做后续的计算
+    const int linearTileCols = 64;
 
-            for (int i = 0; i < k; i++) {
-                uint8_t *inputWalk = inputStart;
-
-                c[block * kstride + i] = DotU8U8(inputWalk, weightWalk, m);
-                weightWalk += m;
-            }
-        }
-#else
-        int block = 0;
-	    for (; block < n; block++) {
-		    uint8_t *weightWalk = b;
-		    uint8_t *inputStart = a + block * m;
-
-		    for (int i = 0; i < k; i++) {
-			    int value = 0;
-			    uint8_t *inputWalk = inputStart;
-			    for (int j = 0; j < m; j++) {
-				    value += (int)(*(weightWalk++)) * (*(inputWalk++));
-			    }
-
-			    c[block * kstride + i] = value;
-		    }
-	    }
-#endif
+    static bool UseBFloat16Input(const CpuLinearKernels *kernels, int n) {
+        // AMX级别的kernel才使用AVX512_BF16, 见DetectCpuInstructionLevel
+        return n >= bf16InputMinRows && kernels->bfloat16InputLinearPart != nullptr && GetCpuInstructionLevel() >= ISA_AMX;
     }
 
-    //a = [n, m], b = [k, m], c = aT(b') = [n, k]
-    void MultiplyInt4(uint8_t *a, uint8_t *b, int32_t *c, int n, int m, int k, int kstride,
-                      int *weightSums, int *weightZeros, float *scales, float *bias, LowBitConfig *config,
-                      int *inputSums) {
-        int block = 0;
-        for (; block < n; block++) {
-            uint32_t inputSum = inputSums[block];
-            uint8_t *weightWalk = b;
-            uint8_t *inputStart = a + block * m;
-
-            for (int i = 0; i < k; i++) {
-                int value = 0;
-                uint8_t *inputWalk = inputStart;
-                int j = 0;
-#ifdef __ARM_FEATURE_DOTPROD
-                uint8x8_t maskHigh = vdup_n_u8(0xF0);
-                uint8x8_t maskLow = vdup_n_u8(0xF);
-                uint32x2_t sum0 = {0, 0};
-
-                for (; j + 15 < m; j += 16) {
-                    uint8x8_t ori = vld1_u8(weightWalk + (i * m + j) / 2);
-                    uint8x8x2_t in = vld2_u8(inputWalk + j);
-                    uint8x8_t va = vand_u8(ori, maskLow);
-                    uint8x8_t vb = vshr_n_u8(vand_u8(ori, maskHigh), 4);
-                    sum0 = vdot_u32(sum0, va, in.val[1]);
-                    sum0 = vdot_u32(sum0, vb, in.val[0]);
-                }
-                value += sum0[0] + sum0[1];
-#elif defined(__aarch64__)
-                uint8x8_t maskHigh = vdup_n_u8(0xF0);
-                uint8x8_t maskLow = vdup_n_u8(0xF);
-                uint32x4_t sum0 = {0, 0, 0, 0};
-
-                for (; j + 15 < m; j += 16) {
-                    uint8x8_t ori = vld1_u8(weightWalk + (i * m + j) / 2);
-                    uint8x8x2_t in = vld2_u8(inputWalk + j);
-                    uint8x8_t va = vand_u8(ori, maskLow);
-                    uint8x8_t vb = vshr_n_u8(vand_u8(ori, maskHigh), 4);
-                    sum0 = vpadalq_u16(sum0, vmull_u8(va, in.val[1]));
-                    sum0 = vpadalq_u16(sum0, vmull_u8(vb, in.val[0]));
-                }
-                value += sum0[0] + sum0[1] + sum0[2] + sum0[3];
-#elif defined(__AVX2__)
-                value += DotU4U8(weightWalk + i * m / 2, inputWalk, m);
-                j += m;
-#endif
-                for (; j + 1 < m; j += 2) {
-                    int id = (i * m + j) / 2;
-                    value += (weightWalk[id] >> 4) * inputWalk[j];
-                    value += (weightWalk[id] & 0xF) * inputWalk[j + 1];
-                }
-
-                for (; j < m; j++) {
-                    int id = (i * m + j) / 2;
-                    if ((i * m + j) % 2) {
-                        value += (weightWalk[id] & 0xF) * inputWalk[j];
-                    } else {
-                        value += (weightWalk[id] >> 4) * inputWalk[j];
-                    }
-                }
-
-                value -= weightSums[i] * config[block].zeroPoint;
-                value -= inputSum * weightZeros[i];
-                value += (int)config[block].zeroPoint * weightZeros[i] * m;
+    // input只转换一次, 所有线程共用
+    static void ToBFloat16Input(float *inputData, std::vector <uint16_t> &bfInput, int n, int m) {
+        bfInput.resize((size_t) n * m);
+        RunRangeMultiThread(n, 1, [&](int st, int end) {
+            Float32ToBFloat16(inputData + (size_t) st * m, bfInput.data() + (size_t) st * m, (end - st) * m);
+        });
+    }
 
-                ((float*)c)[block * kstride + i] = scales[i] * config[block].scale * value +
-                                                   (bias == nullptr ? 0.0 : bias[i]);
-            }
+    // float的input, bfloat16的weight, output = [n, k]
+    void BFloat16LinearMultiThread(float *inputData, uint16_t *weightData, float *biasData, float *outputData,
+                                   int n, int m, int k, int threadNum) {
+        const CpuLinearKernels *kernels = GetCpuLinearKernels();
+        if (UseBFloat16Input(kernels, n)) {
+            std::vector <uint16_t> bfInput;
+            ToBFloat16Input(inputData, bfInput, n, m);
+            RunPartsMultiThread(k, threadNum, kernels->bfloat16InputLinearPart,
+                                bfInput.data(), weightData, biasData, outputData, n, m, k);
+            return;
         }
+        RunPartsMultiThread(k, threadNum, kernels->bfloat16LinearPart,
+                            inputData, weightData, biasData, outputData, n, m, k);
     }
 
-    //a = [n, m], b = [k, m], c = aT(b') = [n, k]
-    void MultiplyInt4Group(uint8_t *a, uint8_t *b, int32_t *c, int n, int m, int k, int kstride,
-                         int *weightSums, float *weightMins, float *scales, float *bias, 
-                         float *iscales, float *izeros, float *inputSums, int group, int groupCnt) {
-        std::vector <float> values;
-        values.resize(group);
-
-        int block = 0;
-        for (; block < n; block++) {
-            uint8_t *weightWalk = b;
-            uint8_t *inputStart = a + block * m;
-
-            for (int i = 0; i < k; i++) {
-                std::fill(values.begin(), values.end(), 0.0f);
-                uint8_t *inputWalk = inputStart;
-                float sum = 0.0;
-
-                for (int g = 0; g < group; g++) {
-                    int st = g * groupCnt, end = std::min(m, (g + 1) * groupCnt);
-                    float &value = values[g];
-                    int j = st;
-#ifdef __ARM_FEATURE_DOTPROD
-                    uint8x8_t maskHigh = vdup_n_u8(0xF0);
-                    uint8x8_t maskLow = vdup_n_u8(0xF);
-                    uint32x2_t sum0 = {0, 0};
-
-                    for (; j + 15 < end; j += 16) {
-                        uint8x8_t ori = vld1_u8(weightWalk + (i * m + j) / 2);
-                        uint8x8x2_t in = vld2_u8(inputWalk + j);
-                        uint8x8_t va = vand_u8(ori, maskLow);
-                        uint8x8_t vb = vshr_n_u8(vand_u8(ori, maskHigh), 4);
-                        sum0 = vdot_u32(sum0, va, in.val[1]);
-                        sum0 = vdot_u32(sum0, vb, in.val[0]);
-                    }
-                    value += sum0[0] + sum0[1];
-#elif defined(__aarch64__)
-                    uint8x8_t maskHigh = vdup_n_u8(0xF0);
-                    uint8x8_t maskLow = vdup_n_u8(0xF);
-                    uint32x4_t sum0 = {0, 0, 0, 0};
-
-                    for (; j + 15 < end; j += 16) {
-                        uint8x8_t ori = vld1_u8(weightWalk + (i * m + j) / 2);
-                        uint8x8x2_t in = vld2_u8(inputWalk + j);
-                        uint8x8_t va = vand_u8(ori, maskLow);
-                        uint8x8_t vb = vshr_n_u8(vand_u8(ori, maskHigh), 4);
-                        sum0 = vpadalq_u16(sum0, vmull_u8(va, in.val[1]));
-                        sum0 = vpadalq_u16(sum0, vmull_u8(vb, in.val[0]));
-                    }
-                    value += sum0[0] + sum0[1] + sum0[2] + sum0[3];
-#elif defined(__AVX2__)
-                    value += DotU4U8(weightWalk + (i * m + st) / 2, inputWalk + st, end - st);
-                    j += (end - st);
-#endif
-                    for (; j + 1 < end; j += 2) {
-                        int id = (i * m + j) / 2;
-                        value += (weightWalk[id] >> 4) * inputWalk[j];
-                        value += (weightWalk[id] & 0xF) * inputWalk[j + 1];
-                    }
-                }
-
-                int g = 0;
-#ifdef __aarch64__
-                float32x4_t vSum = vdupq_n_f32(0.0f);
-                float32x4_t vGroupCnt = vdupq_n_f32(groupCnt);
-                for (; g + 3 < group; g += 4) {
-                    int iid = block * group + g;
-                    int gid = i * group + g;
-                    float32x4_t vValue = vld1q_f32(values.data() + g);
-                    float32x4_t vWeightSum = vcvtq_f32_s32(vld1q_s32(weightSums + gid));
-                    float32x4_t vWeightMin = vld1q_f32(weightMins + gid);
-                    float32x4_t vScale = vld1q_f32(scales + gid);
-                    float32x4_t vIzero = vld1q_f32(izeros + iid);
-                    float32x4_t vIscale = vld1q_f32(iscales + iid);
-                    float32x4_t vInputSum = vld1q_f32(inputSums + iid);
-                    float32x4_t vMiddle = vsubq_f32(vInputSum, vmulq_f32(vIzero, vGroupCnt));
-                    vValue = vsubq_f32(vValue, vmulq_f32(vWeightSum, vIzero));
-                    vSum = vaddq_f32(vSum, vmulq_f32(vScale, vmulq_f32(vIscale, vValue)));
-                    vSum = vaddq_f32(vSum, vmulq_f32(vWeightMin, vmulq_f32(vMiddle, vIscale)));
-                }
-                sum += vSum[0] + vSum[1] + vSum[2] + vSum[3];
-#endif
-                for (; g < group; g++) {
-                    int iid = block * group + g;
-                    int gid = i * group + g;
-                    int value = values[g];
-                    value -= weightSums[gid] * izeros[iid];
-                    sum += scales[gid] * iscales[iid] * value +
-                        weightMins[gid] * (inputSums[iid] - izeros[iid] * groupCnt) * iscales[iid];
-                }
-
-                if (group * groupCnt > m) {
-                    int iid = block * group + group - 1;
-                    int gid = i * group + group - 1;
-                    sum += weightMins[gid] * izeros[iid] * (group * groupCnt - m) * iscales[iid];
-                }
-
-                ((float*)c)[block * kstride + i] = sum + (bias == nullptr ? 0.0 : bias[i]);
-            }
+    // Linear的bias转成float, bias为空时返回nullptr; float32的bias直接使用, 其余类型转换到holder中
+    float *GetLinearBias(Data &bias, int k, std::vector <float> &holder) {
+        if (bias.dims.size() == 0) {
+            return nullptr;
+        }
+        AssertInFastLLM(bias.Count(0) == (uint64_t) k, "Linear error: bias's shape error.\n");
+        if (bias.dataType == DataType::FLOAT32) {
+            return (float *) bias.cpuData;
         }
+        holder.resize(k);
+        if (bias.dataType == DataType::BFLOAT16) {
+            BFloat16ToFloat32((uint16_t *) bias.cpuData, holder.data(), k);
+        } else if (bias.dataType == DataType::FLOAT16) {
+            Float16ToFloat32((uint16_t *) bias.cpuData, holder.data(), k);
+        } else {
+            ErrorInFastLLM("Linear error: bias's type should be float32, float16 or bfloat16.\n");
+        }
+        return holder.data();
     }
 
-    //a = [n, m], b = [k, m], c = aT(b') = [n, k]
-    void MultiplyInt4NoZero(uint8_t *a, uint8_t *b, int32_t *c, int n, int m, int k, int kstride,
-                      int *weightSums, float *weightMins, float *scales, float *bias, LowBitConfig *config,
-                      int *inputSums) {
-        int block = 0;
-        for (; block < n; block++) {
-            uint32_t inputSum = inputSums[block];
-            uint8_t *weightWalk = b;
-            uint8_t *inputStart = a + block * m;
-
-            for (int i = 0; i < k; i++) {
-                int value = 0;
-                uint8_t *inputWalk = inputStart;
-                int j = 0;
-#ifdef __ARM_FEATURE_DOTPROD
-                uint8x8_t maskHigh = vdup_n_u8(0xF0);
-                uint8x8_t maskLow = vdup_n_u8(0xF);
-                uint32x2_t sum0 = {0, 0};
-
-                for (; j + 15 < m; j += 16) {
-                    uint8x8_t ori = vld1_u8(weightWalk + (i * m + j) / 2);
-                    uint8x8x2_t in = vld2_u8(inputWalk + j);
-                    uint8x8_t va = vand_u8(ori, maskLow);
-                    uint8x8_t vb = vshr_n_u8(vand_u8(ori, maskHigh), 4);
-                    sum0 = vdot_u32(sum0, va, in.val[1]);
-                    sum0 = vdot_u32(sum0, vb, in.val[0]);
-                }
-                value += sum0[0] + sum0[1];
-#elif defined(__aarch64__)
-                uint8x8_t maskHigh = vdup_n_u8(0xF0);
-                uint8x8_t maskLow = vdup_n_u8(0xF);
-                uint32x4_t sum0 = {0, 0, 0, 0};
-
-                for (; j + 15 < m; j += 16) {
-                    uint8x8_t ori = vld1_u8(weightWalk + (i * m + j) / 2);
-                    uint8x8x2_t in = vld2_u8(inputWalk + j);
-                    uint8x8_t va = vand_u8(ori, maskLow);
-                    uint8x8_t vb = vshr_n_u8(vand_u8(ori, maskHigh), 4);
-                    sum0 = vpadalq_u16(sum0, vmull_u8(va, in.val[1]));
-                    sum0 = vpadalq_u16(sum0, vmull_u8(vb, in.val[0]));
-                }
-                value += sum0[0] + sum0[1] + sum0[2] + sum0[3];
-#elif defined(__AVX2__)
-                value += DotU4U8(weightWalk + i * m / 2, inputWalk, m);
-                j += m;
-#endif
-
-                for (; j + 1 < m; j += 2) {
-                    int id = (i * m + j) / 2;
-                    value += (weightWalk[id] >> 4) * inputWalk[j];
-                    value += (weightWalk[id] & 0xF) * inputWalk[j + 1];
-                }
-
-                value -= weightSums[i] * config[block].zeroPoint;
-                ((float*)c)[block * kstride + i] = scales[i] * config[block].scale * value +
-                        weightMins[i] * ((float)inputSum - (int)config[block].zeroPoint * m) * config[block].scale +
-                        (bias == nullptr ? 0.0 : bias[i]);
-            }
-        }
+    // CpuLinearTiles支持的weight类型
+    static bool IsLinearTilesWeight(const Data *weight) {
+        return weight->l2_num != -1 || weight->dataType == DataType::FLOAT32 || weight->dataType == DataType::FLOAT16 ||
+               weight->dataType == DataType::BFLOAT16 || weight->dataType == DataType::INT8 ||
+               weight->dataType == DataType::INT4 || weight->dataType == DataType::INT4_NOZERO ||
+               weight->dataType == DataType::INT4_GROUP;
     }
 
-    //a = [n, m], b = [k, m], c = aT(b') = [n, k]
-    void MultiplyMultiThread(uint8_t *a, uint8_t *b, int32_t *c, int n, int m, int k, int threadNum) {
-        int per = k / threadNum;
-        int cur = 0;
-        if (threadNum == 1) {
-            Multiply(a, b + cur * m, c + cur, n, m, k - cur, k);
-        } else {
-            auto pool = GetPool();
-            std::vector<std::future<void> > futures;
-            for (int i = 0; i < threadNum; i++) {
-                int end = cur + per + (cur + per * (threadNum - i) < k);
-                if (i == threadNum - 1) {
-                    end = k;
-                }
-                futures.push_back(pool->Submit(Multiply, a, b + cur * m, c + cur, n, m, end - cur, k));
-                cur = end;
-            }
-            for (int i = 0; i < futures.size(); i++) {
-                futures[i].get();
-            }
-        }
+    // 几个weight能否共用同一份准备好的input (CpuLinearTiles)
+    static bool IsSameLinearFormat(const Data *a, const Data *b) {
+        return a->dataType == b->dataType && (a->l2_num != -1) == (b->l2_num != -1) &&
+               (a->dataType != DataType::INT4_GROUP || (a->group == b->group && a->groupCnt == b->groupCnt));
     }
 
-    //a = [n, m], b = [k, m], c = aT(b') = [n, k]
-    void MultiplyInt4MultiThread(uint8_t *a, uint8_t *b, int32_t *c, int n, int m, int k,
-                                 int *weightSums, int *weightZeros, float *scales, float *bias, std::vector <LowBitConfig> &configs, int threadNum) {
-        std::vector <int> inputSums;
-        for (int i = 0; i < n; i++) {
-            int sum = 0;
-            for (int j = 0; j < m; j++) {
-                sum += a[i * m + j];
-            }
-            inputSums.push_back(sum);
+    // 按列分块计算的Linear(LinearEx, LinearSwiglu等)能否运行: input需要为float32, weights的类型需要支持且相同
+    // datas中没有的项不检查
+    bool CanRunLinearTiles(const DataDict &datas, const std::vector <std::string> &weightNames) {
+        auto input = datas.find("input");
+        if (input != datas.end() && input->second != nullptr && input->second->dataType != DataType::FLOAT32) {
+            return false;
         }
-        int per = k / threadNum;
-        int cur = 0;
-        if (threadNum == 1) {
-            MultiplyInt4(a, b + cur * m / 2, c + cur, n, m, k - cur, k,
-                         weightSums + cur, weightZeros + cur, scales + cur,
-                         (bias == nullptr ? (float*)nullptr : bias + cur), configs.data(), inputSums.data());
-        } else {
-            auto pool = GetPool();
-            std::vector<std::future<void> > futures;
-            for (int i = 0; i < threadNum; i++) {
-                int end = (i == threadNum - 1 ? k : cur + per + (cur + per * (threadNum - i) < k));
-                futures.push_back(pool->Submit(MultiplyInt4, a, b + cur * m / 2, c + cur, n, m, end - cur, k,
-                                               weightSums + cur, weightZeros + cur, scales + cur,
-                                               (bias == nullptr ? (float *) nullptr : bias + cur), configs.data(),
-                                               inputSums.data()));
-                cur = end;
+        const Data *first = nullptr;
+        for (auto &name : weightNames) {
+            auto it = datas.find(name);
+            if (it == datas.end() || it->second == nullptr) {
+                continue;
             }
-            for (int i = 0; i < futures.size(); i++) {
-                futures[i].get();
+            if (!IsLinearTilesWeight(it->second) || (first != nullptr && !IsSameLinearFormat(first, it->second))) {
+                return false;
             }
+            first = it->second;
         }
+        return true;
     }
 
-    //a = [n, m], b = [k, m], c = aT(b') = [n, k]
-    void MultiplyInt4NoZeroMultiThread(uint8_t *a, uint8_t *b, int32_t *c, int n, int m, int k,
-                                 int *weightSums, float *weightMins, float *scales, float *bias,
-                                 std::vector <LowBitConfig> &configs, int threadNum) {
-        std::vector <int> inputSums;
-        for (int i = 0; i < n; i++) {
-            int sum = 0;
-            for (int j = 0; j < m; j++) {
-                sum += a[i * m + j];
-            }
-            inputSums.push_back(sum);
-        }
-        int per = k / threadNum;
-        int cur = 0;
-        if (threadNum == 1) {
-            MultiplyInt4NoZero(a, b + cur * m / 2, c + cur, n, m, k - cur, k,
-                         weightSums + cur, weightMins + cur, scales + cur,
-                         (bias == nullptr ? (float*)nullptr : bias + cur), configs.data(), inputSums.data());
-        } else {
-            auto pool = GetPool();
-            std::vector<std::future<void> > futures;
-            for (int i = 0; i < threadNum; i++) {
-                int end = (i == threadNum - 1 ? k : cur + per + (cur + per * (threadNum - i) < k));
-                futures.push_back(pool->Submit(MultiplyInt4NoZero, a, b + cur * m / 2, c + cur, n, m, end - cur, k,
-                                               weightSums + cur, weightMins + cur, scales + cur,
-                                               (bias == nullptr ? (float *) nullptr : bias + cur), configs.data(),
-                                               inputSums.data()));
-                cur = end;
-            }
-            for (int i = 0; i < futures.size(); i++) {
-                futures[i].get();
+    bool CpuLinearOp::CanRun(const std::string &opType, const fastllm::DataDict &datas,
+                          const fastllm::FloatDict &floatParams, const fastllm::IntDict &intParams) {
+        if (intParams.find("exType") != intParams.end()) {
+            LinearExType exType = (LinearExType)intParams.find("exType")->second;
+            if (exType == LinearExType::ExTypeNone) {
+                return true;
             }
+            return (exType == LinearExType::ExSilu || exType == LinearExType::ExGelu || exType == LinearExType::ExSwiglu) &&
+                   CanRunLinearTiles(datas, {"weight"});
         }
+        return true;
     }
 
-    //a = [n, m], b = [k, m], c = aT(b') = [n, k]
-    void MultiplyInt4GroupMultiThread(uint8_t *a, uint8_t *b, int32_t *c, int n, int m, int k,
-                                 int *weightSums, float *weightMins, float *scales, float *bias,
-                                 std::vector <LowBitConfig> &configs, int threadNum, int group, int groupCnt) {
-        std::vector <float> inputSums;
-        for (int i = 0; i < n; i++) {
-            for (int g = 0; g < group; g++) {
-                int sum = 0;
-                for (int j = g * groupCnt; j < (g + 1) * groupCnt && j < m; j++) {
-                    sum += a[i * m + j];
-                }
-                inputSums.push_back(sum);
-            }
+    // 把一行float按[min, max]量化成uint8, Linear的INT8 / INT4 / INT4_NOZERO权重都使用这种input量化方式
+    void QuantizeRowUInt8(float *input, uint8_t *output, int m, LowBitConfig &config) {
+        float minValue = 1e9, maxValue = -1e9;
+        int j = 0;
+#ifdef __aarch64__
+        float32x4_t mins = vdupq_n_f32(1e100);
+        float32x4_t maxs = vdupq_n_f32(-1e100);
+        for (; j + 3 < m; j += 4) {
+            float32x4_t v = vld1q_f32(input + j);
+            mins = vminq_f32(mins, v);
+            maxs = vmaxq_f32(maxs, v);
         }
-        std::vector <float> iscales, izeros;
-        for (int i = 0; i < configs.size(); i++) {
-            iscales.push_back(configs[i].scale);
-            izeros.push_back(configs[i].zeroPoint);
+        for (int l = 0; l < 4; l++) {
+            minValue = std::min(minValue, mins[l]);
+            maxValue = std::max(maxValue, maxs[l]);
         }
+#endif
+        for (; j < m; j++) {
+            minValue = std::min(minValue, input[j]);
+            maxValue = std::max(maxValue, input[j]);
+        }
+        config = LowBitConfig(minValue, maxValue, 8, 0);
 
-        int per = k / threadNum;
-        int cur = 0;
-        if (threadNum == 1) {
-            MultiplyInt4Group(a, b, c, n, m, k, k,
-                         weightSums, weightMins, scales,
-                         (bias == nullptr ? (float*)nullptr : bias), iscales.data(), izeros.data(), inputSums.data(),
-                         group, groupCnt);
-        } else {
-            auto pool = GetPool();
-            std::vector<std::future<void> > futures;
-            for (int i = 0; i < threadNum; i++) {
-                int end = (i == threadNum - 1 ? k : cur + per + (cur + per * (threadNum - i) < k));
-                futures.push_back(pool->Submit(MultiplyInt4Group, a, b + cur * m / 2, c + cur, n, m, end - cur, k,
-                                               weightSums + cur * group, weightMins + cur * group, scales + cur * group,
-                                               (bias == nullptr ? (float *) nullptr : bias + cur), iscales.data(), izeros.data(),
-                                               inputSums.data(), group, groupCnt));
-                cur = end;
-            }
-            for (int i = 0; i < futures.size(); i++) {
-                futures[i].get();
-            }
+        float scale = config.scale;
+        float zeroPoint = config.zeroPoint;
+        j = 0;
+#ifdef __aarch64__
+        float32x4_t scales = vdupq_n_f32(scale);
+        float32x4_t zeros = vdupq_n_f32(zeroPoint + 0.5);
+        int32x4_t maxds = vcombine_s32(vcreate_s32(0x000000ff000000ff), vcreate_s32(0x000000ff000000ff));
+        int32x4_t minds = vcombine_s32(vcreate_s32(0x0000000000000000), vcreate_s32(0x0000000000000000));
+        for (; j + 7 < m; j += 8) {
+            float32x4_t fin1 = vld1q_f32(input + j);
+            float32x4_t fin2 = vld1q_f32(input + j + 4);
+            fin1 = vaddq_f32(vdivq_f32(fin1, scales), zeros);
+            fin2 = vaddq_f32(vdivq_f32(fin2, scales), zeros);
+            int32x4_t out1 = vcvtq_s32_f32(fin1);
+            int32x4_t out2 = vcvtq_s32_f32(fin2);
+            out1 = vmaxq_s32(out1, minds);
+            out1 = vminq_s32(out1, maxds);
+            out2 = vmaxq_s32(out2, minds);
+            out2 = vminq_s32(out2, maxds);
+            uint16x8_t out3 = vpaddq_u16(vreinterpretq_u16_s32(out1), vreinterpretq_u16_s32(out2));
+            uint8x8_t out = vmovn_u16(out3);
+            vst1_u8(output + j, out);
+        }
+#endif
+        for (; j < m; j++) {
+            output[j] = (uint8_t) (std::min(255., (double) std::max(input[j] / scale + zeroPoint + 0.5, 0.0)));
         }
     }
 
-    bool CpuLinearOp::CanRun(const std::string &opType, const fastllm::DataDict &datas,
-                          const fastllm::FloatDict &floatParams, const fastllm::IntDict &intParams) {
-        if (intParams.find("exType") != intParams.end()) {
-            return false;
+    // 按行量化Linear的input并转换成layout排布, 处理[st, end)行
+    static void QuantizeLinearInputPart(float *inputData, uint8_t *uinput, LowBitConfig *configs, int m, int layout,
+                                        int st, int end) {
+        for (int i = st; i < end; i++) {
+            QuantizeRowUInt8(inputData + (size_t) i * m, uinput + (size_t) i * m, m, configs[i]);
+            ConvertLinearInputRow(uinput + (size_t) i * m, m, layout);
         }
-        return true;
     }
 
-    void CpuLinearOp::Run(const std::string &opType, const fastllm::DataDict &datas,
-                          const fastllm::FloatDict &floatParams, const fastllm::IntDict &intParams) {
-//auto st = std::chrono::system_clock::now();
-        Data &input = *(datas.find("input")->second);
-        Data &output = *(datas.find("output")->second);
-        // Data &weight = *(datas.find("weight")->second);
-        Data *weight_ptr = datas.find("weight")->second;
-        std::shared_ptr<Data> weight_sp;
-        Data &bias = *(datas.find("bias")->second);
+    static void ConvertLinearInputPart(uint8_t *uinput, int m, int layout, int st, int end) {
+        for (int i = st; i < end; i++) {
+            ConvertLinearInputRow(uinput + (size_t) i * m, m, layout);
+        }
+    }
 
-        if (weight_ptr->l2_num != -1) {    
-            // 构造新的权重
-            weight_sp = std::make_shared<Data>(DataType::FLOAT32, weight_ptr->dims);
-            weight_sp->Allocate();
-            float* data_ptr = (float*)weight_sp->cpuData;
-
-            int threadNum = GetThreads();
-            int per = weight_ptr->size / threadNum;
-            auto pool = GetPool();
-            std::vector<std::future<void> > futures;
-            if (weight_ptr->dataType == DataType::INT8) {
-                uint8_t *index_ptr = (uint8_t *) weight_ptr->cpuData;
-                for (int i = 0; i < threadNum; i++) {
-                    int st = i * per;
-                    int end = (i == threadNum - 1 ? weight_ptr->size : st + per);
-                    futures.push_back(pool->Submit(findWeight<uint8_t>, data_ptr, index_ptr, weight_ptr->index2data, st, end));
-                }
-                // for (int i = 0; i < weight_ptr->size; i++) {
-                //     data_ptr[i] = weight_ptr->index2data[index_ptr[i]];
-                // }
-            } else {
-                uint16_t *index_ptr = (uint16_t *) weight_ptr->cpuData;
-                for (int i = 0; i < threadNum; i++) {
-                    int st = i * per;
-                    int end = (i == threadNum - 1 ? weight_ptr->size : st + per);
-                    futures.push_back(pool->Submit(findWeight<uint16_t>, data_ptr, index_ptr, weight_ptr->index2data, st, end));
-                }
-                // for (int i = 0; i < weight_ptr->size; i++) {
-                //     data_ptr[i] = weight_ptr->index2data[index_ptr[i]];
-                // }
-            }
-            for (int i = 0; i < futures.size(); i++) {
-                futures[i].get();
+    // 每行量化值的和(LinearInputInt8Signed排布时为转换前的值)
+    static void LinearInputSumsPart(uint8_t *uinput, int *inputSums, int m, int layout, int st, int end) {
+        uint8_t mask = (layout == LinearInputInt8Signed ? 128 : 0);
+        for (int i = st; i < end; i++) {
+            uint8_t *row = uinput + (size_t) i * m;
+            int sum = 0;
+            for (int j = 0; j < m; j++) {
+                sum += (row[j] ^ mask);
             }
-            weight_ptr = weight_sp.get();
+            inputSums[i] = sum;
         }
-        Data &weight = *weight_ptr;
+    }
 
-        output.Allocate(0.0f);
-        int n = input.Count(0) / input.dims.back();
-        int m = input.dims.back();
-        int k = output.dims.back();
+    // 按列分块计算的Linear: input(转换 / 量化成kernel需要的格式)只准备一次, 之后各个线程可以计算任意的列区间,
+    // 这样Linear之后的激活函数, RoPE等可以在计算完一块之后马上处理, 不需要再把整个output读写一遍
+    // 同一份input可以给多个相同类型的weight使用(如gate和up, q, k和v)
+    struct CpuLinearTiles {
+        const CpuLinearKernels *kernels;
+        int n, m;
+        float *inputData;
+        std::vector <uint16_t> halfInput; // ARM fp16 / AVX512_BF16计算时转换好的input
 
-        if (input.dataType == DataType::FLOAT32 && output.dataType == DataType::FLOAT32) {
-            if (weight.dataType == DataType::FLOAT32) {
-                float *inputData = (float *) input.cpuData;
-                float *weightData = (float *) weight.cpuData;
-                float *outputData = (float *) output.cpuData;
-                float *biasData = bias.dims.size() > 0 ? (float *) bias.cpuData : nullptr;
+        // INT8 / INT4 / INT4_NOZERO / INT4_GROUP: 量化后的input, 每行(组)的量化参数和元素和
+        // 可以直接使用quantizedInput时uinputData, configs指向它的数据, 否则指向uinput, inputConfigs
+        uint8_t *uinputData = nullptr;
+        LowBitConfig *configs = nullptr;
+        std::vector <uint8_t> uinput;
+        std::vector <LowBitConfig> inputConfigs;
+        std::vector <int> inputSums;
+        std::vector <float> groupSums, iscales, izeros;
 
-                int threadNum = GetThreads();
-                int per = k / threadNum;
-                int cur = 0;
-                auto pool = GetPool();
-                std::vector<std::future<void> > futures;
-                for (int i = 0; i < threadNum - 1; i++) {
-                    int end = cur + per + (cur + per * (threadNum - i) < k);
-                    futures.push_back(pool->Submit(FloatLinearPart, inputData, weightData, biasData, outputData,
-                                                   n, m, k, cur, end));
-                    cur = end;
-                }
+        bool useAMX = false; // INT8的weight, 行数较多时用AMX计算, 此时列区间的起点需要是16的倍数
+        int mPad = 0;
+        int8_t *amxInputData = nullptr;
+        std::vector <int8_t> amxInput; // input的形状不是[16, 64]的整数倍时, 补0后的input
 
-                FloatLinearPart(inputData, weightData, biasData, outputData, n, m, k, cur, k);
-                for (int i = 0; i < futures.size(); i++) {
-                    futures[i].get();
-                }
-            } else if (weight.dataType == DataType::FLOAT16) {
-                float *inputData = (float *) input.cpuData;
-                uint16_t *weightData = (uint16_t *) weight.cpuData;
-                float *outputData = (float *) output.cpuData;
-                float *biasData = bias.dims.size() > 0 ? (float *) bias.cpuData : nullptr;
-#ifdef __ARM_FEATURE_FP16_VECTOR_ARITHMETIC
-                uint16_t *temp = new uint16_t[n * m];
-                for (int i = 0; i < n * m; i++) {
-                    temp[i] = float_to_half(inputData[i]);
-                }
-                inputData = (float*)temp;
-#endif
-                int threadNum = GetThreads();
-                int per = k / threadNum;
-                int cur = 0;
-                auto pool = GetPool();
-                std::vector<std::future<void> > futures;
-                for (int i = 0; i < threadNum - 1; i++) {
-                    int end = cur + per + (cur + per * (threadNum - i) < k);
-                    futures.push_back(pool->Submit(Float16LinearPart, inputData, weightData, biasData, outputData,
-                                                   n, m, k, cur, end));
-                    cur = end;
-                }
+        // segments: weight的行分成几段分别划分给各个线程(LinearEx的gate和up合并在一起时为2)
+        CpuLinearTiles(const DataDict &datas, Data &input, const std::vector <Data*> &weights, int segments = 1);
 
-                Float16LinearPart(inputData, weightData, biasData, outputData, n, m, k, cur, k);
-                for (int i = 0; i < futures.size(); i++) {
-                    futures[i].get();
-                }
-#ifdef __ARM_FEATURE_FP16_VECTOR_ARITHMETIC
-                delete[] temp;
-#endif
-            } else if (weight.dataType == DataType::INT8) {
-                float *inputData = (float *) input.cpuData;
-                uint8_t *weightData = (uint8_t *) weight.cpuData;
-                float *outputData = (float *) output.cpuData;
-                float *biasData = bias.dims.size() > 0 ? (float *) bias.cpuData : nullptr;
-                weight.CalcWeightSum();
+        // 准备按行量化(排布为layout)的input和每行的和
+        void QuantizeInput(const DataDict &datas, int layout);
 
-                std::vector<LowBitConfig> inputConfigs;
-                for (int i = 0; i < n; i++) {
-                    float minValue = 1e9, maxValue = -1e9;
-                    for (int j = 0; j < m; j++) {
-                        minValue = std::min(minValue, inputData[i * m + j]);
-                        maxValue = std::max(maxValue, inputData[i * m + j]);
-                    }
-                    inputConfigs.push_back(LowBitConfig(minValue, maxValue, 8, 0));
-                }
-                std::vector<uint8_t> uinput;
-                uinput.resize(n * m);
-                for (int i = 0; i < n * m; i++) {
-#ifdef __AVX2__
-                    uinput[i] = inputConfigs[i / m].quantization(inputData[i]);
-                    uinput[i] = (uinput[i] + !uinput[i]) ^ 128;
-#else
-                    uinput[i] = inputConfigs[i / m].quantization(inputData[i]);
-#endif
-                }
+        // 分给各个线程的列区间需要按这个数对齐
+        int Align() const {
+            return useAMX ? 16 : 1;
+        }
 
-                MultiplyMultiThread(uinput.data(), weightData, (int32_t *) outputData, n, m, k, GetThreads());
-                for (int i = 0; i < n; i++) {
-                    uint32_t inputSum = 0;
-                    for (int j = 0; j < m; j++) {
-#ifdef __AVX2__
-                        inputSum += uinput[i * m + j] ^ 128;
-#else
-                        inputSum += uinput[i * m + j];
-#endif
-                    }
+        // 计算output的[st, end)列, 写到out中(out指向第st列, 行间距为stride); biasData对应weight的第0列
+        void Compute(Data &weight, float *biasData, float *out, int stride, int st, int end);
+    };
 
-                    for (int j = 0; j < k; j++) {
-                        int value = ((int32_t *) outputData)[i * k + j];
-#ifdef __AVX2__
-                        value += (128 * weight.weightSum[j]);
-                        value += (128 * inputSum);
-                        value -= m * 128 * 128;
-#endif
-                        value -= weight.weightSum[j] * inputConfigs[i].zeroPoint;
-                        value -= inputSum * weight.perChannelsConfigs[j].zeroPoint;
-                        value += (int) inputConfigs[i].zeroPoint * weight.perChannelsConfigs[j].zeroPoint * m;
-                        outputData[i * k + j] = weight.perChannelsConfigs[j].scale * inputConfigs[i].scale * value +
-                                                (biasData == nullptr ? 0.0 : biasData[j]);
-                    }
-                }
+    static void CalcAMXWeightPart(Data *weight, int st, int end) {
+        weight->CalcAMXWeight(st, end);
+    }
 
-                /*
-                这部分是float输入，float输出
-                int threadNum = threads;
-                int per = k / threadNum;
-                int cur = 0;
-                std::vector<std::thread *> threads;
-                for (int i = 0; i < threadNum - 1; i++) {
-                    int end = cur + per + (cur + per * (threadNum - i) < k);
-                    threads.push_back(new std::thread(&Int8LinearPart, inputData, weightData, biasData, outputData,
-                                                      weight.perChannelsConfigs.data(), n, m, k, cur, end));
-                    cur = end;
-                }
-                Int8LinearPart(inputData, weightData, biasData, outputData, weight.perChannelsConfigs.data(), n, m, k, cur, k);
-                for (int i = 0; i < threadNum - 1; i++) {
-                    threads[i]->join();
-                    delete threads[i];
-                }
-                */
-            } else if (weight.dataType == DataType::INT4 || weight.dataType == DataType::INT4_NOZERO) {
-                float *inputData = (float *) input.cpuData;
-                uint8_t *weightData = (uint8_t *) weight.cpuData;
-                float *outputData = (float *) output.cpuData;
-                float *biasData = bias.dims.size() > 0 ? (float *) bias.cpuData : nullptr;
-                weight.CalcWeightSum();
+    CpuLinearTiles::CpuLinearTiles(const DataDict &datas, Data &input, const std::vector <Data*> &weights, int segments) {
+        AssertInFastLLM(input.dataType == DataType::FLOAT32, "Linear error: input's type should be float32.\n");
+        kernels = GetCpuLinearKernels();
+        n = input.Count(0) / input.dims.back();
+        m = input.dims.back();
+        inputData = (float *) input.cpuData;
+        Data &weight = *weights[0];
+        for (Data *w : weights) {
+            AssertInFastLLM(IsLinearTilesWeight(w) && IsSameLinearFormat(&weight, w),
+                            "Linear error: unsupport weight's dataType.\n");
+            w->PlaceOnNumaNodes(segments);
+        }
 
-                std::vector<LowBitConfig> inputConfigs;
-                for (int i = 0; i < n; i++) {
-                    float minValue = 1e9, maxValue = -1e9;
-                    int j = 0;
-#ifdef __aarch64__
-                    float32x4_t mins = vdupq_n_f32(1e100);
-                    float32x4_t maxs = vdupq_n_f32(-1e100);
-                    for (; j + 3 < m; j += 4) {
-                        float32x4_t v = vld1q_f32(inputData + i * m + j);
-                        mins = vminq_f32(mins, v);
-                        maxs = vmaxq_f32(maxs, v);
-                    }
-                    for (int l = 0; l < 4; l++) {
-                        minValue = std::min(minValue, mins[l]);
-                        maxValue = std::max(maxValue, maxs[l]);
-                    }
+        if (weight.l2_num != -1 || weight.dataType == DataType::FLOAT32) {
+            return;
+        } else if (weight.dataType == DataType::FLOAT16) {
+#ifdef __ARM_FEATURE_FP16_VECTOR_ARITHMETIC
+            halfInput.resize((size_t) n * m);
+            for (size_t i = 0; i < halfInput.size(); i++) {
+                halfInput[i] = float_to_half(inputData[i]);
+            }
 #endif
-                    for (; j < m; j++) {
-                        minValue = std::min(minValue, inputData[i * m + j]);
-                        maxValue = std::max(maxValue, inputData[i * m + j]);
+        } else if (weight.dataType == DataType::BFLOAT16) {
+            if (UseBFloat16Input(kernels, n)) {
+                ToBFloat16Input(inputData, halfInput, n, m);
+            }
+        } else if (weight.dataType == DataType::INT8) {
+            QuantizeInput(datas, GetLinearInputLayout(kernels, weight.dataType));
+            // 低内存模式下不使用AMX, 避免再存一份重排的权重
+            useAMX = (n >= amxMinRows && kernels->multiplyAMX != nullptr && GetCpuInstructionLevel() >= ISA_AMX &&
+                      !GetLowMemMode());
+            if (useAMX) {
+                mPad = (m + 63) / 64 * 64;
+                if (n % 16 == 0 && m == mPad) {
+                    amxInputData = (int8_t *) uinputData;
+                } else {
+                    int nPad = (n + 15) / 16 * 16;
+                    amxInput.resize((size_t) nPad * mPad, 0);
+                    for (int i = 0; i < n; i++) {
+                        memcpy(amxInput.data() + (size_t) i * mPad, uinputData + (size_t) i * m, m);
                     }
-                    inputConfigs.push_back(LowBitConfig(minValue, maxValue, 8, 0));
+                    amxInputData = amxInput.data();
                 }
-                std::vector<uint8_t> uinput;
-                uinput.resize(n * m);
-
-                for (int i = 0; i < n; i++) {
-                    float scale = inputConfigs[i].scale;
-                    float zeroPoint = inputConfigs[i].zeroPoint;
-                    float *cur = inputData + i * m;
-                    uint8_t *u = uinput.data() + i * m;
-                    int j = 0;
-#ifdef __aarch64__
-                    float32x4_t scales = vdupq_n_f32(scale);
-                    float32x4_t zeros = vdupq_n_f32(zeroPoint + 0.5);
-                    int32x4_t maxds = vcombine_s32(vcreate_s32(0x000000ff000000ff), vcreate_s32(0x000000ff000000ff));
-                    int32x4_t minds = vcombine_s32(vcreate_s32(0x0000000000000000), vcreate_s32(0x0000000000000000));
-                    for (; j + 7 < m; j += 8) {
-                        float32x4_t fin1 = vld1q_f32(cur + j);
-                        float32x4_t fin2 = vld1q_f32(cur + j + 4);
-                        fin1 = vaddq_f32(vdivq_f32(fin1, scales), zeros);
-                        fin2 = vaddq_f32(vdivq_f32(fin2, scales), zeros);
-                        int32x4_t out1 = vcvtq_s32_f32(fin1);
-                        int32x4_t out2 = vcvtq_s32_f32(fin2);
-                        out1 = vmaxq_s32(out1, minds);
-                        out1 = vminq_s32(out1, maxds);
-                        out2 = vmaxq_s32(out2, minds);
-                        out2 = vminq_s32(out2, maxds);
-                        uint16x8_t out3 = vpaddq_u16(vreinterpretq_u16_s32(out1), vreinterpretq_u16_s32(out2));
-                        uint8x8_t out = vmovn_u16(out3);
-                        vst1_u8(u + j, out);
-                    }
-#endif
-                    for (; j < m; j++) {
-                        u[j] = (uint8_t) (std::min(255., (double) std::max(cur[j] / scale + zeroPoint + 0.5, 0.0)));
+            }
+            for (Data *w : weights) {
+                w->CalcWeightSum();
+                if (useAMX && w->amxWeight.size() == 0) {
+                    // 加载时已经重排好的权重不会走到这里, 只有运行时构造的权重(如AddWeight)第一次使用时多线程重排
+                    int k = w->dims[0];
+                    w->amxWeight.resize((size_t) (k + 15) / 16 * mPad * 16, 0);
+                    RunPartsMultiThread(k, GetThreads(), CalcAMXWeightPart, w);
+                    // 新生成的amxWeight也要放到对应的node上
+                    w->numaPlacedThreads = 0;
+                    w->PlaceOnNumaNodes(segments);
+                }
+            }
+        } else if (weight.dataType == DataType::INT4 || weight.dataType == DataType::INT4_NOZERO) {
+            QuantizeInput(datas, GetLinearInputLayout(kernels, weight.dataType));
+            for (Data *w : weights) {
+                w->CalcWeightSum();
+            }
+        } else if (weight.dataType == DataType::INT4_GROUP) {
+            // 按组量化input, 和weight的分组相同
+            int group = weight.group, groupCnt = weight.groupCnt;
+            for (int i = 0; i < n; i++) {
+                for (int g = 0; g < group; g++) {
+                    int st = g * groupCnt;
+                    int end = std::min(m, (g + 1) * groupCnt);
+                    float minValue = 1e9, maxValue = -1e9;
+                    for (int j = st; j < end; j++) {
+                        minValue = std::min(minValue, inputData[i * m + j]);
+                        maxValue = std::max(maxValue, inputData[i * m + j]);
                     }
+                    inputConfigs.push_back(LowBitConfig(minValue, maxValue, 8, 0));
                 }
-#ifdef __AVX__
-                uint8_t *temp = new uint8_t[32];
-                for (int i = 0; i < n; i++) {
-                    for (int j = 0; j + 31 < m; j += 32) {
-                        memcpy(temp, uinput.data() + i * m + j, 32);
-                        for (int k = 0; k < 16; k++) {
-                            uinput[i * m + j + k] = temp[k * 2 + 1];
-                            uinput[i * m + j + k + 16] = temp[k * 2];
-                        }
-                    }
+            }
+            uinput.resize((size_t) n * m);
+            for (int i = 0; i < n; i++) {
+                for (int j = 0; j < m; j++) {
+                    uinput[i * m + j] = inputConfigs[i * group + j / groupCnt].quantization(inputData[i * m + j]);
                 }
-                delete[] temp;
-#endif
-                if (weight.dataType == DataType::INT4) {
-                    MultiplyInt4MultiThread(uinput.data(), weightData, (int32_t *) outputData, n, m, k,
-                                            weight.weightSum.data(), weight.zeros.data(), weight.scales.data(),
-                                            biasData,
-                                            inputConfigs, GetThreads());
-                } else {
-                    MultiplyInt4NoZeroMultiThread(uinput.data(), weightData, (int32_t *) outputData, n, m, k,
-                                                  weight.weightSum.data(), weight.mins.data(), weight.scales.data(),
-                                                  biasData,
-                                                  inputConfigs, GetThreads());
+            }
+            for (int i = 0; i < n; i++) {
+                for (int g = 0; g < group; g++) {
+                    int sum = 0;
+                    for (int j = g * groupCnt; j < (g + 1) * groupCnt && j < m; j++) {
+                        sum += uinput[i * m + j];
+                    }
+                    groupSums.push_back(sum);
                 }
+            }
+            for (auto &config : inputConfigs) {
+                iscales.push_back(config.scale);
+                izeros.push_back(config.zeroPoint);
+            }
+            if (kernels->int4ReorderInput) {
+                RunPartsMultiThread(n, GetThreads(), ConvertLinearInputPart, uinput.data(), m,
+                                    (int) LinearInputInt4Reordered);
+            }
+            uinputData = uinput.data();
+            for (Data *w : weights) {
+                w->CalcWeightSum();
+            }
+        }
+    }
 
-/*
-            //这部分是float输入，float输出
-            int threadNum = GetThreads();
-            int per = k / threadNum;
-            int cur = 0;
-            std::vector<std::thread *> threads;
-            for (int i = 0; i < threadNum - 1; i++) {
-                int end = cur + per + (cur + per * (threadNum - i) < k);
-                threads.push_back(new std::thread(&Int4LinearPart, inputData, weightData, biasData, outputData,
-                                                  weight.perChannelsConfigs.data(), n, m, k, cur, end));
-                cur = end;
-            }
-            Int4LinearPart(inputData, weightData, biasData, outputData, weight.perChannelsConfigs.data(), n, m, k, cur, k);
-            for (int i = 0; i < threadNum - 1; i++) {
-                threads[i]->join();
-                delete threads[i];
-            }
-*/
-            } else if (weight.dataType == DataType::INT4_GROUP) {
-                float *inputData = (float *) input.cpuData;
-                uint8_t *weightData = (uint8_t *) weight.cpuData;
-                float *outputData = (float *) output.cpuData;
-                float *biasData = bias.dims.size() > 0 ? (float *) bias.cpuData : nullptr;
-                int group = weight.group, groupCnt = weight.groupCnt;
-                weight.CalcWeightSum();
+    void CpuLinearTiles::QuantizeInput(const DataDict &datas, int layout) {
+        auto it = datas.find("quantizedInput");
+        Data *quantized = (it != datas.end() ? it->second : nullptr);
+        if (quantized != nullptr && quantized->dataType == DataType::INT8 && quantized->cpuData != nullptr &&
+            quantized->perChannelsConfigs.size() == n && quantized->Count(0) == (uint64_t) n * m &&
+            (quantized->linearInputLayout == layout || quantized->linearInputLayout == LinearInputRaw)) {
+            // 直接使用AddRMSNorm等融合算子输出的quantizedInput, 排布不同时原地转换一次(之后的Linear不需要再转换)
+            if (quantized->linearInputLayout != layout) {
+                RunPartsMultiThread(n, GetThreads(), ConvertLinearInputPart, quantized->cpuData, m, layout);
+                quantized->linearInputLayout = layout;
+            }
+            uinputData = quantized->cpuData;
+            configs = quantized->perChannelsConfigs.data();
+        } else {
+            uinput.resize((size_t) n * m);
+            inputConfigs.resize(n);
+            RunPartsMultiThread(n, GetThreads(), QuantizeLinearInputPart, inputData, uinput.data(),
+                                inputConfigs.data(), m, layout);
+            uinputData = uinput.data();
+            configs = inputConfigs.data();
+        }
+        inputSums.resize(n);
+        RunPartsMultiThread(n, GetThreads(), LinearInputSumsPart, uinputData, inputSums.data(), m, layout);
+    }
 
-                std::vector<LowBitConfig> inputConfigs;
-                for (int i = 0; i < n; i++) {
-                    for (int g = 0; g < group; g++) {
-                        int st = g * groupCnt;
-                        int end = std::min(m, (g + 1) * groupCnt);
-                        float minValue = 1e9, maxValue = -1e9;
-                        for (int j = st; j < end; j++) {
-                            minValue = std::min(minValue, inputData[i * m + j]);
-                            maxValue = std::max(maxValue, inputData[i * m + j]);
-                        }
-                        inputConfigs.push_back(LowBitConfig(minValue, maxValue, 8, 0));
-                    }
-                }
-                std::vector<uint8_t> uinput;
-                uinput.resize(n * m);
-                for (int i = 0; i < n; i++) {
-                    for (int j = 0; j < m; j++) {
-                        uinput[i * m + j] = inputConfigs[i * group + j / groupCnt].quantization(inputData[i * m + j]);    
+    void CpuLinearTiles::Compute(Data &weight, float *biasData, float *out, int stride, int st, int end) {
+        int cols = end - st;
+        if (cols <= 0) {
+            return;
+        }
+        float *bias = (biasData == nullptr ? nullptr : biasData + st);
+        if (weight.l2_num != -1) {
+            // L2权重: 直接用码本下标计算, 不展开成float权重
+            float *codebook = weight.index2data.data();
+            int codebookSize = (int) weight.index2data.size();
+            if (weight.dataType == DataType::INT8) {
+                kernels->codebookLinearPartU8(inputData, weight.cpuData + (size_t) st * m, codebook, codebookSize,
+                                              bias, out, n, m, stride, 0, cols);
+            } else {
+                kernels->codebookLinearPartU16(inputData, (uint16_t *) weight.cpuData + (size_t) st * m, codebook, codebookSize,
+                                               bias, out, n, m, stride, 0, cols);
+            }
+        } else if (weight.dataType == DataType::FLOAT32) {
+            kernels->floatLinearPart(inputData, (float *) weight.cpuData + (size_t) st * m, bias, out, n, m, stride, 0, cols);
+        } else if (weight.dataType == DataType::FLOAT16) {
+            float *input = halfInput.size() > 0 ? (float *) halfInput.data() : inputData;
+            kernels->float16LinearPart(input, (uint16_t *) weight.cpuData + (size_t) st * m, bias, out, n, m, stride, 0, cols);
+        } else if (weight.dataType == DataType::BFLOAT16) {
+            uint16_t *weightData = (uint16_t *) weight.cpuData + (size_t) st * m;
+            if (halfInput.size() > 0) {
+                kernels->bfloat16InputLinearPart(halfInput.data(), weightData, bias, out, n, m, stride, 0, cols);
+            } else {
+                kernels->bfloat16LinearPart(inputData, weightData, bias, out, n, m, stride, 0, cols);
+            }
+        } else if (weight.dataType == DataType::INT8) {
+            int32_t *c = (int32_t *) out;
+            if (useAMX && st % 16 == 0) {
+                kernels->multiplyAMX(amxInputData, weight.amxWeight.data(), c, n, mPad, st, end, stride);
+            } else {
+                kernels->multiply(uinputData, weight.cpuData + (size_t) st * m, c, n, m, cols, stride);
+            }
+            for (int i = 0; i < n; i++) {
+                int inputSum = inputSums[i];
+                for (int j = 0; j < cols; j++) {
+                    int value = c[(size_t) i * stride + j];
+                    int weightSum = weight.weightSum[st + j];
+                    LowBitConfig &config = weight.perChannelsConfigs[st + j];
+                    if (kernels->int8SignedInput) {
+                        value += (128 * weightSum);
+                        value += (128 * inputSum);
+                        value -= m * 128 * 128;
                     }
-                }
+                    value -= weightSum * configs[i].zeroPoint;
+                    value -= inputSum * config.zeroPoint;
+                    value += (int) configs[i].zeroPoint * config.zeroPoint * m;
+                    out[(size_t) i * stride + j] = config.scale * configs[i].scale * value +
+                                                   (bias == nullptr ? 0.0 : bias[j]);
+                }
+            }
+        } else if (weight.dataType == DataType::INT4) {
+            kernels->multiplyInt4(uinputData, weight.cpuData + (size_t) st * m / 2, (int32_t *) out, n, m, cols, stride,
+                                  weight.weightSum.data() + st, weight.zeros.data() + st, weight.scales.data() + st,
+                                  bias, configs, inputSums.data());
+        } else if (weight.dataType == DataType::INT4_NOZERO) {
+            kernels->multiplyInt4NoZero(uinputData, weight.cpuData + (size_t) st * m / 2, (int32_t *) out, n, m, cols, stride,
+                                        weight.weightSum.data() + st, weight.mins.data() + st, weight.scales.data() + st,
+                                        bias, configs, inputSums.data());
+        } else if (weight.dataType == DataType::INT4_GROUP) {
+            int group = weight.group, groupCnt = weight.groupCnt;
+            kernels->multiplyInt4Group(uinputData, weight.cpuData + (size_t) st * m / 2, (int32_t *) out, n, m, cols, stride,
+                                       weight.weightSum.data() + (size_t) st * group, weight.mins.data() + (size_t) st * group,
+                                       weight.scales.data() + (size_t) st * group, bias,
+                                       iscales.data(), izeros.data(), groupSums.data(), group, groupCnt);
+        }
+    }
+
+    // 把[0, k)列按align对齐均分给各个线程, 每个线程调用func(st, end)
+    template <typename F>
+    void RunLinearPartsMultiThread(int k, int align, F func) {
+        int units = (k + align - 1) / align;
+        RunPartsMultiThread(units, GetThreads(), [&](int st, int end) {
+            func(st * align, std::min(k, end * align));
+        });
+    }
+
+    // Linear之后的激活函数, 处理[n, cols]的一块; ExSwiglu时output = silu(gate) * up, 否则output = act(gate)
+    // gate和output的行间距为stride, up的行间距为upStride, output可以和gate相同
+    void LinearExActivation(float *gate, float *up, float *output, LinearExType exType,
+                            int n, int cols, int stride, int upStride) {
+        const CpuLinearKernels *kernels = GetCpuLinearKernels();
+        for (int i = 0; i < n; i++) {
+            float *g = gate + (size_t) i * stride, *o = output + (size_t) i * stride;
+            if (exType == LinearExType::ExSilu) {
+                kernels->silu(g, nullptr, o, cols);
+            } else if (exType == LinearExType::ExGelu) {
+                kernels->gelu(g, o, cols);
+            } else if (exType == LinearExType::ExSwiglu) {
+                kernels->silu(g, up + (size_t) i * upStride, o, cols);
+            }
+        }
+    }
 
-#ifdef __AVX__
-                uint8_t *temp = new uint8_t[32];
-                for (int i = 0; i < n; i++) {
-                    for (int j = 0; j + 31 < m; j += 32) {
-                        memcpy(temp, uinput.data() + i * m + j, 32);
-                        for (int k = 0; k < 16; k++) {
-                            uinput[i * m + j + k] = temp[k * 2 + 1];
-                            uinput[i * m + j + k + 16] = temp[k * 2];
-                        }
-                    }
-                }
-                delete[] temp;
-#endif
+    // output = silu(input * gate^T + gateBias) * (input * up^T + upBias), gate和up分别为weight的第[gateOffset, gateOffset + k)行
+    // 和第[upOffset, upOffset + k)行, bias和weight的行对应(可以为nullptr)
+    // 每个线程按linearTileCols列一块计算gate和up, gate直接写入output, up只放在线程自己的一小块空间里
+    void LinearSwigluTiles(CpuLinearTiles &tiles, Data &gate, float *gateBias, int gateOffset,
+                           Data &up, float *upBias, int upOffset, float *output, int k) {
+        int n = tiles.n;
+        RunLinearPartsMultiThread(k, tiles.Align(), [&](int st, int end) {
+            std::vector <float> upTile((size_t) n * linearTileCols);
+            for (int c = st; c < end; c += linearTileCols) {
+                int e = std::min(end, c + linearTileCols);
+                tiles.Compute(gate, gateBias, output + c, k, gateOffset + c, gateOffset + e);
+                tiles.Compute(up, upBias, upTile.data(), linearTileCols, upOffset + c, upOffset + e);
+                LinearExActivation(output + c, upTile.data(), output + c, LinearExType::ExSwiglu,
+                                   n, e - c, k, linearTileCols);
+            }
+        });
+    }
 
-                MultiplyInt4GroupMultiThread(uinput.data(), weightData, (int32_t *) outputData, n, m, k,
-                                            weight.weightSum.data(), weight.mins.data(), weight.scales.data(),
-                                            biasData, inputConfigs, GetThreads(), group, groupCnt);
-/*
-                //这部分是float输入，float输出
-                float *inputData = (float *) input.cpuData;
-                uint8_t *weightData = (uint8_t *) weight.cpuData;
-                float *outputData = (float *) output.cpuData;
-                float *biasData = bias.dims.size() > 0 ? (float *) bias.cpuData : nullptr;
-                int group = weight.group, groupCnt = weight.groupCnt;
-
-                int threadNum = GetThreads();
-                int per = k / threadNum;
-                int cur = 0;
-                std::vector<std::thread *> threads;
-                for (int i = 0; i < threadNum - 1; i++) {
-                    int end = cur + per + (cur + per * (threadNum - i) < k);
-                    threads.push_back(new std::thread(&Int4GroupLinearPart, inputData, weightData, biasData, outputData,
-                                                    weight.perChannelsConfigs.data(), n, m, k, cur, end, group, groupCnt));
-                    cur = end;
-                }
-                Int4GroupLinearPart(inputData, weightData, biasData, outputData, weight.perChannelsConfigs.data(), n, m, k, cur, k, group, groupCnt);
-                for (int i = 0; i < threadNum - 1; i++) {
-                    threads[i]->join();
-                    delete threads[i];
-                }
-*/
+    void CpuLinearOp::Run(const std::string &opType, const fastllm::DataDict &datas,
+                          const fastllm::FloatDict &floatParams, const fastllm::IntDict &intParams) {
+        Data &input = *(datas.find("input")->second);
+        Data &output = *(datas.find("output")->second);
+        Data &weight = *(datas.find("weight")->second);
+        Data &bias = *(datas.find("bias")->second);
+        LinearExType exType = LinearExType::ExTypeNone;
+        if (intParams.find("exType") != intParams.end()) {
+            exType = (LinearExType)intParams.find("exType")->second;
+        }
+        // NUMA模式下第一次使用时把权重的各段行迁移到负责计算它们的线程所在的node上
+        // ExSwiglu时weight的前一半(gate)和后一半(up)分别划分给各个线程, 两半要分别放置
+        int segments = (exType == LinearExType::ExSwiglu ? 2 : 1);
+        weight.PlaceOnNumaNodes(segments);
+
+        output.Allocate();
+        int n = input.Count(0) / input.dims.back();
+        int m = input.dims.back();
+        int k = output.dims.back();
+
+        if (input.dataType == DataType::FLOAT32 && output.dataType == DataType::FLOAT32) {
+            CpuLinearTiles tiles(datas, input, {&weight}, segments);
+            std::vector <float> biasHolder;
+            float *biasData = GetLinearBias(bias, weight.dims[0], biasHolder);
+            float *outputData = (float *) output.cpuData;
+            if (exType == LinearExType::ExSwiglu) {
+                // LinearEx: weight的前一半是gate, 后一半是up
+                LinearSwigluTiles(tiles, weight, biasData, 0, weight, biasData, k, outputData, k);
+            } else if (exType != LinearExType::ExTypeNone) {
+                // LinearEx: 每计算完一块马上做激活函数
+                RunLinearPartsMultiThread(k, tiles.Align(), [&](int st, int end) {
+                    for (int c = st; c < end; c += linearTileCols) {
+                        int e = std::min(end, c + linearTileCols);
+                        tiles.Compute(weight, biasData, outputData + c, k, c, e);
+                        LinearExActivation(outputData + c, nullptr, outputData + c, exType, n, e - c, k, 0);
+                    }
+                });
             } else {
-                ErrorInFastLLM("Linear error: unsupport weight's dataType.\n");
+                RunLinearPartsMultiThread(k, tiles.Align(), [&](int st, int end) {
+                    tiles.Compute(weight, biasData, outputData + st, k, st, end);
+                });
             }
-        } else if (input.dataType == DataType::FLOAT16 && output.dataType == DataType::FLOAT16) {
+            return;
+        }
+        AssertInFastLLM(exType == LinearExType::ExTypeNone, "LinearEx error: input's type should be float32.\n");
+        if (input.dataType == DataType::FLOAT16 && output.dataType == DataType::FLOAT16) {
             if (weight.dataType == DataType::FLOAT16) {
                 uint16_t *inputData = (uint16_t *) input.cpuData;
                 uint16_t *weightData = (uint16_t *) weight.cpuData;
                 uint16_t *outputData = (uint16_t *) output.cpuData;
                 float *biasData = bias.dims.size() > 0 ? (float *) bias.cpuData : nullptr;
-                int threadNum = GetThreads();
-                int per = k / threadNum;
-                int cur = 0;
-                auto pool = GetPool();
-                std::vector<std::future<void> > futures;
-                for (int i = 0; i < threadNum - 1; i++) {
-                    int end = cur + per + (cur + per * (threadNum - i) < k);
-                    futures.push_back(pool->Submit(Float16xFloat16LinearPart, inputData, weightData, biasData, outputData,
-                                                   n, m, k, cur, end));
-                    cur = end;
-                }
-
-                Float16xFloat16LinearPart(inputData, weightData, biasData, outputData, n, m, k, cur, k);
-                for (int i = 0; i < futures.size(); i++) {
-                    futures[i].get();
-                }
+                RunPartsMultiThread(k, GetThreads(), Float16xFloat16LinearPart,
+                                    inputData, weightData, biasData, outputData, n, m, k);
+            } else {
+                ErrorInFastLLM("Linear error: unsupport weight's dataType.\n");
+            }
+        } else if (input.dataType == DataType::BFLOAT16 && output.dataType == DataType::BFLOAT16) {
+            if (weight.dataType == DataType::BFLOAT16) {
+                std::vector <float> inputData, outputData;
+                inputData.resize(n * m);
+                outputData.resize(n * k);
+                BFloat16ToFloat32((uint16_t *) input.cpuData, inputData.data(), n * m);
+                std::vector <float> biasHolder;
+                float *biasData = GetLinearBias(bias, k, biasHolder);
+                BFloat16LinearMultiThread(inputData.data(), (uint16_t *) weight.cpuData, biasData, outputData.data(),
+                                          n, m, k, GetThreads());
+                Float32ToBFloat16(outputData.data(), (uint16_t *) output.cpuData, n * k);
             } else {
                 ErrorInFastLLM("Linear error: unsupport weight's dataType.\n");
             }
         } else {
             ErrorInFastLLM("Linear error: unsupport weight's dataType.\n");
         }
+    }
+
+    void CpuLinearSwigluOp::Reshape(const std::string &opType, const fastllm::DataDict &datas,
+                                    const fastllm::FloatDict &floatParams, const fastllm::IntDict &intParams) {
+        Data &input = *(datas.find("input")->second);
+        Data &output = *(datas.find("output")->second);
+        Data &gateWeight = *(datas.find("weight")->second);
+        Data &upWeight = *(datas.find("upWeight")->second);
+
+        AssertInFastLLM(gateWeight.dims.size() == 2 && upWeight.dims == gateWeight.dims,
+                        "LinearSwiglu's gate weight and up weight should have the same 2-D shape.\n");
+        AssertInFastLLM(input.dims.back() == gateWeight.dims[1], "LinearSwiglu's weight's shape error.\n");
+        AssertInFastLLM(input.dataType == DataType::FLOAT32, "LinearSwiglu error: input's type should be float32.\n");
+
+        gateWeight.weightType = WeightType::LINEAR;
+        upWeight.weightType = WeightType::LINEAR;
+        std::vector <int> dims = input.dims;
+        dims.back() = gateWeight.dims[0];
+
+        output.dataType = input.dataType;
+        output.Resize(dims);
+    }
+
+    bool CpuLinearSwigluOp::CanRun(const std::string &opType, const fastllm::DataDict &datas,
+                                   const fastllm::FloatDict &floatParams, const fastllm::IntDict &intParams) {
+        return CanRunLinearTiles(datas, {"weight", "upWeight"});
+    }
+
+    void CpuLinearSwigluOp::Run(const std::string &opType, const fastllm::DataDict &datas,
+                                const fastllm::FloatDict &floatParams, const fastllm::IntDict &intParams) {
+        Data &input = *(datas.find("input")->second);
+        Data &output = *(datas.find("output")->second);
+        Data &gateWeight = *(datas.find("weight")->second);
+        Data &upWeight = *(datas.find("upWeight")->second);
+        output.Allocate();
+
+        // gate和up共用同一份准备好的input, 每块gate和up算完之后马上做silu(gate) * up
+        CpuLinearTiles tiles(datas, input, {&gateWeight, &upWeight});
+        LinearSwigluTiles(tiles, gateWeight, nullptr, 0, upWeight, nullptr, 0, (float *) output.cpuData, output.dims.back());
+    }
+
+    // 保证[heads, len, headDim]格式的KV cache还能再追加len个位置, 扩容方式和模型中CatDirect之前的扩容相同; 没有扩容过的cache(如CopyFrom得到的)也先扩容
+    void ExpandKVCache(Data &cache, int heads, int len, int headDim, int unitLen) {
+        while ((cache.dims.size() == 0 && (cache.expansionDims.size() == 0 || len > cache.expansionDims[1]))
+               || (cache.dims.size() > 0 && (cache.expansionDims.size() == 0 || cache.dims[1] + len > cache.expansionDims[1]))) {
+            std::vector <int> newDims;
+            if (cache.Count(0) == 0 || cache.dims.size() == 0) {
+                newDims = std::vector <int> {heads, ((len - 1) / unitLen + 1) * unitLen, headDim};
+            } else {
+                newDims = cache.dims;
+                newDims[1] += ((len - 1) / unitLen + 1) * unitLen;
+            }
+            cache.Expansion(newDims);
+        }
+    }
+
+    // 原地对[tokens, m]的一个head做和LlamaRotatePosition2D相同的旋转
+    static void RotateHeadRows(float *data, int tokens, int m, int rotaryDim, float *positionIds, int positionStride,
+                               int seqLen, float *sin, float *cos, int sinStride) {
+        int half = m / 2, rot = std::min(rotaryDim, half);
+        for (int t = 0; t < tokens; t++) {
+            int index = (int) positionIds[(t / seqLen) * positionStride + t % seqLen];
+            float *s = sin + (size_t) sinStride * index, *c = cos + (size_t) sinStride * index;
+            float *now = data + (size_t) t * m;
+            for (int j = 0; j < rot; j++) {
+                float a = now[j], b = now[j + half];
+                now[j] = a * c[j] - b * s[j];
+                now[j + half] = a * s[j] + b * c[j];
+            }
+        }
+    }
 
-        if (weight_ptr->l2_num != -1) {
-            delete[] weight.cpuData;
+    void CpuLlamaQKVRotateAppendOp::Reshape(const std::string &opType, const fastllm::DataDict &datas,
+                                            const fastllm::FloatDict &floatParams, const fastllm::IntDict &intParams) {
+        Data &input = *(datas.find("input")->second);
+        Data &output = *(datas.find("output")->second);
+        int numHeads = intParams.find("numHeads")->second;
+        int headDim = intParams.find("headDim")->second;
+        AssertInFastLLM(input.dataType == DataType::FLOAT32 && input.dims.size() == 3,
+                        "LlamaQKVRotateAppend error: input should be a float32 tensor of [bsz, seqlen, hidden].\n");
+        int tokens = input.dims[0] * input.dims[1];
+
+        output.dataType = DataType::FLOAT32;
+        output.Resize({numHeads, tokens, headDim});
+    }
+
+    // 检查Reshape / Run中的所有前提, datas中没有的项不检查
+    bool CpuLlamaQKVRotateAppendOp::CanRun(const std::string &opType, const fastllm::DataDict &datas,
+                                           const fastllm::FloatDict &floatParams, const fastllm::IntDict &intParams) {
+        auto get = [&](const std::string &name) -> Data* {
+            auto it = datas.find(name);
+            return it == datas.end() ? nullptr : it->second;
+        };
+        auto getInt = [&](const std::string &name) -> int {
+            auto it = intParams.find(name);
+            return it == intParams.end() ? -1 : it->second;
+        };
+        if (!CanRunLinearTiles(datas, {"weight", "kWeight", "vWeight"})) {
+            return false;
+        }
+        Data *input = get("input");
+        if (input != nullptr && input->dims.size() != 3) {
+            return false;
+        }
+        int numHeads = getInt("numHeads"), numKVHeads = getInt("numKVHeads"), headDim = getInt("headDim");
+        bool packed = (get("kWeight") == nullptr);
+        if (get("weight") != nullptr && numHeads > 0 && numKVHeads > 0 && headDim > 0) {
+            // weight的行数需要和head数对应, 列数和input的最后一维相同
+            const char *weightNames[3] = {"weight", "kWeight", "vWeight"};
+            int rows[3] = {packed ? (numHeads + numKVHeads * 2) * headDim : numHeads * headDim,
+                           numKVHeads * headDim, numKVHeads * headDim};
+            for (int i = 0; i < (packed ? 1 : 3); i++) {
+                Data *weight = get(weightNames[i]);
+                if (weight == nullptr || weight->dims.size() != 2 || weight->dims[0] != rows[i] ||
+                    (input != nullptr && weight->dims[1] != input->dims.back())) {
+                    return false;
+                }
+            }
+        }
+        for (auto &name : {"bias", "kBias", "vBias"}) {
+            Data *bias = get(name);
+            if (bias != nullptr && bias->dims.size() > 0 && bias->dataType != DataType::FLOAT32 &&
+                bias->dataType != DataType::FLOAT16 && bias->dataType != DataType::BFLOAT16) {
+                return false;
+            }
+        }
+        for (auto &name : {"positionIds", "sin", "cos"}) {
+            Data *data = get(name);
+            if (data != nullptr && data->dataType != DataType::FLOAT32) {
+                return false;
+            }
+        }
+        Data *pastKey = get("pastKey"), *pastValue = get("pastValue");
+        for (Data *cache : {pastKey, pastValue}) {
+            if (cache != nullptr && cache->dims.size() > 0 &&
+                (cache->dataType != DataType::FLOAT32 || cache->dataDevice != DataDevice::CPU || cache->dims.size() != 3 ||
+                 (numKVHeads > 0 && cache->dims[0] != numKVHeads) || (headDim > 0 && cache->dims[2] != headDim))) {
+                return false;
+            }
         }
-//float spend = GetSpan(st, std::chrono::system_clock::now());
-//float gops = (float)n * m * k / spend / 1e9;
-// printf("n = %d, m = %d, k = %d, spend %f s, gops = %f\n", n, m, k, spend, gops);
+        if (pastKey != nullptr && pastValue != nullptr &&
+            (pastKey->dims.size() == 0 ? 0 : pastKey->dims[1]) != (pastValue->dims.size() == 0 ? 0 : pastValue->dims[1])) {
+            return false;
+        }
+        return true;
+    }
+
+    void CpuLlamaQKVRotateAppendOp::Run(const std::string &opType, const fastllm::DataDict &datas,
+                                        const fastllm::FloatDict &floatParams, const fastllm::IntDict &intParams) {
+        Data &input = *(datas.find("input")->second);
+        Data &output = *(datas.find("output")->second);
+        Data &positionIds = *(datas.find("positionIds")->second);
+        Data &sinData = *(datas.find("sin")->second);
+        Data &cosData = *(datas.find("cos")->second);
+        Data &pastKey = *(datas.find("pastKey")->second);
+        Data &pastValue = *(datas.find("pastValue")->second);
+        int numHeads = intParams.find("numHeads")->second;
+        int numKVHeads = intParams.find("numKVHeads")->second;
+        int headDim = intParams.find("headDim")->second;
+        int rotaryDim = intParams.find("rotaryDim")->second;
+        int tokens = input.dims[0] * input.dims[1];
+        output.Allocate();
+
+        // 1. q, k, v的weight和bias; 只有一个qkv weight时每一行按[q, k, v]拼接
+        Data empty;
+        const char *weightNames[3] = {"weight", "kWeight", "vWeight"};
+        const char *biasNames[3] = {"bias", "kBias", "vBias"};
+        bool packed = (datas.find("kWeight")->second == nullptr);
+        Data *weights[3];
+        float *biasData[3];
+        std::vector <float> biasHolder[3];
+        for (int i = 0; i < 3; i++) {
+            int src = packed ? 0 : i;
+            weights[i] = datas.find(weightNames[src])->second;
+            Data *bias = datas.find(biasNames[src])->second;
+            biasData[i] = GetLinearBias(bias == nullptr ? empty : *bias, weights[i]->dims[0], biasHolder[i]);
+        }
+        int offsets[3] = {0, 0, 0}; // q, k, v在各自weight中的起始列
+        if (packed) {
+            AssertInFastLLM(weights[0]->dims[0] == (numHeads + numKVHeads * 2) * headDim,
+                            "LlamaQKVRotateAppend error: qkv weight's shape error.\n");
+            offsets[1] = numHeads * headDim;
+            offsets[2] = (numHeads + numKVHeads) * headDim;
+        }
+        CpuLinearTiles tiles(datas, input, packed ? std::vector <Data*> {weights[0]} :
+                                                    std::vector <Data*> {weights[0], weights[1], weights[2]});
+
+        // 2. KV cache扩容
+        int cacheOffset = pastKey.dims.size() == 0 ? 0 : pastKey.dims[1];
+        AssertInFastLLM((pastValue.dims.size() == 0 ? 0 : pastValue.dims[1]) == cacheOffset,
+                        "LlamaQKVRotateAppend error: pastKey and pastValue should have the same length.\n");
+        ExpandKVCache(pastKey, numKVHeads, tokens, headDim, 64);
+        ExpandKVCache(pastValue, numKVHeads, tokens, headDim, 64);
+
+        // 3. 按head分块计算Linear: q的一个head在output中, k, v的一个head在KV cache中都是连续的[tokens, headDim],
+        // 所以每个head直接算到最终位置, 算完马上原地做旋转位置编码, 不需要q, k, v的中间结果
+        float *qOutput = (float *) output.cpuData;
+        float *keyCache = (float *) pastKey.cpuData, *valueCache = (float *) pastValue.cpuData;
+        uint64_t keyHeadStride = pastKey.strides[0], valueHeadStride = pastValue.strides[0];
+        float *positionData = (float *) positionIds.cpuData;
+        int positionStride = positionIds.dims.back(), seqLen = input.dims[1], sinStride = sinData.dims[1];
+        RunPartsMultiThread(numHeads + numKVHeads * 2, GetThreads(), [&](int st, int end) {
+            for (int u = st; u < end; u++) {
+                int part = (u < numHeads ? 0 : (u < numHeads + numKVHeads ? 1 : 2));
+                int h = u - (part == 0 ? 0 : (part == 1 ? numHeads : numHeads + numKVHeads));
+                float *out = (part == 0 ? qOutput + (size_t) h * tokens * headDim :
+                              (part == 1 ? keyCache + h * keyHeadStride : valueCache + h * valueHeadStride) +
+                              (size_t) cacheOffset * headDim);
+                int col = offsets[part] + h * headDim;
+                tiles.Compute(*weights[part], biasData[part], out, headDim, col, col + headDim);
+                if (part < 2) {
+                    RotateHeadRows(out, tokens, headDim, rotaryDim, positionData, positionStride, seqLen,
+                                   (float *) sinData.cpuData, (float *) cosData.cpuData, sinStride);
+                }
+            }
+        });
+
+        std::vector <int> dims = {numKVHeads, cacheOffset + tokens, headDim};
+        pastKey.Resize(dims);
+        pastValue.Resize(dims);
     }
 
     void CpuSplitOp::Reshape(const std::string &opType, const fastllm::DataDict &datas,
@@ -2116,59 +2132,69 @@ namespace fastllm {
         }
     }
 
-    void MatMulSingle(float *input0Base, float *input1Base, float *outputBase,
-                      int input0Spatial, int input1Spatial, int outputSpatial,
-                      int input0Stride, int input1Stride,
-                      int n, int m, int k, float alpha, int st, int end) {
+    // MatMul / MatMulTransB的计算参数: input0的第b个head和input1的第b / group个head相乘, 结果写入output的第b个head
+    // input0, output可以是[heads, n, ...]或[n, heads, ...]排布, 所以head之间和行之间的间隔分开记录
+    struct MatMulParams {
+        int input0HeadStride, input0Stride;
+        int input1Spatial, input1Stride;
+        int outputHeadStride, outputStride;
+        int group, n, m, k;
+        float alpha;
+    };
+
+    void MatMulSingle(float *input0Base, float *input1Base, float *outputBase, MatMulParams *p, int st, int end) {
+        int n = p->n, m = p->m, k = p->k;
         for (int b = st; b < end; b++) {
-            float *input0Data = input0Base + b * input0Spatial;
-            float *input1Data = input1Base + b * input1Spatial;
-            float *outputData = outputBase + b * outputSpatial;
-            std::fill(outputData, outputData + n * k, 0.0f);
+            float *input0Data = input0Base + (uint64_t)b * p->input0HeadStride;
+            float *input1Data = input1Base + (uint64_t)(b / p->group) * p->input1Spatial;
+            float *outputData = outputBase + (uint64_t)b * p->outputHeadStride;
             for (int i = 0; i < n; i++) {
+                float *outputRow = outputData + i * p->outputStride;
+                std::fill(outputRow, outputRow + k, 0.0f);
                 for (int j = 0; j < m; j++) {
-                    float now = input0Data[i * input0Stride + j] * alpha;
+                    float now = input0Data[i * p->input0Stride + j] * p->alpha;
                     for (int l = 0; l < k; l++) {
-                        outputData[i * k + l] += (now * input1Data[j * k + l]);
+                        outputRow[l] += (now * input1Data[j * p->input1Stride + l]);
                     }
                 }
             }
         }
     }
 
-    void MatMulFloat16Single(uint16_t *input0Base, uint16_t *input1Base, uint16_t *outputBase,
-                             int input0Spatial, int input1Spatial, int outputSpatial,
-                             int input0Stride, int input1Stride,
-                             int n, int m, int k, float alpha, int st, int end) {
+    void MatMulFloat16Single(uint16_t *input0Base, uint16_t *input1Base, uint16_t *outputBase, MatMulParams *p,
+                             int st, int end) {
+        int n = p->n, m = p->m, k = p->k;
         float *input0 = new float[n * m];
         float *input1 = new float[m * k];
         float *output = new float[n * k];
 
         for (int b = st; b < end; b++) {
-            uint16_t *input0Data = input0Base + b * input0Spatial;
-            uint16_t *input1Data = input1Base + b * input1Spatial;
-            uint16_t *outputData = outputBase + b * outputSpatial;
+            uint16_t *input0Data = input0Base + (uint64_t)b * p->input0HeadStride;
+            uint16_t *input1Data = input1Base + (uint64_t)(b / p->group) * p->input1Spatial;
+            uint16_t *outputData = outputBase + (uint64_t)b * p->outputHeadStride;
             for (int i = 0; i < n; i++) {
                 for (int j = 0; j < m; j++) {
-                    input0[i * m + j] = fp16tofp32.dict[input0Data[i * input0Stride + j]];
+                    input0[i * m + j] = fp16tofp32.dict[input0Data[i * p->input0Stride + j]];
                 }
             }
             for (int j = 0; j < m; j++) {
                 for (int l = 0; l < k; l++) {
-                    input1[j * k + l] = fp16tofp32.dict[input1Data[j * k + l]];
+                    input1[j * k + l] = fp16tofp32.dict[input1Data[j * p->input1Stride + l]];
                 }
             }
             std::fill(output, output + n * k, 0.0f);
             for (int i = 0; i < n; i++) {
                 for (int j = 0; j < m; j++) {
-                    float now = input0[i * m + j] * alpha;
+                    float now = input0[i * m + j] * p->alpha;
                     for (int l = 0; l < k; l++) {
                         output[i * k + l] += (now * input1[j * k + l]);
                     }
                 }
             }
-            for (int i = 0; i < n * k; i++) {
-                outputData[i] = float_to_half(output[i]);
+            for (int i = 0; i < n; i++) {
+                for (int l = 0; l < k; l++) {
+                    outputData[i * p->outputStride + l] = float_to_half(output[i * k + l]);
+                }
             }
         }
 
@@ -2177,65 +2203,127 @@ namespace fastllm {
         delete[] output;
     }
 
-    void MatMulTransBSingle(float *input0Base, float *input1Base, float *outputBase,
-                            int input0Spatial, int input1Spatial, int outputSpatial,
-                            int input0Stride, int input1Stride,
-                            int n, int m, int k, float alpha, int st, int end) {
+    void MatMulTransBSingle(float *input0Base, float *input1Base, float *outputBase, MatMulParams *p,
+                            int st, int end) {
+        int n = p->n, m = p->m, k = p->k;
+        auto dotRow = GetCpuLinearKernels()->dotRow;
         for (int b = st; b < end; b++) {
-            float *input0Data = input0Base + b * input0Spatial;
-            float *input1Data = input1Base + b * input1Spatial;
-            float *outputData = outputBase + b * outputSpatial;
+            float *input0Data = input0Base + (uint64_t)b * p->input0HeadStride;
+            float *input1Data = input1Base + (uint64_t)(b / p->group) * p->input1Spatial;
+            float *outputData = outputBase + (uint64_t)b * p->outputHeadStride;
             for (int i = 0; i < n; i++) {
+                float *input0Row = input0Data + i * p->input0Stride;
                 for (int j = 0; j < k; j++) {
-                    float now = 0.0f;
-                    int l = 0;
-#ifdef __aarch64__
-                    float32x4_t sum = {0, 0, 0, 0};
-                    for (; l + 3 < m; l += 4) {
-                        sum = vaddq_f32(sum, vmulq_f32(vld1q_f32(input0Data + i * input0Stride + l),
-                                                       vld1q_f32(input1Data + j * input1Stride + l)));
-                    }
-                    now += sum[0] + sum[1] + sum[2] + sum[3];
-#elif defined(__AVX__)
-                    __m256 vsum = _mm256_set1_ps(0.0f);
-                    for (; l + 7 < m; l += 8) {
-                        __m256 vx = _mm256_loadu_ps((const float *) (input0Data + i * input0Stride + l));
-                        __m256 vy = _mm256_loadu_ps((const float *) (input1Data + j * input1Stride + l));
-                        vsum = _mm256_add_ps(vsum, _mm256_mul_ps(vx, vy));
-                    }
-                    now += Floatsum(vsum);
-#endif
-                    for (; l < m; l++) {
-                        now += input0Data[i * input0Stride + l] * input1Data[j * input1Stride + l];
-                    }
-                    outputData[i * k + j] = now * alpha;
+                    float now = dotRow(input0Row, input1Data + j * p->input1Stride, m);
+                    outputData[i * p->outputStride + j] = now * p->alpha;
                 }
             }
         }
     }
 
-    void MatMulTransBFloat16Single(uint16_t *input0Base, uint16_t *input1Base, uint16_t *outputBase,
-                            int input0Spatial, int input1Spatial, int outputSpatial,
-                            int input0Stride, int input1Stride,
-                            int n, int m, int k, float alpha, int st, int end) {
+    void MatMulTransBFloat16Single(uint16_t *input0Base, uint16_t *input1Base, uint16_t *outputBase, MatMulParams *p,
+                                   int st, int end) {
+        int n = p->n, m = p->m, k = p->k;
         for (int b = st; b < end; b++) {
-            uint16_t *input0Data = input0Base + b * input0Spatial;
-            uint16_t *input1Data = input1Base + b * input1Spatial;
-            uint16_t *outputData = outputBase + b * outputSpatial;
+            uint16_t *input0Data = input0Base + (uint64_t)b * p->input0HeadStride;
+            uint16_t *input1Data = input1Base + (uint64_t)(b / p->group) * p->input1Spatial;
+            uint16_t *outputData = outputBase + (uint64_t)b * p->outputHeadStride;
             for (int i = 0; i < n; i++) {
                 for (int j = 0; j < k; j++) {
                     float now = 0.0f;
                     int l = 0;
                     for (; l < m; l++) {
-                        now += fp16tofp32.dict[input0Data[i * input0Stride + l]] *
-                                fp16tofp32.dict[input1Data[j * input1Stride + l]];
+                        now += fp16tofp32.dict[input0Data[i * p->input0Stride + l]] *
+                                fp16tofp32.dict[input1Data[j * p->input1Stride + l]];
                     }
-                    outputData[i * k + j] = float_to_half(now * alpha);
+                    outputData[i * p->outputStride + j] = float_to_half(now * p->alpha);
                 }
             }
         }
     }
 
+    // 计算MatMul / MatMulTransB的output形状, 返回input0的head数
+    // input0Layout / outputLayout为LayoutSeqMajor时, input0 / output为[n, heads, m]排布
+    static int GetMatMulOutputDims(const std::string &opType, const Data &input0, const Data &input1,
+                                   const fastllm::IntDict &intParams, bool transB, std::vector <int> &dims) {
+        int input0Layout = intParams.find("input0Layout") != intParams.end() ? intParams.find("input0Layout")->second : LayoutHeadMajor;
+        int outputLayout = intParams.find("outputLayout") != intParams.end() ? intParams.find("outputLayout")->second : LayoutHeadMajor;
+        int group = intParams.find("group") != intParams.end() ? intParams.find("group")->second : 1;
+        AssertInFastLLM(input0.dims.size() >= 2 && input1.dims.size() >= 2,
+                        opType + "'s input's shape's size should be >= 2.\n");
+        AssertInFastLLM(input0Layout == LayoutHeadMajor || input0.dims.size() == 3,
+                        opType + ": seq-major input0 should be 3D.\n");
+        int n = input0.dims[input0.dims.size() - 2], heads = input0.Count(0) / input0.Count(input0.dims.size() - 2);
+        if (input0Layout == LayoutSeqMajor) {
+            n = input0.dims[0];
+            heads = input0.dims[1];
+        }
+        int m = input0.dims.back();
+        int k = transB ? input1.dims[input1.dims.size() - 2] : input1.dims.back();
+        AssertInFastLLM(m == (transB ? input1.dims.back() : input1.dims[input1.dims.size() - 2]),
+                        opType + "'s shape error.\n");
+        int batch1 = input1.Count(0) / input1.Count(input1.dims.size() - 2);
+        AssertInFastLLM(heads == batch1 * group, opType + ": input0's heads should be equal to input1's heads * group.\n");
+
+        if (outputLayout == LayoutSeqMajor) {
+            dims = {n, heads, k};
+        } else if (input0Layout == LayoutSeqMajor) {
+            dims = {heads, n, k};
+        } else {
+            dims = input0.dims;
+            dims.back() = k;
+        }
+        return heads;
+    }
+
+    // 由Reshape之后的output计算MatMul / MatMulTransB的参数, 返回input0的head数
+    static int GetMatMulParams(const Data &input0, const Data &input1, const Data &output,
+                               const fastllm::FloatDict &floatParams, const fastllm::IntDict &intParams,
+                               MatMulParams &p) {
+        int input0Layout = intParams.find("input0Layout") != intParams.end() ? intParams.find("input0Layout")->second : LayoutHeadMajor;
+        int outputLayout = intParams.find("outputLayout") != intParams.end() ? intParams.find("outputLayout")->second : LayoutHeadMajor;
+        p.alpha = floatParams.find("alpha") != floatParams.end() ? floatParams.find("alpha")->second : 1.0f;
+        p.group = intParams.find("group") != intParams.end() ? intParams.find("group")->second : 1;
+        int heads;
+        p.m = input0.dims.back();
+        p.k = output.dims.back();
+        if (input0Layout == LayoutSeqMajor) {
+            heads = input0.dims[1];
+            p.n = input0.dims[0];
+            p.input0HeadStride = input0.strides[1];
+            p.input0Stride = input0.strides[0];
+        } else {
+            heads = input0.Count(0) / input0.Count(input0.dims.size() - 2);
+            p.n = input0.dims[input0.dims.size() - 2];
+            p.input0HeadStride = input0.Count(input0.dims.size() - 2);
+            p.input0Stride = input0.strides[input0.dims.size() - 2];
+        }
+        p.input1Spatial = input1.Count(input1.dims.size() - 2);
+        p.input1Stride = input1.strides[input1.dims.size() - 2];
+        if (outputLayout == LayoutSeqMajor) {
+            p.outputHeadStride = output.strides[1];
+            p.outputStride = output.strides[0];
+        } else {
+            p.outputHeadStride = p.n * p.k;
+            p.outputStride = p.k;
+        }
+        return heads;
+    }
+
+    // 把heads个head分给若干线程计算
+    template <typename T>
+    static void RunMatMulHeads(void (*func)(T*, T*, T*, MatMulParams*, int, int),
+                               T *input0, T *input1, T *output, MatMulParams &p, int heads) {
+        int threadNum = GetThreads();
+#ifdef _WIN64
+        threadNum = 1;
+#endif
+        if ((uint64_t)heads * p.n * p.m * p.k < 64 * 4096) {
+            threadNum = 1;
+        }
+        RunPartsMultiThread(heads, std::min(threadNum, 4), func, input0, input1, output, &p);
+    }
+
     void CpuMatMulOp::Reshape(const std::string &opType, const fastllm::DataDict &datas,
                               const fastllm::FloatDict &floatParams, const fastllm::IntDict &intParams) {
         Data &input0 = *(datas.find("input0")->second);
@@ -2246,21 +2334,8 @@ namespace fastllm {
         AssertInFastLLM((input0.dataType == DataType::FLOAT32 && input1.dataType == DataType::FLOAT32) ||
                         (input0.dataType == DataType::FLOAT16 && input1.dataType == DataType::FLOAT16),
                         "MatMul's input's type should be float32 or float16.\n");
-        AssertInFastLLM(input0.dims.size() >= 2 && input1.dims.size() >= 2,
-                        "MatMul's input's shape's size should be >= 2.\n");
-        AssertInFastLLM(input0.dims.back() == input1.dims[input1.dims.size() - 2],
-                        "MatMul's shape error.\n");
-        int input0Spatial = input0.Count(input0.dims.size() - 2);
-        int input1Spatial = input1.Count(input1.dims.size() - 2);
-        int batch0 = input0.Count(0) / input0Spatial;
-        int batch1 = input1.Count(0) / input1Spatial;
-        int group = intParams.find("group") != intParams.end() ? intParams.find("group")->second : 1;
-        AssertInFastLLM(batch0 == batch1 * group, "MatMul: input0.dims[1] should be equal to input1.dims[0] * group.\n");
-        // AssertInFastLLM(batch0 == batch1, "MatMul's shape error.\n");
-
-        std::vector <int> dims = input0.dims;
-        dims.back() = input1.dims[input1.dims.size() - 1];
-
+        std::vector <int> dims;
+        GetMatMulOutputDims("MatMul", input0, input1, intParams, false, dims);
         output.dataType = input0.dataType;
         output.Resize(dims);
     }
@@ -2272,63 +2347,15 @@ namespace fastllm {
         Data &output = *(datas.find("output")->second);
 
         output.Allocate();
-
-        float alpha = floatParams.find("alpha") != floatParams.end() ? floatParams.find("alpha")->second : 1.0f;
-        int group = intParams.find("group") != intParams.end() ? intParams.find("group")->second : 1;
-        int input0Spatial = input0.Count(input0.dims.size() - 2) * group;
-        int input1Spatial = input1.Count(input1.dims.size() - 2);
-        int input0Stride = input0.strides[input0.dims.size() - 2];
-        int input1Stride = input1.strides[input1.dims.size() - 2];
-        int n = input0.dims[input0.dims.size() - 2] * group;
-        int m = input0.dims.back();
-        int k = input1.dims[input1.dims.size() - 1];
-        int batch0 = input0.Count(0) / input0Spatial;
-        int batch1 = input1.Count(0) / input1Spatial;
-
-        int outputSpatial = output.Count(output.dims.size() - 2) * group;
-        int threadNum = GetThreads();
-#ifdef _WIN64
-        threadNum = 1;
-#endif
-        if (batch0 * n * m * k < 64 * 4096) {
-            threadNum = 1;
-        }
-        threadNum = std::min(threadNum, 4);
+        MatMulParams p;
+        int heads = GetMatMulParams(input0, input1, output, floatParams, intParams, p);
         // TODO: 汇编优化
-        int per = batch0 / threadNum;
-        int cur = 0;
-        auto pool = GetPool();
-        std::vector <std::future <void> > futures;
         if (input0.dataType == DataType::FLOAT32) {
-            for (int i = 0; i < threadNum - 1; i++) {
-                int end = cur + per + (cur + per * (threadNum - i) < batch0);
-                futures.push_back(pool->Submit(MatMulSingle,
-                                               (float *) input0.cpuData, (float *) input1.cpuData,
-                                               (float *) output.cpuData,
-                                               input0Spatial, input1Spatial, outputSpatial, input0Stride, input1Stride,
-                                               n, m, k, alpha, cur, end));
-                cur = end;
-            }
-            MatMulSingle((float *) input0.cpuData, (float *) input1.cpuData, (float *) output.cpuData,
-                         input0Spatial, input1Spatial, outputSpatial, input0Stride, input1Stride,
-                         n, m, k, alpha, cur, batch0);
+            RunMatMulHeads(MatMulSingle, (float *) input0.cpuData, (float *) input1.cpuData,
+                           (float *) output.cpuData, p, heads);
         } else if (input0.dataType == DataType::FLOAT16) {
-            for (int i = 0; i < threadNum - 1; i++) {
-                int end = cur + per + (cur + per * (threadNum - i) < batch0);
-                futures.push_back(pool->Submit(MatMulFloat16Single,
-                                               (uint16_t *) input0.cpuData, (uint16_t *) input1.cpuData,
-                                               (uint16_t *) output.cpuData,
-                                               input0Spatial, input1Spatial, outputSpatial, input0Stride, input1Stride,
-                                               n, m, k, alpha, cur, end));
-                cur = end;
-            }
-            MatMulFloat16Single((uint16_t *) input0.cpuData, (uint16_t *) input1.cpuData, (uint16_t *) output.cpuData,
-                         input0Spatial, input1Spatial, outputSpatial, input0Stride, input1Stride,
-                         n, m, k, alpha, cur, batch0);
-        }
-
-        for (int i = 0; i < futures.size(); i++) {
-            futures[i].get();
+            RunMatMulHeads(MatMulFloat16Single, (uint16_t *) input0.cpuData, (uint16_t *) input1.cpuData,
+                           (uint16_t *) output.cpuData, p, heads);
         }
     }
 
@@ -2342,20 +2369,8 @@ namespace fastllm {
         AssertInFastLLM((input0.dataType == DataType::FLOAT32 && input1.dataType == DataType::FLOAT32) ||
                         (input0.dataType == DataType::FLOAT16 && input1.dataType == DataType::FLOAT16),
                         "MatMulTransB's input's type should be float32 or float16.\n");
-        AssertInFastLLM(input0.dims.size() >= 2 && input1.dims.size() >= 2,
-                        "MatMulTransB's input's shape's size should be >= 2.\n");
-        AssertInFastLLM(input0.dims.back() == input1.dims.back(),
-                        "MatMulTransB's shape error.\n");
-        int input0Spatial = input0.Count(input0.dims.size() - 2);
-        int input1Spatial = input1.Count(input1.dims.size() - 2);
-        int batch0 = input0.Count(0) / input0Spatial;
-        int batch1 = input1.Count(0) / input1Spatial;
-        int group = intParams.find("group") != intParams.end() ? intParams.find("group")->second : 1;
-        AssertInFastLLM(batch0 == batch1 * group, "MatMulTransB: input0.dims[0] should be equal to input1.dims[0] * group.\n");
-        // AssertInFastLLM(batch0 == batch1, "MatMulTransB's shape error.\n");
-
-        std::vector <int> dims = input0.dims;
-        dims.back() = input1.dims[input1.dims.size() - 2];
+        std::vector <int> dims;
+        GetMatMulOutputDims("MatMulTransB", input0, input1, intParams, true, dims);
         output.dataType = input0.dataType;
         output.Resize(dims);
     }
@@ -2367,62 +2382,14 @@ namespace fastllm {
         Data &output = *(datas.find("output")->second);
 
         output.Allocate();
-
-        float alpha = floatParams.find("alpha") != floatParams.end() ? floatParams.find("alpha")->second : 1.0;
-        int group = intParams.find("group") != intParams.end() ? intParams.find("group")->second : 1;
-        int input0Spatial = input0.Count(input0.dims.size() - 2) * group;
-        int input1Spatial = input1.Count(input1.dims.size() - 2);
-        int input0Stride = input0.strides[input0.dims.size() - 2];
-        int input1Stride = input1.strides[input1.dims.size() - 2];
-        int n = input0.dims[input0.dims.size() - 2] * group;
-        int m = input0.dims.back();
-        int k = input1.dims[input1.dims.size() - 2];
-        int batch0 = input0.Count(0) / input0Spatial;
-        int batch1 = input1.Count(0) / input1Spatial;
-
-        int outputSpatial = output.Count(output.dims.size() - 2) * group;
-        int threadNum = GetThreads();
-#ifdef _WIN64
-        threadNum = 1;
-#endif
-        if (batch0 * n * m * k < 64 * 4096) {
-            threadNum = 1;
-        }
-        threadNum = std::min(threadNum, 4);
-        int per = batch0 / threadNum;
-        int cur = 0;
-        auto pool = GetPool();
-        std::vector <std::future <void> > futures;
+        MatMulParams p;
+        int heads = GetMatMulParams(input0, input1, output, floatParams, intParams, p);
         if (input0.dataType == DataType::FLOAT32) {
-            for (int i = 0; i < threadNum - 1; i++) {
-                int end = cur + per + (cur + per * (threadNum - i) < batch0);
-                futures.push_back(pool->Submit(MatMulTransBSingle,
-                                               (float *) input0.cpuData, (float *) input1.cpuData,
-                                               (float *) output.cpuData,
-                                               input0Spatial, input1Spatial, outputSpatial, input0Stride, input1Stride,
-                                               n, m, k, alpha, cur, end));
-                cur = end;
-            }
-            MatMulTransBSingle((float *) input0.cpuData, (float *) input1.cpuData, (float *) output.cpuData,
-                               input0Spatial, input1Spatial, outputSpatial, input0Stride, input1Stride,
-                               n, m, k, alpha, cur, batch0);
+            RunMatMulHeads(MatMulTransBSingle, (float *) input0.cpuData, (float *) input1.cpuData,
+                           (float *) output.cpuData, p, heads);
         } else {
-            for (int i = 0; i < threadNum - 1; i++) {
-                int end = cur + per + (cur + per * (threadNum - i) < batch0);
-                futures.push_back(pool->Submit(MatMulTransBFloat16Single,
-                                               (uint16_t *) input0.cpuData, (uint16_t *) input1.cpuData,
-                                               (uint16_t *) output.cpuData,
-                                               input0Spatial, input1Spatial, outputSpatial, input0Stride, input1Stride,
-                                               n, m, k, alpha, cur, end));
-                cur = end;
-            }
-            MatMulTransBFloat16Single((uint16_t *) input0.cpuData, (uint16_t *) input1.cpuData, (uint16_t *) output.cpuData,
-                               input0Spatial, input1Spatial, outputSpatial, input0Stride, input1Stride,
-                               n, m, k, alpha, cur, batch0);
-        }
-
-        for (int i = 0; i < futures.size(); i++) {
-            futures[i].get();
+            RunMatMulHeads(MatMulTransBFloat16Single, (uint16_t *) input0.cpuData, (uint16_t *) input1.cpuData,
+                           (uint16_t *) output.cpuData, p, heads);
         }
     }
 
@@ -2455,53 +2422,10 @@ namespace fastllm {
         }
 
         if (inner == 1) {
-            for (int i = 0; i < outer; i++) {
-                float maxValue = 0;
-                int j = 0;
-#ifdef __aarch64__
-                float32x4_t vmax = vdupq_n_f32(-1e9);
-                for (; j + 3 < channels; j += 4) {
-                    vmax = vmaxq_f32(vmax, vld1q_f32(inputData + j));
-                }
-                for (int k = 0; k < 4; k++) {
-                    maxValue = std::max(maxValue, vmax[k]);
-                }
-#endif
-                for (; j < channels; j++) {
-                    maxValue = std::max(maxValue, inputData[j]);
-                }
-
-                j = 0;
-#ifdef __aarch64__
-                vmax = vdupq_n_f32(maxValue);
-                for (; j + 3 < channels; j += 4) {
-                    vst1q_f32(outputData + j, exp_ps(vsubq_f32(vld1q_f32(inputData + j), vmax)));
-                }
-#endif
-                for (; j < channels; j++) {
-                    outputData[j] = exp(inputData[j] - maxValue);
-                }
-                float sum = 0.0;
-                j = 0;
-                for (; j < channels; j++) {
-                    sum += outputData[j];
-                }
-                if (fabs(sum) < 1e-9) {
-                    sum = 0.1;
-                }
-                j = 0;
-#ifdef __aarch64__
-                float32x4_t fsum = vdupq_n_f32(sum);
-                for (j = 0; j + 3 < channels; j += 4) {
-                    vst1q_f32(outputData + j, vdivq_f32(vld1q_f32(outputData + j), fsum));
-                }
-#endif
-                for (; j < channels; j++) {
-                    outputData[j] = outputData[j] / sum;
-                }
-                inputData += channels;
-                outputData += channels;
-            }
+            RunRangeMultiThread(outer, std::max(1, elementwiseMinLen / channels), SoftmaxRowsPart,
+                                GetCpuLinearKernels()->softmaxRow, inputData, outputData, channels);
+            inputData += outer * channels;
+            outputData += outer * channels;
         } else {
             for (int i = 0; i < outer; i++) {
                 std::vector<float> maxValue(inner, -FLT_MAX);
@@ -2551,20 +2475,8 @@ namespace fastllm {
         float *inputData = (float*)input.cpuData;
         float *outputData = (float*)output.cpuData;
         int len = input.Count(0);
-        int i = 0;
-#ifdef __aarch64__
-        float32x4_t c1 = vdupq_n_f32(1.0f);
-        for (; i + 3 < len; i += 4) {
-            float32x4_t vx = vld1q_f32(inputData + i);
-            float32x4_t vdiv = vaddq_f32(c1, exp_ps(vnegq_f32(vx)));
-            vx = vdivq_f32(vx, vdiv);
-            vst1q_f32(outputData + i, vx);
-        }
-#endif
-        for (; i < len; i++) {
-            float x = inputData[i];
-            outputData[i] = x / (1.0 + expf(-x));
-        }
+        RunRangeMultiThread(len, elementwiseMinLen, SiluPart, GetCpuLinearKernels()->silu,
+                            inputData, outputData, len, len, false);
     }
 
     void CpuTanHOp::Run(const std::string &opType, const fastllm::DataDict &datas,
@@ -2574,47 +2486,10 @@ namespace fastllm {
         output.Allocate();
         AssertInFastLLM(input.dataType == DataType::FLOAT32, "GeluNew error: Data's type should be float32.\n");
 
-        float temp = sqrt(2.0f / M_PI), factor = 0.044715;
         float *inputData = (float*)input.cpuData;
         float *outputData = (float*)output.cpuData;
         int len = input.Count(0);
-        int i = 0;
-        for (; i < len; i++) {
-            outputData[i] = tanhf(inputData[i]);
-        }
-    }
-
-    float erf(float a)
-    {
-        float r, s, t, u;
-
-        t = fabsf(a);
-        s = a * a;
-        if (t > 0.927734375f)
-        {   // 475/512
-            // maximum error 0.99527 ulp
-            r = fmaf(-1.72853470e-5f, t, 3.83197126e-4f); // -0x1.220000p-16,0x1.91cfb2p-12
-            u = fmaf(-3.88396438e-3f, t, 2.42546219e-2f); // -0x1.fd1438p-9, 0x1.8d6342p-6
-            r = fmaf(r, s, u);
-            r = fmaf(r, t, -1.06777877e-1f); // -0x1.b55cb8p-4
-            r = fmaf(r, t, -6.34846687e-1f); // -0x1.450aa0p-1
-            r = fmaf(r, t, -1.28717512e-1f); // -0x1.079d0cp-3
-            r = fmaf(r, t, -t);
-            r = 1.0f - expf(r);
-            r = copysignf(r, a);
-        }
-        else
-        {
-            // maximum error 0.98929 ulp
-            r = -5.96761703e-4f;             // -0x1.38e000p-11
-            r = fmaf(r, s, 4.99119423e-3f);  //  0x1.471a58p-8
-            r = fmaf(r, s, -2.67681349e-2f); // -0x1.b691b2p-6
-            r = fmaf(r, s, 1.12819925e-1f);  //  0x1.ce1c44p-4
-            r = fmaf(r, s, -3.76125336e-1f); // -0x1.812700p-2
-            r = fmaf(r, s, 1.28379166e-1f);  //  0x1.06eba8p-3
-            r = fmaf(r, a, a);
-        }
-        return r;
+        RunRangeMultiThread(len, elementwiseMinLen, ActivationPart, GetCpuLinearKernels()->tanh, inputData, outputData);
     }
 
     void CpuGeluOp::Run(const std::string &opType, const fastllm::DataDict &datas,
@@ -2624,15 +2499,10 @@ namespace fastllm {
         output.Allocate();
         AssertInFastLLM(input.dataType == DataType::FLOAT32, "GeluNew error: Data's type should be float32.\n");
 
-        float temp = sqrt(2.0f / M_PI), factor = 0.044715;
         float *inputData = (float*)input.cpuData;
         float *outputData = (float*)output.cpuData;
         int len = input.Count(0);
-        int i = 0;
-        for (; i < len; i++) {
-            float x = inputData[i];
-            outputData[i] = x * 0.5f * (1.0f + erf(x / sqrt(2.0)));
-        }
+        RunRangeMultiThread(len, elementwiseMinLen, ActivationPart, GetCpuLinearKernels()->gelu, inputData, outputData);
     }
 
     void CpuGeluNewOp::Run(const std::string &opType, const fastllm::DataDict &datas,
@@ -2645,77 +2515,7 @@ namespace fastllm {
         float *inputData = (float*)input.cpuData;
         float *outputData = (float*)output.cpuData;
         int len = input.Count(0);
-        int i = 0;
-#ifdef __aarch64__
-        float32x4_t c0 = vdupq_n_f32(0.044715f);
-        float32x4_t c1 = vdupq_n_f32(1.0f);
-        float32x4_t c2 = vdupq_n_f32(0.7978845608028654f);
-        float32x4_t c3 = vdupq_n_f32(0.5f);
-
-        for (; i + 3 < len; i += 4) {
-            float32x4_t vx = vld1q_f32(inputData + i);
-            float32x4_t v1 = vaddq_f32(c1, vmulq_f32(vmulq_f32(c0, vx), vx));
-            float32x4_t v2 = vmulq_f32(vmulq_f32(c2, vx), v1);
-            float32x4_t vex = exp_ps(v2);
-            float32x4_t venegx = exp_ps(vnegq_f32(v2));
-            float32x4_t vtan = vdivq_f32(vsubq_f32(vex, venegx), vaddq_f32(vex, venegx));
-            float32x4_t vout = vmulq_f32(vmulq_f32(c3, vx), vaddq_f32(c1, vtan));
-            vst1q_f32(outputData + i, vout);
-        }
-#endif
-#ifdef __AVX2__
-        auto var1 = _mm256_set1_ps(0.044715f);
-        auto var2 = _mm256_set1_ps(0.7978845608028654f);
-        auto var3 = _mm256_set1_ps(378.f);
-        auto var4 = _mm256_set1_ps(17325.f);
-        auto var5 = _mm256_set1_ps(135135.f);
-        auto var6 = _mm256_set1_ps(28.f);
-        auto var7 = _mm256_set1_ps(3150.f);
-        auto var8 = _mm256_set1_ps(62370.f);
-        auto var9 = _mm256_set1_ps(135135.f);
-        auto var10 = _mm256_set1_ps(0.5);
-        auto varOne = _mm256_set1_ps(1.f);
-        auto varNegOne = _mm256_set1_ps(-1.f);
-
-        for (; i < len - 7; i+=8) {
-            auto x = _mm256_loadu_ps(inputData + i);  
-            // sqrt(2 / PI) * (0.044715 * x^3 + x)
-            auto y = _mm256_mul_ps(x, x);
-            y = _mm256_mul_ps(y, x);
-            y = _mm256_mul_ps(y, var1);
-            y = _mm256_add_ps(y, x);
-            y = _mm256_mul_ps(y, var2);
-
-            // y = tanh(y)
-            {
-            auto y2 = _mm256_mul_ps(y, y);
-            auto w = _mm256_add_ps(y2, var3);
-            w = _mm256_mul_ps(w, y2);
-            w = _mm256_add_ps(w, var4);
-            w = _mm256_mul_ps(w, y2);
-            w = _mm256_add_ps(w, var5);
-            w = _mm256_mul_ps(w, y);
-            auto z = _mm256_mul_ps(y2, var6);
-            z = _mm256_add_ps(z, var7);
-            z = _mm256_mul_ps(z, y2);
-            z = _mm256_add_ps(z, var8);
-            z = _mm256_mul_ps(z, y2);
-            z = _mm256_add_ps(z, var9);
-            z = _mm256_div_ps(w, z);
-            z = _mm256_max_ps(z, varNegOne);
-            y = _mm256_min_ps(z, varOne);
-            }
-
-            y = _mm256_add_ps(y, varOne);
-            y = _mm256_mul_ps(y, x);
-            y = _mm256_mul_ps(y, var10);
-            _mm256_storeu_ps(outputData + i, y);
-        }
-#endif
-        for (; i < len; i++) {
-            float x = inputData[i];
-            outputData[i] = 0.5f * x * (1.0f + tanhf(0.7978845608028654f * x * (1.0f + 0.044715f * x * x)));
-        }
+        RunRangeMultiThread(len, elementwiseMinLen, ActivationPart, GetCpuLinearKernels()->geluNew, inputData, outputData);
     }
 
     void CpuSwigluOp::Reshape(const std::string &opType, const fastllm::DataDict &datas,
@@ -2751,29 +2551,10 @@ namespace fastllm {
 
         int spatial = input.Count(input.dims.size() - 1), mid = spatial / 2;
         int outer = input.Count(0) / spatial;
-        for (int o = 0; o < outer; o++) {
-            int i = 0;
-#ifdef __aarch64__
-            float32x4_t c1 = vdupq_n_f32(1.0f);
-            for (; i + 3 < mid; i += 4) {
-                float32x4_t vx = vld1q_f32(inputData + i);
-                float32x4_t vy = vld1q_f32(inputData + i + mid);
-                vx = vdivq_f32(vx, vaddq_f32(c1, exp_ps(vnegq_f32(vx))));
-                vy = vmulq_f32(vx, vy);
-                vst1q_f32(outputData + i, vy);
-            }
-#endif
-            for (; i < mid; i++) {
-                float x = inputData[i], y = inputData[i + mid];
-                outputData[i] = (x / (1.0 + expf(-x))) * y;
-            }
-            inputData += spatial;
-            outputData += spatial / 2;
-        }
+        RunRangeMultiThread(outer * mid, elementwiseMinLen, SiluPart, GetCpuLinearKernels()->silu,
+                            inputData, outputData, mid, spatial, true);
 
         if (input.dataType == DataType::FLOAT16) {
-            inputData -= input.Count(0);
-            outputData -= output.Count(0);
             int len = output.Count(0);
             for (int i = 0; i < len; i++) {
                 ((uint16_t *) output.cpuData)[i] = float_to_half(outputData[i]);
@@ -3097,20 +2878,7 @@ namespace fastllm {
             int n = input.dims[0];
             int m = input.Count(1);
 
-            int threadNum = 1;
-            int per = m / threadNum;
-            int cur = 0;
-            auto pool = GetPool();
-            std::vector <std::future <void> > futures;
-            for (int i = 0; i < threadNum - 1; i++) {
-                int end = cur + per + (cur + per * (threadNum - i) < m);
-                futures.push_back(pool->Submit(Transpose, ((float*)tmpData) + cur * n, ((float*)curData) + cur, n, m, n, end - cur));
-                cur = end;
-            }
-            Transpose(((float*)tmpData) + cur * n, ((float*)curData) + cur, n, m, n, m - cur);
-            for (int i = 0; i < futures.size(); i++) {
-                futures[i].get();
-            }
+            Transpose((float*)tmpData, (float*)curData, n, m, n, m);
         } else if (axis == std::vector <int> {1, 0, 2}) {
             int n = input.dims[0];
             int m = input.dims[1];
@@ -0,0 +1,1572 @@
+// CPU上Linear, 激活函数和Norm等的计算kernel
+// 开启USE_FAT_BINARY时, 这个文件会用不同的指令集参数编译多次, 每次放在不同的namespace里(FASTLLM_CPU_KERNEL_ISA),
+// 运行时由GetCpuLinearKernels()按cpuid检测结果选择; 否则只按编译参数(-march=native)编译一次
+// 注意: 这里不要实例化std容器等模板, 否则不同指令集编译出的同名实例会在链接时被随机合并
+
+#include "cpukernels.h"
+
+#include <cstring>
+
+#ifdef __aarch64__
+#include <arm_neon.h>
+#include "armMath.h"
+#endif
+
+#include "utils.h"
+#include "avxMath.h"
+
+#ifndef FASTLLM_CPU_KERNEL_ISA
+#define FASTLLM_CPU_KERNEL_ISA native
+#endif
+
+#define FASTLLM_KERNEL_CONCAT_(a, b) a##b
+#define FASTLLM_KERNEL_CONCAT(a, b) FASTLLM_KERNEL_CONCAT_(a, b)
+
+namespace fastllm {
+namespace FASTLLM_CPU_KERNEL_ISA {
+    // 代替std::min / std::max, 原因见文件开头的说明
+    static inline int KernelMin(int a, int b) {
+        return b < a ? b : a;
+    }
+
+    static inline float KernelMax(float a, float b) {
+        return a < b ? b : a;
+    }
+
+#ifdef __AVX2__
+    int DotU8U8(uint8_t *a, uint8_t *b, int n) {
+        __m256i acc = _mm256_setzero_si256();
+        int i = 0;
+        int ans = 0;
+        const __m256i lowMask = _mm256_set1_epi8(0xf);
+        const __m256i ones = _mm256_set1_epi16(1);
+        const __m256i ones8 = _mm256_set1_epi8(1);
+        const __m256i xors = _mm256_set1_epi8(-128);
+        for (; i + 31 < n; i += 32) {
+            __m256i bx = _mm256_loadu_si256((const __m256i *) (a + i));
+            __m256i by = _mm256_loadu_si256((const __m256i *) (b + i));
+
+            by = _mm256_xor_si256(by, xors);
+            by = _mm256_add_epi8(by, _mm256_and_si256(_mm256_cmpeq_epi8(by, xors), ones8));
+
+            by = _mm256_sign_epi8(by, bx);
+            bx = _mm256_sign_epi8(bx, bx);
+
+            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_maddubs_epi16(bx, by), ones));
+        }
+        for (; i < n; i++) {
+            ans += ((int8_t*)a)[i] * ((int)b[i] - 128);
+        }
+
+        return ans + I32sum(acc);
+    };
+//#else
+//    int DotU8U8(uint8_t *a, uint8_t *b, int n) {
+//        __m256i acc = _mm256_setzero_si256();
+
+//        int i = 0;
+//        int ans = 0;
+//        for (; i + 31 < n; i += 32) {
+//            __m256i bx = _mm256_loadu_si256((const __m256i *) (a + i));
+//            __m256i by = _mm256_loadu_si256((const __m256i *) (b + i));
+
+//            __m256i mx0 = _mm256_cvtepu8_epi16(_mm256_extractf128_si256(bx, 0));
+//            __m256i mx1 = _mm256_cvtepu8_epi16(_mm256_extractf128_si256(bx, 1));
+
+//            __m256i my0 = _mm256_cvtepu8_epi16(_mm256_extractf128_si256(by, 0));
+//            __m256i my1 = _mm256_cvtepu8_epi16(_mm256_extractf128_si256(by, 1));
+
+//            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(mx0, my0));
+//            //acc = _mm256_add_epi32(acc, _mm256_madd_epi16(mx1, my1));
+//        }
+//        for (; i < n; i++) {
+//            ans += a[i] * b[i];
+//        }
+
+//        return ans + I32sum(acc);
+//    };
+    int DotU4U8(uint8_t *a, uint8_t *b, int n) {
+        __m256i acc = _mm256_setzero_si256();
+
+        int i = 0;
+        int ans = 0;
+        const __m256i lowMask = _mm256_set1_epi8(0xf);
+        const __m256i ones = _mm256_set1_epi16(1);
+        for (; i + 31 < n; i += 32) {
+            __m128i orix = _mm_loadu_si128((const __m128i *) (a + i / 2));
+            __m256i bytex = _mm256_set_m128i(_mm_srli_epi16(orix, 4), orix);
+            __m256i bx = _mm256_and_si256(lowMask, bytex);
+            __m256i by = _mm256_loadu_si256((const __m256i *) (b + i));
+            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_maddubs_epi16(by, bx), ones));
+        }
+        for (; i < n; i++) {
+            int w = (i & 1) ? (a[i / 2] & 0xF) : (a[i / 2] >> 4);
+            ans += w * b[i];
+        }
+
+        return ans + I32sum(acc);
+    };
+
+    // 一行weight同时和ROWS行input做点积, weight每32字节只读取、变换一次, input行间距为stride
+    template <int ROWS>
+    void DotU8U8Rows(uint8_t *a, int stride, uint8_t *b, int n, int *c) {
+        __m256i acc[ROWS];
+        for (int r = 0; r < ROWS; r++) {
+            acc[r] = _mm256_setzero_si256();
+        }
+        int i = 0;
+        const __m256i ones = _mm256_set1_epi16(1);
+        const __m256i ones8 = _mm256_set1_epi8(1);
+        const __m256i xors = _mm256_set1_epi8(-128);
+        for (; i + 31 < n; i += 32) {
+            __m256i by = _mm256_loadu_si256((const __m256i *) (b + i));
+            by = _mm256_xor_si256(by, xors);
+            by = _mm256_add_epi8(by, _mm256_and_si256(_mm256_cmpeq_epi8(by, xors), ones8));
+            for (int r = 0; r < ROWS; r++) {
+                __m256i bx = _mm256_loadu_si256((const __m256i *) (a + r * stride + i));
+                __m256i sy = _mm256_sign_epi8(by, bx);
+                bx = _mm256_sign_epi8(bx, bx);
+                acc[r] = _mm256_add_epi32(acc[r], _mm256_madd_epi16(_mm256_maddubs_epi16(bx, sy), ones));
+            }
+        }
+        for (int r = 0; r < ROWS; r++) {
+            int ans = 0;
+            for (int j = i; j < n; j++) {
+                ans += ((int8_t*)a)[r * stride + j] * ((int)b[j] - 128);
+            }
+            c[r] = ans + I32sum(acc[r]);
+        }
+    }
+
+    void DotU8U8Rows(uint8_t *a, int stride, uint8_t *b, int n, int rows, int *c) {
+        switch (rows) {
+            case 4: DotU8U8Rows <4> (a, stride, b, n, c); break;
+            case 3: DotU8U8Rows <3> (a, stride, b, n, c); break;
+            case 2: DotU8U8Rows <2> (a, stride, b, n, c); break;
+            default:
+                for (int r = 0; r < rows; r++) {
+                    c[r] = DotU8U8(a + r * stride, b, n);
+                }
+        }
+    }
+
+    // 一行int4 weight同时和ROWS行input做点积, weight只解包一次, input行间距为stride
+    template <int ROWS>
+    void DotU4U8Rows(uint8_t *a, uint8_t *b, int stride, int n, int *c) {
+        __m256i acc[ROWS];
+        for (int r = 0; r < ROWS; r++) {
+            acc[r] = _mm256_setzero_si256();
+        }
+        int i = 0;
+        const __m256i lowMask = _mm256_set1_epi8(0xf);
+        const __m256i ones = _mm256_set1_epi16(1);
+        for (; i + 31 < n; i += 32) {
+            __m128i orix = _mm_loadu_si128((const __m128i *) (a + i / 2));
+            __m256i bytex = _mm256_set_m128i(_mm_srli_epi16(orix, 4), orix);
+            __m256i bx = _mm256_and_si256(lowMask, bytex);
+            for (int r = 0; r < ROWS; r++) {
+                __m256i by = _mm256_loadu_si256((const __m256i *) (b + r * stride + i));
+                acc[r] = _mm256_add_epi32(acc[r], _mm256_madd_epi16(_mm256_maddubs_epi16(by, bx), ones));
+            }
+        }
+        for (int r = 0; r < ROWS; r++) {
+            int ans = 0;
+            for (int j = i; j < n; j++) {
+                int w = (j & 1) ? (a[j / 2] & 0xF) : (a[j / 2] >> 4);
+                ans += w * b[r * stride + j];
+            }
+            c[r] = ans + I32sum(acc[r]);
+        }
+    }
+
+#if defined(__AVX512VNNI__) && defined(__AVX512BW__) && defined(__AVX512VL__)
+    // AVX512-VNNI: vpdpbusd计算 sum(uint8 weight * int8 input), 不需要DotU8U8里的sign技巧
+    // 结果不含 -128 * sum(input), 由调用者减去
+    template <int ROWS>
+    void DotU8S8RowsVNNI(uint8_t *a, int stride, uint8_t *b, int n, int *c) {
+        __m512i acc[ROWS];
+        for (int r = 0; r < ROWS; r++) {
+            acc[r] = _mm512_setzero_si512();
+        }
+        for (int i = 0; i < n; i += 64) {
+            __mmask64 mask = (n - i >= 64) ? ~0ULL : ((1ULL << (n - i)) - 1);
+            __m512i vb = _mm512_maskz_loadu_epi8(mask, b + i);
+            for (int r = 0; r < ROWS; r++) {
+                __m512i va = _mm512_maskz_loadu_epi8(mask, a + r * stride + i);
+                acc[r] = _mm512_dpbusd_epi32(acc[r], vb, va);
+            }
+        }
+        for (int r = 0; r < ROWS; r++) {
+            c[r] = _mm512_reduce_add_epi32(acc[r]);
+        }
+    }
+
+    void DotU8S8RowsVNNI(uint8_t *a, int stride, uint8_t *b, int n, int rows, int *c) {
+        switch (rows) {
+            case 4: DotU8S8RowsVNNI <4> (a, stride, b, n, c); break;
+            case 3: DotU8S8RowsVNNI <3> (a, stride, b, n, c); break;
+            case 2: DotU8S8RowsVNNI <2> (a, stride, b, n, c); break;
+            default: DotU8S8RowsVNNI <1> (a, stride, b, n, c); break;
+        }
+    }
+
+    // AVX512-VNNI版本的DotU4U8Rows, 每次处理64个int4, input需按32个一组重排(与AVX2版本相同)
+    template <int ROWS>
+    void DotU4U8RowsVNNI(uint8_t *a, uint8_t *b, int stride, int n, int *c) {
+        __m512i acc[ROWS];
+        __m256i acc256[ROWS];
+        for (int r = 0; r < ROWS; r++) {
+            acc[r] = _mm512_setzero_si512();
+            acc256[r] = _mm256_setzero_si256();
+        }
+        int i = 0;
+        const __m512i lowMask = _mm512_set1_epi8(0xf);
+        for (; i + 63 < n; i += 64) {
+            __m256i orix = _mm256_loadu_si256((const __m256i *) (a + i / 2));
+            __m512i bytex = _mm512_inserti64x4(_mm512_castsi256_si512(orix), _mm256_srli_epi16(orix, 4), 1);
+            // [lo0, lo1, hi0, hi1] -> [lo0, hi0, lo1, hi1], 和每32个input的重排方式对应
+            bytex = _mm512_shuffle_i64x2(bytex, bytex, 0xD8);
+            __m512i bx = _mm512_and_si512(lowMask, bytex);
+            for (int r = 0; r < ROWS; r++) {
+                __m512i by = _mm512_loadu_si512((const void *) (b + r * stride + i));
+                acc[r] = _mm512_dpbusd_epi32(acc[r], by, bx);
+            }
+        }
+        for (; i + 31 < n; i += 32) {
+            __m128i orix = _mm_loadu_si128((const __m128i *) (a + i / 2));
+            __m256i bytex = _mm256_set_m128i(_mm_srli_epi16(orix, 4), orix);
+            __m256i bx = _mm256_and_si256(_mm256_set1_epi8(0xf), bytex);
+            for (int r = 0; r < ROWS; r++) {
+                __m256i by = _mm256_loadu_si256((const __m256i *) (b + r * stride + i));
+                acc256[r] = _mm256_dpbusd_epi32(acc256[r], by, bx);
+            }
+        }
+        for (int r = 0; r < ROWS; r++) {
+            int ans = 0;
+            for (int j = i; j < n; j++) {
+                int w = (j & 1) ? (a[j / 2] & 0xF) : (a[j / 2] >> 4);
+                ans += w * b[r * stride + j];
+            }
+            c[r] = ans + _mm512_reduce_add_epi32(acc[r]) + I32sum(acc256[r]);
+        }
+    }
+#endif
+
+    void DotU4U8Rows(uint8_t *a, uint8_t *b, int stride, int n, int rows, int *c, bool useVNNI) {
+#if defined(__AVX512VNNI__) && defined(__AVX512BW__) && defined(__AVX512VL__)
+        if (useVNNI) {
+            switch (rows) {
+                case 4: DotU4U8RowsVNNI <4> (a, b, stride, n, c); break;
+                case 3: DotU4U8RowsVNNI <3> (a, b, stride, n, c); break;
+                case 2: DotU4U8RowsVNNI <2> (a, b, stride, n, c); break;
+                default: DotU4U8RowsVNNI <1> (a, b, stride, n, c); break;
+            }
+            return;
+        }
+#else
+        (void)useVNNI;
+#endif
+        switch (rows) {
+            case 4: DotU4U8Rows <4> (a, b, stride, n, c); break;
+            case 3: DotU4U8Rows <3> (a, b, stride, n, c); break;
+            case 2: DotU4U8Rows <2> (a, b, stride, n, c); break;
+            default:
+                for (int r = 0; r < rows; r++) {
+                    c[r] = DotU4U8(a, b + r * stride, n);
+                }
+        }
+    }
+#endif
+
+#if defined(__AMX_INT8__) && defined(__AMX_TILE__)
+    struct AMXTileConfig {
+        uint8_t paletteId = 1;
+        uint8_t startRow = 0;
+        uint8_t reserved[14] = {0};
+        uint16_t colsb[16] = {0};
+        uint8_t rows[16] = {0};
+    };
+
+    // 每个tile为16行 x 64字节, 一次tdpbssd计算 [16, 64] x [64, 16]
+    // a: [nPad, mPad] 补0后的int8 input, b: Data::CalcAMXWeight重排好的权重
+    // 计算 c[i][j - kst] = sum(a[i] * (weight[j] - 128)), j in [kst, kend), kst为16的倍数, 与DotU8U8的结果对齐
+    void MultiplyAMX(int8_t *a, int8_t *b, int32_t *c, int n, int mPad, int kst, int kend, int kstride) {
+        AMXTileConfig config;
+        for (int i = 0; i < 6; i++) {
+            config.rows[i] = 16;
+            config.colsb[i] = 64;
+        }
+        _tile_loadconfig(&config);
+
+        int nPad = (n + 15) / 16 * 16;
+        alignas(64) int32_t result[16 * 16];
+        for (int j = kst; j < kend; j += 16) {
+            int cols = KernelMin(16, kend - j);
+            int8_t *packed = b + (size_t)(j / 16) * mPad * 16;
+            for (int i = 0; i < nPad; i += 64) {
+                int blocks = KernelMin(4, (nPad - i) / 16);
+                _tile_zero(0);
+                _tile_zero(1);
+                _tile_zero(2);
+                _tile_zero(3);
+                for (int l = 0; l < mPad; l += 64) {
+                    _tile_loadd(5, packed + l / 4 * 64, 64);
+                    _tile_loadd(4, a + (size_t)i * mPad + l, mPad);
+                    _tile_dpbssd(0, 4, 5);
+                    if (blocks > 1) {
+                        _tile_loadd(4, a + (size_t)(i + 16) * mPad + l, mPad);
+                        _tile_dpbssd(1, 4, 5);
+                    }
+                    if (blocks > 2) {
+                        _tile_loadd(4, a + (size_t)(i + 32) * mPad + l, mPad);
+                        _tile_dpbssd(2, 4, 5);
+                    }
+                    if (blocks > 3) {
+                        _tile_loadd(4, a + (size_t)(i + 48) * mPad + l, mPad);
+                        _tile_dpbssd(3, 4, 5);
+                    }
+                }
+                for (int t = 0; t < blocks; t++) {
+                    switch (t) {
+                        case 0: _tile_stored(0, result, 64); break;
+                        case 1: _tile_stored(1, result, 64); break;
+                        case 2: _tile_stored(2, result, 64); break;
+                        default: _tile_stored(3, result, 64); break;
+                    }
+                    for (int r = 0; r < 16 && i + t * 16 + r < n; r++) {
+                        memcpy(c + (size_t)(i + t * 16 + r) * kstride + (j - kst), result + r * 16, cols * sizeof(int32_t));
+                    }
+                }
+            }
+        }
+        _tile_release();
+    }
+#endif
+
+
+    void FloatLinearPart(float *inputData, float *weightData, float *biasData, float *outputData,
+                         int n, int m, int k, int st, int end) {
+        for (int i = 0; i < n; i++) {
+            for (int j = st; j < end; j++) {
+                float now = biasData ? biasData[j] : 0.0f;
+                int l = 0;
+#ifdef __aarch64__
+                float32x4_t sum = {0, 0, 0, 0};
+                for (; l + 3 < m; l += 4) {
+                    sum = vaddq_f32(sum, vmulq_f32(vld1q_f32(inputData + i * m + l), vld1q_f32(weightData + j * m + l)));
+                }
+                now += sum[0] + sum[1] + sum[2] + sum[3];
+#else
+#ifdef __AVX2__
+                __m256 vsum = _mm256_setzero_ps();
+                for (; l + 7 < m; l += 8) {
+                    __m256 vi = _mm256_loadu_ps(inputData + i * m + l);
+                    __m256 vw = _mm256_loadu_ps(weightData + j * m + l);
+                    vsum = _mm256_fmadd_ps(vi, vw, vsum);
+                }
+                now += Floatsum(vsum);
+#endif
+#endif
+                for (; l < m; l++) {
+                    now += inputData[i * m + l] * weightData[j * m + l];
+                }
+                outputData[i * k + j] = now;
+            }
+        }
+    }
+
+    // float的input, float16的weight, 直接计算得到float的output
+    void Float16LinearPart(float *inputData, uint16_t *weightData, float *biasData, float *outputData,
+                           int n, int m, int k, int st, int end) {
+        for (int i = 0; i < n; i++) {
+            for (int j = st; j < end; j++) {
+                float now = biasData ? biasData[j] : 0.0f;
+                int l = 0;
+#ifdef __ARM_FEATURE_FP16_VECTOR_ARITHMETIC
+                float16x8_t sum = {0, 0, 0, 0, 0, 0, 0, 0};
+                for (; l + 7 < m; l += 8) {
+                    sum = vfmaq_f16(sum, vld1q_f16((float16_t*)inputData + i * m + l),
+                                        vld1q_f16((float16_t*)weightData + j * m + l));
+                }
+                now += sum[0] + sum[1] + sum[2] + sum[3] + sum[4] + sum[5] + sum[6] + sum[7];
+#else
+#ifdef __aarch64__
+                float32x4_t sum = {0, 0, 0, 0};
+                for (; l + 3 < m; l += 4) {
+                    float32x4_t vcur = {fp16tofp32.dict[weightData[j * m + l]], fp16tofp32.dict[weightData[j * m + l + 1]],
+                                        fp16tofp32.dict[weightData[j * m + l + 2]], fp16tofp32.dict[weightData[j * m + l + 3]]};
+                    sum = vaddq_f32(sum, vmulq_f32(vld1q_f32(inputData + i * m + l), vcur));
+                }
+                now += sum[0] + sum[1] + sum[2] + sum[3];
+#else
+#ifdef __AVX2__
+                __m256 vsum = _mm256_setzero_ps();
+                for (; l + 7 < m; l += 8) {
+                    __m256 vi = _mm256_loadu_ps(inputData + i * m + l);
+                    __m256 vw = _mm256_cvtph_ps(_mm_loadu_si128((__m128i *) (weightData + j * m + l)));
+                    vsum = _mm256_fmadd_ps(vi, vw, vsum);
+                }
+                now += Floatsum(vsum);
+#endif
+#endif
+#endif
+                for (; l < m; l++) {
+                    now += inputData[i * m + l] * fp16tofp32.dict[weightData[j * m + l]];
+                }
+                outputData[i * k + j] = now;
+            }
+        }
+    }
+
+    // 量化矩阵乘时一起计算的input行数, 每行weight读入后同时和这些行做点积
+    const int multiplyBlockRows = 4;
+
+    // L2(码本)权重: weight存的是码本下标, 计算时在寄存器里查表后直接和input做FMA, 不展开成float权重
+    // 码本较小时用vpermps查表, 否则用gather
+    template <typename T>
+    void CodebookLinearPart(float *inputData, T *indexData, float *codebook, int codebookSize, float *biasData,
+                            float *outputData, int n, int m, int k, int st, int end) {
+#ifdef __AVX512F__
+        __m512 table0 = _mm512_setzero_ps(), table1 = _mm512_setzero_ps();
+        if (codebookSize <= 32) {
+            float temp[32] = {0};
+            memcpy(temp, codebook, codebookSize * sizeof(float));
+            table0 = _mm512_loadu_ps(temp);
+            table1 = _mm512_loadu_ps(temp + 16);
+        }
+#elif defined(__AVX2__)
+        __m256 table = _mm256_setzero_ps();
+        if (codebookSize <= 8) {
+            float temp[8] = {0};
+            memcpy(temp, codebook, codebookSize * sizeof(float));
+            table = _mm256_loadu_ps(temp);
+        }
+#endif
+        float sums[multiplyBlockRows];
+        for (int bst = 0; bst < n; bst += multiplyBlockRows) {
+            int rows = KernelMin(multiplyBlockRows, n - bst);
+            float *inputStart = inputData + (long long) bst * m;
+            for (int j = st; j < end; j++) {
+                T *index = indexData + (long long) j * m;
+                int l = 0;
+#ifdef __AVX512F__
+                __m512 acc[multiplyBlockRows];
+                for (int r = 0; r < rows; r++) {
+                    acc[r] = _mm512_setzero_ps();
+                }
+                for (; l + 15 < m; l += 16) {
+                    __m512i vidx;
+                    if (sizeof(T) == 1) {
+                        vidx = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *) (index + l)));
+                    } else {
+                        vidx = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *) (index + l)));
+                    }
+                    __m512 vw;
+                    if (codebookSize <= 16) {
+                        vw = _mm512_permutexvar_ps(vidx, table0);
+                    } else if (codebookSize <= 32) {
+                        vw = _mm512_permutex2var_ps(table0, vidx, table1);
+                    } else {
+                        vw = _mm512_i32gather_ps(vidx, codebook, 4);
+                    }
+                    for (int r = 0; r < rows; r++) {
+                        acc[r] = _mm512_fmadd_ps(_mm512_loadu_ps(inputStart + r * m + l), vw, acc[r]);
+                    }
+                }
+                for (int r = 0; r < rows; r++) {
+                    sums[r] = _mm512_reduce_add_ps(acc[r]);
+                }
+#elif defined(__AVX2__)
+                __m256 acc[multiplyBlockRows];
+                for (int r = 0; r < rows; r++) {
+                    acc[r] = _mm256_setzero_ps();
+                }
+                for (; l + 7 < m; l += 8) {
+                    __m256i vidx;
+                    if (sizeof(T) == 1) {
+                        vidx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (index + l)));
+                    } else {
+                        vidx = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *) (index + l)));
+                    }
+                    __m256 vw = codebookSize <= 8 ? _mm256_permutevar8x32_ps(table, vidx)
+                                                  : _mm256_i32gather_ps(codebook, vidx, 4);
+                    for (int r = 0; r < rows; r++) {
+                        acc[r] = _mm256_fmadd_ps(_mm256_loadu_ps(inputStart + r * m + l), vw, acc[r]);
+                    }
+                }
+                for (int r = 0; r < rows; r++) {
+                    sums[r] = Floatsum(acc[r]);
+                }
+#else
+                for (int r = 0; r < rows; r++) {
+                    sums[r] = 0.0f;
+                }
+#endif
+                for (; l < m; l++) {
+                    float w = codebook[index[l]];
+                    for (int r = 0; r < rows; r++) {
+                        sums[r] += inputStart[r * m + l] * w;
+                    }
+                }
+                for (int r = 0; r < rows; r++) {
+                    outputData[(long long) (bst + r) * k + j] = sums[r] + (biasData == nullptr ? 0.0f : biasData[j]);
+                }
+            }
+        }
+    }
+
+    // float的input, bfloat16的weight, weight移位展开成float后做FMA
+    // 支持AVX512_BF16且n >= multiplyBlockRows时, input也先转成bfloat16, 用vdpbf16ps计算 (n较小时访存是瓶颈, 保持float精度)
+    void BFloat16LinearPart(float *inputData, uint16_t *weightData, float *biasData, float *outputData,
+                            int n, int m, int k, int st, int end) {
+        float sums[multiplyBlockRows];
+        for (int bst = 0; bst < n; bst += multiplyBlockRows) {
+            int rows = KernelMin(multiplyBlockRows, n - bst);
+            float *inputStart = inputData + (long long) bst * m;
+            for (int j = st; j < end; j++) {
+                uint16_t *weight = weightData + (long long) j * m;
+                int l = 0;
+#ifdef __AVX512F__
+                __m512 acc[multiplyBlockRows];
+                for (int r = 0; r < rows; r++) {
+                    acc[r] = _mm512_setzero_ps();
+                }
+                for (; l + 15 < m; l += 16) {
+                    __m512 vw = _mm512_castsi512_ps(_mm512_slli_epi32(
+                            _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *) (weight + l))), 16));
+                    for (int r = 0; r < rows; r++) {
+                        acc[r] = _mm512_fmadd_ps(_mm512_loadu_ps(inputStart + r * m + l), vw, acc[r]);
+                    }
+                }
+                for (int r = 0; r < rows; r++) {
+                    sums[r] = _mm512_reduce_add_ps(acc[r]);
+                }
+#elif defined(__AVX2__)
+                __m256 acc[multiplyBlockRows];
+                for (int r = 0; r < rows; r++) {
+                    acc[r] = _mm256_setzero_ps();
+                }
+                for (; l + 7 < m; l += 8) {
+                    __m256 vw = _mm256_castsi256_ps(_mm256_slli_epi32(
+                            _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *) (weight + l))), 16));
+                    for (int r = 0; r < rows; r++) {
+                        acc[r] = _mm256_fmadd_ps(_mm256_loadu_ps(inputStart + r * m + l), vw, acc[r]);
+                    }
+                }
+                for (int r = 0; r < rows; r++) {
+                    sums[r] = Floatsum(acc[r]);
+                }
+#else
+                for (int r = 0; r < rows; r++) {
+                    sums[r] = 0.0f;
+                }
+#endif
+                for (; l < m; l++) {
+                    float w = bfloat16_to_float(weight[l]);
+                    for (int r = 0; r < rows; r++) {
+                        sums[r] += inputStart[r * m + l] * w;
+                    }
+                }
+                for (int r = 0; r < rows; r++) {
+                    outputData[(long long) (bst + r) * k + j] = sums[r] + (biasData == nullptr ? 0.0f : biasData[j]);
+                }
+            }
+        }
+    }
+
+#if defined(__AVX512BF16__) && defined(__AVX512BW__)
+    // bfloat16的input和weight, 用dpbf16ps每次计算32个乘加
+    void BFloat16InputLinearPart(uint16_t *inputData, uint16_t *weightData, float *biasData, float *outputData,
+                                 int n, int m, int k, int st, int end) {
+        int m32 = m / 32 * 32;
+        float sums[multiplyBlockRows];
+        for (int bst = 0; bst < n; bst += multiplyBlockRows) {
+            int rows = KernelMin(multiplyBlockRows, n - bst);
+            uint16_t *inputStart = inputData + (long long) bst * m;
+            for (int j = st; j < end; j++) {
+                uint16_t *weight = weightData + (long long) j * m;
+                __m512 acc[multiplyBlockRows];
+                for (int r = 0; r < rows; r++) {
+                    acc[r] = _mm512_setzero_ps();
+                }
+                int l = 0;
+                for (; l < m32; l += 32) {
+                    __m512bh vw = (__m512bh) _mm512_loadu_si512((const __m512i *) (weight + l));
+                    for (int r = 0; r < rows; r++) {
+                        __m512bh vi = (__m512bh) _mm512_loadu_si512((const __m512i *) (inputStart + (long long) r * m + l));
+                        acc[r] = _mm512_dpbf16_ps(acc[r], vi, vw);
+                    }
+                }
+                for (int r = 0; r < rows; r++) {
+                    sums[r] = _mm512_reduce_add_ps(acc[r]);
+                }
+                for (; l < m; l++) {
+                    float w = bfloat16_to_float(weight[l]);
+                    for (int r = 0; r < rows; r++) {
+                        sums[r] += bfloat16_to_float(inputStart[(long long) r * m + l]) * w;
+                    }
+                }
+                for (int r = 0; r < rows; r++) {
+                    outputData[(long long) (bst + r) * k + j] = sums[r] + (biasData == nullptr ? 0.0f : biasData[j]);
+                }
+            }
+        }
+    }
+#endif
+
+    //a = [n, m], b = [k, m], c = aT(b') = [n, k]
+    void Multiply(uint8_t *a, uint8_t *b, int32_t *c, int n, int m, int k, int kstride) {
+#ifdef __ARM_FEATURE_DOTPROD
+        int block = 0;
+        for (; block < n; block++) {
+            uint8_t *weightWalk = b;
+            uint8_t *inputStart = a + block * m;
+
+            for (int i = 0; i < k; i++) {
+                int value = 0;
+                uint8_t *inputWalk = inputStart;
+                int j = 0;
+                uint32x4_t sum0 = {0, 0, 0, 0};
+                for (; j + 31 < m; j += 32) {
+                    uint8x16_t vi = vld1q_u8(inputWalk);
+                    uint8x16_t vi0 = vld1q_u8(inputWalk + 16);
+                    uint8x16_t vw = vld1q_u8(weightWalk);
+                    uint8x16_t vw0 = vld1q_u8(weightWalk + 16);
+                    sum0 = vdotq_u32(sum0, vi, vw);
+                    sum0 = vdotq_u32(sum0, vi0, vw0);
+                    inputWalk += 32;
+                    weightWalk += 32;
+                }
+
+                value += sum0[0] + sum0[1] + sum0[2] + sum0[3];
+                for (; j < m; j++) {
+				    value += (int)(*(weightWalk++)) * (*(inputWalk++));
+			    }
+                c[block * kstride + i] = value;
+            }
+        }
+#elif defined(__aarch64__)
+        int block = 0;
+        for (; block < n; block++) {
+            uint8_t *weightWalk = b;
+            uint8_t *inputStart = a + block * m;
+
+            for (int i = 0; i < k; i++) {
+                int value = 0;
+                uint8_t *inputWalk = inputStart;
+
+                int per = 64;
+                int cnt = m / per;
+                int sur = m % per;
+
+                uint32x4_t sum = {0};
+                uint16x8_t temp = {0};
+                uint16x8_t temp1 = {0};
+                uint16x8_t temp2 = {0};
+                uint16x8_t temp3 = {0};
+                uint16x8_t temp4 = {0};
+                uint16x8_t temp5 = {0};
+                uint16x8_t temp6 = {0};
+                uint16x8_t temp7 = {0};
+
+                while (cnt--) {
+                    temp = vmull_u8(vld1_u8(inputWalk), vld1_u8(weightWalk));
+                    temp1 = vmull_u8(vld1_u8(inputWalk + 8), vld1_u8(weightWalk + 8));
+                    temp2 = vmull_u8(vld1_u8(inputWalk + 16), vld1_u8(weightWalk + 16));
+                    temp3 = vmull_u8(vld1_u8(inputWalk + 24), vld1_u8(weightWalk + 24));
+                    temp4 = vmull_u8(vld1_u8(inputWalk + 32), vld1_u8(weightWalk + 32));
+                    temp5 = vmull_u8(vld1_u8(inputWalk + 40), vld1_u8(weightWalk + 40));
+                    temp6 = vmull_u8(vld1_u8(inputWalk + 48), vld1_u8(weightWalk + 48));
+                    temp7 = vmull_u8(vld1_u8(inputWalk + 56), vld1_u8(weightWalk + 56));
+
+                    sum = vpadalq_u16(sum, temp);
+                    sum = vpadalq_u16(sum, temp1);
+                    sum = vpadalq_u16(sum, temp2);
+                    sum = vpadalq_u16(sum, temp3);
+                    sum = vpadalq_u16(sum, temp4);
+                    sum = vpadalq_u16(sum, temp5);
+                    sum = vpadalq_u16(sum, temp6);
+                    sum = vpadalq_u16(sum, temp7);
+
+                    inputWalk += per;
+                    weightWalk += per;
+                }
+
+                value += (sum[0] + sum[1] + sum[2] + sum[3]);
+                while (sur--) {
+                    value += (int)(*(weightWalk++)) * (*(inputWalk++));
+                }
+
+                c[block * kstride + i] = value;
+            }
+        }
+#elif defined(__AVX2__)
+        int values[multiplyBlockRows];
+#if defined(__AVX512VNNI__) && defined(__AVX512BW__) && defined(__AVX512VL__)
+        if (GetCpuInstructionLevel() >= ISA_AVX512_VNNI) {
+            int inputSums[multiplyBlockRows];
+            for (int block = 0; block < n; block += multiplyBlockRows) {
+                int rows = KernelMin(multiplyBlockRows, n - block);
+                uint8_t *weightWalk = b;
+                uint8_t *inputStart = a + block * m;
+                for (int r = 0; r < rows; r++) {
+                    inputSums[r] = 0;
+                    for (int j = 0; j < m; j++) {
+                        inputSums[r] += ((int8_t*)inputStart)[r * m + j];
+                    }
+                }
+
+                for (int i = 0; i < k; i++) {
+                    DotU8S8RowsVNNI(inputStart, m, weightWalk, m, rows, values);
+                    for (int r = 0; r < rows; r++) {
+                        c[(block + r) * kstride + i] = values[r] - 128 * inputSums[r];
+                    }
+                    weightWalk += m;
+                }
+            }
+            return;
+        }
+#endif
+        for (int block = 0; block < n; block += multiplyBlockRows) {
+            int rows = KernelMin(multiplyBlockRows, n - block);
+            uint8_t *weightWalk = b;
+            uint8_t *inputStart = a + block * m;
+
+            for (int i = 0; i < k; i++) {
+                DotU8U8Rows(inputStart, m, weightWalk, m, rows, values);
+                for (int r = 0; r < rows; r++) {
+                    c[(block + r) * kstride + i] = values[r];
+                }
+                weightWalk += m;
+            }
+        }
+#else
+        for (int bst = 0; bst < n; bst += multiplyBlockRows) {
+            int bend = KernelMin(n, bst + multiplyBlockRows);
+            for (int i = 0; i < k; i++) {
+                uint8_t *weightStart = b + i * m;
+                for (int block = bst; block < bend; block++) {
+                    int value = 0;
+                    uint8_t *weightWalk = weightStart;
+                    uint8_t *inputWalk = a + block * m;
+                    for (int j = 0; j < m; j++) {
+                        value += (int)(*(weightWalk++)) * (*(inputWalk++));
+                    }
+
+                    c[block * kstride + i] = value;
+                }
+            }
+        }
+#endif
+    }
+
+    //a = [n, m], b = [k, m], c = aT(b') = [n, k]
+    void MultiplyInt4(uint8_t *a, uint8_t *b, int32_t *c, int n, int m, int k, int kstride,
+                      int *weightSums, int *weightZeros, float *scales, float *bias, LowBitConfig *config,
+                      int *inputSums) {
+#ifdef __AVX2__
+        bool useVNNI = GetCpuInstructionLevel() >= ISA_AVX512_VNNI;
+#endif
+        int dots[multiplyBlockRows];
+        for (int bst = 0; bst < n; bst += multiplyBlockRows) {
+            int bend = KernelMin(n, bst + multiplyBlockRows);
+            uint8_t *weightWalk = b;
+
+            for (int i = 0; i < k; i++) {
+#ifdef __AVX2__
+                DotU4U8Rows(weightWalk + i * m / 2, a + bst * m, m, m, bend - bst, dots, useVNNI);
+#endif
+                for (int block = bst; block < bend; block++) {
+                    uint32_t inputSum = inputSums[block];
+                    int value = 0;
+                    uint8_t *inputWalk = a + block * m;
+                    int j = 0;
+#ifdef __ARM_FEATURE_DOTPROD
+                    uint8x8_t maskHigh = vdup_n_u8(0xF0);
+                    uint8x8_t maskLow = vdup_n_u8(0xF);
+                    uint32x2_t sum0 = {0, 0};
+
+                    for (; j + 15 < m; j += 16) {
+                        uint8x8_t ori = vld1_u8(weightWalk + (i * m + j) / 2);
+                        uint8x8x2_t in = vld2_u8(inputWalk + j);
+                        uint8x8_t va = vand_u8(ori, maskLow);
+                        uint8x8_t vb = vshr_n_u8(vand_u8(ori, maskHigh), 4);
+                        sum0 = vdot_u32(sum0, va, in.val[1]);
+                        sum0 = vdot_u32(sum0, vb, in.val[0]);
+                    }
+                    value += sum0[0] + sum0[1];
+#elif defined(__aarch64__)
+                    uint8x8_t maskHigh = vdup_n_u8(0xF0);
+                    uint8x8_t maskLow = vdup_n_u8(0xF);
+                    uint32x4_t sum0 = {0, 0, 0, 0};
+
+                    for (; j + 15 < m; j += 16) {
+                        uint8x8_t ori = vld1_u8(weightWalk + (i * m + j) / 2);
+                        uint8x8x2_t in = vld2_u8(inputWalk + j);
+                        uint8x8_t va = vand_u8(ori, maskLow);
+                        uint8x8_t vb = vshr_n_u8(vand_u8(ori, maskHigh), 4);
+                        sum0 = vpadalq_u16(sum0, vmull_u8(va, in.val[1]));
+                        sum0 = vpadalq_u16(sum0, vmull_u8(vb, in.val[0]));
+                    }
+                    value += sum0[0] + sum0[1] + sum0[2] + sum0[3];
+#elif defined(__AVX2__)
+                    value += dots[block - bst];
+                    j += m;
+#endif
+                    for (; j + 1 < m; j += 2) {
+                        int id = (i * m + j) / 2;
+                        value += (weightWalk[id] >> 4) * inputWalk[j];
+                        value += (weightWalk[id] & 0xF) * inputWalk[j + 1];
+                    }
+
+                    for (; j < m; j++) {
+                        int id = (i * m + j) / 2;
+                        if ((i * m + j) % 2) {
+                            value += (weightWalk[id] & 0xF) * inputWalk[j];
+                        } else {
+                            value += (weightWalk[id] >> 4) * inputWalk[j];
+                        }
+                    }
+
+                    value -= weightSums[i] * config[block].zeroPoint;
+                    value -= inputSum * weightZeros[i];
+                    value += (int)config[block].zeroPoint * weightZeros[i] * m;
+
+                    ((float*)c)[block * kstride + i] = scales[i] * config[block].scale * value +
+                                                       (bias == nullptr ? 0.0 : bias[i]);
+                }
+            }
+        }
+    }
+
+    //a = [n, m], b = [k, m], c = aT(b') = [n, k]
+    void MultiplyInt4Group(uint8_t *a, uint8_t *b, int32_t *c, int n, int m, int k, int kstride,
+                         int *weightSums, float *weightMins, float *scales, float *bias, 
+                         float *iscales, float *izeros, float *inputSums, int group, int groupCnt) {
+#ifdef __AVX2__
+        bool useVNNI = GetCpuInstructionLevel() >= ISA_AVX512_VNNI;
+#endif
+        float *allValues = new float[group * multiplyBlockRows];
+        int dots[multiplyBlockRows];
+
+        for (int bst = 0; bst < n; bst += multiplyBlockRows) {
+            int bend = KernelMin(n, bst + multiplyBlockRows);
+            uint8_t *weightWalk = b;
+
+            for (int i = 0; i < k; i++) {
+                memset(allValues, 0, group * multiplyBlockRows * sizeof(float));
+#ifdef __AVX2__
+                for (int g = 0; g < group; g++) {
+                    int st = g * groupCnt, end = KernelMin(m, (g + 1) * groupCnt);
+                    DotU4U8Rows(weightWalk + (i * m + st) / 2, a + bst * m + st, m, end - st, bend - bst, dots, useVNNI);
+                    for (int block = bst; block < bend; block++) {
+                        allValues[(block - bst) * group + g] = dots[block - bst];
+                    }
+                }
+#endif
+                for (int block = bst; block < bend; block++) {
+                    float *values = allValues + (block - bst) * group;
+                    float sum = 0.0;
+#ifndef __AVX2__
+                    uint8_t *inputWalk = a + block * m;
+                    for (int g = 0; g < group; g++) {
+                        int st = g * groupCnt, end = KernelMin(m, (g + 1) * groupCnt);
+                        float &value = values[g];
+                        int j = st;
+#ifdef __ARM_FEATURE_DOTPROD
+                        uint8x8_t maskHigh = vdup_n_u8(0xF0);
+                        uint8x8_t maskLow = vdup_n_u8(0xF);
+                        uint32x2_t sum0 = {0, 0};
+
+                        for (; j + 15 < end; j += 16) {
+                            uint8x8_t ori = vld1_u8(weightWalk + (i * m + j) / 2);
+                            uint8x8x2_t in = vld2_u8(inputWalk + j);
+                            uint8x8_t va = vand_u8(ori, maskLow);
+                            uint8x8_t vb = vshr_n_u8(vand_u8(ori, maskHigh), 4);
+                            sum0 = vdot_u32(sum0, va, in.val[1]);
+                            sum0 = vdot_u32(sum0, vb, in.val[0]);
+                        }
+                        value += sum0[0] + sum0[1];
+#elif defined(__aarch64__)
+                        uint8x8_t maskHigh = vdup_n_u8(0xF0);
+                        uint8x8_t maskLow = vdup_n_u8(0xF);
+                        uint32x4_t sum0 = {0, 0, 0, 0};
+
+                        for (; j + 15 < end; j += 16) {
+                            uint8x8_t ori = vld1_u8(weightWalk + (i * m + j) / 2);
+                            uint8x8x2_t in = vld2_u8(inputWalk + j);
+                            uint8x8_t va = vand_u8(ori, maskLow);
+                            uint8x8_t vb = vshr_n_u8(vand_u8(ori, maskHigh), 4);
+                            sum0 = vpadalq_u16(sum0, vmull_u8(va, in.val[1]));
+                            sum0 = vpadalq_u16(sum0, vmull_u8(vb, in.val[0]));
+                        }
+                        value += sum0[0] + sum0[1] + sum0[2] + sum0[3];
+#endif
+                        for (; j + 1 < end; j += 2) {
+                            int id = (i * m + j) / 2;
+                            value += (weightWalk[id] >> 4) * inputWalk[j];
+                            value += (weightWalk[id] & 0xF) * inputWalk[j + 1];
+                        }
+                    }
+#endif
+
+                    int g = 0;
+#ifdef __aarch64__
+                    float32x4_t vSum = vdupq_n_f32(0.0f);
+                    float32x4_t vGroupCnt = vdupq_n_f32(groupCnt);
+                    for (; g + 3 < group; g += 4) {
+                        int iid = block * group + g;
+                        int gid = i * group + g;
+                        float32x4_t vValue = vld1q_f32(values + g);
+                        float32x4_t vWeightSum = vcvtq_f32_s32(vld1q_s32(weightSums + gid));
+                        float32x4_t vWeightMin = vld1q_f32(weightMins + gid);
+                        float32x4_t vScale = vld1q_f32(scales + gid);
+                        float32x4_t vIzero = vld1q_f32(izeros + iid);
+                        float32x4_t vIscale = vld1q_f32(iscales + iid);
+                        float32x4_t vInputSum = vld1q_f32(inputSums + iid);
+                        float32x4_t vMiddle = vsubq_f32(vInputSum, vmulq_f32(vIzero, vGroupCnt));
+                        vValue = vsubq_f32(vValue, vmulq_f32(vWeightSum, vIzero));
+                        vSum = vaddq_f32(vSum, vmulq_f32(vScale, vmulq_f32(vIscale, vValue)));
+                        vSum = vaddq_f32(vSum, vmulq_f32(vWeightMin, vmulq_f32(vMiddle, vIscale)));
+                    }
+                    sum += vSum[0] + vSum[1] + vSum[2] + vSum[3];
+#endif
+                    for (; g < group; g++) {
+                        int iid = block * group + g;
+                        int gid = i * group + g;
+                        int value = values[g];
+                        value -= weightSums[gid] * izeros[iid];
+                        sum += scales[gid] * iscales[iid] * value +
+                            weightMins[gid] * (inputSums[iid] - izeros[iid] * groupCnt) * iscales[iid];
+                    }
+
+                    if (group * groupCnt > m) {
+                        int iid = block * group + group - 1;
+                        int gid = i * group + group - 1;
+                        sum += weightMins[gid] * izeros[iid] * (group * groupCnt - m) * iscales[iid];
+                    }
+
+                    ((float*)c)[block * kstride + i] = sum + (bias == nullptr ? 0.0 : bias[i]);
+                }
+            }
+        }
+        delete[] allValues;
+    }
+
+    //a = [n, m], b = [k, m], c = aT(b') = [n, k]
+    void MultiplyInt4NoZero(uint8_t *a, uint8_t *b, int32_t *c, int n, int m, int k, int kstride,
+                      int *weightSums, float *weightMins, float *scales, float *bias, LowBitConfig *config,
+                      int *inputSums) {
+#ifdef __AVX2__
+        bool useVNNI = GetCpuInstructionLevel() >= ISA_AVX512_VNNI;
+#endif
+        int dots[multiplyBlockRows];
+        for (int bst = 0; bst < n; bst += multiplyBlockRows) {
+            int bend = KernelMin(n, bst + multiplyBlockRows);
+            uint8_t *weightWalk = b;
+
+            for (int i = 0; i < k; i++) {
+#ifdef __AVX2__
+                DotU4U8Rows(weightWalk + i * m / 2, a + bst * m, m, m, bend - bst, dots, useVNNI);
+#endif
+                for (int block = bst; block < bend; block++) {
+                    uint32_t inputSum = inputSums[block];
+                    int value = 0;
+                    uint8_t *inputWalk = a + block * m;
+                    int j = 0;
+#ifdef __ARM_FEATURE_DOTPROD
+                    uint8x8_t maskHigh = vdup_n_u8(0xF0);
+                    uint8x8_t maskLow = vdup_n_u8(0xF);
+                    uint32x2_t sum0 = {0, 0};
+
+                    for (; j + 15 < m; j += 16) {
+                        uint8x8_t ori = vld1_u8(weightWalk + (i * m + j) / 2);
+                        uint8x8x2_t in = vld2_u8(inputWalk + j);
+                        uint8x8_t va = vand_u8(ori, maskLow);
+                        uint8x8_t vb = vshr_n_u8(vand_u8(ori, maskHigh), 4);
+                        sum0 = vdot_u32(sum0, va, in.val[1]);
+                        sum0 = vdot_u32(sum0, vb, in.val[0]);
+                    }
+                    value += sum0[0] + sum0[1];
+#elif defined(__aarch64__)
+                    uint8x8_t maskHigh = vdup_n_u8(0xF0);
+                    uint8x8_t maskLow = vdup_n_u8(0xF);
+                    uint32x4_t sum0 = {0, 0, 0, 0};
+
+                    for (; j + 15 < m; j += 16) {
+                        uint8x8_t ori = vld1_u8(weightWalk + (i * m + j) / 2);
+                        uint8x8x2_t in = vld2_u8(inputWalk + j);
+                        uint8x8_t va = vand_u8(ori, maskLow);
+                        uint8x8_t vb = vshr_n_u8(vand_u8(ori, maskHigh), 4);
+                        sum0 = vpadalq_u16(sum0, vmull_u8(va, in.val[1]));
+                        sum0 = vpadalq_u16(sum0, vmull_u8(vb, in.val[0]));
+                    }
+                    value += sum0[0] + sum0[1] + sum0[2] + sum0[3];
+#elif defined(__AVX2__)
+                    value += dots[block - bst];
+                    j += m;
+#endif
+
+                    for (; j + 1 < m; j += 2) {
+                        int id = (i * m + j) / 2;
+                        value += (weightWalk[id] >> 4) * inputWalk[j];
+                        value += (weightWalk[id] & 0xF) * inputWalk[j + 1];
+                    }
+
+                    value -= weightSums[i] * config[block].zeroPoint;
+                    ((float*)c)[block * kstride + i] = scales[i] * config[block].scale * value +
+                            weightMins[i] * ((float)inputSum - (int)config[block].zeroPoint * m) * config[block].scale +
+                            (bias == nullptr ? 0.0 : bias[i]);
+                }
+            }
+        }
+    }
+
+    void Silu(float *input, float *up, float *output, int len) {
+        int i = 0;
+#ifdef __AVX512F__
+        __m512 ones16 = _mm512_set1_ps(1.0f);
+        for (; i + 15 < len; i += 16) {
+            __m512 x = _mm512_loadu_ps(input + i);
+            __m512 y = _mm512_div_ps(x, _mm512_add_ps(ones16, exp512_ps(_mm512_sub_ps(_mm512_setzero_ps(), x))));
+            if (up != nullptr) {
+                y = _mm512_mul_ps(y, _mm512_loadu_ps(up + i));
+            }
+            _mm512_storeu_ps(output + i, y);
+        }
+#endif
+#ifdef __AVX2__
+        __m256 ones = _mm256_set1_ps(1.0f);
+        for (; i + 7 < len; i += 8) {
+            __m256 x = _mm256_loadu_ps(input + i);
+            __m256 y = _mm256_div_ps(x, _mm256_add_ps(ones, exp256_ps(_mm256_sub_ps(_mm256_setzero_ps(), x))));
+            if (up != nullptr) {
+                y = _mm256_mul_ps(y, _mm256_loadu_ps(up + i));
+            }
+            _mm256_storeu_ps(output + i, y);
+        }
+#endif
+#ifdef __aarch64__
+        float32x4_t c1 = vdupq_n_f32(1.0f);
+        for (; i + 3 < len; i += 4) {
+            float32x4_t vx = vld1q_f32(input + i);
+            vx = vdivq_f32(vx, vaddq_f32(c1, exp_ps(vnegq_f32(vx))));
+            if (up != nullptr) {
+                vx = vmulq_f32(vx, vld1q_f32(up + i));
+            }
+            vst1q_f32(output + i, vx);
+        }
+#endif
+        for (; i < len; i++) {
+            float x = input[i];
+            output[i] = x / (1.0f + expf(-x)) * (up == nullptr ? 1.0f : up[i]);
+        }
+    }
+
+    void Gelu(float *input, float *output, int len) {
+        int i = 0;
+#ifdef __AVX512F__
+        for (; i + 15 < len; i += 16) {
+            __m512 x = _mm512_loadu_ps(input + i);
+            __m512 e = erf512_ps(_mm512_mul_ps(x, _mm512_set1_ps((float) M_SQRT1_2)));
+            _mm512_storeu_ps(output + i, _mm512_mul_ps(_mm512_mul_ps(x, _mm512_set1_ps(0.5f)),
+                                                       _mm512_add_ps(e, _mm512_set1_ps(1.0f))));
+        }
+#endif
+#ifdef __AVX2__
+        for (; i + 7 < len; i += 8) {
+            __m256 x = _mm256_loadu_ps(input + i);
+            __m256 e = erf256_ps(_mm256_mul_ps(x, _mm256_set1_ps((float) M_SQRT1_2)));
+            _mm256_storeu_ps(output + i, _mm256_mul_ps(_mm256_mul_ps(x, _mm256_set1_ps(0.5f)),
+                                                       _mm256_add_ps(e, _mm256_set1_ps(1.0f))));
+        }
+#endif
+        for (; i < len; i++) {
+            float x = input[i];
+            output[i] = x * 0.5f * (1.0f + erff(x * (float) M_SQRT1_2));
+        }
+    }
+
+    // 0.5 * x * (1 + tanh(y)) = x / (1 + exp(-2y)), 只需要一次exp
+    void GeluNew(float *input, float *output, int len) {
+        int i = 0;
+#ifdef __AVX512F__
+        for (; i + 15 < len; i += 16) {
+            __m512 x = _mm512_loadu_ps(input + i);
+            __m512 y = _mm512_fmadd_ps(_mm512_mul_ps(x, x), _mm512_set1_ps(0.044715f), _mm512_set1_ps(1.0f));
+            y = exp512_ps(_mm512_mul_ps(_mm512_mul_ps(x, _mm512_set1_ps(-2.0f * 0.7978845608028654f)), y));
+            _mm512_storeu_ps(output + i, _mm512_div_ps(x, _mm512_add_ps(y, _mm512_set1_ps(1.0f))));
+        }
+#endif
+#ifdef __AVX2__
+        for (; i + 7 < len; i += 8) {
+            __m256 x = _mm256_loadu_ps(input + i);
+            __m256 y = _mm256_fmadd_ps(_mm256_mul_ps(x, x), _mm256_set1_ps(0.044715f), _mm256_set1_ps(1.0f));
+            y = exp256_ps(_mm256_mul_ps(_mm256_mul_ps(x, _mm256_set1_ps(-2.0f * 0.7978845608028654f)), y));
+            _mm256_storeu_ps(output + i, _mm256_div_ps(x, _mm256_add_ps(y, _mm256_set1_ps(1.0f))));
+        }
+#endif
+#ifdef __aarch64__
+        float32x4_t c0 = vdupq_n_f32(0.044715f);
+        float32x4_t c1 = vdupq_n_f32(1.0f);
+        float32x4_t c2 = vdupq_n_f32(0.7978845608028654f);
+        float32x4_t c3 = vdupq_n_f32(0.5f);
+        for (; i + 3 < len; i += 4) {
+            float32x4_t vx = vld1q_f32(input + i);
+            float32x4_t v1 = vaddq_f32(c1, vmulq_f32(vmulq_f32(c0, vx), vx));
+            float32x4_t v2 = vmulq_f32(vmulq_f32(c2, vx), v1);
+            float32x4_t vex = exp_ps(v2);
+            float32x4_t venegx = exp_ps(vnegq_f32(v2));
+            float32x4_t vtan = vdivq_f32(vsubq_f32(vex, venegx), vaddq_f32(vex, venegx));
+            float32x4_t vout = vmulq_f32(vmulq_f32(c3, vx), vaddq_f32(c1, vtan));
+            vst1q_f32(output + i, vout);
+        }
+#endif
+        for (; i < len; i++) {
+            float x = input[i];
+            output[i] = 0.5f * x * (1.0f + tanhf(0.7978845608028654f * x * (1.0f + 0.044715f * x * x)));
+        }
+    }
+
+    void TanH(float *input, float *output, int len) {
+        int i = 0;
+#ifdef __AVX512F__
+        for (; i + 15 < len; i += 16) {
+            _mm512_storeu_ps(output + i, tanh512_ps(_mm512_loadu_ps(input + i)));
+        }
+#endif
+#ifdef __AVX2__
+        for (; i + 7 < len; i += 8) {
+            _mm256_storeu_ps(output + i, tanh256_ps(_mm256_loadu_ps(input + i)));
+        }
+#endif
+        for (; i < len; i++) {
+            output[i] = tanhf(input[i]);
+        }
+    }
+
+    void AddTo(float *input, float *residual, int len) {
+        int i = 0;
+#ifdef __AVX512F__
+        for (; i + 15 < len; i += 16) {
+            _mm512_storeu_ps(input + i, _mm512_add_ps(_mm512_loadu_ps(input + i), _mm512_loadu_ps(residual + i)));
+        }
+#endif
+#ifdef __AVX2__
+        for (; i + 7 < len; i += 8) {
+            _mm256_storeu_ps(input + i, _mm256_add_ps(_mm256_loadu_ps(input + i), _mm256_loadu_ps(residual + i)));
+        }
+#endif
+#ifdef __aarch64__
+        for (; i + 3 < len; i += 4) {
+            vst1q_f32(input + i, vaddq_f32(vld1q_f32(input + i), vld1q_f32(residual + i)));
+        }
+#endif
+        for (; i < len; i++) {
+            input[i] += residual[i];
+        }
+    }
+
+    float DotRow(float *a, float *b, int len) {
+        float now = 0.0f;
+        int i = 0;
+#ifdef __AVX512F__
+        __m512 vsum512 = _mm512_setzero_ps();
+        for (; i + 15 < len; i += 16) {
+            vsum512 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), vsum512);
+        }
+        now += _mm512_reduce_add_ps(vsum512);
+#endif
+#ifdef __AVX2__
+        __m256 vsum = _mm256_setzero_ps();
+        for (; i + 7 < len; i += 8) {
+            vsum = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), vsum);
+        }
+        now += Floatsum(vsum);
+#endif
+#ifdef __aarch64__
+        float32x4_t sum = {0, 0, 0, 0};
+        for (; i + 3 < len; i += 4) {
+            sum = vaddq_f32(sum, vmulq_f32(vld1q_f32(a + i), vld1q_f32(b + i)));
+        }
+        now += sum[0] + sum[1] + sum[2] + sum[3];
+#endif
+        for (; i < len; i++) {
+            now += a[i] * b[i];
+        }
+        return now;
+    }
+
+    int SumU8Row(uint8_t *data, int len) {
+        int ans = 0;
+        int i = 0;
+#ifdef __AVX2__
+        __m256i acc = _mm256_setzero_si256();
+        const __m256i ones = _mm256_set1_epi16(1);
+        for (; i + 31 < len; i += 32) {
+            __m256i ax = _mm256_loadu_si256((const __m256i *) (data + i));
+            __m256i mx0 = _mm256_cvtepu8_epi16(_mm256_extractf128_si256(ax, 0));
+            __m256i mx1 = _mm256_cvtepu8_epi16(_mm256_extractf128_si256(ax, 1));
+            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(mx0, ones));
+            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(mx1, ones));
+        }
+        ans += I32sum(acc);
+#endif
+#ifdef __aarch64__
+        uint32x4_t sum0 = {0, 0, 0, 0};
+        for (; i + 7 < len; i += 8) {
+            sum0 = vaddw_u16(sum0, vpaddl_u8(vld1_u8(data + i)));
+        }
+        ans += sum0[0] + sum0[1] + sum0[2] + sum0[3];
+#endif
+        for (; i < len; i++) {
+            ans += data[i];
+        }
+        return ans;
+    }
+
+    int SumU4Row(uint8_t *data, int bytes) {
+        int ans = 0;
+        int i = 0;
+#ifdef __AVX2__
+        __m256i acc = _mm256_setzero_si256();
+        const __m256i lowMask = _mm256_set1_epi8(0xf);
+        const __m256i ones = _mm256_set1_epi16(1);
+        for (; i + 15 < bytes; i += 16) {
+            __m128i orix = _mm_loadu_si128((const __m128i *) (data + i));
+            __m256i bytex = _mm256_set_m128i(_mm_srli_epi16(orix, 4), orix);
+            __m256i bx = _mm256_and_si256(lowMask, bytex);
+            __m256i mx0 = _mm256_cvtepu8_epi16(_mm256_extractf128_si256(bx, 0));
+            __m256i mx1 = _mm256_cvtepu8_epi16(_mm256_extractf128_si256(bx, 1));
+            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(mx0, ones));
+            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(mx1, ones));
+        }
+        ans += I32sum(acc);
+#endif
+#ifdef __aarch64__
+        uint8x8_t maskHigh = vdup_n_u8(0xF0);
+        uint8x8_t maskLow = vdup_n_u8(0xF);
+        uint32x4_t sum0 = {0, 0, 0, 0};
+        for (; i + 7 < bytes; i += 8) {
+            uint8x8_t ori = vld1_u8(data + i);
+            uint16x4_t sa = vpaddl_u8(vand_u8(ori, maskLow));
+            uint16x4_t sb = vpaddl_u8(vshr_n_u8(vand_u8(ori, maskHigh), 4));
+            sum0 = vaddw_u16(sum0, vadd_u16(sa, sb));
+        }
+        ans += sum0[0] + sum0[1] + sum0[2] + sum0[3];
+#endif
+        for (; i < bytes; i++) {
+            ans += (data[i] & 0xF) + (data[i] >> 4);
+        }
+        return ans;
+    }
+
+    void SoftmaxRow(float *input, float *output, int channels) {
+        float maxValue = 0;
+        int j = 0;
+#ifdef __AVX2__
+        __m256 vmax = _mm256_set1_ps(maxValue);
+        for (; j + 7 < channels; j += 8) {
+            vmax = _mm256_max_ps(vmax, _mm256_loadu_ps(input + j));
+        }
+        float temp[8];
+        _mm256_storeu_ps(temp, vmax);
+        for (int k = 0; k < 8; k++) {
+            maxValue = KernelMax(maxValue, temp[k]);
+        }
+#endif
+#ifdef __aarch64__
+        float32x4_t vmax = vdupq_n_f32(-1e9);
+        for (; j + 3 < channels; j += 4) {
+            vmax = vmaxq_f32(vmax, vld1q_f32(input + j));
+        }
+        for (int k = 0; k < 4; k++) {
+            maxValue = KernelMax(maxValue, vmax[k]);
+        }
+#endif
+        for (; j < channels; j++) {
+            maxValue = KernelMax(maxValue, input[j]);
+        }
+
+        float sum = 0.0;
+        j = 0;
+#ifdef __AVX512F__
+        __m512 vmax16 = _mm512_set1_ps(maxValue), vsum16 = _mm512_setzero_ps();
+        for (; j + 15 < channels; j += 16) {
+            __m512 e = exp512_ps(_mm512_sub_ps(_mm512_loadu_ps(input + j), vmax16));
+            vsum16 = _mm512_add_ps(vsum16, e);
+            _mm512_storeu_ps(output + j, e);
+        }
+        sum += _mm512_reduce_add_ps(vsum16);
+#endif
+#ifdef __AVX2__
+        __m256 vmax8 = _mm256_set1_ps(maxValue), vsum8 = _mm256_setzero_ps();
+        for (; j + 7 < channels; j += 8) {
+            __m256 e = exp256_ps(_mm256_sub_ps(_mm256_loadu_ps(input + j), vmax8));
+            vsum8 = _mm256_add_ps(vsum8, e);
+            _mm256_storeu_ps(output + j, e);
+        }
+        sum += Floatsum(vsum8);
+#endif
+#ifdef __aarch64__
+        vmax = vdupq_n_f32(maxValue);
+        for (; j + 3 < channels; j += 4) {
+            float32x4_t e = exp_ps(vsubq_f32(vld1q_f32(input + j), vmax));
+            sum += e[0] + e[1] + e[2] + e[3];
+            vst1q_f32(output + j, e);
+        }
+#endif
+        for (; j < channels; j++) {
+            output[j] = exp(input[j] - maxValue);
+            sum += output[j];
+        }
+        if (fabs(sum) < 1e-9) {
+            sum = 0.1;
+        }
+
+        float scale = 1.0f / sum;
+        j = 0;
+#ifdef __AVX2__
+        __m256 vscale = _mm256_set1_ps(scale);
+        for (; j + 7 < channels; j += 8) {
+            _mm256_storeu_ps(output + j, _mm256_mul_ps(_mm256_loadu_ps(output + j), vscale));
+        }
+#endif
+#ifdef __aarch64__
+        float32x4_t vscale = vdupq_n_f32(scale);
+        for (; j + 3 < channels; j += 4) {
+            vst1q_f32(output + j, vmulq_f32(vld1q_f32(output + j), vscale));
+        }
+#endif
+        for (; j < channels; j++) {
+            output[j] = output[j] * scale;
+        }
+    }
+
+    void RMSNormRow(float *input, float *weight, float *output, int channels, float eps) {
+        float mean = 0.f;
+        int j = 0;
+#ifdef __AVX2__
+        __m256 sums = _mm256_setzero_ps();
+        for (; j + 7 < channels; j += 8) {
+            __m256 vi = _mm256_loadu_ps(input + j);
+            sums = _mm256_fmadd_ps(vi, vi, sums);
+        }
+        mean = Floatsum(sums);
+#endif
+#ifdef __aarch64__
+        float32x4_t sums = vdupq_n_f32(0.0);
+        for (; j + 3 < channels; j += 4) {
+            float32x4_t vi = vld1q_f32(input + j);
+            sums = vaddq_f32(sums, vmulq_f32(vi, vi));
+        }
+        mean = sums[0] + sums[1] + sums[2] + sums[3];
+#endif
+        for (; j < channels; j++) {
+            mean += input[j] * input[j];
+        }
+        float scale = 1.0 / sqrt(mean / channels + eps);
+        j = 0;
+#ifdef __AVX2__
+        __m256 vscale = _mm256_set1_ps(scale);
+        for (; j + 7 < channels; j += 8) {
+            __m256 vi = _mm256_loadu_ps(input + j);
+            __m256 vw = _mm256_loadu_ps(weight + j);
+            _mm256_storeu_ps(output + j, _mm256_mul_ps(_mm256_mul_ps(vi, vscale), vw));
+        }
+#endif
+#ifdef __aarch64__
+        float32x4_t vscale = vdupq_n_f32(scale);
+        for (; j + 3 < channels; j += 4) {
+            float32x4_t vi = vld1q_f32(input + j);
+            float32x4_t vw = vld1q_f32(weight + j);
+            vst1q_f32(output + j, vmulq_f32(vmulq_f32(vi, vscale), vw));
+        }
+#endif
+        for (; j < channels; j++) {
+            output[j] = input[j] * scale * weight[j];
+        }
+    }
+
+    void LayerNormRow(float *input, float *gamma, float *beta, float *output, int channels, float eps) {
+        float mean = 0.f, s2 = 0.f;
+        int j = 0;
+#ifdef __AVX2__
+        __m256 sums = _mm256_setzero_ps(), sums2 = _mm256_setzero_ps();
+        for (; j + 7 < channels; j += 8) {
+            __m256 vi = _mm256_loadu_ps(input + j);
+            sums = _mm256_add_ps(sums, vi);
+            sums2 = _mm256_fmadd_ps(vi, vi, sums2);
+        }
+        mean = Floatsum(sums);
+        s2 = Floatsum(sums2);
+#endif
+#ifdef __aarch64__
+        float32x4_t sums = vdupq_n_f32(0.0);
+        float32x4_t sums2 = vdupq_n_f32(0.0);
+        for (; j + 3 < channels; j += 4) {
+            float32x4_t vi = vld1q_f32(input + j);
+            sums = vaddq_f32(sums, vi);
+            sums2 = vaddq_f32(sums2, vmulq_f32(vi, vi));
+        }
+        mean = sums[0] + sums[1] + sums[2] + sums[3];
+        s2 = sums2[0] + sums2[1] + sums2[2] + sums2[3];
+#endif
+        for (; j < channels; j++) {
+            mean += input[j];
+            s2 += input[j] * input[j];
+        }
+        mean /= channels;
+        float var = sqrt(s2 / channels - mean * mean + eps);
+        float scale = 1.0f / var;
+        j = 0;
+#ifdef __AVX2__
+        __m256 vmean = _mm256_set1_ps(mean), vscale = _mm256_set1_ps(scale);
+        for (; j + 7 < channels; j += 8) {
+            __m256 vi = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(input + j), vmean), vscale);
+            _mm256_storeu_ps(output + j, _mm256_fmadd_ps(vi, _mm256_loadu_ps(gamma + j), _mm256_loadu_ps(beta + j)));
+        }
+#endif
+#ifdef __aarch64__
+        float32x4_t means = vdupq_n_f32(mean);
+        float32x4_t vars = vdupq_n_f32(scale);
+        for (; j + 3 < channels; j += 4) {
+            float32x4_t va = vld1q_f32(gamma + j), vb = vld1q_f32(beta + j);
+            float32x4_t vi = vld1q_f32(input + j);
+            float32x4_t vo = vaddq_f32(vmulq_f32(vmulq_f32(vsubq_f32(vi, means), vars), va), vb);
+            vst1q_f32(output + j, vo);
+        }
+#endif
+        for (; j < channels; j++) {
+            output[j] = (input[j] - mean) / var * gamma[j] + beta[j];
+        }
+    }
+
+    // 12组累加器足够掩盖乘加的延迟 (一般为4个周期, 每周期2条)
+    uint64_t FmaProbe(int iterations, float *sink) {
+        const int acc = 12;
+#if defined(__AVX512F__)
+        __m512 sums[acc], va = _mm512_set1_ps(0.999f), vb = _mm512_set1_ps(0.001f);
+        for (int j = 0; j < acc; j++) {
+            sums[j] = _mm512_set1_ps((float)j);
+        }
+        for (int i = 0; i < iterations; i++) {
+            for (int j = 0; j < acc; j++) {
+                sums[j] = _mm512_fmadd_ps(sums[j], va, vb);
+            }
+        }
+        __m512 total = sums[0];
+        for (int j = 1; j < acc; j++) {
+            total = _mm512_add_ps(total, sums[j]);
+        }
+        *sink = _mm512_reduce_add_ps(total);
+        return (uint64_t)iterations * acc * 16 * 2;
+#elif defined(__AVX2__)
+        __m256 sums[acc], va = _mm256_set1_ps(0.999f), vb = _mm256_set1_ps(0.001f);
+        for (int j = 0; j < acc; j++) {
+            sums[j] = _mm256_set1_ps((float)j);
+        }
+        for (int i = 0; i < iterations; i++) {
+            for (int j = 0; j < acc; j++) {
+                sums[j] = _mm256_fmadd_ps(sums[j], va, vb);
+            }
+        }
+        __m256 total = sums[0];
+        for (int j = 1; j < acc; j++) {
+            total = _mm256_add_ps(total, sums[j]);
+        }
+        *sink = Floatsum(total);
+        return (uint64_t)iterations * acc * 8 * 2;
+#elif defined(__aarch64__)
+        float32x4_t sums[acc], va = vdupq_n_f32(0.999f), vb = vdupq_n_f32(0.001f);
+        for (int j = 0; j < acc; j++) {
+            sums[j] = vdupq_n_f32((float)j);
+        }
+        for (int i = 0; i < iterations; i++) {
+            for (int j = 0; j < acc; j++) {
+                sums[j] = vfmaq_f32(vb, sums[j], va);
+            }
+        }
+        float32x4_t total = sums[0];
+        for (int j = 1; j < acc; j++) {
+            total = vaddq_f32(total, sums[j]);
+        }
+        *sink = vaddvq_f32(total);
+        return (uint64_t)iterations * acc * 4 * 2;
+#else
+        float sums[acc];
+        for (int j = 0; j < acc; j++) {
+            sums[j] = (float)j;
+        }
+        for (int i = 0; i < iterations; i++) {
+            for (int j = 0; j < acc; j++) {
+                sums[j] = sums[j] * 0.999f + 0.001f;
+            }
+        }
+        float total = 0.0f;
+        for (int j = 0; j < acc; j++) {
+            total += sums[j];
+        }
+        *sink = total;
+        return (uint64_t)iterations * acc * 2;
+#endif
+    }
+
+    static CpuInstructionLevel CompiledLevel() {
+#if defined(__AMX_INT8__) && defined(__AMX_TILE__) && defined(__AVX512VNNI__) && defined(__AVX512BW__)
+        return ISA_AMX;
+#elif defined(__AVX512VNNI__) && defined(__AVX512BW__)
+        return ISA_AVX512_VNNI;
+#elif defined(__AVX512F__) && defined(__AVX512BW__)
+        return ISA_AVX512;
+#elif defined(__AVX2__)
+        return ISA_AVX2;
+#else
+        return ISA_BASE;
+#endif
+    }
+}
+
+    const CpuLinearKernels *FASTLLM_KERNEL_CONCAT(GetCpuLinearKernels_, FASTLLM_CPU_KERNEL_ISA)() {
+        static CpuLinearKernels kernels = {
+            FASTLLM_CPU_KERNEL_ISA::CompiledLevel(),
+#ifdef __AVX2__
+            true, true,
+#else
+            false, false,
+#endif
+            FASTLLM_CPU_KERNEL_ISA::FloatLinearPart,
+            FASTLLM_CPU_KERNEL_ISA::Float16LinearPart,
+            FASTLLM_CPU_KERNEL_ISA::CodebookLinearPart<uint8_t>,
+            FASTLLM_CPU_KERNEL_ISA::CodebookLinearPart<uint16_t>,
+            FASTLLM_CPU_KERNEL_ISA::BFloat16LinearPart,
+#if defined(__AVX512BF16__) && defined(__AVX512BW__)
+            FASTLLM_CPU_KERNEL_ISA::BFloat16InputLinearPart,
+#else
+            nullptr,
+#endif
+            FASTLLM_CPU_KERNEL_ISA::Multiply,
+            FASTLLM_CPU_KERNEL_ISA::MultiplyInt4,
+            FASTLLM_CPU_KERNEL_ISA::MultiplyInt4NoZero,
+            FASTLLM_CPU_KERNEL_ISA::MultiplyInt4Group,
+#if defined(__AMX_INT8__) && defined(__AMX_TILE__)
+            FASTLLM_CPU_KERNEL_ISA::MultiplyAMX,
+#else
+            nullptr,
+#endif
+            FASTLLM_CPU_KERNEL_ISA::Silu,
+            FASTLLM_CPU_KERNEL_ISA::Gelu,
+            FASTLLM_CPU_KERNEL_ISA::GeluNew,
+            FASTLLM_CPU_KERNEL_ISA::TanH,
+            FASTLLM_CPU_KERNEL_ISA::AddTo,
+            FASTLLM_CPU_KERNEL_ISA::DotRow,
+            FASTLLM_CPU_KERNEL_ISA::SumU8Row,
+            FASTLLM_CPU_KERNEL_ISA::SumU4Row,
+            FASTLLM_CPU_KERNEL_ISA::SoftmaxRow,
+            FASTLLM_CPU_KERNEL_ISA::RMSNormRow,
+            FASTLLM_CPU_KERNEL_ISA::LayerNormRow,
+            FASTLLM_CPU_KERNEL_ISA::FmaProbe
+        };
+        return &kernels;
+    }
+}
@@ -67,6 +67,13 @@ namespace fastllm {
         return true;
     }
 
+    bool CudaAttention::CanRun(const std::string &opType, const fastllm::DataDict &datas,
+                               const fastllm::FloatDict &floatParams, const fastllm::IntDict &intParams) {
+        // 只支持[heads, seq, dim]排布
+        return intParams.find("qLayout") == intParams.end() && intParams.find("kvLayout") == intParams.end() &&
+               intParams.find("outputLayout") == intParams.end();
+    }
+
     void CudaAttention::Reshape(const std::string &opType, const fastllm::DataDict &datas,
                                const fastllm::FloatDict &floatParams, const fastllm::IntDict &intParams) {
         Data &q = *(datas.find("q")->second);
@@ -348,6 +355,12 @@ namespace fastllm {
                                           input1.dims[axis] * inner * unitSize, outer);
     }
 
+    bool CudaMatMulOp::CanRun(const std::string &opType, const fastllm::DataDict &datas,
+                              const fastllm::FloatDict &floatParams, const fastllm::IntDict &intParams) {
+        // 只支持[heads, seq, dim]排布
+        return intParams.find("input0Layout") == intParams.end() && intParams.find("outputLayout") == intParams.end();
+    }
+
     void CudaMatMulOp::Reshape(const std::string &opType, const fastllm::DataDict &datas,
                               const fastllm::FloatDict &floatParams, const fastllm::IntDict &intParams) {
         Data &input0 = *(datas.find("input0")->second);
@@ -402,6 +415,12 @@ namespace fastllm {
                                batch1, n, m, k, alpha);
     }
 
+    bool CudaMatMulTransBOp::CanRun(const std::string &opType, const fastllm::DataDict &datas,
+                                    const fastllm::FloatDict &floatParams, const fastllm::IntDict &intParams) {
+        // 只支持[heads, seq, dim]排布
+        return intParams.find("input0Layout") == intParams.end() && intParams.find("outputLayout") == intParams.end();
+    }
+
     void CudaMatMulTransBOp::Reshape(const std::string &opType, const fastllm::DataDict &datas,
                                     const fastllm::FloatDict &floatParams, const fastllm::IntDict &intParams) {
         Data &input0 = *(datas.find("input0")->second);
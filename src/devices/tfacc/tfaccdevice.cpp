@@ -259,8 +259,10 @@ namespace fastllm {
         Data &k = *(datas.find("k")->second);
         Data &v = *(datas.find("v")->second);
         int maskType = intParams.find("maskType") != intParams.end() ? intParams.find("maskType")->second : 0;
+        bool defaultLayout = intParams.find("qLayout") == intParams.end() && intParams.find("kvLayout") == intParams.end() &&
+                             intParams.find("outputLayout") == intParams.end();
 
-        if (!k.isKVCache || !v.isKVCache || maskType != 0) {
+        if (!k.isKVCache || !v.isKVCache || maskType != 0 || !defaultLayout) {
             CpuAttention::Run(opType, datas, floatParams, intParams);
             return;
         }
@@ -6,6 +6,9 @@
 
 #include "executor.h"
 
+#include <deque>
+#include <set>
+
 #include "devices/cpu/cpudevice.h"
 
 #ifdef USE_CUDA
@@ -18,6 +21,32 @@
 #endif
 
 namespace fastllm {
+    // op名字 -> 编号; 名字存在deque中, 注册新的op时已有名字的地址不变
+    static std::mutex opRegistryLocker;
+
+    static std::map <std::string, int> &GetOpIds() {
+        static std::map <std::string, int> opIds;
+        return opIds;
+    }
+
+    static std::deque <std::string> &GetOpNames() {
+        static std::deque <std::string> opNames;
+        return opNames;
+    }
+
+    OpHandle::OpHandle(const std::string &opType) {
+        std::lock_guard <std::mutex> guard(opRegistryLocker);
+        auto &opIds = GetOpIds();
+        auto &opNames = GetOpNames();
+        auto it = opIds.find(opType);
+        if (it == opIds.end()) {
+            it = opIds.insert(std::make_pair(opType, (int)opNames.size())).first;
+            opNames.push_back(opType);
+        }
+        this->id = it->second;
+        this->name = &opNames[it->second];
+    }
+
     Executor::Executor() {
         this->devices.clear();
 #ifdef USE_CUDA
@@ -27,6 +56,8 @@ namespace fastllm {
         this->devices.push_back((BaseDevice*) new TfaccDevice());
 #endif
         this->devices.push_back((BaseDevice*) new CpuDevice());
+        const char *profile = getenv("FASTLLM_PROFILE");
+        this->profiling = !(profile != nullptr && std::string(profile) == "0");
     }
 
     Executor::~Executor() {
@@ -37,10 +68,12 @@ namespace fastllm {
 
     void Executor::ClearDevices() {
         this->devices.clear();
+        this->dispatchCache.clear();
     }
 
     void Executor::AddDevice(fastllm::BaseDevice *device) {
         this->devices.push_back(device);
+        this->dispatchCache.clear();
     }
 
     void Executor::SetFirstDevice(const std::string &device) {
@@ -57,6 +90,9 @@ namespace fastllm {
                 this->devices.push_back(temp[i]);
             }
         }
+        if (this->devices != temp) {
+            this->dispatchCache.clear();
+        }
     }
 
     std::vector <int> Executor::GetDeviceIds(const std::string &device) {
@@ -73,13 +109,230 @@ namespace fastllm {
         return this->devices[0]->CanRun(opType, datas, floatParams, intParams);
     }
 
+    // 可以放进slab的输出: 名为output, 不和其他输入共用, 并且是CPU上的普通中间结果
+    static Data *GetGraphOutput(const fastllm::DataDict &datas, const fastllm::IntDict &intParams) {
+        auto it = datas.find("output");
+        if (it == datas.end() || it->second == nullptr || intParams.find("output___batch") != intParams.end()) {
+            return nullptr;
+        }
+        Data *output = it->second;
+        for (auto &other : datas) {
+            if (other.first != "output" && other.second == output) {
+                return nullptr;
+            }
+        }
+        if (output->dataDevice != DataDevice::CPU || output->directMemory || output->isKVCache ||
+            output->expansionDims.size() > 0 || output->dims.size() == 0 || output->Count(0) == 0) {
+            return nullptr;
+        }
+        return output;
+    }
+
+    void Executor::GraphMarkUse(Data *data) {
+        if (data == nullptr || data->dataDevice != DataDevice::CPU || data->cpuData == nullptr) {
+            return;
+        }
+        uint64_t addr = (uint64_t)data->cpuData;
+        auto it = graphLiveRanges.upper_bound(addr);
+        if (it != graphLiveRanges.begin()) {
+            it--;
+            if (addr < it->second.first) {
+                graph->values[it->second.second].lastUse = graphOpId;
+            }
+        }
+    }
+
+    static std::string GetDataTypeName(DataType type) {
+        switch (type) {
+            case DataType::FLOAT32: return "float32";
+            case DataType::FLOAT16: return "float16";
+            case DataType::BFLOAT16: return "bfloat16";
+            case DataType::INT16: return "int16";
+            case DataType::INT8: return "int8";
+            case DataType::INT4: return "int4";
+            case DataType::INT4_NOZERO: return "int4_nozero";
+            case DataType::INT4_GROUP: return "int4_group";
+            case DataType::INT2: return "int2";
+            case DataType::BIT: return "bit";
+            case DataType::INT32PARAM: return "int32param";
+            default: return "type" + std::to_string((int)type);
+        }
+    }
+
+    static uint64_t GetDataBytes(const Data *data) {
+        if (data == nullptr || data->dims.size() == 0 || data->Count(0) == 0) {
+            return 0;
+        }
+        return (data->Count(0) * data->unitSize - 1) / data->unitSizeDiv + 1;
+    }
+
+    // 一次op读写的数据量: 所有输入输出(包括权重和KV cache)的字节数之和
+    // hasBatch为false时intParams中没有"xxx___batch"参数, 不需要拼接字符串查找
+    static uint64_t GetOpBytes(const fastllm::DataDict &datas, const fastllm::IntDict &intParams, bool hasBatch) {
+        uint64_t bytes = 0;
+        for (auto &it : datas) {
+            auto batch = hasBatch ? intParams.find(it.first + "___batch") : intParams.end();
+            if (batch != intParams.end()) {
+                for (int i = 0; i < batch->second; i++) {
+                    bytes += GetDataBytes(((Data**)it.second)[i]);
+                }
+            } else {
+                bytes += GetDataBytes(it.second);
+            }
+        }
+        return bytes;
+    }
+
+    static std::string GetShapeString(const std::vector <int> &dims) {
+        std::string ret = "[";
+        for (int i = 0; i < dims.size(); i++) {
+            ret += (i > 0 ? "," : "") + std::to_string(dims[i]);
+        }
+        return ret + "]";
+    }
+
+    // 估算矩阵乘法类op的浮点运算量 (乘加各算一次), 其余op记为0
+    static uint64_t EstimateFlops(const std::string &opType, const fastllm::DataDict &datas, const fastllm::IntDict &intParams,
+                                  bool hasBatch) {
+        auto get = [&](const std::string &name) -> Data* {
+            auto it = datas.find(name);
+            if (it == datas.end() || (hasBatch && intParams.find(name + "___batch") != intParams.end())) {
+                return nullptr;
+            }
+            return it->second;
+        };
+        Data *input = get("input"), *output = get("output");
+        if (opType == "Linear" || opType == "LinearSwiglu" || opType == "LlamaQKVRotateAppend") {
+            if (input == nullptr || input->dims.size() == 0 || input->dims.back() == 0) {
+                return 0;
+            }
+            uint64_t rows = input->Count(0) / input->dims.back(), flops = 0;
+            for (auto &name : {"weight", "upWeight", "kWeight", "vWeight"}) {
+                Data *weight = get(name);
+                if (weight != nullptr && weight->dims.size() == 2) {
+                    flops += 2 * rows * weight->dims[0] * weight->dims[1];
+                }
+            }
+            return flops;
+        }
+        if (opType == "MatMul" || opType == "MatMulTransB") {
+            Data *input0 = get("input0");
+            if (input0 == nullptr || output == nullptr || input0->dims.size() == 0 || output->dims.size() == 0) {
+                return 0;
+            }
+            return 2 * output->Count(0) * input0->dims.back();
+        }
+        if (opType == "Attention") {
+            Data *k = get("k");
+            if (k == nullptr || output == nullptr || k->dims.size() != 3 || output->dims.size() == 0) {
+                return 0;
+            }
+            auto layout = intParams.find("kvLayout");
+            int len = (layout != intParams.end() && layout->second == LayoutSeqMajor) ? k->dims[0] : k->dims[1];
+            // q * k^T 和 softmax(...) * v 各 2 * heads * seqLen * len * headDim
+            return 4 * output->Count(0) * len;
+        }
+        return 0;
+    }
+
+    static double GetRooflineSpend(const MachinePeak &peak, uint64_t bytes, uint64_t flops) {
+        if (peak.bandwidth <= 0 || peak.gflops <= 0) {
+            return 0.0;
+        }
+        return std::max(bytes / (peak.bandwidth * 1e9), flops / (peak.gflops * 1e9));
+    }
+
+    void OpProfile::Add(double spend, uint64_t bytes, uint64_t flops, double rooflineSpend) {
+        this->spend += spend;
+        this->calls++;
+        this->bytes += bytes;
+        this->flops += flops;
+        this->rooflineSpend += rooflineSpend;
+    }
+
+    std::string OpProfile::ToString(const MachinePeak &peak) const {
+        char buffer[256];
+        int len = snprintf(buffer, sizeof(buffer), "spend %f, calls %d", spend, calls);
+        if (spend > 0 && bytes > 0) {
+            len += snprintf(buffer + len, sizeof(buffer) - len, ", %.2f GB/s", bytes / spend / 1e9);
+        }
+        if (spend > 0 && flops > 0) {
+            len += snprintf(buffer + len, sizeof(buffer) - len, ", %.2f GFLOPS", flops / spend / 1e9);
+        }
+        if (spend > 0 && rooflineSpend > 0) {
+            len += snprintf(buffer + len, sizeof(buffer) - len, ", %.1f%% of roofline", rooflineSpend / spend * 100);
+            if (flops > 0 && bytes > 0) {
+                // 计算强度低于 峰值算力 / 峰值带宽 时受带宽限制
+                bool memoryBound = (double)flops / bytes < peak.gflops / peak.bandwidth;
+                snprintf(buffer + len, sizeof(buffer) - len, " (%s bound)", memoryBound ? "memory" : "compute");
+            }
+        }
+        return buffer;
+    }
+
+    const Executor::DispatchEntry &Executor::GetDispatch(int opId, bool lockInCPU) {
+        int index = opId * 2 + lockInCPU;
+        if (index >= dispatchCache.size()) {
+            dispatchCache.resize(index + 1);
+        }
+        DispatchEntry &entry = dispatchCache[index];
+        if (!entry.ready) {
+            std::string opType;
+            {
+                std::lock_guard <std::mutex> guard(opRegistryLocker);
+                opType = GetOpNames()[opId];
+            }
+            for (auto device : devices) {
+                if (lockInCPU && device->deviceType != "cpu") {
+                    continue;
+                }
+                auto it = device->ops.find(opType);
+                if (it != device->ops.end()) {
+                    entry.candidates.push_back(std::make_pair(device, it->second));
+                }
+            }
+            entry.ready = true;
+        }
+        return entry;
+    }
+
     void Executor::Run(const std::string &opType, const fastllm::DataDict &datas, const fastllm::FloatDict &floatParams,
                        const fastllm::IntDict &intParams) {
-        auto st = std::chrono::system_clock::now();
+        Run(OpHandle(opType), datas, floatParams, intParams);
+    }
+
+    void Executor::Run(const OpHandle &op, const fastllm::DataDict &datas, const fastllm::FloatDict &floatParams,
+                       const fastllm::IntDict &intParams) {
+        std::chrono::system_clock::time_point st;
+        if (profiling) {
+            st = std::chrono::system_clock::now();
+        }
+        std::chrono::steady_clock::time_point traceSt;
+        if (tracing) {
+            traceSt = std::chrono::steady_clock::now();
+        }
+        const std::string &opType = op.Name();
+
+        // 只有带"xxx___batch"参数时datas中才有Data*数组, 大多数调用不需要逐个拼接字符串查找
+        bool hasBatch = false;
+        for (auto &it : intParams) {
+            if (it.first.size() > 8 && it.first.compare(it.first.size() - 8, 8, "___batch") == 0) {
+                hasBatch = true;
+                break;
+            }
+        }
+        auto getBatch = [&](const std::string &name) -> int {
+            if (!hasBatch) {
+                return -1;
+            }
+            auto it = intParams.find(name + "___batch");
+            return it == intParams.end() ? -1 : it->second;
+        };
+
         bool lockInCPU = false;
         for (auto &it: datas) {
-            if (intParams.find(it.first + "___batch") != intParams.end()) {
-                int batch = intParams.find(it.first + "___batch")->second;
+            int batch = getBatch(it.first);
+            if (batch != -1) {
                 for (int i = 0; i < batch; i++) {
                     lockInCPU |= (((Data**)it.second)[i] && ((Data**)it.second)[i]->lockInCPU);
                 }
@@ -87,49 +340,443 @@ namespace fastllm {
                 lockInCPU |= (it.second && it.second->lockInCPU);
             }
         }
-        for (auto device: devices) {
-            if (lockInCPU && device->deviceType != "cpu") {
-                continue;
+
+        bool inGraph = (graph != nullptr && graphMatched);
+        BaseDevice *target = nullptr;
+        BaseOperator *targetOp = nullptr;
+        if (inGraph && graph->ready) {
+            // 重放: 直接使用记录的设备
+            if (graphOpId < graph->ops.size() && graph->ops[graphOpId].opId == op.id) {
+                GraphPlan::Op &record = graph->ops[graphOpId];
+                if (!(lockInCPU && record.device->deviceType != "cpu") &&
+                    record.op->CanRun(opType, datas, floatParams, intParams)) {
+                    target = record.device;
+                    targetOp = record.op;
+                }
             }
-            if (device->CanRun(opType, datas, floatParams, intParams)) {
-#ifdef USE_CUDA
-                if (device->deviceType == "cuda" && device->deviceIds.size() > 0) {
-                    FastllmCudaSetDevice(device->deviceIds[0]);
+            if (target == nullptr) {
+                // 和记录不一致, 这一步剩下的op按普通方式执行, 结束后重新记录
+                graphMatched = inGraph = false;
+            }
+        }
+        if (target == nullptr) {
+            for (auto &candidate : GetDispatch(op.id, lockInCPU).candidates) {
+                if (candidate.second->CanRun(opType, datas, floatParams, intParams)) {
+                    target = candidate.first;
+                    targetOp = candidate.second;
+                    break;
                 }
+            }
+        }
+
+        if (target != nullptr) {
+#ifdef USE_CUDA
+            if (target->deviceType == "cuda" && target->deviceIds.size() > 0) {
+                FastllmCudaSetDevice(target->deviceIds[0]);
+            }
 #endif
+            // 已经在CPU上的数据不需要再检查
+            bool targetIsCpu = (target->deviceType == "cpu");
+            auto toTarget = [&](Data *data) {
+                if (data && !(targetIsCpu && data->dataDevice == DataDevice::CPU)) {
+                    data->ToDevice((void *) target);
+                }
+            };
+            for (auto &it: datas) {
+                int batch = getBatch(it.first);
+                if (batch != -1) {
+                    for (int i = 0; i < batch; i++) {
+                        toTarget(((Data**)it.second)[i]);
+                    }
+                } else {
+                    toTarget(it.second);
+                }
+            }
+            targetOp->Reshape(opType, datas, floatParams, intParams);
+
+            Data *graphOutput = inGraph ? GetGraphOutput(datas, intParams) : nullptr;
+            if (inGraph && !graph->ready) {
                 for (auto &it: datas) {
-                    if (intParams.find(it.first + "___batch") != intParams.end()) {
-                        int batch = intParams.find(it.first + "___batch")->second;
+                    if (it.second == graphOutput) {
+                        continue;
+                    }
+                    int batch = getBatch(it.first);
+                    if (batch != -1) {
                         for (int i = 0; i < batch; i++) {
-                            if (((Data**)it.second)[i]) {
-                                ((Data**)it.second)[i]->ToDevice((void *) device);
-                            }
+                            GraphMarkUse(((Data**)it.second)[i]);
                         }
                     } else {
-                        if (it.second) {
-                            it.second->ToDevice((void *) device);
-                        }
+                        GraphMarkUse(it.second);
                     }
                 }
-                device->Reshape(opType, datas, floatParams, intParams);
-                device->Run(opType, datas, floatParams, intParams);
-                break;
+            } else if (inGraph && graphOutput != nullptr && graph->ops[graphOpId].value != -1) {
+                // 重放: 把输出放到slab中规划好的位置上, 放不下时这次正常分配, 这一步结束后重新规划
+                GraphPlan::Value &value = graph->values[graph->ops[graphOpId].value];
+                uint64_t bytes = (graphOutput->Count(0) * graphOutput->unitSize - 1) / graphOutput->unitSizeDiv + 1;
+                if (bytes <= value.capacity) {
+                    graphOutput->FreeSpace();
+                    graphOutput->cpuData = graph->slab + value.offset;
+                    graphOutput->isView = true;
+                    graphOutput->expansionSize = graphOutput->Count(0);
+                    graphOutput->expansionBytes = bytes;
+                } else {
+                    value.bytes = std::max(value.bytes, bytes);
+                    graph->grown = true;
+                }
+            }
+
+            targetOp->Run(opType, datas, floatParams, intParams);
+
+            if (inGraph && !graph->ready) {
+                int valueId = -1;
+                if (graphOutput != nullptr && graphOutput->cpuData != nullptr) {
+                    // 新的中间结果: 和它地址重叠的旧结果已经被释放或覆盖
+                    uint64_t addr = (uint64_t)graphOutput->cpuData;
+                    uint64_t bytes = (graphOutput->Count(0) * graphOutput->unitSize - 1) / graphOutput->unitSizeDiv + 1;
+                    auto it = graphLiveRanges.lower_bound(addr);
+                    if (it != graphLiveRanges.begin() && std::prev(it)->second.first > addr) {
+                        it--;
+                    }
+                    while (it != graphLiveRanges.end() && it->first < addr + bytes) {
+                        it = graphLiveRanges.erase(it);
+                    }
+                    valueId = graph->values.size();
+                    graph->values.push_back(GraphPlan::Value {graphOpId, -1, bytes});
+                    graphLiveRanges[addr] = std::make_pair(addr + bytes, valueId);
+                }
+                graph->ops.push_back(GraphPlan::Op {op.id, target, targetOp, valueId});
             }
+            if (inGraph) {
+                graphOpId++;
+            }
+        } else if (inGraph) {
+            graphMatched = false;
+        }
+        if (profiling) {
+            double spend = GetSpan(st, std::chrono::system_clock::now());
+            if (op.id >= profiler.size()) {
+                profiler.resize(op.id + 1);
+            }
+            uint64_t bytes = 0, flops = 0;
+            double rooflineSpend = 0.0;
+            if (target != nullptr && peak.bandwidth > 0) {
+                // 默认打开的统计只读时钟, ClearProfiler / StartTrace测出峰值后才统计数据量和浮点运算量
+                bytes = GetOpBytes(datas, intParams, hasBatch);
+                flops = EstimateFlops(opType, datas, intParams, hasBatch);
+                rooflineSpend = (target->deviceType == "cpu" ? GetRooflineSpend(peak, bytes, flops) : 0.0);
+            }
+            profiler[op.id].Add(spend, bytes, flops, rooflineSpend);
+        }
+        if (tracing && target != nullptr) {
+            TraceOp(op, target, datas, intParams, hasBatch, traceSt);
         }
-        float spend = GetSpan(st, std::chrono::system_clock::now());
-        profiler[opType] += spend;
+    }
+
+    bool Executor::BeginGraph(GraphPlan *plan) {
+        if (graph != nullptr) {
+            return false;
+        }
+        graph = plan;
+        graphOpId = 0;
+        graphMatched = true;
+        graphLiveRanges.clear();
+        return true;
+    }
+
+    void Executor::EndGraph() {
+        if (graph == nullptr) {
+            return;
+        }
+        if (!graph->ready) {
+            if (graphMatched) {
+                graph->ready = true;
+                graph->Plan();
+            } else {
+                graph->Reset();
+            }
+        } else if (!graphMatched || graphOpId != graph->ops.size()) {
+            graph->Reset();
+        } else if (graph->grown) {
+            graph->Plan();
+        }
+        graph = nullptr;
+        graphLiveRanges.clear();
+    }
+
+    GraphPlan::~GraphPlan() {
+        FastllmCpuFree(slab);
+    }
+
+    void GraphPlan::Plan() {
+        std::vector <int> order;
+        for (int i = 0; i < values.size(); i++) {
+            Value &value = values[i];
+            if (value.lastUse < value.def) {
+                // 没有被后面的op使用过的结果由调用者直接读取(例如logits), 保留到这一步结束
+                value.lastUse = ops.size();
+            }
+            // 留出1/4的余量, 长度增长时不用每一步都重新规划
+            value.capacity = ((value.bytes + value.bytes / 4) + 63) / 64 * 64;
+            order.push_back(i);
+        }
+        std::sort(order.begin(), order.end(), [this](int a, int b) {
+            return values[a].capacity > values[b].capacity;
+        });
+
+        // 从大到小依次放置, 每个结果放在和它生存期重叠的已放置结果之间第一个放得下的空隙中
+        slabBytes = 0;
+        std::vector <int> placed;
+        for (int id : order) {
+            Value &value = values[id];
+            std::vector <std::pair <uint64_t, uint64_t> > used;
+            for (int other : placed) {
+                Value &o = values[other];
+                if (o.def <= value.lastUse && value.def <= o.lastUse) {
+                    used.push_back(std::make_pair(o.offset, o.offset + o.capacity));
+                }
+            }
+            std::sort(used.begin(), used.end());
+            uint64_t offset = 0;
+            for (auto &range : used) {
+                if (offset + value.capacity <= range.first) {
+                    break;
+                }
+                offset = std::max(offset, range.second);
+            }
+            value.offset = offset;
+            slabBytes = std::max(slabBytes, offset + value.capacity);
+            placed.push_back(id);
+        }
+
+        FastllmCpuFree(slab);
+        slab = slabBytes > 0 ? FastllmCpuMalloc(slabBytes) : nullptr;
+        grown = false;
+    }
+
+    void GraphPlan::Reset() {
+        FastllmCpuFree(slab);
+        slab = nullptr;
+        slabBytes = 0;
+        ops.clear();
+        values.clear();
+        ready = false;
+        grown = false;
     }
 
     void Executor::ClearProfiler() {
         profiler.clear();
+        peak = GetMachinePeak();
+        profiling = true;
     }
 
     void Executor::PrintProfiler() {
+        // 按名字排序输出
+        std::map <std::string, OpProfile> spends;
+        for (int i = 0; i < profiler.size(); i++) {
+            if (profiler[i].calls > 0) {
+                std::lock_guard <std::mutex> guard(opRegistryLocker);
+                spends[GetOpNames()[i]] = profiler[i];
+            }
+        }
         float sum = 0.0;
-        for (auto &it : profiler) {
-            printf("%s spend %f\n", it.first.c_str(), it.second);
-            sum += it.second;
+        for (auto &it : spends) {
+            printf("%s %s\n", it.first.c_str(), it.second.ToString(peak).c_str());
+            sum += it.second.spend;
         }
         printf("total spend %f\n", sum);
+        if (peak.bandwidth > 0) {
+            printf("machine peak: %.2f GB/s, %.2f GFLOPS\n", peak.bandwidth, peak.gflops);
+        }
+
+        std::lock_guard <std::mutex> guard(traceLocker);
+        if (traceEvents.empty()) {
+            return;
+        }
+        // 按层和按(op, 数据类型, 形状)统计
+        std::map <int, OpProfile> layerSpends;
+        std::map <std::string, OpProfile> shapeSpends;
+        for (auto &event : traceEvents) {
+            if (event.type != TraceEvent::OP) {
+                continue;
+            }
+            double spend = (event.end - event.begin) / 1e9;
+            layerSpends[event.layer].Add(spend, event.bytes, event.flops, event.rooflineSpend);
+            shapeSpends[event.name + " " + event.dataType + " " + event.shapes].Add(spend, event.bytes, event.flops, event.rooflineSpend);
+        }
+        printf("\nspend by layer:\n");
+        for (auto &it : layerSpends) {
+            if (it.first == -1) {
+                printf("(no layer) %s\n", it.second.ToString(peak).c_str());
+            } else {
+                printf("layer %d %s\n", it.first, it.second.ToString(peak).c_str());
+            }
+        }
+        std::vector <std::pair <std::string, OpProfile> > shapes(shapeSpends.begin(), shapeSpends.end());
+        std::sort(shapes.begin(), shapes.end(), [](const std::pair <std::string, OpProfile> &a,
+                                                   const std::pair <std::string, OpProfile> &b) {
+            return a.second.spend > b.second.spend;
+        });
+        printf("\nspend by shape (top 20):\n");
+        for (int i = 0; i < shapes.size() && i < 20; i++) {
+            printf("%s: %s\n", shapes[i].first.c_str(), shapes[i].second.ToString(peak).c_str());
+        }
+    }
+
+    static std::atomic <Executor*> tracingExecutor(nullptr); // 线程池回调写入的Executor, 工作线程中读取
+
+    void Executor::TraceOp(const OpHandle &op, BaseDevice *device, const fastllm::DataDict &datas,
+                           const fastllm::IntDict &intParams, bool hasBatch, std::chrono::steady_clock::time_point st) {
+        TraceEvent event;
+        event.type = TraceEvent::OP;
+        event.name = op.Name();
+        event.tid = 0;
+        event.begin = std::chrono::duration_cast <std::chrono::nanoseconds> (st - traceStart).count();
+        event.end = std::chrono::duration_cast <std::chrono::nanoseconds> (std::chrono::steady_clock::now() - traceStart).count();
+        event.device = device->deviceType;
+        for (auto &scope : traceScopes) {
+            event.scope += (event.scope.empty() ? "" : " > ") + scope.name;
+            if (scope.layer != -1) {
+                event.layer = scope.layer;
+            }
+        }
+        Data *first = nullptr;
+        for (auto &it : datas) {
+            auto batch = hasBatch ? intParams.find(it.first + "___batch") : intParams.end();
+            if (batch != intParams.end()) {
+                event.shapes += (event.shapes.empty() ? "" : " ") + it.first + "=batch" + std::to_string(batch->second);
+                continue;
+            }
+            if (it.second == nullptr || it.second->dims.size() == 0) {
+                continue;
+            }
+            if (first == nullptr || it.first == "input") {
+                first = it.second;
+            }
+            event.shapes += (event.shapes.empty() ? "" : " ") + it.first + "=" + GetShapeString(it.second->dims);
+        }
+        if (first != nullptr) {
+            event.dataType = GetDataTypeName(first->dataType);
+        }
+        event.bytes = GetOpBytes(datas, intParams, hasBatch);
+        event.flops = EstimateFlops(event.name, datas, intParams, hasBatch);
+        event.rooflineSpend = (event.device == "cpu" ? GetRooflineSpend(peak, event.bytes, event.flops) : 0.0);
+        std::lock_guard <std::mutex> guard(traceLocker);
+        traceEvents.push_back(event);
+    }
+
+    void Executor::TracePoolTask(int worker, std::chrono::steady_clock::time_point st,
+                                 std::chrono::steady_clock::time_point end) {
+        Executor *executor = tracingExecutor.load();
+        if (executor == nullptr) {
+            return;
+        }
+        TraceEvent event;
+        event.type = TraceEvent::POOL;
+        event.name = "ParallelFor";
+        event.tid = worker + 1;
+        event.begin = std::chrono::duration_cast <std::chrono::nanoseconds> (st - executor->traceStart).count();
+        event.end = std::chrono::duration_cast <std::chrono::nanoseconds> (end - executor->traceStart).count();
+        std::lock_guard <std::mutex> guard(executor->traceLocker);
+        executor->traceEvents.push_back(event);
+    }
+
+    void Executor::StartTrace() {
+        {
+            std::lock_guard <std::mutex> guard(traceLocker);
+            traceEvents.clear();
+            traceScopes.clear();
+        }
+        peak = GetMachinePeak();
+        traceStart = std::chrono::steady_clock::now();
+        tracing = true;
+        tracingExecutor.store(this);
+        GetThreadPoolTraceHook().store(TracePoolTask);
+    }
+
+    static std::string JsonEscape(const std::string &s) {
+        std::string ret;
+        for (char c : s) {
+            if (c == '"' || c == '\\') {
+                ret += '\\';
+            }
+            ret += c;
+        }
+        return ret;
+    }
+
+    void Executor::StopTrace(const std::string &fileName) {
+        if (!tracing) {
+            return;
+        }
+        GetThreadPoolTraceHook().store(nullptr);
+        // 已经读到回调的工作线程可能还在写traceEvents, 等正在执行的ParallelFor结束后再清空和读取
+        GetPool()->WaitParallelFor();
+        tracing = false;
+        tracingExecutor.store(nullptr);
+        while (!traceScopes.empty()) {
+            PopTraceScope();
+        }
+        if (fileName == "") {
+            return;
+        }
+        FILE *fo = fopen(fileName.c_str(), "w");
+        AssertInFastLLM(fo != nullptr, "StopTrace: can't open file " + fileName + ".\n");
+        std::lock_guard <std::mutex> guard(traceLocker);
+        fprintf(fo, "{\"traceEvents\": [\n");
+        std::set <int> tids;
+        for (auto &event : traceEvents) {
+            tids.insert(event.tid);
+        }
+        bool firstLine = true;
+        for (int tid : tids) {
+            fprintf(fo, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+                    firstLine ? "" : ",\n", tid, tid == 0 ? "main" : ("worker " + std::to_string(tid - 1)).c_str());
+            firstLine = false;
+        }
+        const char *categories[] = {"op", "scope", "pool"};
+        for (auto &event : traceEvents) {
+            fprintf(fo, "%s{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 0, \"tid\": %d, "
+                        "\"ts\": %.3f, \"dur\": %.3f",
+                    firstLine ? "" : ",\n", JsonEscape(event.name).c_str(), categories[event.type], event.tid,
+                    event.begin / 1e3, (event.end - event.begin) / 1e3);
+            firstLine = false;
+            if (event.type == TraceEvent::OP) {
+                fprintf(fo, ", \"args\": {\"layer\": %d, \"scope\": \"%s\", \"shapes\": \"%s\", \"dtype\": \"%s\", "
+                            "\"device\": \"%s\", \"bytes\": %llu, \"flops\": %llu, \"roofline\": %.3f}",
+                        event.layer, JsonEscape(event.scope).c_str(), JsonEscape(event.shapes).c_str(),
+                        event.dataType.c_str(), event.device.c_str(),
+                        (unsigned long long)event.bytes, (unsigned long long)event.flops,
+                        event.end > event.begin ? event.rooflineSpend * 1e9 / (event.end - event.begin) : 0.0);
+            } else if (event.type == TraceEvent::SCOPE && event.layer != -1) {
+                fprintf(fo, ", \"args\": {\"layer\": %d}", event.layer);
+            }
+            fprintf(fo, "}");
+        }
+        fprintf(fo, "\n]}\n");
+        fclose(fo);
+    }
+
+    void Executor::PushTraceScope(const std::string &name, int layer) {
+        if (!tracing) {
+            return;
+        }
+        TraceEvent event;
+        event.type = TraceEvent::SCOPE;
+        event.name = (layer == -1 ? name : "layer " + std::to_string(layer) + " / " + name);
+        event.tid = 0;
+        event.layer = layer;
+        event.begin = std::chrono::duration_cast <std::chrono::nanoseconds> (std::chrono::steady_clock::now() - traceStart).count();
+        traceScopes.push_back(event);
+    }
+
+    void Executor::PopTraceScope() {
+        if (traceScopes.empty()) {
+            return;
+        }
+        TraceEvent event = traceScopes.back();
+        traceScopes.pop_back();
+        event.end = std::chrono::duration_cast <std::chrono::nanoseconds> (std::chrono::steady_clock::now() - traceStart).count();
+        std::lock_guard <std::mutex> guard(traceLocker);
+        traceEvents.push_back(event);
     }
 }
\ No newline at end of file
@@ -9,16 +9,21 @@
 
 #include "executor.h"
 
+#include "cpukernels.h"
+
 #include "range.h"
 
 #include <cstring>
 #include <cmath>
 #include <cfloat>
 #include <thread>
+#include <atomic>
 #include <algorithm>
 #include <ctime>
+#include <deque>
 
-#ifdef USE_MMAP
+#if defined(_WIN32) or defined(_WIN64)
+#else
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -34,6 +39,24 @@
 #include "immintrin.h"
 #endif
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#endif
+
+#if defined(__linux__) && defined(__x86_64__)
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/mempolicy.h>
+#endif
+
 #ifdef USE_CUDA
 #include "fastllm-cuda.cuh"
 #endif
@@ -53,6 +76,132 @@ namespace fastllm {
     static ThreadPool *fastllmThreadPool = nullptr;
     static bool lowMemMode = false;
     static bool kvCacheInCPU = false;
+    static std::atomic <int> numaMode(-1); // -1代表还没有读取环境变量FASTLLM_NUMA; 工作线程中也会读取
+    static std::vector <int> numaThreadNodes; // NUMA模式下每个工作线程所在的node
+    static int graphMode = -1; // -1代表还没有读取环境变量FASTLLM_GRAPH
+
+    static std::atomic <int> cpuInstructionLimit(-1); // -1代表不限制
+
+    static const char *cpuInstructionNames[] = {"BASE", "AVX2", "AVX512", "AVX512_VNNI", "AMX"};
+
+    // 编译时打开的指令集决定了哪些kernel存在 (USE_FAT_BINARY时每个指令集各编译了一份kernel)
+    static int GetCompiledCpuInstructionLevel() {
+#if defined(USE_FAT_BINARY) && defined(USE_FAT_BINARY_AMX)
+        return ISA_AMX;
+#elif defined(USE_FAT_BINARY)
+        return ISA_AVX512_VNNI;
+#elif defined(__AMX_INT8__) && defined(__AMX_TILE__) && defined(__AVX512VNNI__) && defined(__AVX512BW__)
+        return ISA_AMX;
+#elif defined(__AVX512VNNI__) && defined(__AVX512BW__)
+        return ISA_AVX512_VNNI;
+#elif defined(__AVX512F__) && defined(__AVX512BW__)
+        return ISA_AVX512;
+#elif defined(__AVX2__)
+        return ISA_AVX2;
+#else
+        return ISA_BASE;
+#endif
+    }
+
+#if (defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))) || (defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86)))
+    static void CpuId(int leaf, int subLeaf, unsigned int regs[4]) {
+#ifdef _MSC_VER
+        __cpuidex((int*)regs, leaf, subLeaf);
+#else
+        __cpuid_count(leaf, subLeaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+    }
+
+    static uint64_t XGetBV() {
+#ifdef _MSC_VER
+        return _xgetbv(0);
+#else
+        uint32_t eax, edx;
+        __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+        return ((uint64_t)edx << 32) | eax;
+#endif
+    }
+
+    // 用cpuid检测硬件支持的指令集, 同时检查操作系统是否保存了对应的寄存器状态
+    static int DetectCpuInstructionLevel() {
+        unsigned int regs[4];
+        CpuId(0, 0, regs);
+        if (regs[0] < 7) {
+            return ISA_BASE;
+        }
+        CpuId(1, 0, regs);
+        bool osxsave = (regs[2] >> 27) & 1;
+        bool fma = (regs[2] >> 12) & 1;
+        if (!osxsave) {
+            return ISA_BASE;
+        }
+        uint64_t xcr0 = XGetBV();
+        CpuId(7, 0, regs);
+        unsigned int ebx = regs[1], ecx = regs[2], edx = regs[3];
+
+        int level = ISA_BASE;
+        if ((xcr0 & 0x6) == 0x6 && ((ebx >> 5) & 1) && fma) {
+            level = ISA_AVX2;
+        } else {
+            return level;
+        }
+        if ((xcr0 & 0xE6) == 0xE6 && ((ebx >> 16) & 1) && ((ebx >> 30) & 1) && ((ebx >> 31) & 1)) {
+            level = ISA_AVX512;
+        } else {
+            return level;
+        }
+        if ((ecx >> 11) & 1) {
+            level = ISA_AVX512_VNNI;
+        } else {
+            return level;
+        }
+        CpuId(7, 1, regs);
+        bool avx512bf16 = (regs[0] >> 5) & 1;
+        // AMX级别的kernel同时使用AVX512_BF16
+        if ((xcr0 & 0x60000) == 0x60000 && ((edx >> 24) & 1) && ((edx >> 25) & 1) && avx512bf16) {
+#if defined(__linux__) && defined(__x86_64__)
+            // linux下需要先向内核申请AMX tile数据的使用权限 (ARCH_REQ_XCOMP_PERM, XFEATURE_XTILEDATA)
+            if (syscall(SYS_arch_prctl, 0x1023, 18) == 0) {
+                level = ISA_AMX;
+            }
+#endif
+        }
+        return level;
+    }
+#else
+    static int DetectCpuInstructionLevel() {
+        return ISA_BASE;
+    }
+#endif
+
+    void SetCpuInstructionLevel(int level) {
+        cpuInstructionLimit = level;
+    }
+
+    CpuInstructionLevel GetCpuInstructionLevel() {
+        // 局部静态变量的初始化是线程安全的, 只会检测一次
+        static const int detected = []() {
+            const char *env = getenv("FASTLLM_CPU_ISA");
+            if (env != nullptr) {
+                std::string name = env;
+                std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+                for (int i = ISA_BASE; i <= ISA_AMX; i++) {
+                    if (name == cpuInstructionNames[i]) {
+                        // 已经通过SetCpuInstructionLevel设置过的话, 以设置的值为准
+                        int unset = -1;
+                        cpuInstructionLimit.compare_exchange_strong(unset, i);
+                    }
+                }
+            }
+            return std::min(DetectCpuInstructionLevel(), GetCompiledCpuInstructionLevel());
+        }();
+        int level = detected;
+        int limit = cpuInstructionLimit.load();
+        if (limit != -1) {
+            level = std::min(level, limit);
+        }
+        return (CpuInstructionLevel)level;
+    }
 
     void PrintInstructionInfo() {
         std::string avx = "OFF", avx2 = "OFF", aarch64 = "OFF", neonFp16 = "OFF", neonDot = "OFF";
@@ -76,23 +225,108 @@ namespace fastllm {
         printf("AARCH64: %s\n", aarch64.c_str());
         printf("Neon FP16: %s\n", neonFp16.c_str());
         printf("Neon DOT: %s\n", neonDot.c_str());
+#ifdef USE_FAT_BINARY
+        printf("CPU kernel: %s (runtime dispatch)\n", cpuInstructionNames[GetCpuInstructionLevel()]);
+#else
+        printf("CPU kernel: %s\n", cpuInstructionNames[GetCpuInstructionLevel()]);
+#endif
     }
 
     void SetKVCacheInCPU(bool v) {
         kvCacheInCPU = v;
     }
 
+#ifdef __linux__
+    // 解析"0-3,8,10-11"格式的列表
+    static std::vector <int> ParseNumaList(const std::string &fileName) {
+        std::vector <int> ret;
+        FILE *fi = fopen(fileName.c_str(), "r");
+        if (fi == nullptr) {
+            return ret;
+        }
+        char buffer[4096] = {0};
+        if (fgets(buffer, sizeof(buffer), fi) != nullptr) {
+            std::string line = buffer;
+            size_t pos = 0;
+            while (pos < line.size() && isdigit(line[pos])) {
+                size_t next;
+                int st = std::stoi(line.substr(pos), &next), end = st;
+                pos += next;
+                if (pos < line.size() && line[pos] == '-') {
+                    end = std::stoi(line.substr(pos + 1), &next);
+                    pos += next + 1;
+                }
+                for (int i = st; i <= end; i++) {
+                    ret.push_back(i);
+                }
+                if (pos < line.size() && line[pos] == ',') {
+                    pos++;
+                }
+            }
+        }
+        fclose(fi);
+        return ret;
+    }
+
+    // 每个node上当前进程可以使用的cpu列表 (没有可用cpu的node跳过)
+    static std::vector <std::pair <int, std::vector <int> > > GetNumaNodes() {
+        std::vector <std::pair <int, std::vector <int> > > ret;
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed) != 0) {
+            return ret;
+        }
+        for (int node : ParseNumaList("/sys/devices/system/node/online")) {
+            std::vector <int> cpus;
+            for (int cpu : ParseNumaList("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist")) {
+                if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) {
+                    cpus.push_back(cpu);
+                }
+            }
+            if (cpus.size() > 0) {
+                ret.push_back(std::make_pair(node, cpus));
+            }
+        }
+        return ret;
+    }
+#endif
+
+    // NUMA模式下工作线程按编号连续地分给各个node, 并绑定到node内的cpu上
+    static std::vector <int> GetNumaThreadCpus(int t) {
+        std::vector <int> cpus;
+        numaThreadNodes.clear();
+#ifdef __linux__
+        auto nodes = GetNumaNodes();
+        if (nodes.size() == 0) {
+            return cpus;
+        }
+        int nodeCnt = nodes.size();
+        for (int i = 0; i < t; i++) {
+            int id = (int)((long long)i * nodeCnt / t);
+            int first = (int)(((long long)id * t + nodeCnt - 1) / nodeCnt); // 这个node上的第一个线程
+            auto &nodeCpus = nodes[id].second;
+            cpus.push_back(nodeCpus[(i - first) % nodeCpus.size()]);
+            numaThreadNodes.push_back(nodes[id].first);
+        }
+#endif
+        return cpus;
+    }
+
     void SetThreads(int t) {
 #ifdef PY_API
         py::gil_scoped_release release;
 #endif
+        bool numa = GetNumaMode();
         globalLocker.lock();
         threads = t;
         if (fastllmThreadPool != nullptr) {
             fastllmThreadPool->Shutdown();
             delete fastllmThreadPool;
         }
-        fastllmThreadPool = new ThreadPool(t);
+        fastllmThreadPool = new ThreadPool(t, numa ? GetNumaThreadCpus(t) : std::vector <int> ());
+        if (!numa) {
+            numaThreadNodes.clear();
+        }
         globalLocker.unlock();
 #ifdef PY_API
         py::gil_scoped_acquire acquire;
@@ -107,6 +341,24 @@ namespace fastllm {
         return kvCacheInCPU;
     }
 
+    void SetNumaMode(bool numa) {
+        numaMode = (int) numa;
+        if (fastllmThreadPool != nullptr) {
+            SetThreads(threads);
+        }
+    }
+
+    bool GetNumaMode() {
+        int mode = numaMode.load();
+        if (mode == -1) {
+            // 只在还没有设置过时写入, 不覆盖SetNumaMode的设置
+            const char *env = getenv("FASTLLM_NUMA");
+            int envMode = (env != nullptr && std::string(env) == "1");
+            mode = numaMode.compare_exchange_strong(mode, envMode) ? envMode : mode;
+        }
+        return mode == 1;
+    }
+
     bool GetLowMemMode() {
         return lowMemMode;
     }
@@ -120,17 +372,127 @@ namespace fastllm {
             SetThreads(threads);
         return fastllmThreadPool;
     }
-#ifdef USE_MMAP
-    FileMmap::FileMmap(const std::string &path) {
+
+    // cpu上中间结果的内存池: 释放的内存按尺寸分级缓存, 之后的forward直接复用, 不再每次new + memset
+    struct CpuMemoryPool {
+        std::mutex locker;
+        std::unordered_map <uint8_t*, uint64_t> blocks; // 所有由内存池分配的内存块 -> 块的字节数
+        // 块的字节数 -> 空闲的内存块(释放序号, 地址), 按释放的先后排列; 分配时取最后释放的, 淘汰时取最早释放的
+        std::map <uint64_t, std::deque <std::pair <uint64_t, uint8_t*> > > freeBlocks;
+        uint64_t freeBytes = 0; // 空闲的总字节数
+        uint64_t freeCount = 0; // 释放序号
+    };
+    static CpuMemoryPool *cpuMemoryPool = new CpuMemoryPool(); // 不析构, 全局的Data析构时内存池仍然可用
+    static const uint64_t cpuMemoryPoolLimit = 1ULL << 30; // 空闲内存超过这个值时释放最早放回的块
+
+    // 尺寸分级: 每个2的幂次区间分成4级, 浪费不超过25%
+    static uint64_t GetCpuMemoryBlockSize(uint64_t size) {
+        uint64_t step = 64;
+        while (step * 4 < size) {
+            step <<= 1;
+        }
+        return (size + step - 1) / step * step;
+    }
+
+    static void ClearCpuMemoryPoolLocked() {
+        for (auto &it : cpuMemoryPool->freeBlocks) {
+            for (auto &block : it.second) {
+                cpuMemoryPool->blocks.erase(block.second);
+                delete[] block.second;
+            }
+        }
+        cpuMemoryPool->freeBlocks.clear();
+        cpuMemoryPool->freeBytes = 0;
+    }
+
+    // 空闲内存超过上限时, 按释放的先后释放最早放回的块, 直到回到上限以内
+    // 不释放刚放回的块keep: 单个超过上限的块(如很长的prefill或graph的slab)下一步还会用到, 不能每一步都重新分配
+    static void TrimCpuMemoryPoolLocked(uint8_t *keep) {
+        auto &freeBlocks = cpuMemoryPool->freeBlocks;
+        while (cpuMemoryPool->freeBytes > cpuMemoryPoolLimit) {
+            auto oldest = freeBlocks.end();
+            for (auto it = freeBlocks.begin(); it != freeBlocks.end(); it++) {
+                if (oldest == freeBlocks.end() || it->second.front().first < oldest->second.front().first) {
+                    oldest = it;
+                }
+            }
+            if (oldest == freeBlocks.end() || oldest->second.front().second == keep) {
+                break;
+            }
+            uint8_t *block = oldest->second.front().second;
+            cpuMemoryPool->blocks.erase(block);
+            delete[] block;
+            cpuMemoryPool->freeBytes -= oldest->first;
+            oldest->second.pop_front();
+            if (oldest->second.empty()) {
+                freeBlocks.erase(oldest);
+            }
+        }
+    }
+
+    uint8_t *FastllmCpuMalloc(uint64_t size) {
+        uint64_t blockSize = GetCpuMemoryBlockSize(size);
+        std::lock_guard <std::mutex> guard(cpuMemoryPool->locker);
+        auto it = cpuMemoryPool->freeBlocks.find(blockSize);
+        if (it != cpuMemoryPool->freeBlocks.end()) {
+            uint8_t *ret = it->second.back().second;
+            it->second.pop_back();
+            if (it->second.empty()) {
+                cpuMemoryPool->freeBlocks.erase(it);
+            }
+            cpuMemoryPool->freeBytes -= blockSize;
+            return ret;
+        }
+        uint8_t *ret = new uint8_t[blockSize];
+        cpuMemoryPool->blocks[ret] = blockSize;
+        return ret;
+    }
+
+    void FastllmCpuFree(uint8_t *data) {
+        if (data == nullptr) {
+            return;
+        }
+        std::lock_guard <std::mutex> guard(cpuMemoryPool->locker);
+        auto it = cpuMemoryPool->blocks.find(data);
+        if (it == cpuMemoryPool->blocks.end()) {
+            // 不是内存池分配的内存
+            delete[] data;
+            return;
+        }
+        cpuMemoryPool->freeBlocks[it->second].push_back(std::make_pair(cpuMemoryPool->freeCount++, data));
+        cpuMemoryPool->freeBytes += it->second;
+        if (cpuMemoryPool->freeBytes > cpuMemoryPoolLimit) {
+            TrimCpuMemoryPoolLocked(data);
+        }
+    }
+
+    void ClearCpuMemoryPool() {
+        std::lock_guard <std::mutex> guard(cpuMemoryPool->locker);
+        ClearCpuMemoryPoolLocked();
+    }
+#if defined(_WIN32) or defined(_WIN64)
+#else
+    FileMmap::FileMmap(const std::string &path, bool copyOnWrite, bool prefetch) {
         int fd = open(path.c_str(), O_RDONLY);
-        AssertInFastLLM(fd > 0, "cannot open file ");
+        AssertInFastLLM(fd >= 0, "cannot open file " + path + "\n");
 
         struct stat sb;
         AssertInFastLLM(fstat(fd, &sb) == 0, "fstat error");
         size = sb.st_size;
 
-        data = (char *)mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (prefetch) {
+#ifdef POSIX_FADV_SEQUENTIAL
+            // 加大这个文件的预读窗口, 下面的MADV_WILLNEED会按顺序把整个文件读进page cache
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+        }
+        // 私有映射的页在被写之前和page cache共享, 多个进程加载同一个模型时只占一份内存
+        data = (char *)mmap(nullptr, size, copyOnWrite ? PROT_READ | PROT_WRITE : PROT_READ,
+                            copyOnWrite ? MAP_PRIVATE : MAP_SHARED, fd, 0);
         AssertInFastLLM(data != MAP_FAILED, "mmap failed");
+        if (prefetch) {
+            madvise(data, size, MADV_WILLNEED);
+        }
 
         AssertInFastLLM(close(fd) == 0, "close file error");
     }
@@ -171,11 +533,28 @@ namespace fastllm {
         return buffer;
     }
 
+    static uint64_t FileTell(FILE *f) {
+#if defined(_WIN32) or defined(_WIN64)
+        return _ftelli64(f);
+#else
+        return ftello(f);
+#endif
+    }
+
+    static void FileSeek(FILE *f, uint64_t pos) {
+#if defined(_WIN32) or defined(_WIN64)
+        _fseeki64(f, (long long)pos, SEEK_SET);
+#else
+        fseeko(f, (off_t)pos, SEEK_SET);
+#endif
+    }
+
     struct FileBuffer {
         FILE *f;
 
         FileBuffer (const std::string &fileName) {
             f = fopen(fileName.c_str(), "rb");
+            AssertInFastLLM(f != nullptr, "Can't open file " + fileName + "\n");
         }
 
         int ReadInt() {
@@ -196,12 +575,18 @@ namespace fastllm {
 
         std::string ReadString() {
             int len = ReadInt();
-            std::string ret = "";
-            char *v = new char[len + 5];
-            v[len] = 0;
-            if (fread(v, 1, len, f) != len) {
+            std::string ret(len, 0);
+            if (fread(&ret[0], 1, len, f) != len) {
                 ErrorInFastLLM("FileBuffer.ReadString error.\n");
             }
+            return ret;
+        }
+
+        uint64_t ReadUInt64() {
+            uint64_t v;
+            if (fread(&v, 1, 8, f) != 8) {
+                ErrorInFastLLM("FileBuffer.ReadUInt64 error.\n");
+            };
             return v;
         }
 
@@ -211,6 +596,23 @@ namespace fastllm {
             }
         }
 
+        void Seek(uint64_t pos) {
+            FileSeek(f, pos);
+        }
+
+        uint64_t Tell() {
+            return FileTell(f);
+        }
+
+        bool Finished() {
+            int c = fgetc(f);
+            if (c == EOF) {
+                return true;
+            }
+            ungetc(c, f);
+            return false;
+        }
+
         ~FileBuffer() {
             fclose(f);
         }
@@ -221,6 +623,7 @@ namespace fastllm {
 
         FileWriter (const std::string &fileName) {
             f = fopen(fileName.c_str(), "wb");
+            AssertInFastLLM(f != nullptr, "Can't open file " + fileName + "\n");
         }
 
         void WriteInt(int v) {
@@ -242,17 +645,194 @@ namespace fastllm {
             }
         }
 
-        void WriteBytes(uint8_t *buffer, uint64_t bytes) {
+        void WriteUInt64(uint64_t v) {
+            if (fwrite(&v, 1, 8, f) != 8) {
+                ErrorInFastLLM("FileWriter.WriteUInt64 error.\n");
+            };
+        }
+
+        void WriteBytes(const uint8_t *buffer, uint64_t bytes) {
             if (fwrite(buffer, 1, bytes, f) != bytes) {
                 ErrorInFastLLM("FileWriter.WriteBytes error.\n");
             }
         }
 
+        // 补0直到当前位置是alignment的整数倍
+        void Align(uint64_t alignment) {
+            uint64_t pos = Tell();
+            if (pos % alignment != 0) {
+                std::vector <uint8_t> zeros(alignment - pos % alignment, 0);
+                WriteBytes(zeros.data(), zeros.size());
+            }
+        }
+
+        uint64_t Tell() {
+            return FileTell(f);
+        }
+
+        void Seek(uint64_t pos) {
+            FileSeek(f, pos);
+        }
+
         ~FileWriter() {
             fclose(f);
         }
     };
 
+    // .flm v3格式:
+    // versionId(3), key-value表, [peft表], 词表(id, score, 字符串偏移三个连续数组 + 所有字符串拼成的字节数组), [特殊token],
+    // 权重索引的位置(uint64), 各权重的数据(按flmTensorAlignment对齐), 权重索引(名字, 类型, 形状, 量化参数, 数据的位置和字节数),
+    // [编译好的分词trie(普通token和特殊token两个双数组), 没有时加载后重新编译]
+    // 权重数据对齐到页, 加载时直接mmap文件使用, 不需要逐个拷贝
+    static const int flmV3VersionId = 3;
+    static const uint64_t flmTensorAlignment = 4096;
+
+    struct FlmTensorInfo {
+        std::string name;
+        DataType dataType = DataType::FLOAT32;
+        std::vector <int> dims;
+        int perChannelAxis = -1, group = -1, groupCnt = -1;
+        std::vector <float> minMax; // 每个通道(分组)的min, max
+        uint64_t offset = 0, bytes = 0;
+
+        void Write(FileWriter &buffer) const {
+            buffer.WriteString(name);
+            buffer.WriteInt((int)dataType);
+            buffer.WriteInt((int)dims.size());
+            for (int dim : dims) {
+                buffer.WriteInt(dim);
+            }
+            buffer.WriteInt(perChannelAxis);
+            buffer.WriteInt(group);
+            buffer.WriteInt(groupCnt);
+            buffer.WriteInt((int)minMax.size() / 2);
+            buffer.WriteBytes((const uint8_t*)minMax.data(), minMax.size() * sizeof(float));
+            buffer.WriteUInt64(offset);
+            buffer.WriteUInt64(bytes);
+        }
+
+        void Read(FileBuffer &buffer) {
+            name = buffer.ReadString();
+            dataType = (DataType)buffer.ReadInt();
+            dims.resize(buffer.ReadInt());
+            for (int &dim : dims) {
+                dim = buffer.ReadInt();
+            }
+            perChannelAxis = buffer.ReadInt();
+            group = buffer.ReadInt();
+            groupCnt = buffer.ReadInt();
+            minMax.resize(buffer.ReadInt() * 2);
+            buffer.ReadBytes((uint8_t*)minMax.data(), minMax.size() * sizeof(float));
+            offset = buffer.ReadUInt64();
+            bytes = buffer.ReadUInt64();
+        }
+    };
+
+    static void WriteDoubleArrayTrie(FileWriter &buffer, const Tokenizer::DoubleArrayTrie &trie) {
+        buffer.WriteInt((int)trie.base.size());
+        buffer.WriteBytes((const uint8_t*)trie.base.data(), trie.base.size() * sizeof(int));
+        buffer.WriteBytes((const uint8_t*)trie.check.data(), trie.check.size() * sizeof(int));
+        buffer.WriteBytes((const uint8_t*)trie.tokenIds.data(), trie.tokenIds.size() * sizeof(int));
+        buffer.WriteBytes((const uint8_t*)trie.scores.data(), trie.scores.size() * sizeof(float));
+    }
+
+    static void ReadDoubleArrayTrie(FileBuffer &buffer, Tokenizer::DoubleArrayTrie &trie) {
+        int size = buffer.ReadInt();
+        AssertInFastLLM(size >= 256, "Error: tokenizer trie's size error.\n");
+        trie.base.resize(size);
+        trie.check.resize(size);
+        trie.tokenIds.resize(size);
+        trie.scores.resize(size);
+        buffer.ReadBytes((uint8_t*)trie.base.data(), trie.base.size() * sizeof(int));
+        buffer.ReadBytes((uint8_t*)trie.check.data(), trie.check.size() * sizeof(int));
+        buffer.ReadBytes((uint8_t*)trie.tokenIds.data(), trie.tokenIds.size() * sizeof(int));
+        buffer.ReadBytes((uint8_t*)trie.scores.data(), trie.scores.size() * sizeof(float));
+        for (int i = 0; i < size; i++) {
+            AssertInFastLLM(trie.base[i] >= 0 && trie.base[i] + 256 <= size, "Error: tokenizer trie's data error.\n");
+        }
+    }
+
+    // 加载时对权重做的预处理: 读入mmap的页, 提前算好CPU上量化Linear需要的权重和以及AMX格式的INT8权重,
+    // NUMA模式下放置内存, 不留到第一次推理时做
+    static void PrepareLoadedWeight(Data &weight) {
+        if (weight.cpuData == nullptr || weight.dataDevice != DataDevice::CPU) {
+            return;
+        }
+        uint64_t bytes = weight.GetBytes();
+        uint8_t touched = 0;
+        for (uint64_t i = 0; i < bytes; i += 4096) {
+            touched ^= ((volatile uint8_t*)weight.cpuData)[i];
+        }
+        (void)touched;
+        if (weight.dims.size() == 2 && weight.l2_num == -1 &&
+            (weight.dataType == DataType::INT8 || weight.dataType == DataType::INT4 ||
+             weight.dataType == DataType::INT4_NOZERO || weight.dataType == DataType::INT4_GROUP)) {
+            weight.CalcWeightSum();
+        }
+        if (weight.dims.size() == 2 && weight.l2_num == -1 && weight.dataType == DataType::INT8 &&
+            GetCpuInstructionLevel() >= ISA_AMX && !GetLowMemMode()) {
+            // 2维的INT8权重都是Linear的权重(embedding只支持浮点类型)
+            weight.CalcAMXWeight();
+        }
+        weight.PlaceOnNumaNodes();
+    }
+
+    // 并行加载权重: 每个权重的读取和预处理是线程池中的一个任务, 各自用独立的文件句柄读取,
+    // 先读完的权重马上开始预处理, 读文件和计算互相重叠
+    struct ParallelWeightLoader {
+        std::string fileName;
+        std::vector <std::future <void> > futures;
+
+        ParallelWeightLoader (const std::string &fileName) : fileName(fileName) {}
+
+        // weight的数据在文件的pos处
+        void ReadAt(Data *weight, uint64_t pos) {
+            std::string fileName = this->fileName;
+            futures.push_back(GetPool()->Submit([weight, pos, fileName]() {
+                weight->Allocate();
+                FileBuffer reader(fileName);
+                reader.Seek(pos);
+                reader.ReadBytes(weight->cpuData, weight->GetBytes());
+                PrepareLoadedWeight(*weight);
+            }));
+        }
+
+        // weight的数据在buffer的当前位置, 记下位置后跳过
+        void Read(Data *weight, FileBuffer &buffer) {
+            uint64_t pos = buffer.Tell();
+            ReadAt(weight, pos);
+            buffer.Seek(pos + weight->GetBytes());
+        }
+
+        // 数据已经就位(例如mmap), 只做预处理
+        void Prepare(Data *weight) {
+            futures.push_back(GetPool()->Submit([weight]() {
+                PrepareLoadedWeight(*weight);
+            }));
+        }
+
+        // 等待所有任务完成; 有任务出错时也要等其余任务结束, 再抛出第一个错误
+        void Wait() {
+            std::exception_ptr error;
+            for (int i = 0; i < futures.size(); i++) {
+                try {
+                    futures[i].get();
+                } catch (...) {
+                    if (!error) {
+                        error = std::current_exception();
+                    }
+                }
+                printf("Load (%d / %d) \r", i + 1, (int)futures.size());
+                fflush(stdout);
+            }
+            printf("\n");
+            fflush(stdout);
+            if (error) {
+                std::rethrow_exception(error);
+            }
+        }
+    };
+
     Data::Data(fastllm::DataType type) {
         this->dataType = type;
         this->UpdateUnitSize();
@@ -268,6 +848,8 @@ namespace fastllm {
         this->Allocate();
         if (type == DataType::FLOAT32) {
             std::memcpy(this->cpuData, data.data(), this->GetBytes());
+        } else {
+            std::memset(this->cpuData, 0, this->GetBytes());
         }
     }
 
@@ -275,15 +857,252 @@ namespace fastllm {
         CopyFrom(ori);
     }
 
+    Data::Data(Data &&ori) noexcept {
+        *this = std::move(ori);
+    }
+
+    Data &Data::operator = (const Data &ori) {
+        if (this != &ori) {
+            CopyFrom(ori);
+        }
+        return *this;
+    }
+
+    Data &Data::operator = (Data &&ori) noexcept {
+        if (this == &ori) {
+            return *this;
+        }
+#ifndef USE_MMAP
+        this->FreeCpuData();
+#endif
+#ifdef USE_CUDA
+        if (this->cudaData != nullptr && !this->isView) {
+            FastllmCudaFree(this->cudaData);
+        }
+#endif
+        this->cacheUid = ori.cacheUid;
+        this->isKVCache = ori.isKVCache;
+        this->lockInCPU = ori.lockInCPU;
+        this->weightType = ori.weightType;
+        this->dataType = ori.dataType;
+        this->unitSize = ori.unitSize;
+        this->unitSizeDiv = ori.unitSizeDiv;
+        this->dims = std::move(ori.dims);
+        this->strides = std::move(ori.strides);
+        this->expansionSize = ori.expansionSize;
+        this->expansionBytes = ori.expansionBytes;
+        this->expansionDims = std::move(ori.expansionDims);
+        this->cpuData = ori.cpuData;
+        this->cpuDataHolder = std::move(ori.cpuDataHolder);
+        this->isView = ori.isView;
+        this->cudaData = ori.cudaData;
+        this->extraCudaData = std::move(ori.extraCudaData);
+        this->extraCudaHalfData = std::move(ori.extraCudaHalfData);
+        this->deviceData = ori.deviceData;
+        this->extraDeviceData = std::move(ori.extraDeviceData);
+        this->dataDevice = ori.dataDevice;
+        this->dataDeviceIds = std::move(ori.dataDeviceIds);
+        this->perChannelAxis = ori.perChannelAxis;
+        this->group = ori.group;
+        this->groupCnt = ori.groupCnt;
+        this->perChannelsConfigs = std::move(ori.perChannelsConfigs);
+        this->scales = std::move(ori.scales);
+        this->mins = std::move(ori.mins);
+        this->zeros = std::move(ori.zeros);
+        this->weightSum = std::move(ori.weightSum);
+        this->amxWeight = std::move(ori.amxWeight);
+        this->linearInputLayout = ori.linearInputLayout;
+        this->l2_num = ori.l2_num;
+        this->l2_probs = std::move(ori.l2_probs);
+        this->index2data = std::move(ori.index2data);
+        this->thread_num = ori.thread_num;
+        this->size = ori.size;
+        this->name = std::move(ori.name);
+        this->fileName = std::move(ori.fileName);
+        this->filePos = ori.filePos;
+        this->mapFile = std::move(ori.mapFile);
+        this->directMemory = ori.directMemory;
+        this->numaPlacedThreads = ori.numaPlacedThreads;
+        this->numaPlacedSegments = ori.numaPlacedSegments;
+
+        // ori不再持有任何内存
+        ori.cpuData = nullptr;
+        ori.cudaData = nullptr;
+        ori.deviceData = nullptr;
+        ori.isView = false;
+        ori.expansionSize = 0;
+        ori.expansionBytes = 0;
+        ori.dims.clear();
+        ori.strides.clear();
+        ori.expansionDims.clear();
+        return *this;
+    }
+
+    Data Data::View(const Data &ori) {
+        Data view;
+        view.ViewFrom(ori);
+        return view;
+    }
+
+    void Data::ViewFrom(const Data &ori) {
+        if (this == &ori) {
+            return;
+        }
+        this->ViewFrom(ori, 0, 0, ori.dims.size() > 0 ? ori.dims[0] : 0);
+        this->expansionDims = ori.expansionDims;
+        this->strides = ori.strides;
+        this->expansionSize = ori.expansionSize;
+        this->expansionBytes = ori.expansionBytes;
+    }
+
+    void Data::ViewFrom(const Data &ori, int axis, int start, int end) {
+        AssertInFastLLM(this != &ori, "ViewFrom error: can't view itself.\n");
+        AssertInFastLLM(ori.dataDevice == DataDevice::CPU || ori.dataDevice == DataDevice::CUDA,
+                        "ViewFrom error: unsupport device.\n");
+        Data empty;
+        *this = std::move(empty);
+        this->name = ori.name;
+        this->isKVCache = ori.isKVCache;
+        this->cacheUid = ori.cacheUid;
+        this->lockInCPU = ori.lockInCPU;
+        this->weightType = ori.weightType;
+        this->dataType = ori.dataType;
+        this->UpdateUnitSize();
+        this->dataDevice = ori.dataDevice;
+        this->dataDeviceIds = ori.dataDeviceIds;
+        this->perChannelAxis = ori.perChannelAxis;
+        this->perChannelsConfigs = ori.perChannelsConfigs;
+        this->linearInputLayout = ori.linearInputLayout;
+        if (ori.dims.size() == 0) {
+            return;
+        }
+
+        int dimsLen = ori.dims.size();
+        axis = (axis % dimsLen + dimsLen) % dimsLen;
+        AssertInFastLLM(0 <= start && start <= end && end <= ori.dims[axis], "ViewFrom error: wrong range.\n");
+        if (start != 0 || end != ori.dims[axis]) {
+            for (int i = 0; i < axis; i++) {
+                AssertInFastLLM(ori.dims[i] == 1, "ViewFrom error: the range should be continuous.\n");
+            }
+            for (int i = dimsLen - 1, inner = 1; i >= axis; inner *= ori.dims[i], i--) {
+                AssertInFastLLM(ori.strides[i] == inner, "ViewFrom error: the range should be continuous.\n");
+            }
+        }
+        std::vector <int> dims = ori.dims;
+        dims[axis] = end - start;
+        this->Resize(dims);
+        uint64_t offset = (uint64_t)start * ori.strides[axis];
+        AssertInFastLLM((offset * this->unitSize) % this->unitSizeDiv == 0, "ViewFrom error: offset should be aligned.\n");
+        uint64_t offsetBytes = offset * this->unitSize / this->unitSizeDiv;
+        this->expansionSize = this->Count(0);
+        this->expansionBytes = this->expansionSize == 0 ? 0 : this->GetBytes();
+        this->isView = true;
+
+        if (ori.dataDevice == DataDevice::CPU) {
+            if (ori.cpuData == nullptr) {
+                return;
+            }
+            if (ori.cpuDataHolder == nullptr && !ori.isView) {
+                // 第一次被共享时, 把ori的内存交给引用计数管理
+#ifdef USE_MMAP
+                ori.cpuDataHolder = std::shared_ptr <uint8_t> (ori.cpuData, [](uint8_t*) {});
+#else
+                ori.cpuDataHolder = std::shared_ptr <uint8_t> (ori.cpuData, [](uint8_t *data) { FastllmCpuFree(data); });
+#endif
+            }
+            this->cpuDataHolder = ori.cpuDataHolder;
+            this->cpuData = ori.cpuData + offsetBytes;
+        } else {
+            this->cudaData = ori.cudaData == nullptr ? nullptr : (uint8_t*)ori.cudaData + offsetBytes;
+        }
+    }
+
+    void Data::FreeCpuData() {
+        if (this->cpuDataHolder != nullptr) {
+            this->cpuDataHolder.reset();
+        } else if (!this->isView) {
+            FastllmCpuFree(this->cpuData);
+        }
+        this->cpuData = nullptr;
+        this->numaPlacedThreads = 0;
+        this->numaPlacedSegments = 1;
+    }
+
+#ifdef __linux__
+    // 把从data开始的units个单位(每个unitBytes字节)迁移到计算它们的工作线程所在的node上
+    // 和RunPartsMultiThread相同的划分: 先平均分成segments段, 每段的第i部分[len * i / parts, len * (i + 1) / parts)由第i个工作线程计算
+    static void PlaceUnitsOnNumaNodes(uint8_t *data, uint64_t units, uint64_t unitBytes, int segments) {
+        int threadNum = numaThreadNodes.size();
+        uint64_t pageSize = sysconf(_SC_PAGESIZE);
+        uint64_t base = (uint64_t)data, bufferEnd = base + units * unitBytes;
+        uint64_t pageSt = base / pageSize * pageSize;
+        const int bits = sizeof(unsigned long) * 8;
+        for (int s = 0; s < segments; s++) {
+            uint64_t segSt = units * s / segments, len = units * (s + 1) / segments - segSt;
+            int parts = (int)std::max((uint64_t)1, std::min((uint64_t)threadNum, len));
+            for (int i = 0; i < parts; ) {
+                int j = i;
+                while (j + 1 < parts && numaThreadNodes[j + 1] == numaThreadNodes[i]) {
+                    j++;
+                }
+                // 相邻node的分界处四舍五入到整页
+                uint64_t end = base + (segSt + len * (j + 1) / parts) * unitBytes;
+                uint64_t pageEnd = (s + 1 == segments && j + 1 == parts) ? bufferEnd : (end + pageSize / 2) / pageSize * pageSize;
+                if (pageEnd > pageSt) {
+                    int node = numaThreadNodes[i];
+                    std::vector <unsigned long> nodeMask(node / bits + 1, 0);
+                    nodeMask[node / bits] |= (1UL << (node % bits));
+                    // 失败(例如内核不支持)时保持原来的位置
+                    syscall(SYS_mbind, (void*)pageSt, pageEnd - pageSt, MPOL_PREFERRED, nodeMask.data(),
+                            nodeMask.size() * bits + 1, MPOL_MF_MOVE);
+                    pageSt = pageEnd;
+                }
+                i = j + 1;
+            }
+        }
+    }
+#endif
+
+    void Data::PlaceOnNumaNodes(int segments) {
+        if (!GetNumaMode() || (this->numaPlacedThreads == GetThreads() && this->numaPlacedSegments == segments) ||
+            this->cpuData == nullptr || this->dataDevice != DataDevice::CPU || this->dims.size() < 2) {
+            return;
+        }
+        GetPool();
+        int threadNum = GetThreads();
+        this->numaPlacedThreads = threadNum;
+        this->numaPlacedSegments = segments;
+#ifdef __linux__
+        if (numaThreadNodes.size() != threadNum) {
+            return;
+        }
+        uint64_t rowBytes = this->strides[0] * this->unitSize / this->unitSizeDiv;
+        PlaceUnitsOnNumaNodes(this->cpuData, this->dims[0], rowBytes, segments);
+        if (this->amxWeight.size() > 0) {
+            // AMX计算时按16行一组划分给各个线程, amxWeight中每组连续存放
+            uint64_t stripes = (this->dims[0] + 15) / 16;
+            PlaceUnitsOnNumaNodes((uint8_t*)this->amxWeight.data(), stripes, this->amxWeight.size() / stripes, segments);
+        }
+#endif
+    }
+
     void Data::CopyFrom(const Data &ori) {
         this->name = ori.name;
         this->isKVCache = ori.isKVCache;
         this->cacheUid = ori.cacheUid;
         
         // std::cout<<"调用拷贝构造"<<std::endl;
+        if (this->isView) {
+            // 视图的内存是共享的, 拷贝时需要分配自己的内存
+            this->FreeSpace();
+            this->isView = false;
+        }
         if (ori.dims != this->dims || this->cpuData == nullptr || ori.dataType != this->dataType) {
             if (ori.dims.size() == 0) {
-                delete[] this->cpuData;
+                this->FreeCpuData();
+                this->expansionSize = 0;
+                this->expansionBytes = 0;
+                this->isView = false;
                 this->dataType = ori.dataType;
                 this->UpdateUnitSize();
                 this->dims.resize(0);
@@ -344,8 +1163,10 @@ namespace fastllm {
 
         if (this->expansionDims.size() == 0) {
             this->strides.resize(dims.size(), 1);
-            this->strides.back() = 1;
-            for (int i = this->dims.size() - 2; i >= 0; i--) {
+            if (dims.size() > 0) {
+                this->strides.back() = 1;
+            }
+            for (int i = (int) this->dims.size() - 2; i >= 0; i--) {
                 this->strides[i] = this->dims[i + 1] * this->strides[i + 1];
             }
         }
@@ -391,9 +1212,15 @@ namespace fastllm {
     void Data::MallocSpace(uint64_t size) {
         this->expansionSize = size;
         this->expansionBytes = (size * this->unitSize - 1) / this->unitSizeDiv + 1;
+        this->isView = false;
         if (this->dataDevice == DataDevice::CPU) {
-            this->cpuData = new uint8_t[this->expansionBytes];
-            memset(this->cpuData, 0, this->expansionBytes*sizeof(uint8_t));
+            if (this->directMemory || this->isKVCache) {
+                this->cpuData = new uint8_t[this->expansionBytes];
+                memset(this->cpuData, 0, this->expansionBytes*sizeof(uint8_t));
+            } else {
+                // 中间结果从内存池中取, 不清零 (需要0初始化的算子自己填充)
+                this->cpuData = FastllmCpuMalloc(this->expansionBytes);
+            }
         } else if (this->dataDevice == DataDevice::CUDA) {
 #ifdef USE_CUDA
             if (this->directMemory) {
@@ -411,10 +1238,12 @@ namespace fastllm {
         this->expansionSize = 0;
         this->expansionBytes = 0;
         if (this->dataDevice == DataDevice::CPU) {
-            delete[] this->cpuData;
+            this->FreeCpuData();
         } else if (this->dataDevice == DataDevice::CUDA) {
 #ifdef USE_CUDA
-            if (this->directMemory) {
+            if (this->isView) {
+                this->cudaData = nullptr;
+            } else if (this->directMemory) {
                 FastllmCudaDirectFree(this->cudaData);
             } else {
                 FastllmCudaFree(this->cudaData);
@@ -434,7 +1263,8 @@ namespace fastllm {
 
     void Data::Allocate(float v) {
         AssertInFastLLM(this->dataType == DataType::FLOAT32
-                        || this->dataType == DataType::FLOAT16, "Allocate error: Data's type should be float32 or float16.\n");
+                        || this->dataType == DataType::FLOAT16
+                        || this->dataType == DataType::BFLOAT16, "Allocate error: Data's type should be float32, float16 or bfloat16.\n");
         this->Allocate();
         if (this->dataDevice == DataDevice::CPU) {
             if (this->dataType == DataType::FLOAT32) {
@@ -443,6 +1273,9 @@ namespace fastllm {
             } else if (this->dataType == DataType::FLOAT16) {
                 uint16_t *h = (uint16_t*)cpuData;
                 std::fill(h, h + Count(0), float_to_half(v));
+            } else if (this->dataType == DataType::BFLOAT16) {
+                uint16_t *h = (uint16_t*)cpuData;
+                std::fill(h, h + Count(0), float_to_bfloat16(v));
             }
         } else {
             // TODO: 别的设备上的初始化
@@ -450,6 +1283,7 @@ namespace fastllm {
     }
 
     void Data::Expansion(const std::vector<int> &dims) {
+        AssertInFastLLM(!this->isView, "Expansion error: can't expand a view.\n");
         if (this->dims.size() == 0) {
             this->directMemory = true;
             this->strides.resize(dims.size(), 1);
@@ -487,6 +1321,7 @@ namespace fastllm {
         if (this->expansionBytes != 0) {
             if (this->dataDevice == DataDevice::CPU) {
                 uint8_t *old = this->cpuData;
+                std::shared_ptr <uint8_t> oldHolder = std::move(this->cpuDataHolder);
                 MallocSpace(this->strides[0] * std::max(this->dims[0], dims[0]));
                 int outer = this->Count(0) / this->Count(axis);
                 int input0Stride = this->Count(axis);
@@ -497,7 +1332,11 @@ namespace fastllm {
                            old + o * input1Stride * unitSize,
                            this->dims[axis] * inner * unitSize);
                 }
-                delete[] old;
+                if (oldHolder != nullptr) {
+                    oldHolder.reset();
+                } else {
+                    FastllmCpuFree(old);
+                }
             } else if (this->dataDevice == DataDevice::CUDA) {
 #ifdef USE_CUDA
                 uint8_t *old = (uint8_t*)this->cudaData;
@@ -521,10 +1360,10 @@ namespace fastllm {
 
     Data::~Data() {
 #ifndef USE_MMAP
-        delete[] this->cpuData;
+        this->FreeCpuData();
 #endif
 #ifdef USE_CUDA
-        if (this->cudaData != nullptr) {
+        if (this->cudaData != nullptr && !this->isView) {
             FastllmCudaFree(this->cudaData);
             /*if (this->directMemory) {
                 FastllmCudaDirectFree(this->cudaData);
@@ -606,77 +1445,17 @@ namespace fastllm {
             return;
         }
         int n = this->dims[0], m = this->dims[1];
+        const CpuLinearKernels *kernels = GetCpuLinearKernels();
         if (this->dataType == DataType::INT8) {
             weightSum.resize(n);
             for (int i = 0; i < n; i++) {
-                int j = 0;
-#ifdef __AVX2__
-                __m256i acc = _mm256_setzero_si256();
-                const __m256i ones = _mm256_set1_epi16(1);
-                for (; j + 31 < m; j += 32) {
-                    __m256i ax = _mm256_loadu_si256((const __m256i *) (cpuData + i * m + j));
-                    __m256i mx0 = _mm256_cvtepu8_epi16(_mm256_extractf128_si256(ax, 0));
-                    __m256i mx1 = _mm256_cvtepu8_epi16(_mm256_extractf128_si256(ax, 1));
-                    acc = _mm256_add_epi32(acc, _mm256_madd_epi16(mx0, ones));
-                    acc = _mm256_add_epi32(acc, _mm256_madd_epi16(mx1, ones));
-                }
-                weightSum[i] += I32sum(acc);
-#endif
-#ifdef __aarch64__
-                uint32x4_t sum0 = {0, 0, 0, 0};
-                for (; j + 7 < m; j += 8) {
-                    uint8x8_t ori = vld1_u8(cpuData + (i * m + j));
-                    uint16x4_t sa = vpaddl_u8 (ori);
-                    sum0 = vaddw_u16(sum0, sa);
-                }
-                weightSum[i] += sum0[0] + sum0[1] + sum0[2] + sum0[3];
-#endif
-                for (; j < m; j++) {
-                    weightSum[i] += cpuData[i * m + j];
-                }
+                weightSum[i] = kernels->sumU8Row(cpuData + (uint64_t)i * m, m);
             }
         } else if (this->dataType == DataType::INT4 || this->dataType == DataType::INT4_NOZERO) {
             weightSum.resize(n);
             for (int i = 0; i < n; i++) {
-                int j = 0;
-#ifdef __aarch64__
-                uint8x8_t maskHigh = vdup_n_u8(0xF0);
-                uint8x8_t maskLow = vdup_n_u8(0xF);
-                uint32x4_t sum0 = {0, 0, 0, 0};
-
-                for (; j + 15 < m; j += 16) {
-                    uint8x8_t ori = vld1_u8(cpuData + (i * m + j) / 2);
-                    uint8x8_t va = vand_u8(ori, maskLow);
-                    uint8x8_t vb = vshr_n_u8(vand_u8(ori, maskHigh), 4);
-
-                    uint16x4_t sa = vpaddl_u8 (va);
-                    uint16x4_t sb = vpaddl_u8 (vb);
-
-                    sum0 = vaddw_u16(sum0, vadd_u16(sa, sb));
-                }
-                weightSum[i] += sum0[0] + sum0[1] + sum0[2] + sum0[3];
-#endif
-#ifdef __AVX2__
-	            __m256i acc = _mm256_setzero_si256();
-	            const __m256i lowMask = _mm256_set1_epi8(0xf);
-	            const __m256i ones = _mm256_set1_epi16(1);
-	            for (; j + 31 < m; j += 32) {
-		            __m128i orix = _mm_loadu_si128((const __m128i *) (cpuData + (i * m + j) / 2));
-		            __m256i bytex = _mm256_set_m128i(_mm_srli_epi16(orix, 4), orix);
-		            __m256i bx = _mm256_and_si256(lowMask, bytex);
-
-		            __m256i mx0 = _mm256_cvtepu8_epi16(_mm256_extractf128_si256(bx, 0));
-		            __m256i mx1 = _mm256_cvtepu8_epi16(_mm256_extractf128_si256(bx, 1));
-
-		            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(mx0, ones));
-		            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(mx1, ones));
-	            }
-	            weightSum[i] += I32sum(acc);
-#endif
-                for (; j + 1 < m; j += 2) {
-	                int id = (i * m + j) / 2;
-	                weightSum[i] += (cpuData[id] & 0xF) + (cpuData[id] >> 4);
-                }
+                int j = m / 2 * 2;
+                weightSum[i] = kernels->sumU4Row(cpuData + ((uint64_t)i * m) / 2, m / 2);
                 for (; j < m; j++) {
                     int id = (i * m + j) / 2;
                     if ((i * m + j) % 2) {
@@ -693,45 +1472,8 @@ namespace fastllm {
                     int gid = i * this->group + g;
                     int st = g * this->groupCnt;
                     int end = std::min(m, (g + 1) * this->groupCnt);
-                    int j = st;
-#ifdef __aarch64__
-                    uint8x8_t maskHigh = vdup_n_u8(0xF0);
-                    uint8x8_t maskLow = vdup_n_u8(0xF);
-                    uint32x4_t sum0 = {0, 0, 0, 0};
-
-                    for (; j + 15 < end; j += 16) {
-                        uint8x8_t ori = vld1_u8(cpuData + (i * m + j) / 2);
-                        uint8x8_t va = vand_u8(ori, maskLow);
-                        uint8x8_t vb = vshr_n_u8(vand_u8(ori, maskHigh), 4);
-
-                        uint16x4_t sa = vpaddl_u8 (va);
-                        uint16x4_t sb = vpaddl_u8 (vb);
-
-                        sum0 = vaddw_u16(sum0, vadd_u16(sa, sb));
-                    }
-                    weightSum[gid] += sum0[0] + sum0[1] + sum0[2] + sum0[3];
-#endif
-#ifdef __AVX2__X
-                    __m256i acc = _mm256_setzero_si256();
-                    const __m256i lowMask = _mm256_set1_epi8(0xf);
-                    const __m256i ones = _mm256_set1_epi16(1);
-                    for (; j + 31 < m; j += 32) {
-                        __m128i orix = _mm_loadu_si128((const __m128i *) (cpuData + (i * m + j) / 2));
-                        __m256i bytex = _mm256_set_m128i(_mm_srli_epi16(orix, 4), orix);
-                        __m256i bx = _mm256_and_si256(lowMask, bytex);
-
-                        __m256i mx0 = _mm256_cvtepu8_epi16(_mm256_extractf128_si256(bx, 0));
-                        __m256i mx1 = _mm256_cvtepu8_epi16(_mm256_extractf128_si256(bx, 1));
-
-                        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(mx0, ones));
-                        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(mx1, ones));
-                    }
-                    weightSum[i] += I32sum(acc);
-#endif
-                    for (; j + 1 < end; j += 2) {
-                        int id = (i * m + j) / 2;
-                        weightSum[gid] += (cpuData[id] & 0xF) + (cpuData[id] >> 4);
-                    }
+                    int j = st + (end - st) / 2 * 2;
+                    weightSum[gid] = kernels->sumU4Row(cpuData + ((uint64_t)i * m + st) / 2, (end - st) / 2);
                     for (; j < end; j++) {
                         int id = (i * m + j) / 2;
                         if ((i * m + j) % 2) {
@@ -745,6 +1487,31 @@ namespace fastllm {
         } 
     }
 
+    void Data::CalcAMXWeight() {
+        if (this->amxWeight.size() > 0) {
+            return;
+        }
+        AssertInFastLLM(this->dataType == DataType::INT8, "CalcAMXWeight: only support INT8 weight.\n");
+        int n = this->dims[0], m = this->dims[1];
+        int mPad = (m + 63) / 64 * 64, stripes = (n + 15) / 16;
+        amxWeight.resize((size_t)stripes * mPad * 16, 0);
+        CalcAMXWeight(0, n);
+    }
+
+    void Data::CalcAMXWeight(int st, int end) {
+        // 每16行为一组, 组内按VNNI格式重排: packed[l / 4][row * 4 + l % 4] = weight[row][l] - 128, m补0到64的倍数
+        int m = this->dims[1];
+        int mPad = (m + 63) / 64 * 64;
+        size_t stripeSize = (size_t)mPad * 16;
+        for (int i = st; i < end; i++) {
+            int8_t *packed = amxWeight.data() + (i / 16) * stripeSize + (i % 16) * 4;
+            uint8_t *row = cpuData + (size_t)i * m;
+            for (int l = 0; l < m; l++) {
+                packed[(l / 4) * 64 + (l % 4)] = (int8_t)(row[l] ^ 128);
+            }
+        }
+    }
+
     void Data::ToDevice(void *device) {
         BaseDevice *dev = (BaseDevice*)device;
         if (dev->deviceType == "cuda") {
@@ -793,16 +1560,19 @@ namespace fastllm {
 #ifdef USE_MMAP
                     delete[] cpuData;
 #else
-                    delete[] this->cpuData;
-                    this->cpuData = nullptr;
+                    this->FreeCpuData();
 #endif
+                    this->isView = false;
                 }
             } else if (this->dataDevice == DataDevice::CUDA) {
                 if (device == DataDevice::CPU) {
                     this->cpuData = new uint8_t[expansionBytes];
                     FastllmCudaCopyFromDeviceToHost(this->cpuData, this->cudaData, expansionBytes);
-                    FastllmCudaFree(this->cudaData);
+                    if (!this->isView) {
+                        FastllmCudaFree(this->cudaData);
+                    }
                     this->cudaData = nullptr;
+                    this->isView = false;
                 } else if (device == DataDevice::CUDA) {
                     int sourceDevice = this->dataDeviceIds.size() == 0 ? 0 : this->dataDeviceIds[0];
                     int destDevice = deviceIds.size() == 0 ? 0 : deviceIds[0];
@@ -811,8 +1581,11 @@ namespace fastllm {
 
                     FastllmCudaMemcpyBetweenDevices(destDevice, newCudaData, sourceDevice, this->cudaData, expansionBytes);
                     FastllmCudaSetDevice(sourceDevice);
-                    FastllmCudaFree(this->cudaData);
+                    if (!this->isView) {
+                        FastllmCudaFree(this->cudaData);
+                    }
                     this->cudaData = newCudaData;
+                    this->isView = false;
                     FastllmCudaSetDevice(destDevice);
                 }
             }
@@ -867,111 +1640,279 @@ namespace fastllm {
         return ret;
     }
 
-    Tokenizer::TrieNode::TrieNode() {
-        this->tokenId = -999999;
+    void Tokenizer::DoubleArrayTrie::Build(const std::vector <std::pair <std::string, std::pair <int, float> > > &entries) {
+        base.clear();
+        check.clear();
+        tokenIds.clear();
+        scores.clear();
+
+        // 空闲位置串成双向链表, 找base时只枚举空闲位置; 一个位置作为首个子节点失败太多次就不再尝试, 保证建树是线性的
+        std::vector <int> prevFree, nextFree, fails;
+        int head = -1, tail = -1;
+        auto grow = [&](int size) {
+            int old = base.size();
+            if (size <= old) {
+                return;
+            }
+            base.resize(size, 0);
+            check.resize(size, -1);
+            tokenIds.resize(size, -999999);
+            scores.resize(size, 0.0f);
+            prevFree.resize(size);
+            nextFree.resize(size);
+            fails.resize(size, 0);
+            for (int i = std::max(old, 1); i < size; i++) {
+                prevFree[i] = tail;
+                nextFree[i] = -1;
+                if (tail == -1) {
+                    head = i;
+                } else {
+                    nextFree[tail] = i;
+                }
+                tail = i;
+            }
+        };
+        auto erase = [&](int pos) {
+            if (prevFree[pos] == -2) {
+                return;
+            }
+            if (prevFree[pos] == -1) {
+                head = nextFree[pos];
+            } else {
+                nextFree[prevFree[pos]] = nextFree[pos];
+            }
+            if (nextFree[pos] == -1) {
+                tail = prevFree[pos];
+            } else {
+                prevFree[nextFree[pos]] = prevFree[pos];
+            }
+            prevFree[pos] = nextFree[pos] = -2;
+        };
+        grow(1024);
+        prevFree[0] = nextFree[0] = -2;
+
+        struct Range {
+            int node, l, r, depth; // 节点对应entries[l, r), 它们的前depth个字节相同
+        };
+        std::vector <Range> q = {Range{0, 0, (int)entries.size(), 0}};
+        std::vector <std::pair <int, int> > children; // (字节, 子区间的起点)
+        int maxBase = 0, maxUsed = 0;
+        for (int i = 0; i < q.size(); i++) {
+            Range now = q[i];
+            if (now.l < now.r && entries[now.l].first.size() == now.depth) {
+                tokenIds[now.node] = entries[now.l].second.first;
+                scores[now.node] = entries[now.l].second.second;
+                now.l++;
+            }
+            if (now.l == now.r) {
+                continue;
+            }
+            children.clear();
+            for (int j = now.l; j < now.r; j++) {
+                int c = (uint8_t)entries[j].first[now.depth];
+                if (children.empty() || children.back().first != c) {
+                    children.push_back(std::make_pair(c, j));
+                }
+            }
+
+            int b = -1;
+            for (int pos = head; pos != -1 && b == -1; ) {
+                int cur = pos - children[0].first, next = nextFree[pos];
+                if (cur >= 1) {
+                    grow(cur + 257);
+                    bool ok = true;
+                    for (auto &child : children) {
+                        if (check[cur + child.first] != -1) {
+                            ok = false;
+                            break;
+                        }
+                    }
+                    if (ok) {
+                        b = cur;
+                    } else if (++fails[pos] >= 16) {
+                        erase(pos);
+                    }
+                }
+                pos = next;
+            }
+            if (b == -1) {
+                b = std::max(1, (int)base.size() - children[0].first);
+                grow(b + 257);
+            }
+            base[now.node] = b;
+            maxBase = std::max(maxBase, b);
+            for (int j = 0; j < children.size(); j++) {
+                int t = b + children[j].first;
+                check[t] = now.node;
+                erase(t);
+                maxUsed = std::max(maxUsed, t);
+                int r = (j + 1 < children.size() ? children[j + 1].second : now.r);
+                q.push_back(Range{t, children[j].second, r, now.depth + 1});
+            }
+        }
+
+        int size = std::max(maxUsed + 1, maxBase + 256);
+        base.resize(size);
+        check.resize(size);
+        tokenIds.resize(size);
+        scores.resize(size);
+        base.shrink_to_fit();
+        check.shrink_to_fit();
+        tokenIds.shrink_to_fit();
+        scores.shrink_to_fit();
     }
 
     Tokenizer::Tokenizer() {
-        root = new TrieNode();
         int n = 0;
         wchar_t special_token = L'\x0';
         for (; special_token < L'!'; special_token++, n++) {
             byteCharDict[L'\x100' + n] = special_token;
             charByteDict[special_token] = L'\x100' + n;
         }
-        for (special_token = L'\x7F'; special_token < L'\xA1'; special_token++, n++) {
-            byteCharDict[L'\x100' + n] = special_token;
-            charByteDict[special_token] = L'\x100' + n;
+        for (special_token = L'\x7F'; special_token < L'\xA1'; special_token++, n++) {
+            byteCharDict[L'\x100' + n] = special_token;
+            charByteDict[special_token] = L'\x100' + n;
+        }
+        byteCharDict[L'\x100' + n++] = L'\xAD';
+        charByteDict[L'\xAD'] = L'\x100' + n++;
+    }
+
+    Tokenizer::~Tokenizer() {
+    }
+
+    void Tokenizer::Clear() {
+        trieEntries.clear();
+        specialEntries.clear();
+        trie = DoubleArrayTrie();
+        specialTrie = DoubleArrayTrie();
+        trieDirty = true;
+        tokenToStringDict.clear();
+        tokenToScoreDict.clear();
+        stringToTokenDict.clear();
+    }
+
+    // 按字符串排序, 重复插入的token保留最后一次
+    static void SortTrieEntries(std::vector <std::pair <std::string, std::pair <int, float> > > &entries) {
+        std::stable_sort(entries.begin(), entries.end(),
+                         [](const std::pair <std::string, std::pair <int, float> > &a,
+                            const std::pair <std::string, std::pair <int, float> > &b) {
+            return a.first < b.first;
+        });
+        int len = 0;
+        for (int i = 0; i < entries.size(); i++) {
+            if (i + 1 < entries.size() && entries[i + 1].first == entries[i].first) {
+                continue;
+            }
+            if (len != i) {
+                entries[len] = std::move(entries[i]);
+            }
+            len++;
+        }
+        entries.resize(len);
+    }
+
+    // 是否有token在非开头的位置包含词首标记(连续的词首标记除外), 没有的话按词首切分不影响BPE的结果
+    static bool HasTokenAcrossWords(const std::vector <std::pair <std::string, std::pair <int, float> > > &entries,
+                                    const std::string &marker) {
+        int m = marker.size();
+        for (auto &it : entries) {
+            const std::string &token = it.first;
+            for (size_t k = token.find(marker, 1); k != std::string::npos; k = token.find(marker, k + 1)) {
+                if (k < m || token.compare(k - m, m, marker) != 0) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    void Tokenizer::Compile(bool buildTrie) {
+        if (!trieDirty) {
+            return;
+        }
+        std::lock_guard <std::mutex> guard(compileLocker);
+        if (!trieDirty) {
+            return;
         }
-        byteCharDict[L'\x100' + n++] = L'\xAD';
-        charByteDict[L'\xAD'] = L'\x100' + n++;
+        SortTrieEntries(trieEntries);
+        SortTrieEntries(specialEntries);
+        if (buildTrie) {
+            trie.Build(trieEntries);
+            specialTrie.Build(specialEntries);
+        }
+        splitAtBlank = !HasTokenAcrossWords(trieEntries, "\xe2\x96\x81");
+        splitAtByteBlank = !HasTokenAcrossWords(trieEntries, "\xc4\xa0");
+        {
+            std::lock_guard <std::mutex> cacheGuard(wordCacheLocker);
+            wordCacheList.clear();
+            wordCache.clear();
+        }
+        trieDirty = false;
     }
 
-    Tokenizer::~Tokenizer() {
-        Clear();
-        delete root;
+    bool Tokenizer::LookupWordCache(const std::string &word, std::vector <int> &ids) {
+        if (wordCacheCapacity <= 0) {
+            return false;
+        }
+        std::lock_guard <std::mutex> guard(wordCacheLocker);
+        auto it = wordCache.find(word);
+        if (it == wordCache.end()) {
+            return false;
+        }
+        wordCacheList.splice(wordCacheList.begin(), wordCacheList, it->second);
+        ids = it->second->second;
+        return true;
     }
 
-    void Tokenizer::Clear() {
-        std::vector <TrieNode*> q;
-        q.push_back(root);
-        for (int i = 0; i < q.size(); i++) {
-            TrieNode *now = q[i];
-            for (auto it : now->next) {
-                q.push_back(it.second);
-            }
+    void Tokenizer::UpdateWordCache(const std::string &word, const std::vector <int> &ids) {
+        // 很长的"词"(比如没有切分时的整段输入)不缓存
+        if (wordCacheCapacity <= 0 || word.size() > 256) {
+            return;
         }
-        if (specialRoot != nullptr) {
-            q.push_back(specialRoot);
-            for (int i = q.size() - 1; i < q.size(); i++) {
-                TrieNode *now = q[i];
-                for (auto it : now->next) {
-                    q.push_back(it.second);
-                }
-            }
+        std::lock_guard <std::mutex> guard(wordCacheLocker);
+        if (wordCache.find(word) != wordCache.end()) {
+            return;
+        }
+        wordCacheList.emplace_front(word, ids);
+        wordCache[word] = wordCacheList.begin();
+        while ((int)wordCache.size() > wordCacheCapacity) {
+            wordCache.erase(wordCacheList.back().first);
+            wordCacheList.pop_back();
         }
-        for (TrieNode * node : q)
-            delete node;
-        q.clear();
-        root = new TrieNode();
-        specialRoot = nullptr;
-        tokenToStringDict.clear();
-        tokenToScoreDict.clear();
-        stringToTokenDict.clear();
     }
 
     void Tokenizer::Insert(const std::string &s, int tokenId, float score) {
-        TrieNode *now = this->root;
-        for (int i = 0; i < s.size(); i++) {
-            if (now->next.find(s[i]) == now->next.end()) {
-                now->next[s[i]] = new TrieNode();
-            }
-            now = now->next[s[i]];
-        }
-        now->tokenId = tokenId;
-        now->score = score;
+        trieEntries.push_back(std::make_pair(s, std::make_pair(tokenId, score)));
+        trieDirty = true;
         tokenToStringDict[tokenId] = s;
         tokenToScoreDict[tokenId] = score;
         stringToTokenDict[s] = tokenId;
     }
 
     void Tokenizer::SetSpecialTokens(const std::map<std::string, int>& specialTokenMap) {
-        if (specialRoot == nullptr)
-            specialRoot = new TrieNode();
         for (auto &it : specialTokenMap) {
-            TrieNode *now = this->specialRoot;
-            for (int i = 0; i < it.first.size(); i++) {
-                if (now->next.find(it.first[i]) == now->next.end()) {
-                    now->next[it.first[i]] = new TrieNode();
-                }
-                now = now->next[it.first[i]];
-            }
-            now->tokenId = it.second;
-            now->score = 0.0f;
+            specialEntries.push_back(std::make_pair(it.first, std::make_pair(it.second, 0.0f)));
             tokenToStringDict[it.second] = it.first;
             stringToTokenDict[it.first] = it.second;
             specialTokens.push_back(it.first);
         }
+        trieDirty = true;
     }
 
     void Tokenizer::TryMergePairs(std::vector<Symbol> &symbols, int l, int r, std::priority_queue <SymbolPairs> &q) {
         if (l == -1 || r == -1 || symbols[l].len == 0 || symbols[r].len == 0) {
             return;
         }
-        auto now = symbols[l].node;
+        int now = symbols[l].node;
         char *s = symbols[r].s;
         int pos = symbols[r].pos, len = symbols[r].len;
-        for (int i = pos; i < pos + len; i++) {
-            if (now->next.find(s[i]) != now->next.end()) {
-                now = now->next[s[i]];
-            } else {
-                return;
-            }
+        for (int i = pos; i < pos + len && now != -1; i++) {
+            now = trie.Next(now, s[i]);
         }
-        if (now->tokenId == -999999) {
+        if (now == -1 || trie.tokenIds[now] == -999999) {
             return;
         }
-        q.push(SymbolPairs(now->score, l, r, symbols[l].len + symbols[r].len));
+        q.push(SymbolPairs(trie.scores[now], l, r, symbols[l].len + symbols[r].len));
     }
 
     int Tokenizer::GetRank(std::vector<Symbol> &symbols,  std::vector<std::pair<int, int>> &partitions, int idx, int skip) {
@@ -980,8 +1921,9 @@ namespace fastllm {
         }
         auto s = symbols[0].s + symbols[0].pos;
         std::string key(s + partitions[idx].first, s + partitions[idx + skip + 2].first);
-        if (stringToTokenDict.find(key) != stringToTokenDict.end()) {
-            return stringToTokenDict[key];
+        auto it = stringToTokenDict.find(key);
+        if (it != stringToTokenDict.end()) {
+            return it->second;
         }
         return std::numeric_limits<int>::max();
     }
@@ -991,12 +1933,15 @@ namespace fastllm {
             std::wstring ws(ori.size(), L' ');
             for (int i=0; i < ori.length(); i++) {
                 wchar_t wi = static_cast<wchar_t>(static_cast<unsigned char>(ori[i]));
-                if (charByteDict.find(wi) != charByteDict.end()) {
-                    wi = charByteDict[wi];
+                auto it = charByteDict.find(wi);
+                if (it != charByteDict.end()) {
+                    wi = it->second;
                 }
                 ws[i] = wi;
             }
-            return converter.to_bytes(ws);
+            // converter成员不能多线程同时使用, EncodeBatch会并行调用这里
+            std::wstring_convert<std::codecvt_utf8<wchar_t>> localConverter;
+            return localConverter.to_bytes(ws);
         }
         std::string blank = "";
         blank += 226, blank += 150, blank += 129;
@@ -1021,6 +1966,7 @@ namespace fastllm {
     }
 
     Data Tokenizer::Encode(const std::string &ori) {
+        Compile();
         if (this->type == TokenizerType::BPE) {
             std::string s = Normalize(ori);
 
@@ -1034,39 +1980,39 @@ namespace fastllm {
                             now = now * 10 + s[i] - '0';
                             i++;
                         }
-                        symbols.push_back(Symbol(nullptr, (char *) s.data(), i, 0, (int) symbols.size() - 1,
+                        symbols.push_back(Symbol(-1, (char *) s.data(), i, 0, (int) symbols.size() - 1,
                                                  (int) symbols.size() + 1, now));
                         continue;
                     }
                 }
 
-                if (this->specialRoot != nullptr) {
-                    TrieNode *now = this->specialRoot;
+                if (!this->specialEntries.empty()) {
+                    int now = 0;
                     int next = i;
                     for (; next < s.size(); next++) {
-                        if (now->next.find(s[next]) == now->next.end())
+                        int child = specialTrie.Next(now, s[next]);
+                        if (child == -1)
                             break;
-                        now = now->next[s[next]];
+                        now = child;
                     }
-                    if (now->tokenId != -999999 && next > i) {
-                        symbols.push_back(Symbol(nullptr, (char *)s.data(), i, 0, (int) symbols.size() - 1,
-                                          (int) symbols.size() + 1, now->tokenId));
+                    if (specialTrie.tokenIds[now] != -999999 && next > i) {
+                        symbols.push_back(Symbol(-1, (char *)s.data(), i, 0, (int) symbols.size() - 1,
+                                          (int) symbols.size() + 1, specialTrie.tokenIds[now]));
                         i = next - 1;
                         continue;
                     }
                 }
 
                 int tokenId = -999999, pos = i - 1;
-                TrieNode *now = this->root;
+                int now = 0;
                 for (int j = i; j < s.size(); j++) {
-                    if (now->next.find(s[j]) != now->next.end()) {
-                        now = now->next[s[j]];
-                        if (now->tokenId != -999999) {
-                            tokenId = now->tokenId;
-                            pos = j;
-                            break;
-                        }
-                    } else {
+                    now = trie.Next(now, s[j]);
+                    if (now == -1) {
+                        break;
+                    }
+                    if (trie.tokenIds[now] != -999999) {
+                        tokenId = trie.tokenIds[now];
+                        pos = j;
                         break;
                     }
                 }
@@ -1075,57 +2021,88 @@ namespace fastllm {
                                              (int) symbols.size() + 1, -999999));
                     i = pos;
                 } else {
-                    symbols.push_back(Symbol(nullptr, (char *) s.data(), i, 0, (int) symbols.size() - 1,
+                    symbols.push_back(Symbol(-1, (char *) s.data(), i, 0, (int) symbols.size() - 1,
                                              (int) symbols.size() + 1, -999999));
                 }
             }
             symbols.back().next = -1;
 
+            // 在词首标记和不参与合并的symbol(特殊token, 未识别的字符)处切分成词, 每个词单独合并
+            // 词之间不会合并, 合并的结果和整段一起合并相同, 每个词的合并量有限, 总耗时和输入长度成线性; 词的结果按LRU缓存
+            std::string marker = this->byteAsChar ? "\xc4\xa0" : "\xe2\x96\x81";
+            bool splitWords = this->byteAsChar ? this->splitAtByteBlank : this->splitAtBlank;
+            int m = marker.size();
+            std::vector<float> v;
+            std::vector<int> ids;
             std::priority_queue<SymbolPairs> workQueue;
-            for (int i = 1; i < symbols.size(); i++) {
-                TryMergePairs(symbols, i - 1, i, workQueue);
-            }
-
-            while (!workQueue.empty()) {
-                auto top = workQueue.top();
-                workQueue.pop();
-                if (symbols[top.l].len == 0 || symbols[top.r].len == 0 ||
-                    symbols[top.l].len + symbols[top.r].len != top.size) {
+            for (int st = 0; st < symbols.size(); ) {
+                if (symbols[st].len == 0) {
+                    if (symbols[st].fixId != -999999) {
+                        v.push_back(symbols[st].fixId);
+                    } else {
+                        // 未识别的字符
+                        uint8_t c = (uint8_t) (symbols[st].s[symbols[st].pos]);
+                        std::string now = "<0x00>";
+                        now[3] = (c / 16 > 9 ? ('A' + c / 16 - 10) : ('0' + c / 16));
+                        now[4] = (c % 16 > 9 ? ('A' + c % 16 - 10) : ('0' + c % 16));
+                        auto it = stringToTokenDict.find(now);
+                        if (it != stringToTokenDict.end()) {
+                            v.push_back(it->second);
+                        }
+                    }
+                    st++;
                     continue;
                 }
 
-                for (int i = symbols[top.r].pos; i < symbols[top.r].pos + symbols[top.r].len; i++) {
-                    symbols[top.l].node = symbols[top.l].node->next[symbols[top.r].s[i]];
-                }
-                symbols[top.l].len += symbols[top.r].len;
-                symbols[top.r].len = 0;
-                symbols[top.l].next = symbols[top.r].next;
-                if (symbols[top.r].next >= 0) {
-                    symbols[symbols[top.r].next].prev = top.l;
+                int end = st + 1;
+                for (; end < symbols.size() && symbols[end].len > 0; end++) {
+                    int pos = symbols[end].pos;
+                    if (splitWords && s.compare(pos, m, marker) == 0 && !(pos >= m && s.compare(pos - m, m, marker) == 0)) {
+                        break;
+                    }
                 }
+                std::string word = s.substr(symbols[st].pos, symbols[end - 1].pos + symbols[end - 1].len - symbols[st].pos);
+                if (!LookupWordCache(word, ids)) {
+                    symbols[st].prev = -1;
+                    symbols[end - 1].next = -1;
+                    for (int i = st + 1; i < end; i++) {
+                        TryMergePairs(symbols, i - 1, i, workQueue);
+                    }
 
-                TryMergePairs(symbols, symbols[top.l].prev, top.l, workQueue);
-                TryMergePairs(symbols, top.l, symbols[top.l].next, workQueue);
-            }
+                    while (!workQueue.empty()) {
+                        auto top = workQueue.top();
+                        workQueue.pop();
+                        if (symbols[top.l].len == 0 || symbols[top.r].len == 0 ||
+                            symbols[top.l].len + symbols[top.r].len != top.size) {
+                            continue;
+                        }
 
-            std::vector<float> v;
-            for (int i = 0; i < symbols.size(); i++) {
-                if (symbols[i].len > 0) {
-                    v.push_back(symbols[i].node->tokenId);
-                } else if (symbols[i].node == nullptr) {
-                    if (symbols[i].fixId != -999999) {
-                        v.push_back(symbols[i].fixId);
-                    } else {
-                        // 未识别的字符
-                        uint8_t c = (uint8_t) (symbols[i].s[symbols[i].pos]);
-                        std::string now = "<0x00>";
-                        now[3] = (c / 16 > 9 ? ('A' + c / 16 - 10) : ('0' + c / 16));
-                        now[4] = (c % 16 > 9 ? ('A' + c % 16 - 10) : ('0' + c % 16));
-                        if (stringToTokenDict.find(now) != stringToTokenDict.end()) {
-                            v.push_back(stringToTokenDict[now]);
+                        for (int i = symbols[top.r].pos; i < symbols[top.r].pos + symbols[top.r].len; i++) {
+                            symbols[top.l].node = trie.Next(symbols[top.l].node, symbols[top.r].s[i]);
+                        }
+                        symbols[top.l].len += symbols[top.r].len;
+                        symbols[top.r].len = 0;
+                        symbols[top.l].next = symbols[top.r].next;
+                        if (symbols[top.r].next >= 0) {
+                            symbols[symbols[top.r].next].prev = top.l;
+                        }
+
+                        TryMergePairs(symbols, symbols[top.l].prev, top.l, workQueue);
+                        TryMergePairs(symbols, top.l, symbols[top.l].next, workQueue);
+                    }
+
+                    ids.clear();
+                    for (int i = st; i < end; i++) {
+                        if (symbols[i].len > 0) {
+                            ids.push_back(trie.tokenIds[symbols[i].node]);
                         }
                     }
+                    UpdateWordCache(word, ids);
+                }
+                for (int id : ids) {
+                    v.push_back(id);
                 }
+                st = end;
             }
             return Data(DataType::FLOAT32, {1, (int)v.size()}, v);
         } else if (this->type == TokenizerType::GLM) {
@@ -1166,16 +2143,15 @@ namespace fastllm {
                     std::vector<Symbol> symbols;
                     for (int i = 0; i < subStr.size(); i++) {
                         int tokenId = -999999, pos = i - 1;
-                        TrieNode *now = this->root;
+                        int now = 0;
                         for (int j = i; j < subStr.size(); j++) {
-                            if (now->next.find(subStr[j]) != now->next.end()) {
-                                now = now->next[subStr[j]];
-                                if (now->tokenId != -999999) {
-                                    tokenId = now->tokenId;
-                                    pos = j;
-                                    break;
-                                }
-                            } else {
+                            now = trie.Next(now, subStr[j]);
+                            if (now == -1) {
+                                break;
+                            }
+                            if (trie.tokenIds[now] != -999999) {
+                                tokenId = trie.tokenIds[now];
+                                pos = j;
                                 break;
                             }
                         }
@@ -1184,7 +2160,7 @@ namespace fastllm {
                                                      (int) symbols.size() + 1, -999999));
                             i = pos;
                         } else {
-                            symbols.push_back(Symbol(nullptr, (char *) subStr.data(), i, 0, (int) symbols.size() - 1,
+                            symbols.push_back(Symbol(-1, (char *) subStr.data(), i, 0, (int) symbols.size() - 1,
                                                      (int) symbols.size() + 1, -999999));
                         }
                     }
@@ -1204,7 +2180,7 @@ namespace fastllm {
                         }
 
                         for (int i = symbols[top.r].pos; i < symbols[top.r].pos + symbols[top.r].len; i++) {
-                            symbols[top.l].node = symbols[top.l].node->next[symbols[top.r].s[i]];
+                            symbols[top.l].node = trie.Next(symbols[top.l].node, symbols[top.r].s[i]);
                         }
                         symbols[top.l].len += symbols[top.r].len;
                         symbols[top.r].len = 0;
@@ -1218,8 +2194,8 @@ namespace fastllm {
                     }
                     for (int i = 0; i < symbols.size(); i++) {
                         if (symbols[i].len > 0) {
-                            v.push_back(symbols[i].node->tokenId);
-                        } else if (symbols[i].node == nullptr) {
+                            v.push_back(trie.tokenIds[symbols[i].node]);
+                        } else if (symbols[i].node == -1) {
                             if (symbols[i].fixId != -999999) {
                                 v.push_back(symbols[i].fixId);
                             } else {
@@ -1228,8 +2204,9 @@ namespace fastllm {
                                 std::string now = "<0x00>";
                                 now[3] = (c / 16 > 9 ? ('A' + c / 16 - 10) : ('0' + c / 16));
                                 now[4] = (c % 16 > 9 ? ('A' + c % 16 - 10) : ('0' + c % 16));
-                                if (stringToTokenDict.find(now) != stringToTokenDict.end()) {
-                                    v.push_back(stringToTokenDict[now]);
+                                auto it = stringToTokenDict.find(now);
+                                if (it != stringToTokenDict.end()) {
+                                    v.push_back(it->second);
                                 }
                             }
                         }
@@ -1298,7 +2275,8 @@ namespace fastllm {
                         symbols.clear();
                         for (int j = 0; j < partitions.size() - 1; j++) {
                             std::string key = cur.substr(partitions[j].first, partitions[j + 1].first - partitions[j].first);
-                            v.push_back((float) stringToTokenDict[key]);
+                            auto it = stringToTokenDict.find(key);
+                            v.push_back(it != stringToTokenDict.end() ? (float) it->second : 0.0f);
                         }
                     }
 
@@ -1314,16 +2292,15 @@ namespace fastllm {
                 }
 
                 int tokenId = -999999, pos = i - 1;
-                TrieNode *now = this->root;
+                int now = 0;
                 for (int j = i; j < ori.size(); j++) {
-                    if (now->next.find(ori[j]) != now->next.end()) {
-                        now = now->next[ori[j]];
-                        if (now->tokenId != -999999) {
-                            tokenId = now->tokenId;
-                            pos = j;
-                            break;
-                        }
-                    } else {
+                    now = trie.Next(now, ori[j]);
+                    if (now == -1) {
+                        break;
+                    }
+                    if (trie.tokenIds[now] != -999999) {
+                        tokenId = trie.tokenIds[now];
+                        pos = j;
                         break;
                     }
                 }
@@ -1332,7 +2309,7 @@ namespace fastllm {
                                              (int) symbols.size() + 1, -999999));
                     i = pos;
                 } else {
-                    symbols.push_back(Symbol(nullptr, (char *) ori.data(), i, 0, (int) symbols.size() - 1,
+                    symbols.push_back(Symbol(-1, (char *) ori.data(), i, 0, (int) symbols.size() - 1,
                                              (int) symbols.size() + 1, -999999));
                 }
             }
@@ -1342,21 +2319,21 @@ namespace fastllm {
             std::vector <float> v;
             for (int i = 0; i < ori.size(); i++) {
                 int tokenId = -999999, pos = i - 1;
-                TrieNode *now = this->root;
+                int now = 0;
 
                 if (i > 0 && isDigitOrChar(ori[i - 1]) && isDigitOrChar(ori[i])) {
-                    now = now->next['#']->next['#'];
+                    now = trie.Next(now, '#');
+                    AssertInFastLLM(now != -1 && (now = trie.Next(now, '#')) != -1, "Error: BERT tokenizer needs token \"##\".\n");
                 }
                 for (int j = i; j < ori.size(); j++) {
-                    if (now->next.find(ori[j]) != now->next.end()) {
-                        now = now->next[ori[j]];
-                        if (now->tokenId != -999999) {
-                            tokenId = now->tokenId;
-                            pos = j;
-                        }
-                    } else {
+                    now = trie.Next(now, ori[j]);
+                    if (now == -1) {
                         break;
                     }
+                    if (trie.tokenIds[now] != -999999) {
+                        tokenId = trie.tokenIds[now];
+                        pos = j;
+                    }
                 }
                 if (pos >= i) {
                     i = pos;
@@ -1369,17 +2346,16 @@ namespace fastllm {
             std::vector <float> v;
             for (int i = 0; i < ori.size(); i++) {
                 int tokenId = -999999, pos = i - 1;
-                TrieNode *now = this->root;
+                int now = 0;
                 for (int j = i; j < ori.size(); j++) {
-                    if (now->next.find(ori[j]) != now->next.end()) {
-                        now = now->next[ori[j]];
-                        if (now->tokenId != -999999) {
-                            tokenId = now->tokenId;
-                            pos = j;
-                        }
-                    } else {
+                    now = trie.Next(now, ori[j]);
+                    if (now == -1) {
                         break;
                     }
+                    if (trie.tokenIds[now] != -999999) {
+                        tokenId = trie.tokenIds[now];
+                        pos = j;
+                    }
                 }
                 if (pos >= i) {
                     i = pos;
@@ -1391,6 +2367,17 @@ namespace fastllm {
         }
     }
 
+    std::vector <Data> Tokenizer::EncodeBatch(const std::vector <std::string> &inputs) {
+        Compile();
+        std::vector <Data> ret(inputs.size(), Data(DataType::FLOAT32));
+        GetPool()->ParallelFor(0, (int)inputs.size(), 1, [&](int st, int end) {
+            for (int i = st; i < end; i++) {
+                ret[i] = Encode(inputs[i]);
+            }
+        }, ParallelScheduleDynamic);
+        return ret;
+    }
+
     std::string Tokenizer::DecodeTokens(const std::vector<int> &tokens) {
         std::string ret = "";
         for (int i = 0; i < tokens.size(); i++) {
@@ -1510,7 +2497,18 @@ namespace fastllm {
         return -1;
     }
 
+    static std::atomic <uint64_t> weightMapRevision(0);
+
+    static uint64_t NextWeightMapRevision() {
+        return ++weightMapRevision;
+    }
+
     void WeightMap::LoadFromFile(const std::string &fileName) {
+        this->revision = NextWeightMapRevision();
+        if (FileBuffer(fileName).ReadInt() >= flmV3VersionId) {
+            LoadFromFileV3(fileName);
+            return;
+        }
 #ifdef USE_MMAP
         std::shared_ptr<FileMmap> mapped_file = std::make_shared<FileMmap>(fileName);
         ModelLoader buffer((char *)mapped_file->data, mapped_file->size);
@@ -1575,6 +2573,7 @@ namespace fastllm {
         printf("[Begin to load weights!]\n");
 #endif
         int len = buffer.ReadInt();
+        ParallelWeightLoader loader(fileName);
         // len = 2; // [TODO] 记得注释
         for (int i = 0; i < len; i++) {
             std::string name = buffer.ReadString();
@@ -1602,6 +2601,7 @@ namespace fastllm {
                 weight[name] = Data(dataType, dims);
             }
             weight[name].name = name;
+            weight[name].directMemory = true;
 
             if (lowMemMode && this->embeddingNames.find(name) != this->embeddingNames.end()) {
                 if (dataType == DataType::FLOAT32 || dataType == DataType::BFLOAT16 || dataType == DataType::FLOAT16) {
@@ -1628,13 +2628,15 @@ namespace fastllm {
                 weight[name].SetMapFile(mapped_file);
                 weight[name].expansionBytes = (weight[name].Count(0) * weight[name].unitSize - 1) / weight[name].unitSizeDiv + 1;
 #else
-                weight[name].Allocate();
+                if (dataType == DataType::L2) {
+                    weight[name].Allocate();
+                }
 #endif
                 if (dataType == DataType::FLOAT32 || dataType == DataType::BFLOAT16 || dataType == DataType::FLOAT16) {
 #ifdef USE_MMAP
                     weight[name].cpuData = buffer.ReadBytes(weight[name].GetBytes());
 #else
-                    buffer.ReadBytes(weight[name].cpuData, weight[name].GetBytes());
+                    loader.Read(&weight[name], buffer);
 #endif
                 } else if (dataType == DataType::INT8 || dataType == DataType::INT4) {
                     int bit = (dataType == DataType::INT4 ? 4 : 8);
@@ -1653,7 +2655,7 @@ namespace fastllm {
 #ifdef USE_MMAP
                     weight[name].cpuData = buffer.ReadBytes(weight[name].GetBytes());
 #else
-                    buffer.ReadBytes(weight[name].cpuData, weight[name].GetBytes());
+                    loader.Read(&weight[name], buffer);
 #endif
                 } else if (dataType == DataType::INT4_NOZERO) {
                     int bit = 4;
@@ -1672,7 +2674,7 @@ namespace fastllm {
 #ifdef USE_MMAP
                     weight[name].cpuData = buffer.ReadBytes(weight[name].GetBytes());
 #else
-                    buffer.ReadBytes(weight[name].cpuData, weight[name].GetBytes());
+                    loader.Read(&weight[name], buffer);
 #endif
                 } else if (dataType == DataType::INT4_GROUP) {
                     auto &curWeight = weight[name];
@@ -1696,7 +2698,7 @@ namespace fastllm {
 #ifdef USE_MMAP
                     curWeight.cpuData = buffer.ReadBytes(curWeight.GetBytes());
 #else
-                    buffer.ReadBytes(curWeight.cpuData, curWeight.GetBytes());
+                    loader.Read(&curWeight, buffer);
 #endif
                 } else if (dataType == DataType::L2) {
 #ifdef DEBUG
@@ -1748,17 +2750,141 @@ namespace fastllm {
                     clock_t end = clock();
                     printf("L2 decompress time: %f s\n", (double)(end - start) / CLOCKS_PER_SEC);
 #endif
+                    loader.Prepare(&curWeight);
                 }
+#ifdef USE_MMAP
+                if (dataType != DataType::L2) {
+                    loader.Prepare(&weight[name]);
+                }
+#endif
             }
-
-            printf("Load (%d / %d) \r", (i + 1), len);
-            fflush(stdout);
         }
-        printf("\n");
-        fflush(stdout);
+        loader.Wait();
         return;
     }
 
+    void WeightMap::LoadFromFileV3(const std::string &fileName) {
+        this->revision = NextWeightMapRevision();
+        FileBuffer buffer(fileName);
+        this->versionId = buffer.ReadInt();
+        int keyValueLen = buffer.ReadInt();
+        for (int i = 0; i < keyValueLen; i++) {
+            std::string key = buffer.ReadString();
+            std::string value = buffer.ReadString();
+            this->dicts[key] = value;
+        }
+        if (this->dicts.find("peft_size") != this->dicts.end()) {
+            int peftSize = atoi(this->dicts["peft_size"].c_str());
+            for (int i = 0; i < peftSize; i++) {
+                std::string adapterName = buffer.ReadString();
+                this->peftDict[adapterName] = {};
+                int adapterSize = buffer.ReadInt();
+                for (int j = 0; j < adapterSize; j++) {
+                    std::string key = buffer.ReadString();
+                    std::string value = buffer.ReadString();
+                    this->peftDict[adapterName][key] = value;
+                }
+            }
+        }
+
+        // 词表是几个连续数组, 整块读入
+        int vocabLen = buffer.ReadInt();
+        std::vector <int> ids(vocabLen);
+        std::vector <float> scores(vocabLen);
+        std::vector <uint64_t> offsets(vocabLen + 1);
+        buffer.ReadBytes((uint8_t*)ids.data(), ids.size() * sizeof(int));
+        buffer.ReadBytes((uint8_t*)scores.data(), scores.size() * sizeof(float));
+        buffer.ReadBytes((uint8_t*)offsets.data(), offsets.size() * sizeof(uint64_t));
+        std::string tokenBytes(offsets[vocabLen], 0);
+        buffer.ReadBytes((uint8_t*)&tokenBytes[0], tokenBytes.size());
+        for (int i = 0; i < vocabLen; i++) {
+            tokenizer.Insert(tokenBytes.substr(offsets[i], offsets[i + 1] - offsets[i]), ids[i], scores[i]);
+        }
+        bool hasSpecialTokens = this->dicts.find("tokenizer_has_special_tokens") != this->dicts.end()
+                && this->dicts["tokenizer_has_special_tokens"] == "1";
+        if (hasSpecialTokens) {
+            std::map <std::string, int> specialTokens;
+            int specialTokenLen = buffer.ReadInt();
+            for (int i = 0; i < specialTokenLen; i++) {
+                std::string token = buffer.ReadString();
+                specialTokens[token] = tokenizer.stringToTokenDict[token];
+            }
+            tokenizer.SetSpecialTokens(specialTokens);
+        }
+
+        buffer.Seek(buffer.ReadUInt64());
+        int len = buffer.ReadInt();
+        std::vector <FlmTensorInfo> infos(len);
+        for (int i = 0; i < len; i++) {
+            infos[i].Read(buffer);
+        }
+        if (!buffer.Finished()) {
+            // 直接使用转换时编译好的trie
+            ReadDoubleArrayTrie(buffer, tokenizer.trie);
+            ReadDoubleArrayTrie(buffer, tokenizer.specialTrie);
+            tokenizer.Compile(false);
+        }
+
+#if defined(_WIN32) or defined(_WIN64)
+        std::shared_ptr <FileMmap> mappedFile = nullptr;
+#else
+        std::shared_ptr <FileMmap> mappedFile = std::make_shared <FileMmap> (fileName, true, true);
+#endif
+        ParallelWeightLoader loader(fileName);
+        for (int i = 0; i < len; i++) {
+            FlmTensorInfo &info = infos[i];
+            AssertInFastLLM(info.dataType != DataType::L2, "Error: .flm v3 doesn't support L2 weights.\n");
+            Data &curWeight = weight[info.name];
+            curWeight = Data(info.dataType, info.dims);
+            curWeight.name = info.name;
+            curWeight.directMemory = true;
+            curWeight.perChannelAxis = info.perChannelAxis;
+            curWeight.group = info.group;
+            curWeight.groupCnt = info.groupCnt;
+            AssertInFastLLM(info.bytes == curWeight.GetBytes(), "Error: weight " + info.name + "'s size mismatch.\n");
+
+            int k = info.minMax.size() / 2;
+            if (info.dataType == DataType::INT8 || info.dataType == DataType::INT4) {
+                int bit = (info.dataType == DataType::INT4 ? 4 : 8);
+                curWeight.perChannelsConfigs.resize(k);
+                curWeight.zeros.resize(k);
+                curWeight.scales.resize(k);
+                for (int j = 0; j < k; j++) {
+                    curWeight.perChannelsConfigs[j] = LowBitConfig(info.minMax[j * 2], info.minMax[j * 2 + 1], bit, 0);
+                    curWeight.zeros[j] = curWeight.perChannelsConfigs[j].zeroPoint;
+                    curWeight.scales[j] = curWeight.perChannelsConfigs[j].scale;
+                }
+            } else if (info.dataType == DataType::INT4_NOZERO || info.dataType == DataType::INT4_GROUP) {
+                curWeight.perChannelsConfigs.resize(k);
+                curWeight.mins.resize(k);
+                curWeight.scales.resize(k);
+                for (int j = 0; j < k; j++) {
+                    curWeight.perChannelsConfigs[j] = LowBitConfig(info.minMax[j * 2], info.minMax[j * 2 + 1], 4, 1);
+                    curWeight.mins[j] = curWeight.perChannelsConfigs[j].min;
+                    curWeight.scales[j] = curWeight.perChannelsConfigs[j].scale;
+                }
+            }
+
+            if (lowMemMode && this->embeddingNames.find(info.name) != this->embeddingNames.end()) {
+                AssertInFastLLM(info.dataType == DataType::FLOAT32 || info.dataType == DataType::BFLOAT16 ||
+                                info.dataType == DataType::FLOAT16, "Error: embedding's type should be float32 or bfloat16.\n");
+                curWeight.fileName = fileName;
+                curWeight.filePos = info.offset;
+            } else if (mappedFile != nullptr) {
+                // 和映射共享引用计数, 最后一个使用这段映射的权重释放时解除映射
+                AssertInFastLLM(info.offset + info.bytes <= mappedFile->size, "Error: weight " + info.name + " is out of file.\n");
+                curWeight.cpuData = (uint8_t*)mappedFile->data + info.offset;
+                curWeight.cpuDataHolder = std::shared_ptr <uint8_t> (mappedFile, curWeight.cpuData);
+                curWeight.expansionSize = curWeight.Count(0);
+                curWeight.expansionBytes = info.bytes;
+                loader.Prepare(&curWeight);
+            } else {
+                loader.ReadAt(&curWeight, info.offset);
+            }
+        }
+        loader.Wait();
+    }
+
     void GroupQuantizationMultiThread(int st, int end, int m,
                                     float *f, uint8_t *u8, LowBitConfig *configs, int bit, int group, int groupCnt) {
         int type = (bit == 4) ? 1 : 0;
@@ -1827,30 +2953,41 @@ namespace fastllm {
         AssertInFastLLM(fileName != "", "Error: output's name shouldn't be empty.\n");
         AssertInFastLLM(bit == 0 || bit == 4 || bit == 8 || bit == 16, "Error: only support 16 bit or 8 bit or 4 bit model.\n");
         FileWriter buffer(fileName);
-        buffer.WriteInt(this->versionId);
-        if (this->versionId >= 1) {
-            // versionId >= 1, 前置了一个key-value表
-            buffer.WriteInt((int)dicts.size());
-            for (auto &it : dicts) {
-                buffer.WriteString(it.first);
-                buffer.WriteString(it.second);
-            }
+        buffer.WriteInt(flmV3VersionId);
+        buffer.WriteInt((int)dicts.size());
+        for (auto &it : dicts) {
+            buffer.WriteString(it.first);
+            buffer.WriteString(it.second);
         }
-
-        // 写入词表
-        bool useScore = this->dicts.find("tokenizer_use_score") != this->dicts.end()
-                && this->dicts["tokenizer_use_score"] == "1";
-        buffer.WriteInt((int)tokenizer.tokenToStringDict.size());
-        for (auto &it : tokenizer.tokenToStringDict) {
-            buffer.WriteInt((int)it.second.size());
-            for (int i = 0; i < it.second.size(); i++) {
-                buffer.WriteInt((int)it.second[i]);
-            }
-            buffer.WriteInt(it.first);
-            if (useScore) {
-                buffer.WriteFloat(tokenizer.tokenToScoreDict[it.first]);
+        if (this->dicts.find("peft_size") != this->dicts.end()) {
+            AssertInFastLLM(atoi(this->dicts["peft_size"].c_str()) == (int)peftDict.size(), "Error: peft_size mismatch.\n");
+            for (auto &adapter : peftDict) {
+                buffer.WriteString(adapter.first);
+                buffer.WriteInt((int)adapter.second.size());
+                for (auto &it : adapter.second) {
+                    buffer.WriteString(it.first);
+                    buffer.WriteString(it.second);
+                }
             }
         }
+
+        // 写入词表, 按id排序
+        std::map <int, std::string> vocab(tokenizer.tokenToStringDict.begin(), tokenizer.tokenToStringDict.end());
+        std::vector <int> ids;
+        std::vector <float> scores;
+        std::vector <uint64_t> offsets = {0};
+        std::string tokenBytes;
+        for (auto &it : vocab) {
+            ids.push_back(it.first);
+            scores.push_back(tokenizer.tokenToScoreDict[it.first]);
+            tokenBytes += it.second;
+            offsets.push_back(tokenBytes.size());
+        }
+        buffer.WriteInt((int)ids.size());
+        buffer.WriteBytes((const uint8_t*)ids.data(), ids.size() * sizeof(int));
+        buffer.WriteBytes((const uint8_t*)scores.data(), scores.size() * sizeof(float));
+        buffer.WriteBytes((const uint8_t*)offsets.data(), offsets.size() * sizeof(uint64_t));
+        buffer.WriteBytes((const uint8_t*)tokenBytes.data(), tokenBytes.size());
         bool hasSpecialTokens = this->dicts.find("tokenizer_has_special_tokens") != this->dicts.end()
                 && this->dicts["tokenizer_has_special_tokens"] == "1";
         if (hasSpecialTokens) {
@@ -1861,123 +2998,143 @@ namespace fastllm {
             }
         }
 
+        // 权重索引写在文件末尾, 这里先占位
+        uint64_t indexPosPos = buffer.Tell();
+        buffer.WriteUInt64(0);
+
         // 写入权重
         int need = 0;
         for (auto &it : weight) {
             need += (it.second.dims.size() > 0);
         }
-        buffer.WriteInt(need);
+        std::vector <FlmTensorInfo> infos;
         int tot = 0;
         for (auto &it : weight) {
             if (it.second.dims.size() == 0) {
                 continue;
             }
-            buffer.WriteString(it.first);
             Data &data = it.second;
-            buffer.WriteInt((int)data.dims.size());
-            for (int i : data.dims) {
-                buffer.WriteInt(i);
-            }
             data.ToDevice(DataDevice::CPU);
-
-            if (bit == 0) {
-                DataType dataType = data.dataType;
-                if (dataType == DataType::FLOAT32 || dataType == DataType::BFLOAT16 || dataType == DataType::FLOAT16) {
-                    buffer.WriteInt((int) dataType);
-                    buffer.WriteBytes(data.cpuData, data.GetBytes());
-                } else if (dataType == DataType::INT8 || dataType == DataType::INT4 || dataType == DataType::INT4_NOZERO) {
-                    buffer.WriteInt((int) dataType);
-                    buffer.WriteInt(data.perChannelAxis);
+            FlmTensorInfo info;
+            info.name = it.first;
+            info.dims = data.dims;
+            const uint8_t *payload = data.cpuData;
+            std::vector <uint8_t> converted;
+
+            if (bit == 0 || data.weightType == WeightType::NONE || data.dataType != DataType::FLOAT32) {
+                // 直接存: 不转换, 普通权重, 或者已经不是float32的权重
+                info.dataType = data.dataType;
+                if (data.dataType == DataType::INT8 || data.dataType == DataType::INT4 ||
+                    data.dataType == DataType::INT4_NOZERO || data.dataType == DataType::INT4_GROUP) {
+                    info.perChannelAxis = data.perChannelAxis;
                     int k = data.perChannelAxis == -1 ? 1 : data.dims[data.perChannelAxis];
-                    for (int i = 0; i < k; i++) {
-                        buffer.WriteFloat(data.perChannelsConfigs[i].min);
-                        buffer.WriteFloat(data.perChannelsConfigs[i].max);
+                    if (data.dataType == DataType::INT4_GROUP) {
+                        info.group = data.group;
+                        info.groupCnt = data.groupCnt;
+                        k *= data.group;
                     }
-                    buffer.WriteBytes(data.cpuData, data.GetBytes());
-                } else if (dataType == DataType::INT4_GROUP) {
-                    buffer.WriteInt((int) dataType);
-                    buffer.WriteInt(data.perChannelAxis);
-                    buffer.WriteInt(data.group);
-                    buffer.WriteInt(data.groupCnt);
-                    int k = data.perChannelAxis == -1 ? 1 : data.dims[data.perChannelAxis];
-                    for (int i = 0; i < k * data.group; i++) {
-                        buffer.WriteFloat(data.perChannelsConfigs[i].min);
-                        buffer.WriteFloat(data.perChannelsConfigs[i].max);
+                    for (int i = 0; i < k; i++) {
+                        info.minMax.push_back(data.perChannelsConfigs[i].min);
+                        info.minMax.push_back(data.perChannelsConfigs[i].max);
                     }
-                    buffer.WriteBytes(data.cpuData, data.GetBytes());
-                } else {
+                } else if (data.dataType != DataType::FLOAT32 && data.dataType != DataType::BFLOAT16 &&
+                           data.dataType != DataType::FLOAT16) {
                     ErrorInFastLLM("unknown datatype");
                 }
-            } else {
-                if (data.weightType == WeightType::NONE) {
-                    // 普通权重，直接写入浮点数据
-                    buffer.WriteInt((int) DataType::FLOAT32);
-                    buffer.WriteBytes(data.cpuData, data.GetBytes());
-                } else if (data.weightType == WeightType::EMBEDDING) {
-                    // Embedding权重，存储成BF16
-                    buffer.WriteInt((int) DataType::BFLOAT16);
+            } else if (data.weightType == WeightType::EMBEDDING) {
+                // Embedding权重，存储成BF16
+                info.dataType = DataType::BFLOAT16;
+                int len = data.Count(0);
+                converted.resize(len * sizeof(uint16_t));
+                uint16_t *uDatas = (uint16_t*)converted.data();
+                for (int i = 0; i < len; i++) {
+                    uDatas[i] = ((uint16_t *) data.cpuData)[i * 2 + 1];
+                }
+                payload = converted.data();
+            } else if (data.weightType == WeightType::LINEAR) {
+                if (bit == 16) {
+                    // fp16, 直接转换
+                    info.dataType = DataType::FLOAT16;
                     int len = data.Count(0);
-                    std::vector<uint16_t> uDatas;
-                    uDatas.resize(len);
+                    converted.resize(len * sizeof(uint16_t));
+                    uint16_t *uDatas = (uint16_t*)converted.data();
                     for (int i = 0; i < len; i++) {
-                        uDatas[i] = ((uint16_t *) data.cpuData)[i * 2 + 1];
+                        uDatas[i] = float_to_half(((float *) data.cpuData)[i]);
                     }
-                    buffer.WriteBytes((uint8_t *) uDatas.data(), len * sizeof(uint16_t));
-                } else if (data.weightType == WeightType::LINEAR) {
-                    if (bit == 16) {
-                        // fp16, 直接转换
-                        buffer.WriteInt((int) DataType::FLOAT16);
-                        int len = data.Count(0);
-                        std::vector<uint16_t> uDatas;
-                        uDatas.resize(len);
-                        for (int i = 0; i < len; i++) {
-                            uDatas[i] = float_to_half(((float *) data.cpuData)[i]);
-                        }
-                        buffer.WriteBytes((uint8_t *) uDatas.data(), len * sizeof(uint16_t));
-                    } else {
-                        // Linear层权重，分通道量化之
-                        int k = data.dims[0], m = data.dims[1];
-                        int threadNum = 8;
-                        int per = k / threadNum;
-                        int cur = 0;
-                        auto pool = GetPool();
-                        std::vector <std::future <void> > futures;
-                        std::vector<LowBitConfig> configs;
-                        std::vector<uint8_t> uDatas;
-                        configs.resize(k);
-
-                        int bytes = k * m;
-                        if (bit == 4) {
-                            bytes = (k * m + 1) / 2;
-                        }
-                        uDatas.resize(bytes);
-                        for (int i = 0; i < threadNum; i++) {
-                            int end = cur + per;
-                            if (i == threadNum - 1) {
-                                end = k;
-                            }
-                            futures.push_back(pool->Submit(PerChannelQuantizationMultiThread, cur, end, m,
-                                                              (float *) data.cpuData, uDatas.data(), configs.data(),
-                                                              bit));
-                            cur = end;
-                        }
-                        for (int i = 0; i < threadNum; i++) {
-                            futures[i].get();
+                } else {
+                    // Linear层权重，分通道量化之
+                    int k = data.dims[0], m = data.dims[1];
+                    int threadNum = 8;
+                    int per = k / threadNum;
+                    int cur = 0;
+                    auto pool = GetPool();
+                    std::vector <std::future <void> > futures;
+                    std::vector<LowBitConfig> configs;
+                    configs.resize(k);
+
+                    int bytes = k * m;
+                    if (bit == 4) {
+                        bytes = (k * m + 1) / 2;
+                    }
+                    converted.resize(bytes);
+                    for (int i = 0; i < threadNum; i++) {
+                        int end = cur + per;
+                        if (i == threadNum - 1) {
+                            end = k;
                         }
+                        futures.push_back(pool->Submit(PerChannelQuantizationMultiThread, cur, end, m,
+                                                          (float *) data.cpuData, converted.data(), configs.data(),
+                                                          bit));
+                        cur = end;
+                    }
+                    for (int i = 0; i < threadNum; i++) {
+                        futures[i].get();
+                    }
 
-                        buffer.WriteInt(bit == 8 ? (int) DataType::INT8 : (int) DataType::INT4_NOZERO);
-                        buffer.WriteInt(0); // 按通道0分通道量化
-                        for (int i = 0; i < k; i++) {
-                            buffer.WriteFloat(configs[i].min);
-                            buffer.WriteFloat(configs[i].max);
-                        }
-                        buffer.WriteBytes(uDatas.data(), bytes);
+                    info.dataType = (bit == 8 ? DataType::INT8 : DataType::INT4_NOZERO);
+                    info.perChannelAxis = 0; // 按通道0分通道量化
+                    for (int i = 0; i < k; i++) {
+                        info.minMax.push_back(configs[i].min);
+                        info.minMax.push_back(configs[i].max);
                     }
                 }
+                payload = converted.data();
             }
+
+            info.bytes = Data(info.dataType, info.dims).GetBytes();
+            buffer.Align(flmTensorAlignment);
+            info.offset = buffer.Tell();
+            buffer.WriteBytes(payload, info.bytes);
+            infos.push_back(info);
             printf("output (%d / %d)\r", ++tot, need);
             fflush(stdout);
         }
+
+        uint64_t indexPos = buffer.Tell();
+        buffer.WriteInt((int)infos.size());
+        for (auto &info : infos) {
+            info.Write(buffer);
+        }
+
+        // 按加载时的方式重建一遍分词器, 把编译好的trie写在最后
+        Tokenizer compiled;
+        compiled.wordCacheCapacity = 0;
+        for (int i = 0; i < ids.size(); i++) {
+            compiled.Insert(tokenBytes.substr(offsets[i], offsets[i + 1] - offsets[i]), ids[i], scores[i]);
+        }
+        if (hasSpecialTokens) {
+            std::map <std::string, int> specialTokens;
+            for (auto &token : tokenizer.specialTokens) {
+                specialTokens[token] = compiled.stringToTokenDict[token];
+            }
+            compiled.SetSpecialTokens(specialTokens);
+        }
+        compiled.Compile();
+        WriteDoubleArrayTrie(buffer, compiled.trie);
+        WriteDoubleArrayTrie(buffer, compiled.specialTrie);
+
+        buffer.Seek(indexPosPos);
+        buffer.WriteUInt64(indexPos);
         printf("\n");
         return;
     }
@@ -1997,6 +3154,7 @@ namespace fastllm {
     void WeightMap::AddQLinearWeight(const std::string &key, const std::vector <int> &dims,
                           int bit, float *scales, uint8_t *oriData) {
         AssertInFastLLM(bit == 4 || bit == 8, "Error: only support 8 bit or 4 bit QLinear.\n");
+        this->revision = NextWeightMapRevision();
         DataType dataType = (bit == 4 ? DataType::INT4_NOZERO : DataType::INT8);
         std::vector <int> realDims = dims;
         if (bit == 4) {
@@ -2005,6 +3163,7 @@ namespace fastllm {
         this->weight[key] = Data(dataType, realDims);
         Data &data = this->weight[key];
         data.weightType = WeightType::LINEAR;
+        data.directMemory = true;
         data.UpdateUnitSize();
         data.Allocate();
 
@@ -2048,9 +3207,11 @@ namespace fastllm {
 
     void WeightMap::AddWeight(const std::string &key, const std::vector<int> &dims, fastllm::DataType dataType,
                               fastllm::WeightType weightType, fastllm::DataType oriDataType, uint8_t *oriData, int groupCnt) {
+        this->revision = NextWeightMapRevision();
         this->weight[key] = Data(dataType, dims);
         Data &data = this->weight[key];
         data.weightType = weightType;
+        data.directMemory = true;
         data.UpdateUnitSize();
         data.Allocate();
         if (dataType == oriDataType) {
@@ -2157,8 +3318,7 @@ namespace fastllm {
     void WeightMap::ReleaseWeight() {
         for (auto &w : this->weight) {
 #ifndef USE_MMAP
-            delete[] w.second.cpuData;
-            w.second.cpuData = nullptr;
+            w.second.FreeCpuData();
 #endif
 #ifdef USE_CUDA
             if (w.second.cudaData != nullptr) {
@@ -2170,16 +3330,28 @@ namespace fastllm {
     }
 
     Data &WeightMap::operator[](const std::string &key) {
-        return weight[key];
+        auto it = weight.find(key);
+        if (it == weight.end()) {
+            this->revision = NextWeightMapRevision();
+            return weight[key];
+        }
+        return it->second;
     }
 
     void ToDataType(const Data &input, DataType dataType) {
         if (dataType == DataType::FLOAT32) {
-            curExecutor->Run("ToFloat32", {
+            static OpHandle toFloat32Op("ToFloat32");
+            curExecutor->Run(toFloat32Op, {
                     {"input", (Data*)&input}
             }, {}, {});
         } else if (dataType == DataType::FLOAT16) {
-            curExecutor->Run("ToFloat16", {
+            static OpHandle toFloat16Op("ToFloat16");
+            curExecutor->Run(toFloat16Op, {
+                    {"input", (Data*)&input}
+            }, {}, {});
+        } else if (dataType == DataType::BFLOAT16) {
+            static OpHandle toBFloat16Op("ToBFloat16");
+            curExecutor->Run(toBFloat16Op, {
                     {"input", (Data*)&input}
             }, {}, {});
         } else {
@@ -2188,155 +3360,271 @@ namespace fastllm {
     }
 
     void CopyKVCache(Data &oldCache, Data &newCache, int oldBsStart, int newBsStart, int bs, int offset) {
-        curExecutor->Run("CopyKVCache", {
+        static OpHandle copyKVCacheOp("CopyKVCache");
+        curExecutor->Run(copyKVCacheOp, {
                 {"oldCache", (Data*)&oldCache}, {"newCache", (Data*)&newCache}
         }, {}, {
             {"oldBsStart", oldBsStart}, {"newBsStart", newBsStart}, {"bs", bs}, {"offset", offset}
         });
     }
 
+    bool CanRunAttentionLayout() {
+        IntDict layouts = {{"qLayout", LayoutSeqMajor}, {"kvLayout", LayoutSeqMajor}, {"outputLayout", LayoutSeqMajor}};
+        IntDict matMulLayouts = {{"input0Layout", LayoutSeqMajor}, {"outputLayout", LayoutSeqMajor}};
+        return curExecutor->CanRunOnFirstDevice("Attention", {}, {}, layouts) &&
+               curExecutor->CanRunOnFirstDevice("MatMul", {}, {}, matMulLayouts) &&
+               curExecutor->CanRunOnFirstDevice("MatMulTransB", {}, {}, matMulLayouts);
+    }
+
+    // 只有非默认排布时才传入layout参数, 不支持的设备据此回退
+    static void AddLayoutParam(IntDict &intParams, const std::string &name, AttentionLayout layout) {
+        if (layout != LayoutHeadMajor) {
+            intParams[name] = layout;
+        }
+    }
+
     void Attention(const Data &q, const Data &k, const Data &v, const Data &mask, Data &output,
-                   int group, float scale, int attentionType) {
+                   int group, float scale, int attentionType, AttentionLayout qLayout,
+                   AttentionLayout kvLayout, AttentionLayout outputLayout) {
         int maskType = 0; // 0: 因果mask
-        
-        curExecutor->Run("Attention", {
+        IntDict intParams = {{"group", group}, {"maskType", maskType}};
+        AddLayoutParam(intParams, "qLayout", qLayout);
+        AddLayoutParam(intParams, "kvLayout", kvLayout);
+        AddLayoutParam(intParams, "outputLayout", outputLayout);
+        static OpHandle attentionOp("Attention");
+        curExecutor->Run(attentionOp, {
                 {"q", (Data*)&q}, {"k", (Data*)&k}, {"v", (Data*)&v},
                 {"mask", (Data*)&mask}, {"output", (Data*)&output}
-        }, {{"scale", scale}}, {{"group", group}, {"maskType", maskType}});
+        }, {{"scale", scale}}, intParams);
     }
 
     void Embedding(const Data &input, Data &weight, Data &output) {
-        curExecutor->Run("Embedding", {
+        static OpHandle embeddingOp("Embedding");
+        curExecutor->Run(embeddingOp, {
                 {"input", (Data*)&input}, {"weight", &weight}, {"output", &output}
         }, {}, {});
     }
 
     void RMSNorm(const Data &input, const Data &weight, float eps, Data &output) {
-        curExecutor->Run("RMSNorm", {
+        static OpHandle rMSNormOp("RMSNorm");
+        curExecutor->Run(rMSNormOp, {
                 {"input", (Data*)&input}, {"weight", (Data*)&weight}, {"output", &output}
         }, {{"eps", eps}}, {});
     }
 
     void LayerNorm(Data &input, Data &gamma, Data &beta, int axis, Data &output) {
-        curExecutor->Run("LayerNorm", {
+        static OpHandle layerNormOp("LayerNorm");
+        curExecutor->Run(layerNormOp, {
             {"input", &input}, {"gamma", &gamma}, {"beta", &beta}, {"output", &output}
         }, {}, {{"axis", axis}});
     }
 
+    void AddRMSNorm(Data &input, const Data &residual, const Data &weight, float eps, Data &output,
+                    Data *quantizedOutput, DataType quantizedFor) {
+        if (input.dataType == DataType::FLOAT32 && curExecutor->CanRunOnFirstDevice("AddRMSNorm", {}, {}, {})) {
+            static OpHandle addRMSNormOp("AddRMSNorm");
+            curExecutor->Run(addRMSNormOp, {
+                    {"input", &input}, {"residual", (Data*)&residual}, {"weight", (Data*)&weight},
+                    {"output", &output}, {"quantizedOutput", quantizedOutput}
+            }, {{"eps", eps}}, {{"quantizedFor", quantizedFor}});
+            return;
+        }
+        if (residual.dims.size() > 0) {
+            AddTo(input, residual);
+        }
+        RMSNorm(input, weight, eps, output);
+        if (quantizedOutput != nullptr) {
+            // 没有融合算子时不输出量化结果, Linear会自己量化input
+            quantizedOutput->Resize({});
+            quantizedOutput->perChannelsConfigs.clear();
+            quantizedOutput->linearInputLayout = 0;
+        }
+    }
+
+    void AddLayerNorm(Data &input, const Data &residual, Data &gamma, Data &beta, Data &output,
+                      Data *quantizedOutput, DataType quantizedFor) {
+        if (input.dataType == DataType::FLOAT32 && curExecutor->CanRunOnFirstDevice("AddLayerNorm", {}, {}, {})) {
+            static OpHandle addLayerNormOp("AddLayerNorm");
+            curExecutor->Run(addLayerNormOp, {
+                    {"input", &input}, {"residual", (Data*)&residual}, {"gamma", &gamma}, {"beta", &beta},
+                    {"output", &output}, {"quantizedOutput", quantizedOutput}
+            }, {}, {{"quantizedFor", quantizedFor}});
+            return;
+        }
+        if (residual.dims.size() > 0) {
+            AddTo(input, residual);
+        }
+        LayerNorm(input, gamma, beta, -1, output);
+        if (quantizedOutput != nullptr) {
+            quantizedOutput->Resize({});
+            quantizedOutput->perChannelsConfigs.clear();
+            quantizedOutput->linearInputLayout = 0;
+        }
+    }
+
     void Linear(Data &input, Data &weight, const Data &bias, Data &output) {
-        curExecutor->Run("Linear", {
+        static OpHandle linearOp("Linear");
+        curExecutor->Run(linearOp, {
                 {"input", &input}, {"weight", &weight}, {"bias", (Data*)&bias}, {"output", &output}
         }, {}, {});
     }
 
-    bool CanRunLinearEx(LinearExType exType) {
-        return curExecutor->CanRunOnFirstDevice("Linear", {}, {}, {{"exType", (int)exType}});
+    void Linear(Data &input, Data &weight, const Data &bias, Data &output, const Data &quantizedInput) {
+        static OpHandle linearOp("Linear");
+        curExecutor->Run(linearOp, {
+                {"input", &input}, {"weight", &weight}, {"bias", (Data*)&bias}, {"output", &output},
+                {"quantizedInput", (Data*)&quantizedInput}
+        }, {}, {});
+    }
+
+    bool CanRunLinearEx(LinearExType exType, const Data &input, const Data &weight) {
+        return curExecutor->CanRunOnFirstDevice("Linear", {{"input", (Data*)&input}, {"weight", (Data*)&weight}},
+                                                {}, {{"exType", (int)exType}});
     }
 
     void LinearEx(Data &input, Data &weight, const Data &bias, Data &output, LinearExType exType) {
-        curExecutor->Run("Linear", {
+        static OpHandle linearOp("Linear");
+        curExecutor->Run(linearOp, {
                 {"input", &input}, {"weight", &weight}, {"bias", (Data*)&bias}, {"output", &output}
         }, {}, {{"exType", (int)exType}});
     }
 
+    bool CanRunLinearSwiglu(const Data &input, const Data &gateWeight, const Data &upWeight) {
+        return curExecutor->CanRunOnFirstDevice("LinearSwiglu", {{"input", (Data*)&input}, {"weight", (Data*)&gateWeight},
+                                                {"upWeight", (Data*)&upWeight}}, {}, {});
+    }
+
+    void LinearSwiglu(Data &input, Data &gateWeight, Data &upWeight, Data &output, const Data *quantizedInput) {
+        static OpHandle linearSwigluOp("LinearSwiglu");
+        curExecutor->Run(linearSwigluOp, {
+                {"input", &input}, {"weight", &gateWeight}, {"upWeight", &upWeight}, {"output", &output},
+                {"quantizedInput", (Data*)quantizedInput}
+        }, {}, {});
+    }
+
     void Split(const Data &input, int axis, int start, int end, Data &output) {
-        curExecutor->Run("Split", {
+        static OpHandle splitOp("Split");
+        curExecutor->Run(splitOp, {
                 {"input", (Data*)&input}, {"output", &output}
         }, {}, {{"axis", axis}, {"start", start}, {"end", end}});
     }
 
     void Cat(const Data &input0, const Data &input1, int axis, Data &output) {
-        curExecutor->Run("Cat", {
+        static OpHandle catOp("Cat");
+        curExecutor->Run(catOp, {
                 {"input0", (Data*)&input0}, {"input1", (Data*)&input1}, {"output", &output}
         }, {}, {{"axis", axis}});
     }
 
     void CatDirect(Data &input0, const Data &input1, int axis) {
-        curExecutor->Run("CatDirect", {
+        static OpHandle catDirectOp("CatDirect");
+        curExecutor->Run(catDirectOp, {
                 {"input0", (Data*)&input0}, {"input1", (Data*)&input1}
         }, {}, {{"axis", axis}});
     }
 
-    void MatMul(const Data &input0, const Data &input1, Data &output, float alpha, int group) {
-        curExecutor->Run("MatMul", {
+    void MatMul(const Data &input0, const Data &input1, Data &output, float alpha, int group,
+                AttentionLayout input0Layout, AttentionLayout outputLayout) {
+        IntDict intParams = {{"group", group}};
+        AddLayoutParam(intParams, "input0Layout", input0Layout);
+        AddLayoutParam(intParams, "outputLayout", outputLayout);
+        static OpHandle matMulOp("MatMul");
+        curExecutor->Run(matMulOp, {
                 {"input0", (Data*)&input0}, {"input1", (Data*)&input1}, {"output", &output}
-        }, {{"alpha", alpha}}, {{"group", group}});
+        }, {{"alpha", alpha}}, intParams);
     }
 
-    void MatMulTransB(const Data &input0, const Data &input1, Data &output, float alpha, int group) {
-        curExecutor->Run("MatMulTransB", {
+    void MatMulTransB(const Data &input0, const Data &input1, Data &output, float alpha, int group,
+                      AttentionLayout input0Layout, AttentionLayout outputLayout) {
+        IntDict intParams = {{"group", group}};
+        AddLayoutParam(intParams, "input0Layout", input0Layout);
+        AddLayoutParam(intParams, "outputLayout", outputLayout);
+        static OpHandle matMulTransBOp("MatMulTransB");
+        curExecutor->Run(matMulTransBOp, {
                 {"input0", (Data*)&input0}, {"input1", (Data*)&input1}, {"output", &output}
-        }, {{"alpha", alpha}}, {{"group", group}});
+        }, {{"alpha", alpha}}, intParams);
     }
 
     void Softmax(const Data &input, Data &output, int axis) {
-        curExecutor->Run("SoftMax", {
+        static OpHandle softMaxOp("SoftMax");
+        curExecutor->Run(softMaxOp, {
                 {"input", (Data*)&input}, {"output", &output}
         }, {}, {{"axis", axis}});
     }
 
     void Silu(const fastllm::Data &input, fastllm::Data &output) {
-        curExecutor->Run("Silu", {
+        static OpHandle siluOp("Silu");
+        curExecutor->Run(siluOp, {
                 {"input", (Data*)&input}, {"output", &output}
         }, {}, {});
     }
 
     void TanH(const Data &input, Data &output) {
-        curExecutor->Run("TanH", {
+        static OpHandle tanHOp("TanH");
+        curExecutor->Run(tanHOp, {
                 {"input", (Data*)&input}, {"output", &output}
         }, {}, {});
     }
 
     void Gelu(const fastllm::Data &input, fastllm::Data &output) {
-        curExecutor->Run("Gelu", {
+        static OpHandle geluOp("Gelu");
+        curExecutor->Run(geluOp, {
                 {"input", (Data*)&input}, {"output", &output}
         }, {}, {});
     }
 
     void GeluNew(const fastllm::Data &input, fastllm::Data &output) {
-        curExecutor->Run("GeluNew", {
+        static OpHandle geluNewOp("GeluNew");
+        curExecutor->Run(geluNewOp, {
                 {"input", (Data*)&input}, {"output", &output}
         }, {}, {});
     }
 
     void Swiglu(const fastllm::Data &input, fastllm::Data &output) {
-        curExecutor->Run("Swiglu", {
+        static OpHandle swigluOp("Swiglu");
+        curExecutor->Run(swigluOp, {
                 {"input", (Data*)&input}, {"output", &output}
         }, {}, {});
     }
 
     void Mul(const fastllm::Data &input, float v, fastllm::Data &output) {
-        curExecutor->Run("Mul", {
+        static OpHandle mulOp("Mul");
+        curExecutor->Run(mulOp, {
                 {"input", (Data*)&input}, {"output", &output}
         }, {{"v", v}}, {});
     }
 
     void MulTo(Data &input0, const Data &input1) {
-        curExecutor->Run("MulTo", {
+        static OpHandle mulToOp("MulTo");
+        curExecutor->Run(mulToOp, {
                 {"input0", &input0}, {"input1", (Data*)&input1}
         }, {}, {});
     }
 
     void AddTo(Data &input0, const Data &input1, float alpha) {
-        curExecutor->Run("AddTo", {
+        static OpHandle addToOp("AddTo");
+        curExecutor->Run(addToOp, {
                 {"input0", &input0}, {"input1", (Data*)&input1}
         }, {{"alpha", alpha}}, {});
     }
 
     void AttentionMask(Data &input, const Data &mask, float maskValue) {
-        curExecutor->Run("AttentionMask", {
+        static OpHandle attentionMaskOp("AttentionMask");
+        curExecutor->Run(attentionMaskOp, {
                 {"input", &input}, {"mask", (Data*)&mask}
         }, {{"maskValue", maskValue}}, {});
     }
 
     void AttentionExtendedMask(Data &input, const Data &mask) {
-        curExecutor->Run("AttentionExtendedMask", {
+        static OpHandle attentionExtendedMaskOp("AttentionExtendedMask");
+        curExecutor->Run(attentionExtendedMaskOp, {
                 {"input", &input}, {"mask", (Data*)&mask}
         }, {}, {});
     }
 
     void AlibiMask(Data &input, const Data &mask, float maskValue) {
-        curExecutor->Run("AlibiMask", {
+        static OpHandle alibiMaskOp("AlibiMask");
+        curExecutor->Run(alibiMaskOp, {
                 {"input", &input}, {"mask", (Data*)&mask}
         }, {{"maskValue", maskValue}}, {});
     }
@@ -2347,7 +3635,8 @@ namespace fastllm {
         for (int i = 0; i < axisData.Count(0); i++) {
             ((int32_t*)axisData.cpuData)[i] = axis[i];
         }
-        curExecutor->Run("Permute", {
+        static OpHandle permuteOp("Permute");
+        curExecutor->Run(permuteOp, {
                 {"input", (Data*)&input}, {"axis", &axisData}, {"output", (Data*)&output}
         }, {}, {});
     }
@@ -2358,67 +3647,115 @@ namespace fastllm {
         for (int i = 0; i < axisData.Count(0); i++) {
             ((int32_t*)axisData.cpuData)[i] = axis[i];
         }
-        curExecutor->Run("PermuteSelf", {
+        static OpHandle permuteSelfOp("PermuteSelf");
+        curExecutor->Run(permuteSelfOp, {
                 {"input", (Data*)&input}, {"axis", &axisData}
         }, {}, {});
     }
 
     void TopK(const Data &input, Data &output, int topk) {
-        curExecutor->Run("TopK", {
+        static OpHandle topKOp("TopK");
+        curExecutor->Run(topKOp, {
                 {"input", (Data*)&input}, {"output", &output}
         }, {}, {{"topk", topk}});
     };
 
     void RotatePosition2D(Data &input, const Data &positionIds, Data &sinData, Data &cosData, int rotaryDim) {
-        curExecutor->Run("RotatePosition2D", {
+        static OpHandle rotatePosition2DOp("RotatePosition2D");
+        curExecutor->Run(rotatePosition2DOp, {
                 {"input", &input}, {"positionIds", (Data*)&positionIds}, {"sin", &sinData}, {"cos", &cosData}
         }, {}, {{"rotaryDim", rotaryDim}});
     }
 
     void NearlyRotatePosition2D(Data &input, const Data &positionIds, Data &sinData, Data &cosData, int rotaryDim) {
-        curExecutor->Run("NearlyRotatePosition2D", {
+        static OpHandle nearlyRotatePosition2DOp("NearlyRotatePosition2D");
+        curExecutor->Run(nearlyRotatePosition2DOp, {
                 {"input", &input}, {"positionIds", (Data*)&positionIds}, {"sin", &sinData}, {"cos", &cosData}
         }, {}, {{"rotaryDim", rotaryDim}});
     }
 
     void LlamaRotatePosition2D(Data &input, const Data &positionIds, Data &sinData, Data &cosData, int rotaryDim) {
-        curExecutor->Run("LlamaRotatePosition2D", {
+        static OpHandle llamaRotatePosition2DOp("LlamaRotatePosition2D");
+        curExecutor->Run(llamaRotatePosition2DOp, {
                 {"input", &input}, {"positionIds", (Data*)&positionIds}, {"sin", &sinData}, {"cos", &cosData}
         }, {}, {{"rotaryDim", rotaryDim}});
     }
 
+    static DataDict GetLlamaQKVRotateAppendDatas(Data &input, const std::vector <Data*> &weights,
+                                                 const std::vector <Data*> &biases, const Data &positionIds,
+                                                 Data &sinData, Data &cosData, Data &pastKey, Data &pastValue,
+                                                 Data *q, const Data *quantizedInput) {
+        AssertInFastLLM((weights.size() == 1 || weights.size() == 3) && biases.size() == weights.size(),
+                        "LlamaQKVRotateAppend error: weights should be {qkv} or {q, k, v}.\n");
+        bool packed = (weights.size() == 1);
+        return {
+                {"input", &input}, {"weight", weights[0]}, {"bias", biases[0]},
+                {"kWeight", packed ? nullptr : weights[1]}, {"kBias", packed ? nullptr : biases[1]},
+                {"vWeight", packed ? nullptr : weights[2]}, {"vBias", packed ? nullptr : biases[2]},
+                {"positionIds", (Data*)&positionIds}, {"sin", &sinData}, {"cos", &cosData},
+                {"pastKey", &pastKey}, {"pastValue", &pastValue}, {"output", q},
+                {"quantizedInput", (Data*)quantizedInput}
+        };
+    }
+
+    bool CanRunLlamaQKVRotateAppend(Data &input, const std::vector <Data*> &weights, const std::vector <Data*> &biases,
+                                    const Data &positionIds, Data &sinData, Data &cosData, int rotaryDim,
+                                    int numHeads, int numKVHeads, int headDim, Data &pastKey, Data &pastValue) {
+        return curExecutor->CanRunOnFirstDevice("LlamaQKVRotateAppend",
+                GetLlamaQKVRotateAppendDatas(input, weights, biases, positionIds, sinData, cosData, pastKey, pastValue,
+                                             nullptr, nullptr),
+                {}, {{"rotaryDim", rotaryDim}, {"numHeads", numHeads}, {"numKVHeads", numKVHeads}, {"headDim", headDim}});
+    }
+
+    void LlamaQKVRotateAppend(Data &input, const std::vector <Data*> &weights, const std::vector <Data*> &biases,
+                              const Data &positionIds, Data &sinData, Data &cosData, int rotaryDim,
+                              int numHeads, int numKVHeads, int headDim, Data &pastKey, Data &pastValue, Data &q,
+                              const Data *quantizedInput) {
+        static OpHandle llamaQKVRotateAppendOp("LlamaQKVRotateAppend");
+        curExecutor->Run(llamaQKVRotateAppendOp,
+                GetLlamaQKVRotateAppendDatas(input, weights, biases, positionIds, sinData, cosData, pastKey, pastValue,
+                                             &q, quantizedInput),
+                {}, {{"rotaryDim", rotaryDim}, {"numHeads", numHeads}, {"numKVHeads", numKVHeads}, {"headDim", headDim}});
+    }
+
     void RepeatPenalty(Data &input, const Data &penalty) {
-        curExecutor->Run("RepeatPenalty", {
+        static OpHandle repeatPenaltyOp("RepeatPenalty");
+        curExecutor->Run(repeatPenaltyOp, {
                 {"input", &input}, {"penalty", (Data*)&penalty}
         }, {}, {});
     }
 
     void ApplyLognAttn(Data &input, const Data &lognAttn, const Data &positionIds) {
-        curExecutor->Run("ApplyLognAttn", {
+        static OpHandle applyLognAttnOp("ApplyLognAttn");
+        curExecutor->Run(applyLognAttnOp, {
             {"input", &input}, {"lognAttn", (Data *) &lognAttn}, {"positionIds", (Data *) &positionIds}
         }, {}, {});
     }
 
     void SplitBatch(const Data &input, int axis, int part, std::vector <Data*> &outputs) {
-        curExecutor->Run("SplitBatch", {
+        static OpHandle splitBatchOp("SplitBatch");
+        curExecutor->Run(splitBatchOp, {
                 {"input", (Data*)&input}, {"output", (Data*)outputs.data()}
         }, {}, {{"axis", axis}, {"output___batch", part}});
     }
 
     void CatBatch(std::vector <Data*> &input, int axis, Data &outputs) {
-        curExecutor->Run("CatBatch", {
+        static OpHandle catBatchOp("CatBatch");
+        curExecutor->Run(catBatchOp, {
                 {"input", (Data*)input.data()}, {"output", (Data*)&outputs}
         }, {}, {{"axis", axis}, {"input___batch", (int)input.size()}});
     }
 
     void MulBatch(std::vector <Data*> &input, float v, std::vector <Data*> &output) {
-        curExecutor->Run("MulBatch", {
+        static OpHandle mulBatchOp("MulBatch");
+        curExecutor->Run(mulBatchOp, {
                 {"input", (Data*)input.data()}, {"output", (Data*)output.data()}
         }, {{"v", v}}, {{"input___batch", (int)input.size()}, {"output___batch", (int)output.size()}});
     }
 
     void MatMulBatch(std::vector <Data*> &input0, std::vector <Data*> &input1, std::vector <Data*> &output, float alpha) {
-        curExecutor->Run("MatMulBatch", {
+        static OpHandle matMulBatchOp("MatMulBatch");
+        curExecutor->Run(matMulBatchOp, {
                         {"input0", (Data*)input0.data()}, {"input1", (Data*)input1.data()}, {"output", (Data*)output.data()}
                          }, {{"alpha", alpha}},
                          {{"input0___batch", (int)input0.size()},
@@ -2427,7 +3764,8 @@ namespace fastllm {
     }
 
     void MatMulTransBBatch(std::vector <Data*> &input0, std::vector <Data*> &input1, std::vector <Data*> &output, float alpha) {
-        curExecutor->Run("MatMulTransBBatch", {
+        static OpHandle matMulTransBBatchOp("MatMulTransBBatch");
+        curExecutor->Run(matMulTransBBatchOp, {
                 {"input0", (Data*)input0.data()}, {"input1", (Data*)input1.data()}, {"output", (Data*)output.data()}
         }, {{"alpha", alpha}},
         {{"input0___batch", (int)input0.size()},
@@ -2436,13 +3774,15 @@ namespace fastllm {
     }
 
     void SoftmaxBatch(std::vector <Data*> &input, std::vector <Data*> &output, int axis) {
-        curExecutor->Run("SoftMaxBatch", {
+        static OpHandle softMaxBatchOp("SoftMaxBatch");
+        curExecutor->Run(softMaxBatchOp, {
                 {"input", (Data*)input.data()}, {"output", (Data*)output.data()}
         }, {}, {{"axis", axis}, {"input___batch", (int)input.size()}, {"output___batch", (int)output.size()}});
     }
 
     void CatDirectBatch(std::vector <Data*> &input0, std::vector <Data*> &input1, int axis) {
-        curExecutor->Run("CatDirectBatch", {
+        static OpHandle catDirectBatchOp("CatDirectBatch");
+        curExecutor->Run(catDirectBatchOp, {
                 {"input0", (Data*)input0.data()}, {"input1", (Data*)input1.data()}
         }, {}, {{"axis", axis}, {"input0___batch", (int)input0.size()}, {"input1___batch", (int)input1.size()}});
     }
@@ -2450,7 +3790,8 @@ namespace fastllm {
     void AttentionBatch(std::vector <Data*> &q, std::vector <Data*> &k, std::vector <Data*> &v,
                         std::vector <Data*> &mask, std::vector <Data*> &output,
                         int group, float scale, int attentionType) {
-        curExecutor->Run("AttentionBatch", {
+        static OpHandle attentionBatchOp("AttentionBatch");
+        curExecutor->Run(attentionBatchOp, {
                 {"q", (Data*)q.data()}, {"k", (Data*)k.data()}, {"v", (Data*)v.data()},
                 {"mask", (Data*)mask.data()}, {"output", (Data*)output.data()}
         },
@@ -2536,6 +3877,54 @@ namespace fastllm {
         curExecutor->PrintProfiler();
     }
 
+    void StartTrace() {
+        curExecutor->StartTrace();
+    }
+
+    void StopTrace(const std::string &fileName) {
+        curExecutor->StopTrace(fileName);
+    }
+
+    TraceScope::TraceScope(const char *name, int layer) {
+        if (curExecutor->IsTracing()) {
+            curExecutor->PushTraceScope(name, layer);
+            active = true;
+        }
+    }
+
+    TraceScope::~TraceScope() {
+        End();
+    }
+
+    void TraceScope::End() {
+        if (active) {
+            curExecutor->PopTraceScope();
+            active = false;
+        }
+    }
+
+    void SetGraphMode(bool graph) {
+        graphMode = graph;
+    }
+
+    bool GetGraphMode() {
+        if (graphMode == -1) {
+            const char *env = getenv("FASTLLM_GRAPH");
+            graphMode = (env != nullptr && std::string(env) == "1");
+        }
+        return graphMode == 1;
+    }
+
+    GraphScope::GraphScope(GraphPlan *plan) {
+        this->active = (plan != nullptr && curExecutor->BeginGraph(plan));
+    }
+
+    GraphScope::~GraphScope() {
+        if (this->active) {
+            curExecutor->EndGraph();
+        }
+    }
+
     void ApplyDeviceMap(const std::map <std::string, int> &deviceMap, int current, int total) {
         if (deviceMap.size() == 0) {
             return;
@@ -173,8 +173,9 @@ namespace fastllm {
         std::vector<std::vector<float> > inputTokens;
         inputTokens.resize(batch);
 
+        std::vector <Data> encoded = this->weight.tokenizer.EncodeBatch(prompts);
         for (int i = 0; i < batch; i++) {
-            Data now = this->weight.tokenizer.Encode(prompts[i]);
+            Data &now = encoded[i];
             for (int j = 0; j < now.Count(0); j++) {
                 inputTokens[i].push_back(((float *) now.cpuData)[j]);
             }
@@ -795,4 +796,11 @@ printf("tot = %d\n", tot);
     void basellm::DisableAdapter() {
         adapterName = "";
     }
+
+    GraphPlan *basellm::GetGraphPlan(const std::string &bucket) {
+        if (!GetGraphMode()) {
+            return nullptr;
+        }
+        return &graphPlans[bucket];
+    }
 }
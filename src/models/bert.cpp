@@ -91,7 +91,7 @@ namespace fastllm {
             AddTo(hiddenStates, attnOutput);
             LayerNorm(hiddenStates, this->weight[attnLNWeightName], this->weight[attnLNbiasName], -1, hiddenStates);
             
-            if (CanRunLinearEx(LinearExType::ExGelu)) {
+            if (CanRunLinearEx(LinearExType::ExGelu, hiddenStates, this->weight[interDenseWeightName])) {
                 LinearEx(hiddenStates, this->weight[interDenseWeightName], this->weight[interDenseBiasName], inter, LinearExType::ExGelu);
             } else {
                 Linear(hiddenStates, this->weight[interDenseWeightName], this->weight[interDenseBiasName], inter);
@@ -30,6 +30,38 @@ namespace fastllm {
                                           {"<|action_start|>", 92541}, {"<|action_end|>", 92540}, {"<|interpreter|>", 92539}, {"<|plugin|>", 92538}});
     }
 
+    void Internlm2Model::ResolveLayerWeights() {
+        auto optional = [this](const std::string &name) -> Data* {
+            auto it = this->weight.weight.find(name);
+            return it == this->weight.weight.end() ? nullptr : &it->second;
+        };
+        embedWeight = &this->weight["model.tok_embeddings.weight"];
+        normWeight = &this->weight["model.norm.weight"];
+        lmHeadWeight = &this->weight["output.weight"];
+        layerWeights.resize(block_cnt);
+        for (int i = 0; i < block_cnt; i++) {
+            std::string pre = "model.layers." + std::to_string(i);
+            LlamaLayerWeights &lw = layerWeights[i];
+            lw = LlamaLayerWeights();
+            lw.inputNorm = &this->weight[pre + ".attention_norm.weight"];
+            lw.postNorm = &this->weight[pre + ".ffn_norm.weight"];
+            lw.qkv = optional(pre + ".attention.wqkv.weight"); // 按kv head分组拼接的[q..., k, v]
+            if (lw.qkv == nullptr) {
+                lw.q = &this->weight[pre + ".attention.wq.weight"];
+                lw.k = &this->weight[pre + ".attention.wk.weight"];
+                lw.v = &this->weight[pre + ".attention.wv.weight"];
+                lw.qBias = optional(pre + ".attention.wq.bias");
+                lw.kBias = optional(pre + ".attention.wk.bias");
+                lw.vBias = optional(pre + ".attention.wv.bias");
+            }
+            lw.o = &this->weight[pre + ".attention.wo.weight"];
+            lw.oBias = optional(pre + ".attention.wo.bias");
+            lw.gate = &this->weight[pre + ".feed_forward.w1.weight"];
+            lw.up = &this->weight[pre + ".feed_forward.w3.weight"];
+            lw.down = &this->weight[pre + ".feed_forward.w2.weight"];
+        }
+    }
+
     int Internlm2Model::Forward(const fastllm::Data &inputIds, const fastllm::Data &attentionMask,
                                 const fastllm::Data &positionIds, std::vector<std::pair<Data, Data>> &pastKeyValues,
                                 const GenerationConfig &generationConfig, const LastTokensManager &lastTokens,
@@ -44,7 +76,7 @@ namespace fastllm {
                                 const GenerationConfig &generationConfig, const LastTokensManager &lastTokens,
                                 std::vector <std::vector <float>*> *retLogits) {
         int maxLen = inputIds.dims[1];
-        Data hiddenStates;
+        Data hiddenStates, emptyData;
         Data attenInput;
         Data q, k, v, qkv;
         Data attenWeights, attenOutput;
@@ -53,38 +85,30 @@ namespace fastllm {
         Data* sinDataPtr = &sinData;
         Data* cosDataPtr = &cosData;
 
-        Embedding(inputIds, this->weight["model.tok_embeddings.weight"], hiddenStates);
+        ResolveWeights();
+        Embedding(inputIds, *embedWeight, hiddenStates);
         int seqlen = hiddenStates.dims[1];
         for (int i = 0; i < block_cnt; i++) {
             ApplyDeviceMap(this->deviceMap, i + 1, block_cnt);
-            RMSNorm(hiddenStates, this->weight["model.layers." + std::to_string(i) + ".attention_norm.weight"],
-                    rms_norm_eps, attenInput);
-            std::string qWeightName = "model.layers." + std::to_string(i) + ".attention.wq.weight";
-            std::string qBiasName = "model.layers." + std::to_string(i) + ".attention.wq.bias";
-            std::string kWeightName = "model.layers." + std::to_string(i) + ".attention.wk.weight";
-            std::string kBiasName = "model.layers." + std::to_string(i) + ".attention.wk.bias";
-            std::string vWeightName = "model.layers." + std::to_string(i) + ".attention.wv.weight";
-            std::string vBiasName = "model.layers." + std::to_string(i) + ".attention.wv.bias";
-            std::string qkvWeightName = "model.layers." + std::to_string(i) + ".attention.wqkv.weight";
-            std::string oWeightName = "model.layers." + std::to_string(i) + ".attention.wo.weight";
-            std::string oBiasName = "model.layers." + std::to_string(i) + ".attention.wo.bias";
+            LlamaLayerWeights &lw = layerWeights[i];
+            RMSNorm(hiddenStates, *lw.inputNorm, rms_norm_eps, attenInput);
 
             // 1.1 Get q, k, v
             int bsz = attenInput.dims[0], seqlen = attenInput.dims[1];
-            if (weight.weight.find(qkvWeightName) != weight.weight.end()) {
-                Linear(attenInput, weight[qkvWeightName], Data(), qkv);
+            if (lw.qkv != nullptr) {
+                Linear(attenInput, *lw.qkv, Data(), qkv);
                 int qdim = num_attention_heads / num_key_value_heads;
                 qkv.Reshape({-1, (num_attention_heads / num_key_value_heads + 2), head_dim});
                 Split(qkv, -2, 0, qdim, q);
                 Split(qkv, -2, qdim, qdim + 1, k);
                 Split(qkv, -2, qdim + 1, qdim + 2, v);
             } else {
-                Data qBias = (weight.weight.find(qBiasName) != weight.weight.end()) ? weight[qBiasName] : Data();
-                Data kBias = (weight.weight.find(kBiasName) != weight.weight.end()) ? weight[kBiasName] : Data();
-                Data vBias = (weight.weight.find(vBiasName) != weight.weight.end()) ? weight[vBiasName] : Data();
-                Linear(attenInput, weight[qWeightName], qBias, q);
-                Linear(attenInput, weight[kWeightName], kBias, k);
-                Linear(attenInput, weight[vWeightName], vBias, v);
+                const Data &qBias = lw.qBias != nullptr ? *lw.qBias : emptyData;
+                const Data &kBias = lw.kBias != nullptr ? *lw.kBias : emptyData;
+                const Data &vBias = lw.vBias != nullptr ? *lw.vBias : emptyData;
+                Linear(attenInput, *lw.q, qBias, q);
+                Linear(attenInput, *lw.k, kBias, k);
+                Linear(attenInput, *lw.v, vBias, v);
             }
 
             std::vector <int> qkvSize = {bsz, seqlen, -1, head_dim};
@@ -166,16 +190,20 @@ namespace fastllm {
             attenOutput.Reshape({seqlen, bsz, -1});
             PermuteSelf(attenOutput, {1, 0, 2});
 
-            Data oBias = (weight.weight.find(oBiasName) != weight.weight.end()) ? weight[oBiasName] : Data();
-            Linear(attenOutput, weight[oWeightName], oBias, attenLastOutput);
+            const Data &oBias = lw.oBias != nullptr ? *lw.oBias : emptyData;
+            Linear(attenOutput, *lw.o, oBias, attenLastOutput);
             AddTo(hiddenStates, attenLastOutput);
             // 2. mlp
-            RMSNorm(hiddenStates, this->weight["model.layers." + std::to_string(i) + ".ffn_norm.weight"], rms_norm_eps, attenInput);
-            Linear(attenInput, weight["model.layers." + std::to_string(i) + ".feed_forward.w1.weight"], Data(), w1);
-            Linear(attenInput, weight["model.layers." + std::to_string(i) + ".feed_forward.w3.weight"], Data(), w3);
-            Silu(w1, w1);
-            MulTo(w1, w3);
-            Linear(w1, weight["model.layers." + std::to_string(i) + ".feed_forward.w2.weight"], Data(), w2);
+            RMSNorm(hiddenStates, *lw.postNorm, rms_norm_eps, attenInput);
+            if (CanRunLinearSwiglu(attenInput, *lw.gate, *lw.up)) {
+                LinearSwiglu(attenInput, *lw.gate, *lw.up, w1);
+            } else {
+                Linear(attenInput, *lw.gate, Data(), w1);
+                Linear(attenInput, *lw.up, Data(), w3);
+                Silu(w1, w1);
+                MulTo(w1, w3);
+            }
+            Linear(w1, *lw.down, Data(), w2);
             AddTo(hiddenStates, w2);
         }
 
@@ -192,8 +220,8 @@ namespace fastllm {
         std::vector <int> lastRet;
         {
             auto &hiddenStates = *lastHiddenStates;
-            RMSNorm(hiddenStates, weight["model.norm.weight"], rms_norm_eps, hiddenStates);
-            Linear(hiddenStates, weight["output.weight"], Data(), logits);
+            RMSNorm(hiddenStates, *normWeight, rms_norm_eps, hiddenStates);
+            Linear(hiddenStates, *lmHeadWeight, Data(), logits);
             if (generationConfig.IsSimpleGreedy()) {
                 TopK(logits, topk, 1);
                 topk.ToDevice(DataDevice::CPU);
@@ -226,7 +254,7 @@ namespace fastllm {
                                                    const LastTokensManager &lastTokens,
                                                    std::vector <std::vector <float>*> *retLogits) {
 
-        Data hiddenStates;
+        Data hiddenStates, emptyData;
         Data attenInput;
         Data q, k, v, qkv;
         Data attenWeights, curAttenOutput;
@@ -235,26 +263,18 @@ namespace fastllm {
         std::vector <Data*> sinDataPtrList(batch, &sinData);
         std::vector <Data*> cosDataPtrList(batch, &cosData);
 
-        Embedding(inputIds, this->weight["model.tok_embeddings.weight"], hiddenStates);
+        ResolveWeights();
+        Embedding(inputIds, *embedWeight, hiddenStates);
         int seqlen = hiddenStates.dims[1];
         for (int i = 0; i < block_cnt; i++) {
             ApplyDeviceMap(this->deviceMap, i + 1, block_cnt);
-            RMSNorm(hiddenStates, this->weight["model.layers." + std::to_string(i) + ".attention_norm.weight"],
-                    rms_norm_eps, attenInput);
-            std::string qWeightName = "model.layers." + std::to_string(i) + ".attention.wq.weight";
-            std::string qBiasName = "model.layers." + std::to_string(i) + ".attention.wq.bias";
-            std::string kWeightName = "model.layers." + std::to_string(i) + ".attention.wk.weight";
-            std::string kBiasName = "model.layers." + std::to_string(i) + ".attention.wk.bias";
-            std::string vWeightName = "model.layers." + std::to_string(i) + ".attention.wv.weight";
-            std::string vBiasName = "model.layers." + std::to_string(i) + ".attention.wv.bias";
-            std::string qkvWeightName = "model.layers." + std::to_string(i) + ".attention.wqkv.weight";
-            std::string oWeightName = "model.layers." + std::to_string(i) + ".attention.wo.weight";
-            std::string oBiasName = "model.layers." + std::to_string(i) + ".attention.wo.bias";
+            LlamaLayerWeights &lw = layerWeights[i];
+            RMSNorm(hiddenStates, *lw.inputNorm, rms_norm_eps, attenInput);
 
             // 1.1 Get q, k, v
             int bsz = attenInput.dims[0], seqlen = attenInput.dims[1];
-            if (weight.weight.find(qkvWeightName) != weight.weight.end()) {
-                Linear(attenInput, weight[qkvWeightName], Data(), qkv);
+            if (lw.qkv != nullptr) {
+                Linear(attenInput, *lw.qkv, Data(), qkv);
                 int qdim = num_attention_heads / num_key_value_heads;
                 qkv.Reshape({-1, (num_attention_heads / num_key_value_heads + 2), head_dim});
                 Split(qkv, -2, 0, qdim, q);
@@ -264,12 +284,12 @@ namespace fastllm {
                 k.Reshape({bsz, -1, head_dim * num_key_value_heads});
                 v.Reshape({bsz, -1, head_dim * num_key_value_heads});
             } else {
-                Data qBias = (weight.weight.find(qBiasName) != weight.weight.end()) ? weight[qBiasName] : Data();
-                Data kBias = (weight.weight.find(kBiasName) != weight.weight.end()) ? weight[kBiasName] : Data();
-                Data vBias = (weight.weight.find(vBiasName) != weight.weight.end()) ? weight[vBiasName] : Data();
-                Linear(attenInput, weight[qWeightName], qBias, q);
-                Linear(attenInput, weight[kWeightName], kBias, k);
-                Linear(attenInput, weight[vWeightName], vBias, v);
+                const Data &qBias = lw.qBias != nullptr ? *lw.qBias : emptyData;
+                const Data &kBias = lw.kBias != nullptr ? *lw.kBias : emptyData;
+                const Data &vBias = lw.vBias != nullptr ? *lw.vBias : emptyData;
+                Linear(attenInput, *lw.q, qBias, q);
+                Linear(attenInput, *lw.k, kBias, k);
+                Linear(attenInput, *lw.v, vBias, v);
             }
 
             Data attenOutput = Data(DataType::FLOAT32);
@@ -376,22 +396,26 @@ namespace fastllm {
                 CatDirect(attenOutput, curAttenOutput, 1);
             }
 
-            Data oBias = (weight.weight.find(oBiasName) != weight.weight.end()) ? weight[oBiasName] : Data();
-            Linear(attenOutput, weight[oWeightName], oBias, attenLastOutput);
+            const Data &oBias = lw.oBias != nullptr ? *lw.oBias : emptyData;
+            Linear(attenOutput, *lw.o, oBias, attenLastOutput);
             AddTo(hiddenStates, attenLastOutput);
             // 2. mlp
-            RMSNorm(hiddenStates, this->weight["model.layers." + std::to_string(i) + ".ffn_norm.weight"], rms_norm_eps, attenInput);
-            Linear(attenInput, weight["model.layers." + std::to_string(i) + ".feed_forward.w1.weight"], Data(), w1);
-            Linear(attenInput, weight["model.layers." + std::to_string(i) + ".feed_forward.w3.weight"], Data(), w3);
-            Silu(w1, w1);
-            MulTo(w1, w3);
-            Linear(w1, weight["model.layers." + std::to_string(i) + ".feed_forward.w2.weight"], Data(), w2);
+            RMSNorm(hiddenStates, *lw.postNorm, rms_norm_eps, attenInput);
+            if (CanRunLinearSwiglu(attenInput, *lw.gate, *lw.up)) {
+                LinearSwiglu(attenInput, *lw.gate, *lw.up, w1);
+            } else {
+                Linear(attenInput, *lw.gate, Data(), w1);
+                Linear(attenInput, *lw.up, Data(), w3);
+                Silu(w1, w1);
+                MulTo(w1, w3);
+            }
+            Linear(w1, *lw.down, Data(), w2);
             AddTo(hiddenStates, w2);
         }
 
         Data logits, curLogit;
-        RMSNorm(hiddenStates, weight["model.norm.weight"], rms_norm_eps, hiddenStates);
-        Linear(hiddenStates, weight["output.weight"], Data(), logits);
+        RMSNorm(hiddenStates, *normWeight, rms_norm_eps, hiddenStates);
+        Linear(hiddenStates, *lmHeadWeight, Data(), logits);
         std::vector <int> lastRet;
         int total = 0;
         for (int b = 0; b < batch; b++) {
@@ -90,6 +90,49 @@ namespace fastllm {
         cosData.ToDevice(DataDevice::CPU);
         sinData.CopyFrom(Data(DataType::FLOAT32, { (int)this->sin.size(), (int)this->sin[0].size() }, pair.first));
         cosData.CopyFrom(Data(DataType::FLOAT32, { (int)this->cos.size(), (int)this->cos[0].size() }, pair.second));
+        // 权重可能在InitParams之后才加入(如python接口逐个AddWeight), 第一次Forward时再解析
+        resolvedWeightRevision = 0;
+    }
+
+    void LlamaModel::ResolveWeights() {
+        if (resolvedWeightRevision != 0 && resolvedWeightRevision == this->weight.revision) {
+            return;
+        }
+        ResolveLayerWeights();
+        resolvedWeightRevision = this->weight.revision;
+    }
+
+    void LlamaModel::ResolveLayerWeights() {
+        auto optional = [this](const std::string &name) -> Data* {
+            auto it = this->weight.weight.find(name);
+            return it == this->weight.weight.end() ? nullptr : &it->second;
+        };
+        // std::map中元素的地址在插入其他元素后不变, 可以长期持有
+        embedWeight = &this->weight["model.embed_tokens.weight"];
+        normWeight = &this->weight["model.norm.weight"];
+        lmHeadWeight = &this->weight["lm_head.weight"];
+        layerWeights.resize(block_cnt);
+        for (int i = 0; i < block_cnt; i++) {
+            std::string pre = "model.layers." + std::to_string(i);
+            LlamaLayerWeights &lw = layerWeights[i];
+            lw = LlamaLayerWeights();
+            lw.inputNorm = &this->weight[pre + ".input_layernorm.weight"];
+            lw.postNorm = &this->weight[pre + ".post_attention_layernorm.weight"];
+            lw.qkv = optional(pre + ".self_attn.W_pack.weight");
+            if (lw.qkv == nullptr) {
+                lw.q = &this->weight[pre + ".self_attn.q_proj.weight"];
+                lw.k = &this->weight[pre + ".self_attn.k_proj.weight"];
+                lw.v = &this->weight[pre + ".self_attn.v_proj.weight"];
+                lw.qBias = optional(pre + ".self_attn.q_proj.bias");
+                lw.kBias = optional(pre + ".self_attn.k_proj.bias");
+                lw.vBias = optional(pre + ".self_attn.v_proj.bias");
+            }
+            lw.o = &this->weight[pre + ".self_attn.o_proj.weight"];
+            lw.oBias = optional(pre + ".self_attn.o_proj.bias");
+            lw.gate = &this->weight[pre + ".mlp.gate_proj.weight"];
+            lw.up = &this->weight[pre + ".mlp.up_proj.weight"];
+            lw.down = &this->weight[pre + ".mlp.down_proj.weight"];
+        }
     }
 
     std::pair<std::vector<float>, std::vector<float>> LlamaModel::UpdateRotaryPosEmb(float base, float factor, int seqLen) {
@@ -117,11 +160,19 @@ namespace fastllm {
         return std::make_pair(fsin, fcos);
     }
 
+    // AddRMSNorm输出的量化input给weight的Linear使用时传入的类型; L2权重直接用码本计算, 不读取量化input
+    static DataType QuantizedInputFor(const Data *weight) {
+        return weight->l2_num != -1 ? DataType::FLOAT32 : weight->dataType;
+    }
+
     int LlamaModel::Forward(const fastllm::Data &inputIds, const fastllm::Data &attentionMask,
                             const fastllm::Data &positionIds, std::vector<std::pair<Data, Data>> &pastKeyValues,
                             const GenerationConfig &generationConfig, const LastTokensManager &lastTokens,
                             std::vector <float> *retLogits) {
-        Data alibiData;
+        // 需要在所有中间Data之前定义; 解码(每次一个token)和prefill分别是一个形状桶
+        GraphScope graphScope(GetGraphPlan(inputIds.dims[1] == 1 ? "forward_decode" : "forward_prefill"));
+        ResolveWeights();
+        Data alibiData, emptyData;
         if (this->weight.dicts["use_alibi"] == "1") {
             std::vector<float> alibi = GetInterleave(num_attention_heads);
             alibiData.CopyFrom(Data(DataType::FLOAT32, {(int) alibi.size()}, alibi));
@@ -129,51 +180,24 @@ namespace fastllm {
 
         int maxLen = inputIds.dims[1];
         Data hiddenStates;
-        Data attenInput;
+        Data attenInput, attenInputQ;
         Data q, k, v, qkv;
         Data attenWeights, attenOutput;
         Data attenLastOutput;
         Data w1, w2, w3;
         Data* sinDataPtr = &sinData;
         Data* cosDataPtr = &cosData;
+        // 支持时attention直接读取[seq, heads, dim]排布的q, 并按[seq, heads, dim]排布输出, 省掉q和output的PermuteSelf
+        AttentionLayout layout = CanRunAttentionLayout() ? LayoutSeqMajor : LayoutHeadMajor;
 
-        Embedding(inputIds, this->weight["model.embed_tokens.weight"], hiddenStates);
+        Embedding(inputIds, *embedWeight, hiddenStates);
         for (int i = 0; i < block_cnt; i++) {
             ApplyDeviceMap(this->deviceMap, i + 1, block_cnt);
-            RMSNorm(hiddenStates, this->weight["model.layers." + std::to_string(i) + ".input_layernorm.weight"],
-                    rms_norm_eps, attenInput);
-            std::string qWeightName = "model.layers." + std::to_string(i) + ".self_attn.q_proj.weight";
-            std::string qBiasName = "model.layers." + std::to_string(i) + ".self_attn.q_proj.bias";
-            std::string kWeightName = "model.layers." + std::to_string(i) + ".self_attn.k_proj.weight";
-            std::string kBiasName = "model.layers." + std::to_string(i) + ".self_attn.k_proj.bias";
-            std::string vWeightName = "model.layers." + std::to_string(i) + ".self_attn.v_proj.weight";
-            std::string vBiasName = "model.layers." + std::to_string(i) + ".self_attn.v_proj.bias";
-            std::string qkvWeightName = "model.layers." + std::to_string(i) + ".self_attn.W_pack.weight";
-            std::string oWeightName = "model.layers." + std::to_string(i) + ".self_attn.o_proj.weight";
-            std::string oBiasName = "model.layers." + std::to_string(i) + ".self_attn.o_proj.bias";
-
-            // 1.1 Get q, k, v
-            int bsz = attenInput.dims[0], seqlen = attenInput.dims[1];
-            if (weight.weight.find(qkvWeightName) != weight.weight.end()) {
-                Linear(attenInput, weight[qkvWeightName], Data(), qkv);
-                int per = qkv.dims.back() / (num_attention_heads / num_key_value_heads + 2);
-                int qdim = per * (num_attention_heads / num_key_value_heads);
-                Split(qkv, -1, 0, qdim, q);
-                Split(qkv, -1, qdim, qdim + per, k);
-                Split(qkv, -1, qdim + per, qdim + per * 2, v);
-            } else {
-                Data qBias = (weight.weight.find(qBiasName) != weight.weight.end()) ? weight[qBiasName] : Data();
-                Data kBias = (weight.weight.find(kBiasName) != weight.weight.end()) ? weight[kBiasName] : Data();
-                Data vBias = (weight.weight.find(vBiasName) != weight.weight.end()) ? weight[vBiasName] : Data();
-                Linear(attenInput, weight[qWeightName], qBias, q);
-                Linear(attenInput, weight[kWeightName], kBias, k);
-                Linear(attenInput, weight[vWeightName], vBias, v);
-            }
-
-            std::vector <int> qkvSize = {bsz, seqlen, -1, head_dim};
-            q.Reshape(qkvSize);
-            k.Reshape(qkvSize);
-            v.Reshape(qkvSize);
+            LlamaLayerWeights &lw = layerWeights[i];
+            TraceScope attentionScope("attention", i);
+            // w2为上一层MLP的输出, 残差加法在这里和RMSNorm融合(第一层时为空)
+            AddRMSNorm(hiddenStates, w2, *lw.inputNorm,
+                       rms_norm_eps, attenInput, &attenInputQ, QuantizedInputFor(lw.qkv != nullptr ? lw.qkv : lw.q));
 
             Data &pastKey = pastKeyValues[i].first, &pastValue = pastKeyValues[i].second;
             if (GetKVCacheInCPU()) {
@@ -192,56 +216,101 @@ namespace fastllm {
                 cosDataPtr = new Data(DataType::FLOAT32, {(int)this->cos.size(), (int)this->cos[0].size()}, pair.second);
             }
 
-            if (alibiData.dims.size() == 0) {
-                fastllm::LlamaRotatePosition2D(q, positionIds, *sinDataPtr, *cosDataPtr, rotary_dim);
-                fastllm::LlamaRotatePosition2D(k, positionIds, *sinDataPtr, *cosDataPtr, rotary_dim);
+            // 1.1 Get q, k, v
+            int bsz = attenInput.dims[0], seqlen = attenInput.dims[1];
+            AttentionLayout qLayout = LayoutHeadMajor;
+            std::vector <Data*> qkvWeights, qkvBiases;
+            if (lw.qkv != nullptr) {
+                qkvWeights = {lw.qkv};
+                qkvBiases = {nullptr};
+            } else {
+                qkvWeights = {lw.q, lw.k, lw.v};
+                qkvBiases = {lw.qBias, lw.kBias, lw.vBias};
             }
+            if (alibiData.dims.size() == 0 &&
+                CanRunLlamaQKVRotateAppend(attenInput, qkvWeights, qkvBiases, positionIds, *sinDataPtr, *cosDataPtr,
+                                           rotary_dim, num_attention_heads, num_key_value_heads, head_dim,
+                                           pastKey, pastValue)) {
+                // q, k, v的Linear, 旋转位置编码和写入KV cache在一个算子中完成
+                LlamaQKVRotateAppend(attenInput, qkvWeights, qkvBiases, positionIds, *sinDataPtr, *cosDataPtr, rotary_dim,
+                                     num_attention_heads, num_key_value_heads, head_dim, pastKey, pastValue, q, &attenInputQ);
+            } else {
+                if (lw.qkv != nullptr) {
+                    Linear(attenInput, *lw.qkv, Data(), qkv, attenInputQ);
+                    int per = qkv.dims.back() / (num_attention_heads / num_key_value_heads + 2);
+                    int qdim = per * (num_attention_heads / num_key_value_heads);
+                    Split(qkv, -1, 0, qdim, q);
+                    Split(qkv, -1, qdim, qdim + per, k);
+                    Split(qkv, -1, qdim + per, qdim + per * 2, v);
+                } else {
+                    const Data &qBias = lw.qBias != nullptr ? *lw.qBias : emptyData;
+                    const Data &kBias = lw.kBias != nullptr ? *lw.kBias : emptyData;
+                    const Data &vBias = lw.vBias != nullptr ? *lw.vBias : emptyData;
+                    Linear(attenInput, *lw.q, qBias, q, attenInputQ);
+                    Linear(attenInput, *lw.k, kBias, k, attenInputQ);
+                    Linear(attenInput, *lw.v, vBias, v, attenInputQ);
+                }
 
-            qkvSize = {bsz * seqlen, -1, head_dim};
-            q.Reshape(qkvSize);
-            k.Reshape(qkvSize);
-            v.Reshape(qkvSize);
+                std::vector <int> qkvSize = {bsz, seqlen, -1, head_dim};
+                q.Reshape(qkvSize);
+                k.Reshape(qkvSize);
+                v.Reshape(qkvSize);
+                if (alibiData.dims.size() == 0) {
+                    fastllm::LlamaRotatePosition2D(q, positionIds, *sinDataPtr, *cosDataPtr, rotary_dim);
+                    fastllm::LlamaRotatePosition2D(k, positionIds, *sinDataPtr, *cosDataPtr, rotary_dim);
+                }
 
-            PermuteSelf(q, {1, 0, 2});
-            PermuteSelf(k, {1, 0, 2});
-            PermuteSelf(v, {1, 0, 2});
+                qkvSize = {bsz * seqlen, -1, head_dim};
+                q.Reshape(qkvSize);
+                k.Reshape(qkvSize);
+                v.Reshape(qkvSize);
 
-            int unitLen = 64;
+                qLayout = layout;
+                if (qLayout == LayoutHeadMajor) {
+                    PermuteSelf(q, {1, 0, 2});
+                }
+                PermuteSelf(k, {1, 0, 2});
+                PermuteSelf(v, {1, 0, 2});
+
+                int unitLen = 64;
 #ifdef USE_CUDA
-            unitLen = 128;
+                unitLen = 128;
 #endif
-            while ((pastKey.dims.size() == 0 && (pastKey.expansionDims.size() == 0 || k.dims[1] > pastKey.expansionDims[1]))
-                   || (pastKey.dims.size() > 0 && pastKey.dims[1] + k.dims[1] > pastKey.expansionDims[1])) {
-                std::vector <int> newDims;
-                if (pastKey.Count(0) == 0 || pastKey.dims.size() == 0) {
-                    newDims = std::vector <int> {k.dims[0], ((k.dims[1] - 1) / unitLen + 1) * unitLen, k.dims[2]};
-                } else {
-                    newDims = pastKey.dims;
-                    newDims[1] += ((k.dims[1] - 1) / unitLen + 1) * unitLen;
+                while ((pastKey.dims.size() == 0 && (pastKey.expansionDims.size() == 0 || k.dims[1] > pastKey.expansionDims[1]))
+                       || (pastKey.dims.size() > 0 && pastKey.dims[1] + k.dims[1] > pastKey.expansionDims[1])) {
+                    std::vector <int> newDims;
+                    if (pastKey.Count(0) == 0 || pastKey.dims.size() == 0) {
+                        newDims = std::vector <int> {k.dims[0], ((k.dims[1] - 1) / unitLen + 1) * unitLen, k.dims[2]};
+                    } else {
+                        newDims = pastKey.dims;
+                        newDims[1] += ((k.dims[1] - 1) / unitLen + 1) * unitLen;
+                    }
+                    pastKey.Expansion(newDims);
                 }
-                pastKey.Expansion(newDims);
-            }
-            while ((pastValue.dims.size() == 0 && (pastValue.expansionDims.size() == 0 || v.dims[1] > pastValue.expansionDims[1]))
-                   || (pastValue.dims.size() > 0 && pastValue.dims[1] + v.dims[1] > pastValue.expansionDims[1])) {
-                std::vector <int> newDims;
-                if (pastValue.Count(0) == 0 || pastValue.dims.size() == 0) {
-                    newDims = std::vector <int> {v.dims[0], ((v.dims[1] - 1) / unitLen + 1) * unitLen, v.dims[2]};
-                } else {
-                    newDims = pastValue.dims;
-                    newDims[1] += ((v.dims[1] - 1) / unitLen + 1) * unitLen;
+                while ((pastValue.dims.size() == 0 && (pastValue.expansionDims.size() == 0 || v.dims[1] > pastValue.expansionDims[1]))
+                       || (pastValue.dims.size() > 0 && pastValue.dims[1] + v.dims[1] > pastValue.expansionDims[1])) {
+                    std::vector <int> newDims;
+                    if (pastValue.Count(0) == 0 || pastValue.dims.size() == 0) {
+                        newDims = std::vector <int> {v.dims[0], ((v.dims[1] - 1) / unitLen + 1) * unitLen, v.dims[2]};
+                    } else {
+                        newDims = pastValue.dims;
+                        newDims[1] += ((v.dims[1] - 1) / unitLen + 1) * unitLen;
+                    }
+                    pastValue.Expansion(newDims);
                 }
-                pastValue.Expansion(newDims);
+                CatDirect(pastKey, k, 1);
+                CatDirect(pastValue, v, 1);
             }
-            CatDirect(pastKey, k, 1);
-            CatDirect(pastValue, v, 1);
 
             // 1.2 Attention
             // 1.2.0 q * k^T
 
             if (alibiData.dims.size() == 0) {
-                Attention(q, pastKey, pastValue, attentionMask, attenOutput, q.dims[0] / pastKey.dims[0], 1.0 / sqrt(head_dim), 1);
+                int qHeads = (qLayout == LayoutSeqMajor ? q.dims[1] : q.dims[0]);
+                Attention(q, pastKey, pastValue, attentionMask, attenOutput, qHeads / pastKey.dims[0], 1.0 / sqrt(head_dim), 1,
+                          qLayout, LayoutHeadMajor, layout);
             } else {
-                MatMulTransB(q, pastKey, attenWeights, 1.0 / sqrt(head_dim));
+                MatMulTransB(q, pastKey, attenWeights, 1.0 / sqrt(head_dim), 1, qLayout);
                 attenWeights.Reshape({1, attenWeights.dims[0], attenWeights.dims[1], attenWeights.dims[2]});
                 if (alibiData.dims.size() != 0) {
                     AlibiMask(attenWeights, alibiData, -10000);
@@ -250,44 +319,57 @@ namespace fastllm {
                 }
 
                 Softmax(attenWeights, attenWeights, -1);
-                MatMul(attenWeights, pastValue, attenOutput);
-                attenOutput.Reshape({attenOutput.dims[1], attenOutput.dims[2], attenOutput.dims[3]});
+                MatMul(attenWeights, pastValue, attenOutput, 1.f, 1, LayoutHeadMajor, layout);
+                if (layout == LayoutHeadMajor) {
+                    attenOutput.Reshape({attenOutput.dims[1], attenOutput.dims[2], attenOutput.dims[3]});
+                }
             }
 
-            PermuteSelf(attenOutput, {1, 0, 2});
+            if (layout == LayoutHeadMajor) {
+                PermuteSelf(attenOutput, {1, 0, 2});
+            }
             attenOutput.Reshape({bsz, seqlen, -1});
 
-            Data oBias = (weight.weight.find(oBiasName) != weight.weight.end()) ? weight[oBiasName] : Data();
-            Linear(attenOutput, weight[oWeightName], oBias, attenLastOutput);
-            AddTo(hiddenStates, attenLastOutput);
+            const Data &oBias = lw.oBias != nullptr ? *lw.oBias : emptyData;
+            Linear(attenOutput, *lw.o, oBias, attenLastOutput);
             // 2. mlp
-            RMSNorm(hiddenStates, this->weight["model.layers." + std::to_string(i) + ".post_attention_layernorm.weight"], rms_norm_eps, attenInput);
-            if (CanRunLinearEx(LinearExType::ExSilu)) {
-                LinearEx(attenInput, weight["model.layers." + std::to_string(i) + ".mlp.gate_proj.weight"], Data(), w1, LinearExType::ExSilu);
+            attentionScope.End();
+            TraceScope mlpScope("mlp", i);
+            AddRMSNorm(hiddenStates, attenLastOutput, *lw.postNorm,
+                       rms_norm_eps, attenInput, &attenInputQ, QuantizedInputFor(lw.gate));
+            if (CanRunLinearSwiglu(attenInput, *lw.gate, *lw.up)) {
+                LinearSwiglu(attenInput, *lw.gate, *lw.up, w1, &attenInputQ);
             } else {
-                Linear(attenInput, weight["model.layers." + std::to_string(i) + ".mlp.gate_proj.weight"], Data(), w1);
-                Silu(w1, w1);
+                if (CanRunLinearEx(LinearExType::ExSilu, attenInput, *lw.gate)) {
+                    LinearEx(attenInput, *lw.gate, Data(), w1, LinearExType::ExSilu);
+                } else {
+                    Linear(attenInput, *lw.gate, Data(), w1, attenInputQ);
+                    Silu(w1, w1);
+                }
+                Linear(attenInput, *lw.up, Data(), w3, attenInputQ);
+                MulTo(w1, w3);
             }
-            Linear(attenInput, weight["model.layers." + std::to_string(i) + ".mlp.up_proj.weight"], Data(), w3);
-            MulTo(w1, w3);
-            Linear(w1, weight["model.layers." + std::to_string(i) + ".mlp.down_proj.weight"], Data(), w2);
-            AddTo(hiddenStates, w2);
+            Linear(w1, *lw.down, Data(), w2);
         }
         Data logits, topk;
-        Data tempHiddenStates;
-        Data *lastHiddenStates;
+        Data tempHiddenStates, tempResidual;
+        Data *lastHiddenStates, *lastResidual;
         if (maxLen > 1) {
             Split(hiddenStates, 1, maxLen - 1, maxLen, tempHiddenStates);
+            Split(w2, 1, maxLen - 1, maxLen, tempResidual);
             lastHiddenStates = &tempHiddenStates;
+            lastResidual = &tempResidual;
         } else {
             lastHiddenStates = &hiddenStates;
+            lastResidual = &w2;
         }
 
         int lastRet = -1;
         {
             auto &hiddenStates = *lastHiddenStates;
-            RMSNorm(hiddenStates, weight["model.norm.weight"], rms_norm_eps, hiddenStates);
-            Linear(hiddenStates, weight["lm_head.weight"], Data(), logits);
+            TraceScope headScope("lm_head");
+            AddRMSNorm(hiddenStates, *lastResidual, *normWeight, rms_norm_eps, hiddenStates);
+            Linear(hiddenStates, *lmHeadWeight, Data(), logits);
             if (generationConfig.output_logits && retLogits != nullptr) {
                 int size = logits.dims.back();
                 logits.ToDevice(DataDevice::CPU);
@@ -314,7 +396,10 @@ namespace fastllm {
                             const fastllm::Data &positionIds, std::vector<std::pair<Data, Data>> &pastKeyValues,
                             const GenerationConfig &generationConfig, const LastTokensManager &lastTokens,
                             std::vector <std::vector <float>*> *retLogits) {
-        Data alibiData;
+        GraphScope graphScope(GetGraphPlan("forwardBatch_" + std::to_string(batch) +
+                                           (inputIds.dims[1] == 1 ? "_decode" : "_prefill")));
+        ResolveWeights();
+        Data alibiData, emptyData;
         if (this->weight.dicts["use_alibi"] == "1") {
             std::vector<float> alibi = GetInterleave(num_attention_heads);
             alibiData.CopyFrom(Data(DataType::FLOAT32, {(int) alibi.size()}, alibi));
@@ -322,7 +407,7 @@ namespace fastllm {
 
         int maxLen = inputIds.dims[1];
         Data hiddenStates;
-        Data attenInput;
+        Data attenInput, attenInputQ;
         Data q, k, v, qkv;
         Data attenWeights, attenOutput;
         Data attenLastOutput;
@@ -330,38 +415,32 @@ namespace fastllm {
         Data* sinDataPtr = &sinData;
         Data* cosDataPtr = &cosData;
 
-        Embedding(inputIds, this->weight["model.embed_tokens.weight"], hiddenStates);
+        Embedding(inputIds, *embedWeight, hiddenStates);
         int seqlen = hiddenStates.dims[1];
         for (int i = 0; i < block_cnt; i++) {
             ApplyDeviceMap(this->deviceMap, i + 1, block_cnt);
-            RMSNorm(hiddenStates, this->weight["model.layers." + std::to_string(i) + ".input_layernorm.weight"],
-                    rms_norm_eps, attenInput);
-            std::string qWeightName = "model.layers." + std::to_string(i) + ".self_attn.q_proj.weight";
-            std::string qBiasName = "model.layers." + std::to_string(i) + ".self_attn.q_proj.bias";
-            std::string kWeightName = "model.layers." + std::to_string(i) + ".self_attn.k_proj.weight";
-            std::string kBiasName = "model.layers." + std::to_string(i) + ".self_attn.k_proj.bias";
-            std::string vWeightName = "model.layers." + std::to_string(i) + ".self_attn.v_proj.weight";
-            std::string vBiasName = "model.layers." + std::to_string(i) + ".self_attn.v_proj.bias";
-            std::string qkvWeightName = "model.layers." + std::to_string(i) + ".self_attn.W_pack.weight";
-            std::string oWeightName = "model.layers." + std::to_string(i) + ".self_attn.o_proj.weight";
-            std::string oBiasName = "model.layers." + std::to_string(i) + ".self_attn.o_proj.bias";
+            LlamaLayerWeights &lw = layerWeights[i];
+            TraceScope attentionScope("attention", i);
+            // w2为上一层MLP的输出, 残差加法在这里和RMSNorm融合(第一层时为空)
+            AddRMSNorm(hiddenStates, w2, *lw.inputNorm,
+                       rms_norm_eps, attenInput, &attenInputQ, QuantizedInputFor(lw.qkv != nullptr ? lw.qkv : lw.q));
 
             // 1.1 Get q, k, v
             int bsz = attenInput.dims[0], seqlen = attenInput.dims[1];
-            if (weight.weight.find(qkvWeightName) != weight.weight.end()) {
-                Linear(attenInput, weight[qkvWeightName], Data(), qkv);
+            if (lw.qkv != nullptr) {
+                Linear(attenInput, *lw.qkv, Data(), qkv, attenInputQ);
                 int per = qkv.dims.back() / (num_attention_heads / num_key_value_heads + 2);
                 int qdim = per * (num_attention_heads / num_key_value_heads);
                 Split(qkv, -1, 0, qdim, q);
                 Split(qkv, -1, qdim, qdim + per, k);
                 Split(qkv, -1, qdim + per, qdim + per * 2, v);
             } else {
-                Data qBias = (weight.weight.find(qBiasName) != weight.weight.end()) ? weight[qBiasName] : Data();
-                Data kBias = (weight.weight.find(kBiasName) != weight.weight.end()) ? weight[kBiasName] : Data();
-                Data vBias = (weight.weight.find(vBiasName) != weight.weight.end()) ? weight[vBiasName] : Data();
-                Linear(attenInput, weight[qWeightName], qBias, q);
-                Linear(attenInput, weight[kWeightName], kBias, k);
-                Linear(attenInput, weight[vWeightName], vBias, v);
+                const Data &qBias = lw.qBias != nullptr ? *lw.qBias : emptyData;
+                const Data &kBias = lw.kBias != nullptr ? *lw.kBias : emptyData;
+                const Data &vBias = lw.vBias != nullptr ? *lw.vBias : emptyData;
+                Linear(attenInput, *lw.q, qBias, q, attenInputQ);
+                Linear(attenInput, *lw.k, kBias, k, attenInputQ);
+                Linear(attenInput, *lw.v, vBias, v, attenInputQ);
             }
 
             std::vector <int> qkvSize = {bsz, seqlen, -1, head_dim};
@@ -449,38 +528,47 @@ namespace fastllm {
             attenOutput.Reshape({seqlen, bsz, -1});
             PermuteSelf(attenOutput, {1, 0, 2});
 
-            Data oBias = (weight.weight.find(oBiasName) != weight.weight.end()) ? weight[oBiasName] : Data();
-            Linear(attenOutput, weight[oWeightName], oBias, attenLastOutput);
-            AddTo(hiddenStates, attenLastOutput);
+            const Data &oBias = lw.oBias != nullptr ? *lw.oBias : emptyData;
+            Linear(attenOutput, *lw.o, oBias, attenLastOutput);
             // 2. mlp
-            RMSNorm(hiddenStates, this->weight["model.layers." + std::to_string(i) + ".post_attention_layernorm.weight"], rms_norm_eps, attenInput);
-            if (CanRunLinearEx(LinearExType::ExSilu)) {
-                LinearEx(attenInput, weight["model.layers." + std::to_string(i) + ".mlp.gate_proj.weight"], Data(), w1, LinearExType::ExSilu);
+            attentionScope.End();
+            TraceScope mlpScope("mlp", i);
+            AddRMSNorm(hiddenStates, attenLastOutput, *lw.postNorm,
+                       rms_norm_eps, attenInput, &attenInputQ, QuantizedInputFor(lw.gate));
+            if (CanRunLinearSwiglu(attenInput, *lw.gate, *lw.up)) {
+                LinearSwiglu(attenInput, *lw.gate, *lw.up, w1, &attenInputQ);
             } else {
-                Linear(attenInput, weight["model.layers." + std::to_string(i) + ".mlp.gate_proj.weight"], Data(), w1);
-                Silu(w1, w1);
+                if (CanRunLinearEx(LinearExType::ExSilu, attenInput, *lw.gate)) {
+                    LinearEx(attenInput, *lw.gate, Data(), w1, LinearExType::ExSilu);
+                } else {
+                    Linear(attenInput, *lw.gate, Data(), w1, attenInputQ);
+                    Silu(w1, w1);
+                }
+                Linear(attenInput, *lw.up, Data(), w3, attenInputQ);
+                MulTo(w1, w3);
             }
-            Linear(attenInput, weight["model.layers." + std::to_string(i) + ".mlp.up_proj.weight"], Data(), w3);
-            MulTo(w1, w3);
-            Linear(w1, weight["model.layers." + std::to_string(i) + ".mlp.down_proj.weight"], Data(), w2);
-            AddTo(hiddenStates, w2);
+            Linear(w1, *lw.down, Data(), w2);
         }
 
         Data logits, topk;
-        Data tempHiddenStates;
-        Data *lastHiddenStates;
+        Data tempHiddenStates, tempResidual;
+        Data *lastHiddenStates, *lastResidual;
         if (maxLen > 1) {
             Split(hiddenStates, 1, maxLen - 1, maxLen, tempHiddenStates);
+            Split(w2, 1, maxLen - 1, maxLen, tempResidual);
             lastHiddenStates = &tempHiddenStates;
+            lastResidual = &tempResidual;
         } else {
             lastHiddenStates = &hiddenStates;
+            lastResidual = &w2;
         }
 
         std::vector <int> lastRet;
         {
             auto &hiddenStates = *lastHiddenStates;
-            RMSNorm(hiddenStates, weight["model.norm.weight"], rms_norm_eps, hiddenStates);
-            Linear(hiddenStates, weight["lm_head.weight"], Data(), logits);
+            TraceScope headScope("lm_head");
+            AddRMSNorm(hiddenStates, *lastResidual, *normWeight, rms_norm_eps, hiddenStates);
+            Linear(hiddenStates, *lmHeadWeight, Data(), logits);
             if (generationConfig.IsSimpleGreedy()) {
                 TopK(logits, topk, 1);
                 topk.ToDevice(DataDevice::CPU);
@@ -512,53 +600,56 @@ namespace fastllm {
                                                const std::vector <GenerationConfig> &generationConfigs,
                                                const LastTokensManager &lastTokens,
                                                std::vector <std::vector <float>*> *retLogits) {
-        Data alibiData;
+        bool allDecode = true;
+        for (int len : seqLens) {
+            allDecode &= (len == 1);
+        }
+        GraphScope graphScope(GetGraphPlan("forwardBatchSeqs_" + std::to_string(seqLens.size()) +
+                                           (allDecode ? "_decode" : "_prefill")));
+        ResolveWeights();
+        Data alibiData, emptyData;
         if (this->weight.dicts["use_alibi"] == "1") {
             std::vector<float> alibi = GetInterleave(num_attention_heads);
             alibiData.CopyFrom(Data(DataType::FLOAT32, {(int) alibi.size()}, alibi));
         }
 
         Data hiddenStates;
-        Data attenInput;
+        Data attenInput, attenInputQ;
         Data q, k, v, qkv;
         Data attenWeights, curAttenOutput;
         Data attenLastOutput;
         Data w1, w2, w3;
         std::vector <Data*> sinDataPtrList(batch, &sinData);
         std::vector <Data*> cosDataPtrList(batch, &cosData);
+        // 支持时attention直接读取[seq, heads, dim]排布的q, 并按[seq, heads, dim]排布输出, 省掉q和output的PermuteSelf
+        AttentionLayout layout = CanRunAttentionLayout() ? LayoutSeqMajor : LayoutHeadMajor;
 
-        Embedding(inputIds, this->weight["model.embed_tokens.weight"], hiddenStates);
+        Embedding(inputIds, *embedWeight, hiddenStates);
         int seqlen = hiddenStates.dims[1];
         for (int i = 0; i < block_cnt; i++) {
             ApplyDeviceMap(this->deviceMap, i + 1, block_cnt);
-            RMSNorm(hiddenStates, this->weight["model.layers." + std::to_string(i) + ".input_layernorm.weight"],
-                    rms_norm_eps, attenInput);
-            std::string qWeightName = "model.layers." + std::to_string(i) + ".self_attn.q_proj.weight";
-            std::string qBiasName = "model.layers." + std::to_string(i) + ".self_attn.q_proj.bias";
-            std::string kWeightName = "model.layers." + std::to_string(i) + ".self_attn.k_proj.weight";
-            std::string kBiasName = "model.layers." + std::to_string(i) + ".self_attn.k_proj.bias";
-            std::string vWeightName = "model.layers." + std::to_string(i) + ".self_attn.v_proj.weight";
-            std::string vBiasName = "model.layers." + std::to_string(i) + ".self_attn.v_proj.bias";
-            std::string qkvWeightName = "model.layers." + std::to_string(i) + ".self_attn.W_pack.weight";
-            std::string oWeightName = "model.layers." + std::to_string(i) + ".self_attn.o_proj.weight";
-            std::string oBiasName = "model.layers." + std::to_string(i) + ".self_attn.o_proj.bias";
+            LlamaLayerWeights &lw = layerWeights[i];
+            TraceScope attentionScope("attention", i);
+            // w2为上一层MLP的输出, 残差加法在这里和RMSNorm融合(第一层时为空)
+            AddRMSNorm(hiddenStates, w2, *lw.inputNorm,
+                       rms_norm_eps, attenInput, &attenInputQ, QuantizedInputFor(lw.qkv != nullptr ? lw.qkv : lw.q));
 
             // 1.1 Get q, k, v
             int bsz = attenInput.dims[0], seqlen = attenInput.dims[1];
-            if (weight.weight.find(qkvWeightName) != weight.weight.end()) {
-                Linear(attenInput, weight[qkvWeightName], Data(), qkv);
+            if (lw.qkv != nullptr) {
+                Linear(attenInput, *lw.qkv, Data(), qkv, attenInputQ);
                 int per = qkv.dims.back() / (num_attention_heads / num_key_value_heads + 2);
                 int qdim = per * (num_attention_heads / num_key_value_heads);
                 Split(qkv, -1, 0, qdim, q);
                 Split(qkv, -1, qdim, qdim + per, k);
                 Split(qkv, -1, qdim + per, qdim + per * 2, v);
             } else {
-                Data qBias = (weight.weight.find(qBiasName) != weight.weight.end()) ? weight[qBiasName] : Data();
-                Data kBias = (weight.weight.find(kBiasName) != weight.weight.end()) ? weight[kBiasName] : Data();
-                Data vBias = (weight.weight.find(vBiasName) != weight.weight.end()) ? weight[vBiasName] : Data();
-                Linear(attenInput, weight[qWeightName], qBias, q);
-                Linear(attenInput, weight[kWeightName], kBias, k);
-                Linear(attenInput, weight[vWeightName], vBias, v);
+                const Data &qBias = lw.qBias != nullptr ? *lw.qBias : emptyData;
+                const Data &kBias = lw.kBias != nullptr ? *lw.kBias : emptyData;
+                const Data &vBias = lw.vBias != nullptr ? *lw.vBias : emptyData;
+                Linear(attenInput, *lw.q, qBias, q, attenInputQ);
+                Linear(attenInput, *lw.k, kBias, k, attenInputQ);
+                Linear(attenInput, *lw.v, vBias, v, attenInputQ);
             }
 
             Data attenOutput = Data(DataType::FLOAT32);
@@ -568,9 +659,10 @@ namespace fastllm {
             curVs.resize(batch);
             curQs.resize(batch);
             for (int b = 0; b < batch; b++) {
-                Split(k, 1, total, total + seqLens[b], curKs[b]);
-                Split(v, 1, total, total + seqLens[b], curVs[b]);
-                Split(q, 1, total, total + seqLens[b], curQs[b]);
+                // bsz = 1, 每个请求的q, k, v是连续的一段, 直接用视图, 不拷贝
+                curKs[b].ViewFrom(k, 1, total, total + seqLens[b]);
+                curVs[b].ViewFrom(v, 1, total, total + seqLens[b]);
+                curQs[b].ViewFrom(q, 1, total, total + seqLens[b]);
                 total += seqLens[b];
             }
 
@@ -604,12 +696,17 @@ namespace fastllm {
                     fastllm::LlamaRotatePosition2D(k, *positionIds[b], *sinDataPtrList[b], *cosDataPtrList[b], rotary_dim);
                 }
 
-                PermuteSelf(q, {0, 2, 1, 3});
+                AttentionLayout curLayout = (bsz == 1 ? layout : LayoutHeadMajor);
+                if (curLayout == LayoutHeadMajor) {
+                    PermuteSelf(q, {0, 2, 1, 3});
+                    q.Reshape({-1, seqLens[b], head_dim});
+                } else {
+                    q.Reshape({seqLens[b], -1, head_dim});
+                }
                 PermuteSelf(k, {0, 2, 1, 3});
                 PermuteSelf(v, {0, 2, 1, 3});
 
                 qkvSize = {-1, seqLens[b], head_dim};
-                q.Reshape(qkvSize);
                 k.Reshape(qkvSize);
                 v.Reshape(qkvSize);
                 
@@ -647,7 +744,8 @@ namespace fastllm {
 
                 // 1.2 Attention
                 // 1.2.0 q * k^T
-                MatMulTransB(q, pastKey, attenWeights, 1.0 / sqrt(head_dim), q.dims[0] / pastKey.dims[0]);
+                int qHeads = (curLayout == LayoutSeqMajor ? q.dims[1] : q.dims[0]);
+                MatMulTransB(q, pastKey, attenWeights, 1.0 / sqrt(head_dim), qHeads / pastKey.dims[0], curLayout);
                 attenWeights.Reshape({1, attenWeights.dims[0], attenWeights.dims[1], attenWeights.dims[2]});
                 if (alibiData.dims.size() != 0) {
                     AlibiMask(attenWeights, alibiData, -10000);
@@ -656,11 +754,16 @@ namespace fastllm {
                 }
 
                 Softmax(attenWeights, attenWeights, -1);
-                MatMul(attenWeights, pastValue, curAttenOutput, 1.f, attenWeights.dims[1] / pastValue.dims[0]);
-                curAttenOutput.Reshape({curAttenOutput.dims[1], curAttenOutput.dims[2], curAttenOutput.dims[3]});
-                PermuteSelf(curAttenOutput, {1, 0, 2});
-                curAttenOutput.Reshape({seqLens[b], bsz, -1});
-                PermuteSelf(curAttenOutput, {1, 0, 2});
+                MatMul(attenWeights, pastValue, curAttenOutput, 1.f, attenWeights.dims[1] / pastValue.dims[0],
+                       LayoutHeadMajor, curLayout);
+                if (curLayout == LayoutHeadMajor) {
+                    curAttenOutput.Reshape({curAttenOutput.dims[1], curAttenOutput.dims[2], curAttenOutput.dims[3]});
+                    PermuteSelf(curAttenOutput, {1, 0, 2});
+                    curAttenOutput.Reshape({seqLens[b], bsz, -1});
+                    PermuteSelf(curAttenOutput, {1, 0, 2});
+                } else {
+                    curAttenOutput.Reshape({bsz, seqLens[b], -1});
+                }
                 if (attenOutput.dims.size() == 0) {
                     std::vector <int> dims = curAttenOutput.dims;
                     dims[1] = total;
@@ -669,27 +772,32 @@ namespace fastllm {
                 CatDirect(attenOutput, curAttenOutput, 1);
             }
 
-            Data oBias = (weight.weight.find(oBiasName) != weight.weight.end()) ? weight[oBiasName] : Data();
-            Linear(attenOutput, weight[oWeightName], oBias, attenLastOutput);
-            AddTo(hiddenStates, attenLastOutput);
+            const Data &oBias = lw.oBias != nullptr ? *lw.oBias : emptyData;
+            Linear(attenOutput, *lw.o, oBias, attenLastOutput);
             // 2. mlp
-            RMSNorm(hiddenStates, this->weight["model.layers." + std::to_string(i) + ".post_attention_layernorm.weight"], rms_norm_eps, attenInput);
-            if (CanRunLinearEx(LinearExType::ExSilu)) {
-                LinearEx(attenInput, weight["model.layers." + std::to_string(i) + ".mlp.gate_proj.weight"], Data(), w1, LinearExType::ExSilu);
+            attentionScope.End();
+            TraceScope mlpScope("mlp", i);
+            AddRMSNorm(hiddenStates, attenLastOutput, *lw.postNorm,
+                       rms_norm_eps, attenInput, &attenInputQ, QuantizedInputFor(lw.gate));
+            if (CanRunLinearSwiglu(attenInput, *lw.gate, *lw.up)) {
+                LinearSwiglu(attenInput, *lw.gate, *lw.up, w1, &attenInputQ);
             } else {
-                Linear(attenInput, weight["model.layers." + std::to_string(i) + ".mlp.gate_proj.weight"], Data(), w1);
-                Silu(w1, w1);
+                if (CanRunLinearEx(LinearExType::ExSilu, attenInput, *lw.gate)) {
+                    LinearEx(attenInput, *lw.gate, Data(), w1, LinearExType::ExSilu);
+                } else {
+                    Linear(attenInput, *lw.gate, Data(), w1, attenInputQ);
+                    Silu(w1, w1);
+                }
+                Linear(attenInput, *lw.up, Data(), w3, attenInputQ);
+                MulTo(w1, w3);
             }
-
-            Linear(attenInput, weight["model.layers." + std::to_string(i) + ".mlp.up_proj.weight"], Data(), w3);
-            MulTo(w1, w3);
-            Linear(w1, weight["model.layers." + std::to_string(i) + ".mlp.down_proj.weight"], Data(), w2);
-            AddTo(hiddenStates, w2);
+            Linear(w1, *lw.down, Data(), w2);
         }
 
         Data logits, curLogit;
-        RMSNorm(hiddenStates, weight["model.norm.weight"], rms_norm_eps, hiddenStates);
-        Linear(hiddenStates, weight["lm_head.weight"], Data(), logits);
+        TraceScope headScope("lm_head");
+        AddRMSNorm(hiddenStates, w2, *normWeight, rms_norm_eps, hiddenStates);
+        Linear(hiddenStates, *lmHeadWeight, Data(), logits);
         std::vector <int> lastRet;
         int total = 0;
         for (int b = 0; b < batch; b++) {
@@ -860,8 +968,9 @@ namespace fastllm {
         inputTokens.resize(batch);
         seqLens.resize(batch);
         int maxLen = 0;
+        std::vector <Data> encoded = this->weight.tokenizer.EncodeBatch(prompts);
         for (int i = 0; i < batch; i++) {
-            inputTokens[i].CopyFrom(this->weight.tokenizer.Encode(prompts[i]));
+            inputTokens[i].CopyFrom(encoded[i]);
             maxLen = std::max(maxLen, (int)inputTokens[i].Count(0));
             seqLens[i] = (int)inputTokens[i].Count(0);
         }
@@ -1087,7 +1196,7 @@ namespace fastllm {
                                 it.second->intParams["len"] = seqLen;
 
                                 attentionMasks.push_back(new Data(DataType::FLOAT32, {seqLen, seqLen}, vmask));
-                                positionIds.push_back(new Data(DataType::FLOAT32, {2, seqLen}, vpids));
+                                positionIds.push_back(new Data(DataType::FLOAT32, {1, seqLen}, vpids));
                             } else {
                                 int ret = it.second->currentTokens[0];
                                 seqLens.push_back(1);
@@ -1130,12 +1239,10 @@ namespace fastllm {
                             }
 
                             model->dictLocker.lock();
-                            int idx = 0;
-                            for (auto &it: model->responseContextDict.dicts) {
-                                if (it.second->isEnding) {
-                                    continue;
-                                }
-                                int curRet = ret[idx++];
+                            // Forward期间可能有新的请求加入, 按handle取回这一轮参与计算的请求
+                            for (int i = 0; i < handles.size(); i++) {
+                                auto &it = *model->responseContextDict.dicts.find(handles[i]);
+                                int curRet = ret[i];
                                 if (curRet == model->eos_token_id) {
                                     it.second->isEnding = true;
                                 } else {
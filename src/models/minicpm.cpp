@@ -83,30 +83,26 @@ namespace fastllm {
         Data attenLastOutput;
         Data w1, w2, w3;
 
-        Embedding(inputIds, this->weight["model.embed_tokens.weight"], hiddenStates);
+        ResolveWeights();
+        Embedding(inputIds, *embedWeight, hiddenStates);
         Mul(hiddenStates, embed_scale, hiddenStates);
         for (int i = 0; i < block_cnt; i++) {
             ApplyDeviceMap(this->deviceMap, i + 1, block_cnt);
-            RMSNorm(hiddenStates, this->weight["model.layers." + std::to_string(i) + ".input_layernorm.weight"],
-                    1e-5, attenInput);
-            std::string qWeightName = "model.layers." + std::to_string(i) + ".self_attn.q_proj.weight";
-            std::string kWeightName = "model.layers." + std::to_string(i) + ".self_attn.k_proj.weight";
-            std::string vWeightName = "model.layers." + std::to_string(i) + ".self_attn.v_proj.weight";
-            std::string qkvWeightName = "model.layers." + std::to_string(i) + ".self_attn.W_pack.weight";
-            std::string oWeightName = "model.layers." + std::to_string(i) + ".self_attn.o_proj.weight";
+            LlamaLayerWeights &lw = layerWeights[i];
+            RMSNorm(hiddenStates, *lw.inputNorm, 1e-5, attenInput);
 
             // 1.1 Get q, k, v
             int bsz = attenInput.dims[0], seqlen = attenInput.dims[1];
-            if (weight.weight.find(qkvWeightName) != weight.weight.end()) {
-                Linear(attenInput, weight[qkvWeightName], Data(), qkv);
+            if (lw.qkv != nullptr) {
+                Linear(attenInput, *lw.qkv, Data(), qkv);
                 int per = qkv.dims.back() / 3;
                 Split(qkv, -1, 0, per, q);
                 Split(qkv, -1, per, per * 2, k);
                 Split(qkv, -1, per * 2, per * 3, v);
             } else {
-                Linear(attenInput, weight[qWeightName], Data(), q);
-                Linear(attenInput, weight[kWeightName], Data(), k);
-                Linear(attenInput, weight[vWeightName], Data(), v);
+                Linear(attenInput, *lw.q, Data(), q);
+                Linear(attenInput, *lw.k, Data(), k);
+                Linear(attenInput, *lw.v, Data(), v);
             }
 
             std::vector <int> qkvSize = {bsz, seqlen, num_attention_heads, -1};
@@ -179,16 +175,20 @@ namespace fastllm {
             PermuteSelf(attenOutput, {1, 0, 2});
             attenOutput.Reshape({bsz, seqlen, -1});
 
-            Linear(attenOutput, weight[oWeightName], Data(), attenLastOutput);
+            Linear(attenOutput, *lw.o, Data(), attenLastOutput);
             // Mul(attenLastOutput, this->attention_scale, attenLastOutput);
             AddTo(hiddenStates, attenLastOutput, this->attention_scale);
             // 2. mlp
-            RMSNorm(hiddenStates, this->weight["model.layers." + std::to_string(i) + ".post_attention_layernorm.weight"], 1e-5, attenInput);
-            Linear(attenInput, weight["model.layers." + std::to_string(i) + ".mlp.gate_proj.weight"], Data(), w1);
-            Linear(attenInput, weight["model.layers." + std::to_string(i) + ".mlp.up_proj.weight"], Data(), w3);
-            Silu(w1, w1);
-            MulTo(w1, w3);
-            Linear(w1, weight["model.layers." + std::to_string(i) + ".mlp.down_proj.weight"], Data(), w2);
+            RMSNorm(hiddenStates, *lw.postNorm, 1e-5, attenInput);
+            if (CanRunLinearSwiglu(attenInput, *lw.gate, *lw.up)) {
+                LinearSwiglu(attenInput, *lw.gate, *lw.up, w1);
+            } else {
+                Linear(attenInput, *lw.gate, Data(), w1);
+                Linear(attenInput, *lw.up, Data(), w3);
+                Silu(w1, w1);
+                MulTo(w1, w3);
+            }
+            Linear(w1, *lw.down, Data(), w2);
             // Mul(w2, this->attention_scale, w2);
             AddTo(hiddenStates, w2, this->attention_scale);
         }
@@ -205,9 +205,9 @@ namespace fastllm {
         int lastRet = -1;
         {
             auto &hiddenStates = *lastHiddenStates;
-            RMSNorm(hiddenStates, weight["model.norm.weight"], 1e-5, hiddenStates);
+            RMSNorm(hiddenStates, *normWeight, 1e-5, hiddenStates);
             Mul(hiddenStates, this->rms_scale, hiddenStates);
-            Linear(hiddenStates, weight["lm_head.weight"], Data(), logits);
+            Linear(hiddenStates, *lmHeadWeight, Data(), logits);
             if (generationConfig.output_logits && retLogits != nullptr) {
                 int size = logits.dims.back();
                 logits.ToDevice(DataDevice::CPU);
@@ -238,32 +238,28 @@ namespace fastllm {
         Data attenWeights, attenOutput;
         Data attenLastOutput;
         Data w1, w2, w3;
-        
-        Embedding(inputIds, this->weight["model.embed_tokens.weight"], hiddenStates);
+
+        ResolveWeights();
+        Embedding(inputIds, *embedWeight, hiddenStates);
         Mul(hiddenStates, embed_scale, hiddenStates);
         int seqlen = hiddenStates.dims[1];
         for (int i = 0; i < block_cnt; i++) {
             ApplyDeviceMap(this->deviceMap, i + 1, block_cnt);
-            RMSNorm(hiddenStates, this->weight["model.layers." + std::to_string(i) + ".input_layernorm.weight"],
-                    1e-5, attenInput);
-            std::string qWeightName = "model.layers." + std::to_string(i) + ".self_attn.q_proj.weight";
-            std::string kWeightName = "model.layers." + std::to_string(i) + ".self_attn.k_proj.weight";
-            std::string vWeightName = "model.layers." + std::to_string(i) + ".self_attn.v_proj.weight";
-            std::string qkvWeightName = "model.layers." + std::to_string(i) + ".self_attn.W_pack.weight";
-            std::string oWeightName = "model.layers." + std::to_string(i) + ".self_attn.o_proj.weight";
+            LlamaLayerWeights &lw = layerWeights[i];
+            RMSNorm(hiddenStates, *lw.inputNorm, 1e-5, attenInput);
 
             // 1.1 Get q, k, v
             int bsz = attenInput.dims[0], seqlen = attenInput.dims[1];
-            if (weight.weight.find(qkvWeightName) != weight.weight.end()) {
-                Linear(attenInput, weight[qkvWeightName], Data(), qkv);
+            if (lw.qkv != nullptr) {
+                Linear(attenInput, *lw.qkv, Data(), qkv);
                 int per = qkv.dims.back() / 3;
                 Split(qkv, -1, 0, per, q);
                 Split(qkv, -1, per, per * 2, k);
                 Split(qkv, -1, per * 2, per * 3, v);
             } else {
-                Linear(attenInput, weight[qWeightName], Data(), q);
-                Linear(attenInput, weight[kWeightName], Data(), k);
-                Linear(attenInput, weight[vWeightName], Data(), v);
+                Linear(attenInput, *lw.q, Data(), q);
+                Linear(attenInput, *lw.k, Data(), k);
+                Linear(attenInput, *lw.v, Data(), v);
             }
 
             std::vector <int> qkvSize = {bsz, seqlen, num_attention_heads, -1};
@@ -337,16 +333,20 @@ namespace fastllm {
             attenOutput.Reshape({seqlen, bsz, -1});
             PermuteSelf(attenOutput, {1, 0, 2});
 
-            Linear(attenOutput, weight[oWeightName], Data(), attenLastOutput);
+            Linear(attenOutput, *lw.o, Data(), attenLastOutput);
             // Mul(attenLastOutput, this->attention_scale, attenLastOutput);
             AddTo(hiddenStates, attenLastOutput, this->attention_scale);
             // 2. mlp
-            RMSNorm(hiddenStates, this->weight["model.layers." + std::to_string(i) + ".post_attention_layernorm.weight"], 1e-5, attenInput);
-            Linear(attenInput, weight["model.layers." + std::to_string(i) + ".mlp.gate_proj.weight"], Data(), w1);
-            Linear(attenInput, weight["model.layers." + std::to_string(i) + ".mlp.up_proj.weight"], Data(), w3);
-            Silu(w1, w1);
-            MulTo(w1, w3);
-            Linear(w1, weight["model.layers." + std::to_string(i) + ".mlp.down_proj.weight"], Data(), w2);
+            RMSNorm(hiddenStates, *lw.postNorm, 1e-5, attenInput);
+            if (CanRunLinearSwiglu(attenInput, *lw.gate, *lw.up)) {
+                LinearSwiglu(attenInput, *lw.gate, *lw.up, w1);
+            } else {
+                Linear(attenInput, *lw.gate, Data(), w1);
+                Linear(attenInput, *lw.up, Data(), w3);
+                Silu(w1, w1);
+                MulTo(w1, w3);
+            }
+            Linear(w1, *lw.down, Data(), w2);
             // Mul(w2, this->attention_scale, w2);
             AddTo(hiddenStates, w2, this->attention_scale);
         }
@@ -364,9 +364,9 @@ namespace fastllm {
         std::vector <int> lastRet;
         {
             auto &hiddenStates = *lastHiddenStates;
-            RMSNorm(hiddenStates, weight["model.norm.weight"], 1e-5, hiddenStates);
+            RMSNorm(hiddenStates, *normWeight, 1e-5, hiddenStates);
             Mul(hiddenStates, this->rms_scale, hiddenStates);
-            Linear(hiddenStates, weight["lm_head.weight"], Data(), logits);
+            Linear(hiddenStates, *lmHeadWeight, Data(), logits);
             if (generationConfig.IsSimpleGreedy()) {
                 TopK(logits, topk, 1);
                 topk.ToDevice(DataDevice::CPU);
@@ -401,31 +401,27 @@ namespace fastllm {
         Data attenLastOutput;
         Data w1, w2, w3;
 
-        Embedding(inputIds, this->weight["model.embed_tokens.weight"], hiddenStates);
+        ResolveWeights();
+        Embedding(inputIds, *embedWeight, hiddenStates);
         Mul(hiddenStates, embed_scale, hiddenStates);
         int seqlen = hiddenStates.dims[1];
         for (int i = 0; i < block_cnt; i++) {
             ApplyDeviceMap(this->deviceMap, i + 1, block_cnt);
-            RMSNorm(hiddenStates, this->weight["model.layers." + std::to_string(i) + ".input_layernorm.weight"],
-                    1e-5, attenInput);
-            std::string qWeightName = "model.layers." + std::to_string(i) + ".self_attn.q_proj.weight";
-            std::string kWeightName = "model.layers." + std::to_string(i) + ".self_attn.k_proj.weight";
-            std::string vWeightName = "model.layers." + std::to_string(i) + ".self_attn.v_proj.weight";
-            std::string qkvWeightName = "model.layers." + std::to_string(i) + ".self_attn.W_pack.weight";
-            std::string oWeightName = "model.layers." + std::to_string(i) + ".self_attn.o_proj.weight";
+            LlamaLayerWeights &lw = layerWeights[i];
+            RMSNorm(hiddenStates, *lw.inputNorm, 1e-5, attenInput);
 
             // 1.1 Get q, k, v
             int bsz = attenInput.dims[0], seqlen = attenInput.dims[1];
-            if (weight.weight.find(qkvWeightName) != weight.weight.end()) {
-                Linear(attenInput, weight[qkvWeightName], Data(), qkv);
+            if (lw.qkv != nullptr) {
+                Linear(attenInput, *lw.qkv, Data(), qkv);
                 int per = qkv.dims.back() / 3;
                 Split(qkv, -1, 0, per, q);
                 Split(qkv, -1, per, per * 2, k);
                 Split(qkv, -1, per * 2, per * 3, v);
             } else {
-                Linear(attenInput, weight[qWeightName], Data(), q);
-                Linear(attenInput, weight[kWeightName], Data(), k);
-                Linear(attenInput, weight[vWeightName], Data(), v);
+                Linear(attenInput, *lw.q, Data(), q);
+                Linear(attenInput, *lw.k, Data(), k);
+                Linear(attenInput, *lw.v, Data(), v);
             }
 
             Data attenOutput = Data(DataType::FLOAT32);
@@ -524,24 +520,28 @@ namespace fastllm {
                 CatDirect(attenOutput, curAttenOutput, 1);
             }
 
-            Linear(attenOutput, weight[oWeightName], Data(), attenLastOutput);
+            Linear(attenOutput, *lw.o, Data(), attenLastOutput);
             // Mul(attenLastOutput, this->attention_scale, attenLastOutput);
             AddTo(hiddenStates, attenLastOutput, this->attention_scale);
             // 2. mlp
-            RMSNorm(hiddenStates, this->weight["model.layers." + std::to_string(i) + ".post_attention_layernorm.weight"], 1e-5, attenInput);
-            Linear(attenInput, weight["model.layers." + std::to_string(i) + ".mlp.gate_proj.weight"], Data(), w1);
-            Linear(attenInput, weight["model.layers." + std::to_string(i) + ".mlp.up_proj.weight"], Data(), w3);
-            Silu(w1, w1);
-            MulTo(w1, w3);
-            Linear(w1, weight["model.layers." + std::to_string(i) + ".mlp.down_proj.weight"], Data(), w2);
+            RMSNorm(hiddenStates, *lw.postNorm, 1e-5, attenInput);
+            if (CanRunLinearSwiglu(attenInput, *lw.gate, *lw.up)) {
+                LinearSwiglu(attenInput, *lw.gate, *lw.up, w1);
+            } else {
+                Linear(attenInput, *lw.gate, Data(), w1);
+                Linear(attenInput, *lw.up, Data(), w3);
+                Silu(w1, w1);
+                MulTo(w1, w3);
+            }
+            Linear(w1, *lw.down, Data(), w2);
             // Mul(w2, this->attention_scale, w2);
             AddTo(hiddenStates, w2, this->attention_scale);
         }
 
         Data logits, curLogit;
-        RMSNorm(hiddenStates, weight["model.norm.weight"], 1e-5, hiddenStates);
+        RMSNorm(hiddenStates, *normWeight, 1e-5, hiddenStates);
         Mul(hiddenStates, this->rms_scale, hiddenStates);
-        Linear(hiddenStates, weight["lm_head.weight"], Data(), logits);
+        Linear(hiddenStates, *lmHeadWeight, Data(), logits);
         std::vector <int> lastRet;
         int total = 0;
         for (int b = 0; b < batch; b++) {
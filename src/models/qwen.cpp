@@ -189,10 +189,14 @@ namespace fastllm {
             std::string mlp_w1_weight_name = "transformer.h." + std::to_string(i) + ".mlp.w1.weight";
             std::string mlp_w2_weight_name = "transformer.h." + std::to_string(i) + ".mlp.w2.weight";
             std::string mlp_proj_weight_name = "transformer.h." + std::to_string(i) + ".mlp.c_proj.weight";
-            Linear(attnInput, weight[mlp_w1_weight_name], Data(), a1);
-            Linear(attnInput, weight[mlp_w2_weight_name], Data(), a2);
-            Silu(a2, a2);
-            MulTo(a1, a2);
+            if (CanRunLinearSwiglu(attnInput, weight[mlp_w2_weight_name], weight[mlp_w1_weight_name])) {
+                LinearSwiglu(attnInput, weight[mlp_w2_weight_name], weight[mlp_w1_weight_name], a1);
+            } else {
+                Linear(attnInput, weight[mlp_w1_weight_name], Data(), a1);
+                Linear(attnInput, weight[mlp_w2_weight_name], Data(), a2);
+                Silu(a2, a2);
+                MulTo(a1, a2);
+            }
             Linear(a1, weight[mlp_proj_weight_name], Data(), mlpOutput);
             AddTo(hiddenStates, mlpOutput);
         }
@@ -367,10 +371,14 @@ namespace fastllm {
             std::string mlp_w1_weight_name = "transformer.h." + std::to_string(i) + ".mlp.w1.weight";
             std::string mlp_w2_weight_name = "transformer.h." + std::to_string(i) + ".mlp.w2.weight";
             std::string mlp_proj_weight_name = "transformer.h." + std::to_string(i) + ".mlp.c_proj.weight";
-            Linear(attnInput, weight[mlp_w1_weight_name], Data(), a1);
-            Linear(attnInput, weight[mlp_w2_weight_name], Data(), a2);
-            Silu(a2, a2);
-            MulTo(a1, a2);
+            if (CanRunLinearSwiglu(attnInput, weight[mlp_w2_weight_name], weight[mlp_w1_weight_name])) {
+                LinearSwiglu(attnInput, weight[mlp_w2_weight_name], weight[mlp_w1_weight_name], a1);
+            } else {
+                Linear(attnInput, weight[mlp_w1_weight_name], Data(), a1);
+                Linear(attnInput, weight[mlp_w2_weight_name], Data(), a2);
+                Silu(a2, a2);
+                MulTo(a1, a2);
+            }
             Linear(a1, weight[mlp_proj_weight_name], Data(), mlpOutput);
             AddTo(hiddenStates, mlpOutput);
         }
@@ -534,6 +534,7 @@ PYBIND11_MODULE(pyfastllm, m) {
     .def_readonly("remove_extra_whitespaces", &fastllm::Tokenizer::removeExtraWhitespaces)
     .def_readonly("byte_as_char", &fastllm::Tokenizer::byteAsChar)
     .def("encode", &fastllm::Tokenizer::Encode)
+    .def("encode_batch", &fastllm::Tokenizer::EncodeBatch)
     // .def("decode", &fastllm::Tokenizer::Decode)
     .def("decode", &fastllm::Tokenizer::Decode, "Decode from Tensor")
     .def("decode", &fastllm::Tokenizer::DecodeTokens, "Decode from Vector")
@@ -0,0 +1,855 @@
+//
+// CPU算子的性能测试: 按常见的形状扫描Linear(各种权重类型), Attention, Softmax, RMSNorm, Permute和RoPE,
+// 和朴素实现对比数值; 融合算子(LlamaQKVRotateAppend, LinearSwiglu, LinearEx, AddRMSNorm)和对应的不融合算子序列对比数值,
+// 输出每个用例的耗时, GB/s和GFLOPS (JSON), 可以和之前的结果对比找出变慢的kernel
+//
+
+#include "fastllm.h"
+#include "utils.h"
+
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <random>
+
+struct BenchmarkOpsConfig {
+    int threads = 4; // 使用的线程数
+    bool quick = false; // 只跑小形状, 用于快速检查数值
+    std::string filter; // 只跑名字中包含filter的用例
+    std::string output; // 输出的json文件
+    std::string compare; // 对比的json文件(之前的输出)
+    float slowdown = 0.1f; // 比对比文件慢这么多视为变慢
+    float minTime = 0.2f; // 每个用例至少运行这么多秒
+};
+
+struct BenchmarkResult {
+    std::string name, op, dtype, shape;
+    int iters = 0;
+    double ms = 0.0, bestMs = 0.0; // 平均 / 最快一次的耗时(毫秒)
+    double bytes = 0.0, flops = 0.0; // 每次调用读写的数据量和浮点运算量
+    double maxRelErr = 0.0; // 和朴素实现的最大误差 / 参考值的最大绝对值
+    bool ok = true;
+};
+
+void Usage() {
+    std::cout << "Usage:" << std::endl;
+    std::cout << "[-h|--help]:                  显示帮助" << std::endl;
+    std::cout << "<-t|--threads> <args>:        使用的线程数量" << std::endl;
+    std::cout << "<-q|--quick>:                 只测试小形状" << std::endl;
+    std::cout << "<-f|--filter> <args>:         只测试名字中包含该字符串的用例" << std::endl;
+    std::cout << "<-o|--output> <args>:         输出json文件" << std::endl;
+    std::cout << "<-c|--compare> <args>:        和之前输出的json文件对比耗时" << std::endl;
+    std::cout << "<-s|--slowdown> <args>:       耗时增加超过该比例视为变慢, 默认0.1" << std::endl;
+    std::cout << "<--min_time> <args>:          每个用例至少运行的秒数, 默认0.2" << std::endl;
+}
+
+void ParseArgs(int argc, char **argv, BenchmarkOpsConfig &config) {
+    std::vector <std::string> sargv;
+    for (int i = 0; i < argc; i++) {
+        sargv.push_back(std::string(argv[i]));
+    }
+    for (int i = 1; i < argc; i++) {
+        if (sargv[i] == "-h" || sargv[i] == "--help") {
+            Usage();
+            exit(0);
+        } else if (sargv[i] == "-t" || sargv[i] == "--threads") {
+            config.threads = atoi(sargv[++i].c_str());
+        } else if (sargv[i] == "-q" || sargv[i] == "--quick") {
+            config.quick = true;
+        } else if (sargv[i] == "-f" || sargv[i] == "--filter") {
+            config.filter = sargv[++i];
+        } else if (sargv[i] == "-o" || sargv[i] == "--output") {
+            config.output = sargv[++i];
+        } else if (sargv[i] == "-c" || sargv[i] == "--compare") {
+            config.compare = sargv[++i];
+        } else if (sargv[i] == "-s" || sargv[i] == "--slowdown") {
+            config.slowdown = atof(sargv[++i].c_str());
+        } else if (sargv[i] == "--min_time") {
+            config.minTime = atof(sargv[++i].c_str());
+        } else {
+            Usage();
+            exit(-1);
+        }
+    }
+}
+
+static std::mt19937 rng(2024);
+
+static void FillRandom(std::vector <float> &v, float range = 1.0f) {
+    std::uniform_real_distribution <float> dist(-range, range);
+    for (auto &x : v) {
+        x = dist(rng);
+    }
+}
+
+static fastllm::Data RandomData(const std::vector <int> &dims, float range = 1.0f) {
+    int cnt = 1;
+    for (int d : dims) {
+        cnt *= d;
+    }
+    std::vector <float> v(cnt);
+    FillRandom(v, range);
+    return fastllm::Data(fastllm::DataType::FLOAT32, dims, v);
+}
+
+// 重复运行func, 至少运行minTime秒 (至少3组, 最多1000组), 第一次作为预热不计时;
+// 很快的op每组连续调用多次, 使每组至少1毫秒, 避免时钟精度的影响
+template <typename F>
+static void TimeIt(BenchmarkResult &result, float minTime, F func) {
+    func();
+    int reps = 1;
+    while (true) {
+        auto st = std::chrono::steady_clock::now();
+        for (int i = 0; i < reps; i++) {
+            func();
+        }
+        double spend = std::chrono::duration <double> (std::chrono::steady_clock::now() - st).count();
+        if (spend >= 1e-3 || reps >= (1 << 16)) {
+            break;
+        }
+        reps *= 2;
+    }
+    double total = 0.0, best = 1e100;
+    int iters = 0;
+    while (iters < 3 || (total < minTime && iters < 1000)) {
+        auto st = std::chrono::steady_clock::now();
+        for (int i = 0; i < reps; i++) {
+            func();
+        }
+        double spend = std::chrono::duration <double> (std::chrono::steady_clock::now() - st).count();
+        total += spend;
+        best = std::min(best, spend);
+        iters++;
+    }
+    result.iters = iters * reps;
+    result.ms = total / (iters * reps) * 1e3;
+    result.bestMs = best / reps * 1e3;
+}
+
+// 计算误差: 只比较抽样的位置
+static void CheckError(BenchmarkResult &result, const std::vector <double> &ref, const std::vector <double> &got, double tolerance) {
+    double maxRef = 1e-6, maxErr = 0.0;
+    for (int i = 0; i < ref.size(); i++) {
+        maxRef = std::max(maxRef, fabs(ref[i]));
+        maxErr = std::max(maxErr, fabs(ref[i] - got[i]));
+    }
+    result.maxRelErr = maxErr / maxRef;
+    result.ok = (result.maxRelErr <= tolerance) && !std::isnan(result.maxRelErr);
+}
+
+static std::string DataTypeName(fastllm::DataType type, bool l2) {
+    if (l2) {
+        return "l2";
+    }
+    switch (type) {
+        case fastllm::DataType::FLOAT32: return "float32";
+        case fastllm::DataType::FLOAT16: return "float16";
+        case fastllm::DataType::BFLOAT16: return "bfloat16";
+        case fastllm::DataType::INT8: return "int8";
+        case fastllm::DataType::INT4: return "int4";
+        case fastllm::DataType::INT4_NOZERO: return "int4_nozero";
+        case fastllm::DataType::INT4_GROUP: return "int4_group";
+        default: return "unknown";
+    }
+}
+
+// 构造[k, m]的Linear权重; L2时为码本下标(256个码字)
+static void MakeWeight(fastllm::WeightMap &weights, const std::string &name, int k, int m,
+                       fastllm::DataType dataType, bool l2) {
+    std::vector <float> f((size_t)k * m);
+    FillRandom(f, 0.05f);
+    if (l2) {
+        weights.weight[name] = fastllm::Data(fastllm::DataType::INT8, {k, m});
+        fastllm::Data &w = weights.weight[name];
+        w.weightType = fastllm::WeightType::LINEAR;
+        w.Allocate();
+        w.l2_num = 256;
+        std::vector <float> codebook(256);
+        FillRandom(codebook, 0.05f);
+        w.index2data = codebook;
+        std::uniform_int_distribution <int> dist(0, 255);
+        for (size_t i = 0; i < (size_t)k * m; i++) {
+            w.cpuData[i] = (uint8_t)dist(rng);
+        }
+    } else if (dataType == fastllm::DataType::FLOAT16 || dataType == fastllm::DataType::BFLOAT16) {
+        weights.weight[name] = fastllm::Data(fastllm::DataType::FLOAT32, {k, m}, f);
+        weights.weight[name].weightType = fastllm::WeightType::LINEAR;
+        fastllm::ToDataType(weights.weight[name], dataType);
+    } else if (dataType == fastllm::DataType::INT4) {
+        // WeightMap::AddWeight不生成带zero点的int4, 这里按行量化
+        weights.weight[name] = fastllm::Data(fastllm::DataType::INT4, {k, m});
+        fastllm::Data &w = weights.weight[name];
+        w.weightType = fastllm::WeightType::LINEAR;
+        w.Allocate();
+        memset(w.cpuData, 0, w.GetBytes());
+        w.perChannelAxis = 0;
+        w.perChannelsConfigs.resize(k);
+        w.zeros.resize(k);
+        w.scales.resize(k);
+        w.mins.resize(k);
+        for (int i = 0; i < k; i++) {
+            float minValue = 1e9, maxValue = -1e9;
+            for (int j = 0; j < m; j++) {
+                minValue = std::min(minValue, f[(size_t)i * m + j]);
+                maxValue = std::max(maxValue, f[(size_t)i * m + j]);
+            }
+            fastllm::LowBitConfig config(minValue, maxValue, 4, 0);
+            w.perChannelsConfigs[i] = config;
+            w.zeros[i] = config.zeroPoint;
+            w.scales[i] = config.scale;
+            w.mins[i] = config.min;
+            for (int j = 0; j < m; j++) {
+                size_t id = (size_t)i * m + j;
+                uint8_t value = config.quantization(f[id]);
+                w.cpuData[id / 2] |= (id % 2) ? value : (value << 4);
+            }
+        }
+    } else {
+        weights.AddWeight(name, {k, m}, dataType, fastllm::WeightType::LINEAR, fastllm::DataType::FLOAT32,
+                          (uint8_t*)f.data(), dataType == fastllm::DataType::INT4_GROUP ? 128 : -1);
+    }
+}
+
+// 权重第row行反量化后的值
+static std::vector <float> WeightRow(fastllm::Data &w, int row) {
+    int m = w.dims[1];
+    std::vector <float> ret(m);
+    for (int j = 0; j < m; j++) {
+        size_t id = (size_t)row * m + j;
+        if (w.l2_num != -1) {
+            ret[j] = w.index2data[w.cpuData[id]];
+        } else if (w.dataType == fastllm::DataType::FLOAT32) {
+            ret[j] = ((float*)w.cpuData)[id];
+        } else if (w.dataType == fastllm::DataType::FLOAT16) {
+            ret[j] = fastllm::half_to_float(((uint16_t*)w.cpuData)[id]);
+        } else if (w.dataType == fastllm::DataType::BFLOAT16) {
+            uint32_t bits = (uint32_t)((uint16_t*)w.cpuData)[id] << 16;
+            memcpy(&ret[j], &bits, sizeof(float));
+        } else if (w.dataType == fastllm::DataType::INT8) {
+            ret[j] = w.perChannelsConfigs[row].invQuantization(w.cpuData[id]);
+        } else {
+            uint8_t value = (id % 2) ? (w.cpuData[id / 2] & 0xF) : (w.cpuData[id / 2] >> 4);
+            int config = (w.dataType == fastllm::DataType::INT4_GROUP) ? row * w.group + j / w.groupCnt : row;
+            ret[j] = w.perChannelsConfigs[config].invQuantization(value);
+        }
+    }
+    return ret;
+}
+
+// 抽样的下标: 包括首尾, 最多cnt个
+static std::vector <int> SampleIndex(int len, int cnt) {
+    std::vector <int> ret;
+    int step = std::max(1, len / cnt);
+    for (int i = 0; i < len; i += step) {
+        ret.push_back(i);
+    }
+    if (ret.back() != len - 1) {
+        ret.push_back(len - 1);
+    }
+    return ret;
+}
+
+static BenchmarkResult BenchLinear(const BenchmarkOpsConfig &config, int n, int m, int k,
+                                   fastllm::DataType dataType, bool l2) {
+    BenchmarkResult result;
+    result.op = "Linear";
+    result.dtype = DataTypeName(dataType, l2);
+    result.shape = "n=" + std::to_string(n) + ",m=" + std::to_string(m) + ",k=" + std::to_string(k);
+    fastllm::WeightMap weights;
+    MakeWeight(weights, "weight", k, m, dataType, l2);
+    fastllm::Data &weight = weights["weight"];
+    fastllm::Data input = RandomData({n, m}), bias = RandomData({k}), output(fastllm::DataType::FLOAT32);
+    TimeIt(result, config.minTime, [&]() {
+        fastllm::Linear(input, weight, bias, output);
+    });
+    result.bytes = (double)weight.GetBytes() + input.GetBytes() + bias.GetBytes() + (double)n * k * sizeof(float);
+    result.flops = 2.0 * n * m * k;
+
+    std::vector <double> ref, got;
+    std::vector <int> rows = SampleIndex(n, 4), cols = SampleIndex(k, 64);
+    for (int c : cols) {
+        std::vector <float> w = WeightRow(weight, c);
+        for (int r : rows) {
+            double sum = ((float*)bias.cpuData)[c];
+            for (int j = 0; j < m; j++) {
+                sum += (double)((float*)input.cpuData)[(size_t)r * m + j] * w[j];
+            }
+            ref.push_back(sum);
+            got.push_back(((float*)output.cpuData)[(size_t)r * k + c]);
+        }
+    }
+    // 16位权重的kernel可能把input也转成16位, int8 / int4的kernel把input量化成int8
+    double tolerance = (dataType == fastllm::DataType::FLOAT32 || l2) ? 1e-4 :
+                       (dataType == fastllm::DataType::FLOAT16 || dataType == fastllm::DataType::BFLOAT16) ? 2e-2 : 5e-2;
+    CheckError(result, ref, got, tolerance);
+    return result;
+}
+
+// q: [heads, seqLen, headDim], k / v: [kvHeads, len, headDim], 无mask
+static BenchmarkResult BenchAttention(const BenchmarkOpsConfig &config, int heads, int kvHeads, int seqLen, int len, int headDim) {
+    BenchmarkResult result;
+    result.op = "Attention";
+    result.dtype = "float32";
+    result.shape = "heads=" + std::to_string(heads) + ",kvHeads=" + std::to_string(kvHeads) + ",seq=" + std::to_string(seqLen) +
+                   ",len=" + std::to_string(len) + ",headDim=" + std::to_string(headDim);
+    fastllm::Data q = RandomData({heads, seqLen, headDim}), k = RandomData({kvHeads, len, headDim}),
+                  v = RandomData({kvHeads, len, headDim}), output(fastllm::DataType::FLOAT32);
+    int group = heads / kvHeads;
+    float scale = 1.0f / sqrt(headDim);
+    TimeIt(result, config.minTime, [&]() {
+        fastllm::Attention(q, k, v, fastllm::Data(), output, group, scale, 1);
+    });
+    result.bytes = (double)q.GetBytes() * 2 + k.GetBytes() + v.GetBytes();
+    result.flops = 4.0 * heads * seqLen * len * headDim;
+
+    std::vector <double> ref, got;
+    float *qd = (float*)q.cpuData, *kd = (float*)k.cpuData, *vd = (float*)v.cpuData, *od = (float*)output.cpuData;
+    for (int h : SampleIndex(heads, 4)) {
+        int kvh = h / group;
+        for (int s : SampleIndex(seqLen, 4)) {
+            std::vector <double> w(len);
+            double maxValue = -1e100, sum = 0.0;
+            for (int l = 0; l < len; l++) {
+                double dot = 0.0;
+                for (int d = 0; d < headDim; d++) {
+                    dot += (double)qd[((size_t)h * seqLen + s) * headDim + d] * kd[((size_t)kvh * len + l) * headDim + d];
+                }
+                w[l] = dot * scale;
+                maxValue = std::max(maxValue, w[l]);
+            }
+            for (int l = 0; l < len; l++) {
+                w[l] = exp(w[l] - maxValue);
+                sum += w[l];
+            }
+            for (int d = 0; d < headDim; d++) {
+                double value = 0.0;
+                for (int l = 0; l < len; l++) {
+                    value += w[l] / sum * vd[((size_t)kvh * len + l) * headDim + d];
+                }
+                ref.push_back(value);
+                got.push_back(od[((size_t)h * seqLen + s) * headDim + d]);
+            }
+        }
+    }
+    CheckError(result, ref, got, 1e-3);
+    return result;
+}
+
+static BenchmarkResult BenchSoftmax(const BenchmarkOpsConfig &config, int rows, int channels) {
+    BenchmarkResult result;
+    result.op = "Softmax";
+    result.dtype = "float32";
+    result.shape = "rows=" + std::to_string(rows) + ",channels=" + std::to_string(channels);
+    fastllm::Data input = RandomData({rows, channels}, 8.0f), output(fastllm::DataType::FLOAT32);
+    TimeIt(result, config.minTime, [&]() {
+        fastllm::Softmax(input, output, -1);
+    });
+    result.bytes = (double)input.GetBytes() * 2;
+
+    std::vector <double> ref, got;
+    float *in = (float*)input.cpuData, *out = (float*)output.cpuData;
+    for (int r : SampleIndex(rows, 8)) {
+        double maxValue = -1e100, sum = 0.0;
+        for (int j = 0; j < channels; j++) {
+            maxValue = std::max(maxValue, (double)in[(size_t)r * channels + j]);
+        }
+        for (int j = 0; j < channels; j++) {
+            sum += exp(in[(size_t)r * channels + j] - maxValue);
+        }
+        for (int j = 0; j < channels; j++) {
+            ref.push_back(exp(in[(size_t)r * channels + j] - maxValue) / sum);
+            got.push_back(out[(size_t)r * channels + j]);
+        }
+    }
+    CheckError(result, ref, got, 1e-4);
+    return result;
+}
+
+static BenchmarkResult BenchRMSNorm(const BenchmarkOpsConfig &config, int rows, int channels) {
+    BenchmarkResult result;
+    result.op = "RMSNorm";
+    result.dtype = "float32";
+    result.shape = "rows=" + std::to_string(rows) + ",channels=" + std::to_string(channels);
+    fastllm::Data input = RandomData({rows, channels}), weight = RandomData({channels}), output(fastllm::DataType::FLOAT32);
+    float eps = 1e-6f;
+    TimeIt(result, config.minTime, [&]() {
+        fastllm::RMSNorm(input, weight, eps, output);
+    });
+    result.bytes = (double)input.GetBytes() * 2 + weight.GetBytes();
+
+    std::vector <double> ref, got;
+    float *in = (float*)input.cpuData, *w = (float*)weight.cpuData, *out = (float*)output.cpuData;
+    for (int r : SampleIndex(rows, 8)) {
+        double mean = 0.0;
+        for (int j = 0; j < channels; j++) {
+            mean += (double)in[(size_t)r * channels + j] * in[(size_t)r * channels + j];
+        }
+        double scale = 1.0 / sqrt(mean / channels + eps);
+        for (int j = 0; j < channels; j++) {
+            ref.push_back(in[(size_t)r * channels + j] * scale * w[j]);
+            got.push_back(out[(size_t)r * channels + j]);
+        }
+    }
+    CheckError(result, ref, got, 1e-4);
+    return result;
+}
+
+// [seqLen, heads, headDim] -> [heads, seqLen, headDim]
+static BenchmarkResult BenchPermute(const BenchmarkOpsConfig &config, int seqLen, int heads, int headDim) {
+    BenchmarkResult result;
+    result.op = "Permute";
+    result.dtype = "float32";
+    result.shape = "seq=" + std::to_string(seqLen) + ",heads=" + std::to_string(heads) + ",headDim=" + std::to_string(headDim);
+    fastllm::Data input = RandomData({seqLen, heads, headDim}), output(fastllm::DataType::FLOAT32);
+    TimeIt(result, config.minTime, [&]() {
+        fastllm::Permute(input, {1, 0, 2}, output);
+    });
+    result.bytes = (double)input.GetBytes() * 2;
+
+    std::vector <double> ref, got;
+    float *in = (float*)input.cpuData, *out = (float*)output.cpuData;
+    for (int s : SampleIndex(seqLen, 8)) {
+        for (int h = 0; h < heads; h++) {
+            for (int d = 0; d < headDim; d++) {
+                ref.push_back(in[((size_t)s * heads + h) * headDim + d]);
+                got.push_back(out[((size_t)h * seqLen + s) * headDim + d]);
+            }
+        }
+    }
+    CheckError(result, ref, got, 0.0);
+    return result;
+}
+
+// LlamaRotatePosition2D: input为[1, seqLen, heads, headDim], 位置为0 ~ seqLen - 1
+static BenchmarkResult BenchRoPE(const BenchmarkOpsConfig &config, int seqLen, int heads, int headDim) {
+    BenchmarkResult result;
+    result.op = "RoPE";
+    result.dtype = "float32";
+    result.shape = "seq=" + std::to_string(seqLen) + ",heads=" + std::to_string(heads) + ",headDim=" + std::to_string(headDim);
+    std::vector <float> sin((size_t)seqLen * headDim), cos((size_t)seqLen * headDim), pos(seqLen);
+    for (int i = 0; i < seqLen; i++) {
+        pos[i] = i;
+        for (int j = 0; j < headDim; j++) {
+            float freq = i / pow(10000, (float)(j % (headDim / 2)) * 2 / headDim);
+            sin[(size_t)i * headDim + j] = ::sin(freq);
+            cos[(size_t)i * headDim + j] = ::cos(freq);
+        }
+    }
+    fastllm::Data sinData(fastllm::DataType::FLOAT32, {seqLen, headDim}, sin), cosData(fastllm::DataType::FLOAT32, {seqLen, headDim}, cos);
+    fastllm::Data positionIds(fastllm::DataType::FLOAT32, {1, seqLen}, pos);
+    fastllm::Data origin = RandomData({1, seqLen, heads, headDim}), input(fastllm::DataType::FLOAT32);
+    input.CopyFrom(origin);
+    // RoPE原地计算, 每次计时前不恢复输入(数值只在第一次调用后检查)
+    fastllm::LlamaRotatePosition2D(input, positionIds, sinData, cosData, headDim);
+    std::vector <double> ref, got;
+    float *in = (float*)origin.cpuData, *out = (float*)input.cpuData;
+    for (int s : SampleIndex(seqLen, 8)) {
+        for (int h = 0; h < heads; h++) {
+            size_t base = ((size_t)s * heads + h) * headDim;
+            for (int j = 0; j < headDim / 2; j++) {
+                double a = in[base + j], b = in[base + j + headDim / 2];
+                double c = cos[(size_t)s * headDim + j], d = sin[(size_t)s * headDim + j];
+                ref.push_back(a * c - b * d);
+                ref.push_back(a * d + b * c);
+                got.push_back(out[base + j]);
+                got.push_back(out[base + j + headDim / 2]);
+            }
+        }
+    }
+    CheckError(result, ref, got, 1e-5);
+    TimeIt(result, config.minTime, [&]() {
+        fastllm::LlamaRotatePosition2D(input, positionIds, sinData, cosData, headDim);
+    });
+    result.bytes = (double)input.GetBytes() * 2 + sinData.GetBytes() + cosData.GetBytes();
+    return result;
+}
+
+// 把连续存放的Data的全部数值加到values后面
+static void AppendValues(std::vector <double> &values, const fastllm::Data &data) {
+    float *d = (float*)data.cpuData;
+    for (size_t i = 0; i < data.Count(0); i++) {
+        values.push_back(d[i]);
+    }
+}
+
+// KV cache ([heads, len, headDim], 可能扩容过, 按strides读取)的全部数值加到values后面
+static void AppendCacheValues(std::vector <double> &values, const fastllm::Data &cache) {
+    float *d = (float*)cache.cpuData;
+    for (int h = 0; h < cache.dims[0]; h++) {
+        for (int l = 0; l < cache.dims[1]; l++) {
+            for (int j = 0; j < cache.dims[2]; j++) {
+                values.push_back(d[(size_t)h * cache.strides[0] + (size_t)l * cache.strides[1] + j]);
+            }
+        }
+    }
+}
+
+// 融合算子和不融合的算子序列都用同样量化的input, 结果应该几乎相同
+static double FusedTolerance(fastllm::DataType dataType) {
+    return dataType == fastllm::DataType::FLOAT32 ? 1e-5 : 1e-3;
+}
+
+// LlamaQKVRotateAppend对比Linear + LlamaRotatePosition2D + Cat: input为[1, seqLen, heads * headDim], KV cache中已有past个token
+static BenchmarkResult BenchQKVRotateAppend(const BenchmarkOpsConfig &config, int seqLen, int past, int heads, int kvHeads,
+                                            int headDim, fastllm::DataType dataType, bool packed) {
+    BenchmarkResult result;
+    result.op = "LlamaQKVRotateAppend";
+    result.dtype = DataTypeName(dataType, false);
+    result.shape = "seq=" + std::to_string(seqLen) + ",past=" + std::to_string(past) + ",heads=" + std::to_string(heads) +
+                   ",kvHeads=" + std::to_string(kvHeads) + ",headDim=" + std::to_string(headDim) + (packed ? ",packed" : "");
+    int hidden = heads * headDim, maxLen = past + seqLen;
+    fastllm::WeightMap weights;
+    std::vector <fastllm::Data*> qkvWeights, qkvBiases;
+    fastllm::Data qBias = RandomData({heads * headDim}), kBias = RandomData({kvHeads * headDim}), vBias = RandomData({kvHeads * headDim});
+    if (packed) {
+        MakeWeight(weights, "qkv", (heads + kvHeads * 2) * headDim, hidden, dataType, false);
+        qkvWeights = {&weights["qkv"]};
+        qkvBiases = {nullptr};
+    } else {
+        MakeWeight(weights, "q", heads * headDim, hidden, dataType, false);
+        MakeWeight(weights, "k", kvHeads * headDim, hidden, dataType, false);
+        MakeWeight(weights, "v", kvHeads * headDim, hidden, dataType, false);
+        qkvWeights = {&weights["q"], &weights["k"], &weights["v"]};
+        qkvBiases = {&qBias, &kBias, &vBias};
+    }
+    std::vector <float> sin((size_t)maxLen * headDim), cos((size_t)maxLen * headDim), pos(seqLen);
+    for (int i = 0; i < maxLen; i++) {
+        for (int j = 0; j < headDim; j++) {
+            float freq = i / pow(10000, (float)(j % (headDim / 2)) * 2 / headDim);
+            sin[(size_t)i * headDim + j] = ::sin(freq);
+            cos[(size_t)i * headDim + j] = ::cos(freq);
+        }
+    }
+    for (int i = 0; i < seqLen; i++) {
+        pos[i] = past + i;
+    }
+    fastllm::Data sinData(fastllm::DataType::FLOAT32, {maxLen, headDim}, sin), cosData(fastllm::DataType::FLOAT32, {maxLen, headDim}, cos);
+    fastllm::Data positionIds(fastllm::DataType::FLOAT32, {1, seqLen}, pos);
+    fastllm::Data input = RandomData({1, seqLen, hidden});
+    fastllm::Data pastKey0 = RandomData({kvHeads, past, headDim}), pastValue0 = RandomData({kvHeads, past, headDim});
+    fastllm::Data pastKey, pastValue, q;
+    pastKey.CopyFrom(pastKey0);
+    pastValue.CopyFrom(pastValue0);
+    if (!fastllm::CanRunLlamaQKVRotateAppend(input, qkvWeights, qkvBiases, positionIds, sinData, cosData, headDim,
+                                             heads, kvHeads, headDim, pastKey, pastValue)) {
+        result.ok = false;
+        return result;
+    }
+    fastllm::LlamaQKVRotateAppend(input, qkvWeights, qkvBiases, positionIds, sinData, cosData, headDim,
+                                  heads, kvHeads, headDim, pastKey, pastValue, q);
+
+    // 不融合的算子序列, 和llama的Forward中不能融合时相同
+    fastllm::Data qkv, refQ, refK, refV, refKey, refValue;
+    if (packed) {
+        fastllm::Linear(input, weights["qkv"], fastllm::Data(), qkv);
+        fastllm::Split(qkv, -1, 0, heads * headDim, refQ);
+        fastllm::Split(qkv, -1, heads * headDim, (heads + kvHeads) * headDim, refK);
+        fastllm::Split(qkv, -1, (heads + kvHeads) * headDim, (heads + kvHeads * 2) * headDim, refV);
+    } else {
+        fastllm::Linear(input, weights["q"], qBias, refQ);
+        fastllm::Linear(input, weights["k"], kBias, refK);
+        fastllm::Linear(input, weights["v"], vBias, refV);
+    }
+    for (fastllm::Data *data : {&refQ, &refK, &refV}) {
+        data->Reshape({1, seqLen, -1, headDim});
+    }
+    fastllm::LlamaRotatePosition2D(refQ, positionIds, sinData, cosData, headDim);
+    fastllm::LlamaRotatePosition2D(refK, positionIds, sinData, cosData, headDim);
+    for (fastllm::Data *data : {&refQ, &refK, &refV}) {
+        data->Reshape({seqLen, -1, headDim});
+        fastllm::PermuteSelf(*data, {1, 0, 2});
+    }
+    fastllm::Cat(pastKey0, refK, 1, refKey);
+    fastllm::Cat(pastValue0, refV, 1, refValue);
+
+    std::vector <double> ref, got;
+    AppendValues(ref, refQ);
+    AppendValues(got, q);
+    AppendValues(ref, refKey);
+    AppendCacheValues(got, pastKey);
+    AppendValues(ref, refValue);
+    AppendCacheValues(got, pastValue);
+    CheckError(result, ref, got, FusedTolerance(dataType));
+
+    // 每次计时前把KV cache的长度恢复成past, 已经扩容的空间可以复用
+    TimeIt(result, config.minTime, [&]() {
+        pastKey.Resize({kvHeads, past, headDim});
+        pastValue.Resize({kvHeads, past, headDim});
+        fastllm::LlamaQKVRotateAppend(input, qkvWeights, qkvBiases, positionIds, sinData, cosData, headDim,
+                                      heads, kvHeads, headDim, pastKey, pastValue, q);
+    });
+    int rows = (heads + kvHeads * 2) * headDim;
+    for (fastllm::Data *weight : qkvWeights) {
+        result.bytes += weight->GetBytes();
+    }
+    result.bytes += (double)input.GetBytes() + (double)seqLen * rows * sizeof(float);
+    result.flops = 2.0 * seqLen * hidden * rows;
+    return result;
+}
+
+// LinearSwiglu (gate, up两个权重) 或LinearEx(ExSwiglu, gate和up合并的权重) 对比Linear + Silu + MulTo
+static BenchmarkResult BenchLinearSwiglu(const BenchmarkOpsConfig &config, int n, int m, int k,
+                                         fastllm::DataType dataType, bool merged) {
+    BenchmarkResult result;
+    result.op = merged ? "LinearEx" : "LinearSwiglu";
+    result.dtype = DataTypeName(dataType, false);
+    result.shape = "n=" + std::to_string(n) + ",m=" + std::to_string(m) + ",k=" + std::to_string(k);
+    fastllm::WeightMap weights;
+    fastllm::Data input = RandomData({n, m}), output, gate, up, silu;
+    if (merged) {
+        MakeWeight(weights, "gateUp", k * 2, m, dataType, false);
+        fastllm::Data &weight = weights["gateUp"];
+        if (!fastllm::CanRunLinearEx(fastllm::LinearExType::ExSwiglu, input, weight)) {
+            result.ok = false;
+            return result;
+        }
+        fastllm::LinearEx(input, weight, fastllm::Data(), output, fastllm::LinearExType::ExSwiglu);
+        fastllm::Data gateUp;
+        fastllm::Linear(input, weight, fastllm::Data(), gateUp);
+        fastllm::Split(gateUp, -1, 0, k, gate);
+        fastllm::Split(gateUp, -1, k, k * 2, up);
+        result.bytes = weight.GetBytes();
+    } else {
+        MakeWeight(weights, "gate", k, m, dataType, false);
+        MakeWeight(weights, "up", k, m, dataType, false);
+        if (!fastllm::CanRunLinearSwiglu(input, weights["gate"], weights["up"])) {
+            result.ok = false;
+            return result;
+        }
+        fastllm::LinearSwiglu(input, weights["gate"], weights["up"], output);
+        fastllm::Linear(input, weights["gate"], fastllm::Data(), gate);
+        fastllm::Linear(input, weights["up"], fastllm::Data(), up);
+        result.bytes = (double)weights["gate"].GetBytes() + weights["up"].GetBytes();
+    }
+    fastllm::Silu(gate, silu);
+    fastllm::MulTo(silu, up);
+
+    std::vector <double> ref, got;
+    AppendValues(ref, silu);
+    AppendValues(got, output);
+    CheckError(result, ref, got, FusedTolerance(dataType));
+    TimeIt(result, config.minTime, [&]() {
+        if (merged) {
+            fastllm::LinearEx(input, weights["gateUp"], fastllm::Data(), output, fastllm::LinearExType::ExSwiglu);
+        } else {
+            fastllm::LinearSwiglu(input, weights["gate"], weights["up"], output);
+        }
+    });
+    result.bytes += (double)input.GetBytes() + output.GetBytes();
+    result.flops = 4.0 * n * m * k;
+    return result;
+}
+
+// AddRMSNorm(输出量化的input) + Linear(使用量化的input) 对比AddTo + RMSNorm + Linear
+static BenchmarkResult BenchAddRMSNormLinear(const BenchmarkOpsConfig &config, int n, int m, int k, fastllm::DataType dataType) {
+    BenchmarkResult result;
+    result.op = "AddRMSNorm";
+    result.dtype = DataTypeName(dataType, false);
+    result.shape = "n=" + std::to_string(n) + ",m=" + std::to_string(m) + ",k=" + std::to_string(k);
+    fastllm::WeightMap weights;
+    MakeWeight(weights, "weight", k, m, dataType, false);
+    fastllm::Data &weight = weights["weight"];
+    fastllm::Data origin = RandomData({n, m}), residual = RandomData({n, m}), normWeight = RandomData({m});
+    fastllm::Data hidden, normed, quantized, output, refHidden, refNormed, refOutput;
+    float eps = 1e-6f;
+    hidden.CopyFrom(origin);
+    refHidden.CopyFrom(origin);
+    fastllm::AddRMSNorm(hidden, residual, normWeight, eps, normed, &quantized, dataType);
+    fastllm::Linear(normed, weight, fastllm::Data(), output, quantized);
+    fastllm::AddTo(refHidden, residual);
+    fastllm::RMSNorm(refHidden, normWeight, eps, refNormed);
+    fastllm::Linear(refNormed, weight, fastllm::Data(), refOutput);
+
+    std::vector <double> ref, got;
+    AppendValues(ref, refHidden);
+    AppendValues(got, hidden);
+    AppendValues(ref, refOutput);
+    AppendValues(got, output);
+    CheckError(result, ref, got, FusedTolerance(dataType));
+    // AddRMSNorm原地修改hidden, 每次计时前不恢复(数值只在第一次调用后检查)
+    TimeIt(result, config.minTime, [&]() {
+        fastllm::AddRMSNorm(hidden, residual, normWeight, eps, normed, &quantized, dataType);
+        fastllm::Linear(normed, weight, fastllm::Data(), output, quantized);
+    });
+    result.bytes = (double)weight.GetBytes() + hidden.GetBytes() * 3 + normWeight.GetBytes() + output.GetBytes();
+    result.flops = 2.0 * n * m * k;
+    return result;
+}
+
+// 读取之前输出的json中各用例的耗时; 输出时每行一个用例, 这里按行查找字段
+static std::map <std::string, double> ReadBaseline(const std::string &fileName) {
+    std::map <std::string, double> ret;
+    std::ifstream file(fileName);
+    std::string line;
+    while (std::getline(file, line)) {
+        size_t namePos = line.find("\"name\": \""), msPos = line.find("\"ms\": ");
+        if (namePos == std::string::npos || msPos == std::string::npos) {
+            continue;
+        }
+        namePos += 9;
+        ret[line.substr(namePos, line.find('"', namePos) - namePos)] = atof(line.c_str() + msPos + 6);
+    }
+    return ret;
+}
+
+int main(int argc, char **argv) {
+    BenchmarkOpsConfig config;
+    ParseArgs(argc, argv, config);
+    fastllm::SetThreads(config.threads);
+    if (config.quick) {
+        config.minTime = std::min(config.minTime, 0.02f);
+    }
+
+    // 形状: hidden 2k ~ 8k, batch 1 ~ 256, 序列长度到32k; quick时只用小形状
+    std::vector <int> hiddens = config.quick ? std::vector <int> {512} : std::vector <int> {2048, 4096, 8192};
+    std::vector <int> batches = config.quick ? std::vector <int> {1, 8} : std::vector <int> {1, 16, 256};
+    std::vector <std::pair <int, int> > attentionLens = config.quick ?
+            std::vector <std::pair <int, int> > {{1, 64}, {32, 32}} :
+            std::vector <std::pair <int, int> > {{1, 1024}, {1, 8192}, {1, 32768}, {512, 512}, {2048, 2048}}; // (seqLen, len)
+    std::vector <int> seqLens = config.quick ? std::vector <int> {1, 64} : std::vector <int> {1, 256, 4096};
+    int heads = config.quick ? 8 : 32, kvHeads = config.quick ? 2 : 8, headDim = config.quick ? 64 : 128;
+    std::vector <std::pair <fastllm::DataType, bool> > linearTypes = {
+            {fastllm::DataType::FLOAT32, false}, {fastllm::DataType::FLOAT16, false}, {fastllm::DataType::BFLOAT16, false},
+            {fastllm::DataType::INT8, false}, {fastllm::DataType::INT4, false}, {fastllm::DataType::INT4_NOZERO, false},
+            {fastllm::DataType::INT4_GROUP, false}, {fastllm::DataType::INT8, true}
+    };
+
+    std::vector <std::function <BenchmarkResult()> > cases;
+    std::vector <std::string> caseNames;
+    auto addCase = [&](const std::string &name, std::function <BenchmarkResult()> func) {
+        if (config.filter == "" || name.find(config.filter) != std::string::npos) {
+            caseNames.push_back(name);
+            cases.push_back(func);
+        }
+    };
+    for (auto &type : linearTypes) {
+        for (int hidden : hiddens) {
+            for (int batch : batches) {
+                addCase("Linear/" + DataTypeName(type.first, type.second) + "/n=" + std::to_string(batch) +
+                        ",m=" + std::to_string(hidden) + ",k=" + std::to_string(hidden), [=]() {
+                    return BenchLinear(config, batch, hidden, hidden, type.first, type.second);
+                });
+            }
+        }
+    }
+    // 量化kernel按32 / 64个一组处理m, 这里加上m % 32 != 0的形状检查尾部 (104 % 64 = 40, 200 % 32 = 8)
+    for (auto &type : linearTypes) {
+        if (type.first == fastllm::DataType::FLOAT32 || type.first == fastllm::DataType::FLOAT16 ||
+            type.first == fastllm::DataType::BFLOAT16) {
+            continue;
+        }
+        for (int m : {104, 200}) {
+            for (int batch : batches) {
+                int k = hiddens[0];
+                addCase("Linear/" + DataTypeName(type.first, type.second) + "/n=" + std::to_string(batch) +
+                        ",m=" + std::to_string(m) + ",k=" + std::to_string(k), [=]() {
+                    return BenchLinear(config, batch, m, k, type.first, type.second);
+                });
+            }
+        }
+    }
+    for (auto &lens : attentionLens) {
+        addCase("Attention/float32/heads=" + std::to_string(heads) + ",kvHeads=" + std::to_string(kvHeads) +
+                ",seq=" + std::to_string(lens.first) + ",len=" + std::to_string(lens.second) + ",headDim=" + std::to_string(headDim), [=]() {
+            return BenchAttention(config, heads, kvHeads, lens.first, lens.second, headDim);
+        });
+    }
+    int maxLen = 0;
+    for (auto &lens : attentionLens) {
+        maxLen = std::max(maxLen, lens.second);
+    }
+    for (int rows : seqLens) {
+        for (int channels : {hiddens.back(), maxLen}) {
+            addCase("Softmax/float32/rows=" + std::to_string(rows) + ",channels=" + std::to_string(channels), [=]() {
+                return BenchSoftmax(config, rows, channels);
+            });
+        }
+        addCase("RMSNorm/float32/rows=" + std::to_string(rows) + ",channels=" + std::to_string(hiddens.back()), [=]() {
+            return BenchRMSNorm(config, rows, hiddens.back());
+        });
+        addCase("Permute/float32/seq=" + std::to_string(rows) + ",heads=" + std::to_string(heads) + ",headDim=" + std::to_string(headDim), [=]() {
+            return BenchPermute(config, rows, heads, headDim);
+        });
+        addCase("RoPE/float32/seq=" + std::to_string(rows) + ",heads=" + std::to_string(heads) + ",headDim=" + std::to_string(headDim), [=]() {
+            return BenchRoPE(config, rows, heads, headDim);
+        });
+    }
+
+    // 融合算子和对应的不融合算子序列对比; 权重较大, 只用最小的hidden, quick时包含用AMX计算的行数
+    std::vector <int> fusedBatches = config.quick ? std::vector <int> {1, 32} : batches;
+    std::vector <fastllm::DataType> fusedTypes = {fastllm::DataType::FLOAT32, fastllm::DataType::INT8, fastllm::DataType::INT4};
+    int past = config.quick ? 16 : 256;
+    for (fastllm::DataType type : fusedTypes) {
+        std::string dtype = DataTypeName(type, false);
+        for (int batch : fusedBatches) {
+            for (bool packed : {true, false}) {
+                addCase("LlamaQKVRotateAppend/" + dtype + "/seq=" + std::to_string(batch) + ",past=" + std::to_string(past) +
+                        ",heads=" + std::to_string(heads) + ",kvHeads=" + std::to_string(kvHeads) + ",headDim=" +
+                        std::to_string(headDim) + (packed ? ",packed" : ""), [=]() {
+                    return BenchQKVRotateAppend(config, batch, past, heads, kvHeads, headDim, type, packed);
+                });
+            }
+            std::string shape = "n=" + std::to_string(batch) + ",m=" + std::to_string(hiddens[0]) + ",k=" + std::to_string(hiddens[0] * 2);
+            addCase("LinearSwiglu/" + dtype + "/" + shape, [=]() {
+                return BenchLinearSwiglu(config, batch, hiddens[0], hiddens[0] * 2, type, false);
+            });
+            addCase("LinearEx/" + dtype + "/" + shape, [=]() {
+                return BenchLinearSwiglu(config, batch, hiddens[0], hiddens[0] * 2, type, true);
+            });
+            addCase("AddRMSNorm/" + dtype + "/n=" + std::to_string(batch) + ",m=" + std::to_string(hiddens[0]) +
+                    ",k=" + std::to_string(hiddens[0]), [=]() {
+                return BenchAddRMSNormLinear(config, batch, hiddens[0], hiddens[0], type);
+            });
+        }
+    }
+
+    std::map <std::string, double> baseline;
+    if (config.compare != "") {
+        baseline = ReadBaseline(config.compare);
+    }
+    std::vector <BenchmarkResult> results;
+    int failed = 0, slower = 0;
+    for (int i = 0; i < cases.size(); i++) {
+        BenchmarkResult result = cases[i]();
+        result.name = caseNames[i];
+        results.push_back(result);
+        printf("%-70s %10.4f ms %8.2f GB/s %8.2f GFLOPS  err %.2e %s", result.name.c_str(), result.ms,
+               result.bytes / result.ms / 1e6, result.flops / result.ms / 1e6, result.maxRelErr, result.ok ? "ok" : "FAILED");
+        failed += !result.ok;
+        auto it = baseline.find(result.name);
+        if (it != baseline.end() && it->second > 0) {
+            bool isSlower = result.ms > it->second * (1.0 + config.slowdown);
+            printf("  (%+.1f%%%s)", (result.ms / it->second - 1.0) * 100, isSlower ? " SLOWER" : "");
+            slower += isSlower;
+        }
+        printf("\n");
+        fflush(stdout);
+    }
+
+    if (config.output != "") {
+        FILE *fo = fopen(config.output.c_str(), "w");
+        if (fo == nullptr) {
+            printf("无法写入 %s\n", config.output.c_str());
+            return -1;
+        }
+        fprintf(fo, "[\n");
+        for (int i = 0; i < results.size(); i++) {
+            auto &r = results[i];
+            fprintf(fo, "{\"name\": \"%s\", \"op\": \"%s\", \"dtype\": \"%s\", \"shape\": \"%s\", \"threads\": %d, \"iters\": %d, "
+                        "\"ms\": %.6f, \"best_ms\": %.6f, \"gbps\": %.3f, \"gflops\": %.3f, \"max_rel_err\": %.3e, \"ok\": %s}%s\n",
+                    r.name.c_str(), r.op.c_str(), r.dtype.c_str(), r.shape.c_str(), config.threads, r.iters,
+                    r.ms, r.bestMs, r.bytes / r.ms / 1e6, r.flops / r.ms / 1e6, r.maxRelErr, r.ok ? "true" : "false",
+                    i + 1 < results.size() ? "," : "");
+        }
+        fprintf(fo, "]\n");
+        fclose(fo);
+    }
+    printf("%d cases, %d failed", (int)results.size(), failed);
+    if (config.compare != "") {
+        printf(", %d slower than %s", slower, config.compare.c_str());
+    }
+    printf("\n");
+    return (failed > 0 || slower > 0) ? 1 : 0;
+}
@@ -68,6 +68,12 @@ def get_cpu_threads() -> int:
 def print_ins_info():
     fastllm_lib.print_cpu_ins();
 
+def set_cpu_instruction_level(level: int):
+    fastllm_lib.set_cpu_instruction_level(level);
+
+def get_cpu_instruction_level() -> int:
+    return fastllm_lib.get_cpu_instruction_level();
+
 def set_cpu_kvcache(cpu_kvcache):
     fastllm_lib.set_kvcache_in_cpu(ctypes.c_bool(cpu_kvcache));
 
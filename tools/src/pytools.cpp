@@ -25,6 +25,14 @@ extern "C" {
         return fastllm::GetThreads();
     }
 
+    DLL_EXPORT void set_cpu_instruction_level(int level) {
+        fastllm::SetCpuInstructionLevel(level);
+    }
+
+    DLL_EXPORT int get_cpu_instruction_level() {
+        return fastllm::GetCpuInstructionLevel();
+    }
+
     DLL_EXPORT void set_cpu_low_mem(bool low) {
         fastllm::SetLowMemMode(low);
     }